@@ -0,0 +1,1766 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Cache daemon for the "daemon:" cache scheme. Stores are held in memory
+ * and shared by all clients connecting to the Unix domain socket; they are
+ * optionally snapshotted to a directory, and every store found there is
+ * restored at startup. See bid_dcache.c for the client and bid_private.h
+ * for the protocol.
+ *
+ * Daemons on different nodes may replicate their stores to each other.
+ * Each daemon listens for peers on a TCP port and forwards every change
+ * made by a local client to all its peers, using the client protocol with
+ * BID_CACHE_DAEMON_OP_FLAG_REPLICA set so that changes are not forwarded
+ * again; peers should therefore form a full mesh. A peer's response to a
+ * forwarded change is its acknowledgement. By default changes are
+ * acknowledged to local clients immediately (best effort); with -acks N,
+ * the response to a local client is deferred until N peers have
+ * acknowledged the change, or fails with BID_S_CACHE_WRITE_ERROR after
+ * -ack-timeout milliseconds. A peer whose backlog exceeds
+ * BIDCACHED_PEER_MAX_BACKLOG is disconnected; on (re)connection the entire
+ * contents of every store is sent to it, which bounds replication lag.
+ * The contents are snapshotted at connection time and sent a chunk at a
+ * time as the peer drains its backlog, so that stores of any size can be
+ * resynchronised; later changes supersede the snapshot.
+ *
+ * Peers authenticate each other with a key shared through -peer-key. The
+ * accepting daemon sends a random challenge as soon as a peer connects;
+ * the connecting daemon answers with BID_CACHE_DAEMON_OP_AUTH, carrying a
+ * challenge of its own and HMAC-SHA256(key, "C" || challenges), and the
+ * response proves the acceptor also holds the key, with "A" as the label.
+ * Only then are stores sent. Connections accepted from peers may only make
+ * replicated changes; they cannot read stores. Peer traffic is not
+ * encrypted, and -listen without a host only accepts peers on loopback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#if __APPLE__
+#include "cfjson.h"
+#else
+#include <jansson.h>
+#endif
+#include "browserid.h"
+#include "bid_private.h"
+
+#define BIDCACHED_ITERATE_PAGE          (1024 * 1024)
+#define BIDCACHED_PEER_MAX_BACKLOG      (4 * 1024 * 1024)
+#define BIDCACHED_PEER_SYNC_CHUNK       (256 * 1024)
+#define BIDCACHED_PEER_RETRY_INTERVAL   1000    /* milliseconds */
+#define BIDCACHED_PEER_CHALLENGE_LENGTH 32
+#define BIDCACHED_PEER_MAC_LENGTH       32      /* HMAC-SHA256 */
+#define BIDCACHED_PEER_MIN_KEY_LENGTH   16
+#define BIDCACHED_PEER_MAX_KEY_LENGTH   1024
+
+struct BIDCachedStore {
+    struct BIDCachedStore *Next;
+    char *Name;
+    json_t *Data;
+    time_t LastChangedTime;
+    int Dirty;
+};
+
+struct BIDCachedBuffer {
+    unsigned char *Data;
+    size_t Length;
+    size_t Capacity;
+};
+
+struct BIDCachedClient {
+    int Socket;
+    struct BIDCachedBuffer Input;
+    struct BIDCachedBuffer Output;
+    uint64_t PendingId;             /* change awaiting peer acks */
+    uint8_t PendingOp;
+    unsigned int PendingAcks;
+    uint64_t PendingDeadline;
+    int Peer;                       /* accepted on the peer listener */
+    int Authenticated;
+    unsigned char Challenge[BIDCACHED_PEER_CHALLENGE_LENGTH];
+};
+
+struct BIDCachedPeer {
+    char *Host;
+    char *Port;
+    int Socket;
+    int Connected;
+    int ChallengeAnswered;
+    int Authenticated;
+    unsigned char Challenge[BIDCACHED_PEER_CHALLENGE_LENGTH];
+    unsigned char ExpectedMac[BIDCACHED_PEER_MAC_LENGTH];
+    uint64_t NextConnectTime;
+    struct BIDCachedBuffer Input;
+    struct BIDCachedBuffer Output;
+    uint64_t *InFlight;             /* change IDs awaiting responses, in order */
+    size_t cInFlight;
+    size_t cInFlightCapacity;
+    json_t *SyncData;               /* store name -> entries yet to resync */
+};
+
+static struct BIDCachedStore *gStores = NULL;
+static struct BIDCachedClient *gClients = NULL;
+static size_t gcClients = 0;
+static struct BIDCachedPeer *gPeers = NULL;
+static size_t gcPeers = 0;
+static uint64_t gNextChangeId = 1;
+static unsigned int gAcks = 0;
+static unsigned int gAckTimeout = 1000;
+static const char *gSnapshotDir = NULL;
+static mode_t gSocketMode = 0600;
+static unsigned char gPeerKey[BIDCACHED_PEER_MAX_KEY_LENGTH];
+static size_t gcbPeerKey = 0;
+static int gSnapshotInterval = 300;
+static volatile sig_atomic_t gTerminate = 0;
+static int gVerbose = 0;
+
+static void
+BIDCachedUsage(void)
+{
+    fprintf(stderr, "Usage: bidcached [-socket path] [-mode mode] [-snapshot dir] "
+                    "[-interval seconds] [-listen [host:]port]\n"
+                    "                 [-peer-key file] [-peer host:port ...] [-acks n] "
+                    "[-ack-timeout ms] [-verbose]\n");
+    exit(BID_S_INVALID_PARAMETER);
+}
+
+static void
+BIDCachedSignal(int sig BID_UNUSED)
+{
+    gTerminate = 1;
+}
+
+static uint64_t
+BIDCachedNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+BIDCachedPutUInt32(unsigned char *p, uint32_t n)
+{
+    n = htonl(n);
+    memcpy(p, &n, sizeof(n));
+}
+
+static uint32_t
+BIDCachedGetUInt32(const unsigned char *p)
+{
+    uint32_t n;
+
+    memcpy(&n, p, sizeof(n));
+
+    return ntohl(n);
+}
+
+static int
+BIDCachedBufferReserve(struct BIDCachedBuffer *buf, size_t cbExtra)
+{
+    size_t cbNeeded = buf->Length + cbExtra;
+
+    if (cbNeeded > buf->Capacity) {
+        size_t cbCapacity = buf->Capacity ? buf->Capacity : 4096;
+        unsigned char *data;
+
+        while (cbCapacity < cbNeeded)
+            cbCapacity *= 2;
+
+        data = realloc(buf->Data, cbCapacity);
+        if (data == NULL)
+            return -1;
+
+        buf->Data = data;
+        buf->Capacity = cbCapacity;
+    }
+
+    return 0;
+}
+
+static void
+BIDCachedBufferConsume(struct BIDCachedBuffer *buf, size_t cb)
+{
+    memmove(buf->Data, buf->Data + cb, buf->Length - cb);
+    buf->Length -= cb;
+}
+
+static void
+BIDCachedBufferFree(struct BIDCachedBuffer *buf)
+{
+    free(buf->Data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ * Store names become snapshot file names, so restrict them accordingly.
+ */
+static int
+BIDCachedValidStoreName(const char *szName)
+{
+    const char *p;
+
+    if (szName[0] == '\0' || szName[0] == '.')
+        return 0;
+
+    for (p = szName; *p != '\0'; p++) {
+        if (*p == '/' || *p == '\\')
+            return 0;
+    }
+
+    return 1;
+}
+
+static void
+BIDCachedSnapshotPath(struct BIDCachedStore *store, char *szPath, size_t cchPath)
+{
+    snprintf(szPath, cchPath, "%s/%s.json", gSnapshotDir, store->Name);
+}
+
+static struct BIDCachedStore *
+BIDCachedGetStore(const char *szName)
+{
+    struct BIDCachedStore *store;
+
+    for (store = gStores; store != NULL; store = store->Next) {
+        if (strcmp(store->Name, szName) == 0)
+            return store;
+    }
+
+    if (!BIDCachedValidStoreName(szName))
+        return NULL;
+
+    store = calloc(1, sizeof(*store));
+    if (store == NULL)
+        return NULL;
+
+    store->Name = strdup(szName);
+    if (store->Name == NULL) {
+        free(store);
+        return NULL;
+    }
+
+    if (gSnapshotDir != NULL) {
+        char szPath[PATH_MAX];
+
+        BIDCachedSnapshotPath(store, szPath, sizeof(szPath));
+        store->Data = json_load_file(szPath, 0, NULL);
+        if (store->Data != NULL && !json_is_object(store->Data)) {
+            json_decref(store->Data);
+            store->Data = NULL;
+        }
+    }
+    if (store->Data == NULL)
+        store->Data = json_object();
+    if (store->Data == NULL) {
+        free(store->Name);
+        free(store);
+        return NULL;
+    }
+
+    time(&store->LastChangedTime);
+
+    store->Next = gStores;
+    gStores = store;
+
+    return store;
+}
+
+/*
+ * Restore every store with a snapshot before accepting connections, so
+ * that stores no client has used yet are still sent to peers.
+ */
+static int
+BIDCachedRestoreSnapshots(void)
+{
+    DIR *dir;
+    struct dirent *de;
+
+    if (gSnapshotDir == NULL)
+        return 0;
+
+    dir = opendir(gSnapshotDir);
+    if (dir == NULL) {
+        fprintf(stderr, "bidcached: failed to open %s: %s\n",
+                gSnapshotDir, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        char szName[256];
+        size_t cchName = strlen(de->d_name);
+
+        if (cchName <= 5 || cchName - 5 >= sizeof(szName) ||
+            strcmp(de->d_name + cchName - 5, ".json") != 0)
+            continue;
+
+        memcpy(szName, de->d_name, cchName - 5);
+        szName[cchName - 5] = '\0';
+
+        if (!BIDCachedValidStoreName(szName))
+            continue;
+
+        if (BIDCachedGetStore(szName) == NULL)
+            fprintf(stderr, "bidcached: failed to restore %s\n", szName);
+        else if (gVerbose)
+            fprintf(stderr, "bidcached: restored %s\n", szName);
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+static void
+BIDCachedSnapshot(void)
+{
+    struct BIDCachedStore *store;
+
+    if (gSnapshotDir == NULL)
+        return;
+
+    for (store = gStores; store != NULL; store = store->Next) {
+        char szPath[PATH_MAX], szTempPath[PATH_MAX + 4];
+
+        if (!store->Dirty)
+            continue;
+
+        BIDCachedSnapshotPath(store, szPath, sizeof(szPath));
+        snprintf(szTempPath, sizeof(szTempPath), "%s.tmp", szPath);
+
+        if (json_dump_file(store->Data, szTempPath, JSON_COMPACT) != 0 ||
+            rename(szTempPath, szPath) != 0) {
+            fprintf(stderr, "bidcached: failed to snapshot %s: %s\n",
+                    store->Name, strerror(errno));
+            unlink(szTempPath);
+            continue;
+        }
+
+        store->Dirty = 0;
+    }
+}
+
+static int
+BIDCachedAppendResponse(
+    struct BIDCachedClient *client,
+    BIDError status,
+    const void *pvPayload,
+    size_t cbPayload)
+{
+    unsigned char *p;
+
+    if (BIDCachedBufferReserve(&client->Output, 8 + cbPayload) != 0)
+        return -1;
+
+    p = client->Output.Data + client->Output.Length;
+
+    BIDCachedPutUInt32(p, (uint32_t)(4 + cbPayload));
+    BIDCachedPutUInt32(p + 4, (uint32_t)status);
+    if (cbPayload != 0)
+        memcpy(p + 8, pvPayload, cbPayload);
+
+    client->Output.Length += 8 + cbPayload;
+
+    return 0;
+}
+
+static int
+BIDCachedAppendJsonResponse(
+    struct BIDCachedClient *client,
+    json_t *value)
+{
+    char *szValue;
+    int ret;
+
+    szValue = json_dumps(value, JSON_COMPACT);
+    if (szValue == NULL)
+        return BIDCachedAppendResponse(client, BID_S_INVALID_JSON, NULL, 0);
+
+    ret = BIDCachedAppendResponse(client, BID_S_OK, szValue, strlen(szValue));
+
+    free(szValue);
+
+    return ret;
+}
+
+/*
+ * Reply to ITERATE with about BIDCACHED_ITERATE_PAGE bytes of the store's
+ * entries. The cursor names the next entry and its position, which is
+ * used instead should that entry be removed in the meantime; entries
+ * changed between pages may thus be missed or returned twice.
+ */
+static int
+BIDCachedAppendIterateResponse(
+    struct BIDCachedClient *client,
+    struct BIDCachedStore *store,
+    const char *szCursor)
+{
+    json_t *page = NULL, *entries = NULL;
+    void *iter;
+    size_t index = 0, cbPage = 0;
+    BIDError err = BID_S_NO_MEMORY;
+    int ret;
+
+    if (szCursor[0] != '\0') {
+        char *p;
+        size_t i;
+
+        index = strtoul(szCursor, &p, 10);
+        if (*p != ':')
+            return BIDCachedAppendResponse(client, BID_S_INVALID_PARAMETER, NULL, 0);
+
+        iter = json_object_iter_at(store->Data, p + 1);
+        if (iter == NULL) {
+            for (iter = json_object_iter(store->Data), i = 0;
+                 iter != NULL && i < index;
+                 iter = json_object_iter_next(store->Data, iter), i++)
+                ;
+        }
+    } else {
+        iter = json_object_iter(store->Data);
+    }
+
+    page = json_object();
+    entries = json_object();
+    if (page == NULL || entries == NULL ||
+        json_object_set(page, "d", entries) != 0)
+        goto cleanup;
+
+    for (; iter != NULL; iter = json_object_iter_next(store->Data, iter), index++) {
+        const char *szKey = json_object_iter_key(iter);
+        json_t *value = json_object_iter_value(iter);
+        char *szValue;
+        size_t cbEntry;
+
+        szValue = json_dumps(value, JSON_COMPACT);
+        if (szValue == NULL)
+            goto cleanup;
+
+        cbEntry = strlen(szKey) + strlen(szValue) + 4;
+        free(szValue);
+
+        if (cbPage != 0 && cbPage + cbEntry > BIDCACHED_ITERATE_PAGE)
+            break;
+
+        if (json_object_set(entries, szKey, value) != 0)
+            goto cleanup;
+
+        cbPage += cbEntry;
+    }
+
+    if (iter != NULL) {
+        const char *szKey = json_object_iter_key(iter);
+        char *szNext;
+        size_t cchNext = strlen(szKey) + 32;
+
+        szNext = malloc(cchNext);
+        if (szNext == NULL)
+            goto cleanup;
+
+        snprintf(szNext, cchNext, "%lu:%s", (unsigned long)index, szKey);
+
+        if (json_object_set_new(page, "next", json_string(szNext)) != 0) {
+            free(szNext);
+            goto cleanup;
+        }
+        free(szNext);
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    if (err == BID_S_OK)
+        ret = BIDCachedAppendJsonResponse(client, page);
+    else
+        ret = BIDCachedAppendResponse(client, err, NULL, 0);
+
+    json_decref(entries);
+    json_decref(page);
+
+    return ret;
+}
+
+/*
+ * Peer authentication
+ */
+static int
+BIDCachedLoadPeerKey(const char *szPath)
+{
+    FILE *fp;
+
+    fp = fopen(szPath, "rb");
+    if (fp == NULL) {
+        perror("bidcached: peer key");
+        return -1;
+    }
+
+    gcbPeerKey = fread(gPeerKey, 1, sizeof(gPeerKey), fp);
+    fclose(fp);
+
+    if (gcbPeerKey < BIDCACHED_PEER_MIN_KEY_LENGTH) {
+        fprintf(stderr, "bidcached: peer key must be at least %d bytes\n",
+                BIDCACHED_PEER_MIN_KEY_LENGTH);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * HMAC-SHA256(peer key, label || acceptor challenge || connector challenge)
+ */
+static void
+BIDCachedPeerMac(
+    char label,
+    const unsigned char *pbAcceptorChallenge,
+    const unsigned char *pbConnectorChallenge,
+    unsigned char *pbMac)
+{
+    unsigned char data[1 + 2 * BIDCACHED_PEER_CHALLENGE_LENGTH];
+    unsigned int cbMac = BIDCACHED_PEER_MAC_LENGTH;
+
+    data[0] = (unsigned char)label;
+    memcpy(&data[1], pbAcceptorChallenge, BIDCACHED_PEER_CHALLENGE_LENGTH);
+    memcpy(&data[1 + BIDCACHED_PEER_CHALLENGE_LENGTH], pbConnectorChallenge,
+           BIDCACHED_PEER_CHALLENGE_LENGTH);
+
+    HMAC(EVP_sha256(), gPeerKey, (int)gcbPeerKey, data, sizeof(data), pbMac, &cbMac);
+}
+
+static void
+BIDCachedHexEncode(const unsigned char *pbData, size_t cbData, char *szHex)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < cbData; i++) {
+        *szHex++ = hex[pbData[i] >> 4];
+        *szHex++ = hex[pbData[i] & 0xF];
+    }
+    *szHex = '\0';
+}
+
+/*
+ * Returns -1 unless szHex encodes exactly cbData bytes.
+ */
+static int
+BIDCachedHexDecode(const char *szHex, size_t cchHex, unsigned char *pbData, size_t cbData)
+{
+    size_t i;
+
+    if (cchHex != 2 * cbData)
+        return -1;
+
+    for (i = 0; i < cchHex; i++) {
+        char c = szHex[i];
+        int n;
+
+        if (c >= '0' && c <= '9')
+            n = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            n = c - 'a' + 10;
+        else
+            return -1;
+
+        if (i % 2 == 0)
+            pbData[i / 2] = n << 4;
+        else
+            pbData[i / 2] |= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Peer replication
+ */
+static void
+BIDCachedDisconnectPeer(struct BIDCachedPeer *peer)
+{
+    if (peer->Socket != -1) {
+        if (gVerbose)
+            fprintf(stderr, "bidcached: disconnected from peer %s:%s\n",
+                    peer->Host, peer->Port);
+        close(peer->Socket);
+    }
+
+    peer->Socket = -1;
+    peer->Connected = 0;
+    peer->ChallengeAnswered = 0;
+    peer->Authenticated = 0;
+    peer->NextConnectTime = BIDCachedNow() + BIDCACHED_PEER_RETRY_INTERVAL;
+    peer->Input.Length = 0;
+    peer->Output.Length = 0;
+    peer->cInFlight = 0;
+    json_decref(peer->SyncData);
+    peer->SyncData = NULL;
+}
+
+/*
+ * Queue a change for a peer. The change ID is zero for changes whose
+ * acknowledgement nobody waits for.
+ */
+static int
+BIDCachedQueuePeerChange(
+    struct BIDCachedPeer *peer,
+    uint64_t changeId,
+    uint8_t op,
+    const char *szStore,
+    const char *szKey,
+    const char *szValue)
+{
+    size_t cchStore = strlen(szStore);
+    size_t cchKey = szKey != NULL ? strlen(szKey) : 0;
+    size_t cchValue = szValue != NULL ? strlen(szValue) : 0;
+    size_t cbRequest = 1 + 1 + cchStore + 2 + cchKey + cchValue;
+    unsigned char *p;
+
+    if (peer->Socket == -1)
+        return -1;
+
+    if (peer->Output.Length + 4 + cbRequest > BIDCACHED_PEER_MAX_BACKLOG) {
+        /* too far behind; resynchronise on reconnection */
+        BIDCachedDisconnectPeer(peer);
+        return -1;
+    }
+
+    if (peer->cInFlight == peer->cInFlightCapacity) {
+        size_t cCapacity = peer->cInFlightCapacity ? 2 * peer->cInFlightCapacity : 64;
+        uint64_t *inFlight = realloc(peer->InFlight, cCapacity * sizeof(uint64_t));
+
+        if (inFlight == NULL)
+            return -1;
+
+        peer->InFlight = inFlight;
+        peer->cInFlightCapacity = cCapacity;
+    }
+
+    if (BIDCachedBufferReserve(&peer->Output, 4 + cbRequest) != 0)
+        return -1;
+
+    p = peer->Output.Data + peer->Output.Length;
+
+    BIDCachedPutUInt32(p, (uint32_t)cbRequest);
+    p += 4;
+    *p++ = op | BID_CACHE_DAEMON_OP_FLAG_REPLICA;
+    *p++ = (uint8_t)cchStore;
+    memcpy(p, szStore, cchStore);
+    p += cchStore;
+    *p++ = (cchKey >> 8) & 0xFF;
+    *p++ = (cchKey     ) & 0xFF;
+    if (cchKey != 0)
+        memcpy(p, szKey, cchKey);
+    p += cchKey;
+    if (cchValue != 0)
+        memcpy(p, szValue, cchValue);
+
+    peer->Output.Length += 4 + cbRequest;
+    peer->InFlight[peer->cInFlight++] = changeId;
+
+    return 0;
+}
+
+/*
+ * Drop a changed entry from any pending resyncs, so that they don't send
+ * a stale value after the change itself (which arrives at the peer from
+ * us, or from the peer that made it).
+ */
+static void
+BIDCachedSupersedeSync(uint8_t op, const char *szStore, const char *szKey)
+{
+    size_t i;
+
+    for (i = 0; i < gcPeers; i++) {
+        json_t *syncData = gPeers[i].SyncData;
+
+        if (syncData == NULL)
+            continue;
+
+        if (op == BID_CACHE_DAEMON_OP_DESTROY)
+            json_object_del(syncData, szStore);
+        else
+            json_object_del(json_object_get(syncData, szStore), szKey);
+    }
+}
+
+/*
+ * Forward a change to every connected peer, returning the number of peers
+ * to which it was queued.
+ */
+static unsigned int
+BIDCachedReplicate(
+    uint64_t changeId,
+    uint8_t op,
+    const char *szStore,
+    const char *szKey,
+    json_t *value)
+{
+    char *szValue = NULL;
+    unsigned int cQueued = 0;
+    size_t i;
+
+    if (gcPeers == 0)
+        return 0;
+
+    if (value != NULL) {
+        szValue = json_dumps(value, JSON_COMPACT);
+        if (szValue == NULL)
+            return 0;
+    }
+
+    for (i = 0; i < gcPeers; i++) {
+        if (gPeers[i].Authenticated &&
+            BIDCachedQueuePeerChange(&gPeers[i], changeId, op, szStore, szKey, szValue) == 0)
+            cQueued++;
+    }
+
+    free(szValue);
+
+    return cQueued;
+}
+
+/*
+ * Queue more of a pending resync, until the peer's backlog reaches
+ * BIDCACHED_PEER_SYNC_CHUNK. Entries are removed from the snapshot as they
+ * are queued. Returns -1 if the peer was disconnected.
+ */
+static int
+BIDCachedContinueSync(struct BIDCachedPeer *peer)
+{
+    while (peer->SyncData != NULL &&
+           peer->Output.Length < BIDCACHED_PEER_SYNC_CHUNK) {
+        void *storeIter = json_object_iter(peer->SyncData);
+        const char *szStore;
+        json_t *entries;
+        void *iter;
+        char *szKey, *szValue;
+        int ret;
+
+        if (storeIter == NULL) {
+            json_decref(peer->SyncData);
+            peer->SyncData = NULL;
+            if (gVerbose)
+                fprintf(stderr, "bidcached: resynchronised peer %s:%s\n",
+                        peer->Host, peer->Port);
+            break;
+        }
+
+        szStore = json_object_iter_key(storeIter);
+        entries = json_object_iter_value(storeIter);
+
+        iter = json_object_iter(entries);
+        if (iter == NULL) {
+            json_object_del(peer->SyncData, szStore);
+            continue;
+        }
+
+        szKey = strdup(json_object_iter_key(iter));
+        szValue = json_dumps(json_object_iter_value(iter), JSON_COMPACT);
+        if (szKey == NULL || szValue == NULL) {
+            free(szKey);
+            free(szValue);
+            return -1;
+        }
+
+        json_object_del(entries, szKey);
+
+        ret = BIDCachedQueuePeerChange(peer, 0, BID_CACHE_DAEMON_OP_SET,
+                                       szStore, szKey, szValue);
+        free(szKey);
+        free(szValue);
+
+        if (ret != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Snapshot the entire contents of every store for a newly connected peer.
+ * The copies are shallow, so values are shared with the stores.
+ */
+static void
+BIDCachedSynchronizePeer(struct BIDCachedPeer *peer)
+{
+    struct BIDCachedStore *store;
+
+    json_decref(peer->SyncData);
+
+    peer->SyncData = json_object();
+    if (peer->SyncData == NULL)
+        return;
+
+    for (store = gStores; store != NULL; store = store->Next) {
+        if (json_object_set_new(peer->SyncData, store->Name,
+                                json_copy(store->Data)) != 0) {
+            BIDCachedDisconnectPeer(peer);
+            return;
+        }
+    }
+
+    BIDCachedContinueSync(peer);
+}
+
+static void
+BIDCachedConnectPeer(struct BIDCachedPeer *peer)
+{
+    struct addrinfo hints, *ai = NULL;
+    int s;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    peer->NextConnectTime = BIDCachedNow() + BIDCACHED_PEER_RETRY_INTERVAL;
+
+    if (getaddrinfo(peer->Host, peer->Port, &hints, &ai) != 0)
+        return;
+
+    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (s >= 0) {
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+        if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            peer->Socket = s;
+            peer->Connected = 0;
+        } else {
+            close(s);
+        }
+    }
+
+    freeaddrinfo(ai);
+}
+
+static void
+BIDCachedPeerConnected(struct BIDCachedPeer *peer)
+{
+    int error = 0;
+    socklen_t cbError = sizeof(error);
+
+    if (getsockopt(peer->Socket, SOL_SOCKET, SO_ERROR, &error, &cbError) != 0 ||
+        error != 0) {
+        close(peer->Socket);
+        peer->Socket = -1;
+        return;
+    }
+
+    if (gVerbose)
+        fprintf(stderr, "bidcached: connected to peer %s:%s\n", peer->Host, peer->Port);
+
+    /* wait for the acceptor's challenge before sending anything */
+    peer->Connected = 1;
+}
+
+/*
+ * Process a handshake message from the peer: first its challenge, which
+ * we answer, then its response, which must prove it holds the peer key.
+ * Returns -1 if the peer should be disconnected.
+ */
+static int
+BIDCachedContinuePeerHandshake(
+    struct BIDCachedPeer *peer,
+    BIDError status,
+    const unsigned char *pbPayload,
+    size_t cbPayload)
+{
+    char szChallenge[2 * BIDCACHED_PEER_CHALLENGE_LENGTH + 1];
+    char szMac[2 * BIDCACHED_PEER_MAC_LENGTH + 1];
+    unsigned char mac[BIDCACHED_PEER_MAC_LENGTH];
+
+    if (!peer->ChallengeAnswered) {
+        if (status != BID_S_OK || cbPayload != BIDCACHED_PEER_CHALLENGE_LENGTH ||
+            RAND_bytes(peer->Challenge, sizeof(peer->Challenge)) != 1)
+            return -1;
+
+        BIDCachedPeerMac('C', pbPayload, peer->Challenge, mac);
+        BIDCachedPeerMac('A', pbPayload, peer->Challenge, peer->ExpectedMac);
+
+        BIDCachedHexEncode(peer->Challenge, sizeof(peer->Challenge), szChallenge);
+        BIDCachedHexEncode(mac, sizeof(mac), szMac);
+
+        if (BIDCachedQueuePeerChange(peer, 0, BID_CACHE_DAEMON_OP_AUTH, "",
+                                     szChallenge, szMac) != 0)
+            return -1;
+
+        peer->ChallengeAnswered = 1;
+        return 0;
+    }
+
+    if (status != BID_S_OK || cbPayload != BIDCACHED_PEER_MAC_LENGTH ||
+        CRYPTO_memcmp(pbPayload, peer->ExpectedMac, BIDCACHED_PEER_MAC_LENGTH) != 0) {
+        fprintf(stderr, "bidcached: peer %s:%s failed to authenticate\n",
+                peer->Host, peer->Port);
+        return -1;
+    }
+
+    /* the response to our BID_CACHE_DAEMON_OP_AUTH */
+    BID_ASSERT(peer->cInFlight == 1);
+    peer->cInFlight = 0;
+    peer->Authenticated = 1;
+
+    if (gVerbose)
+        fprintf(stderr, "bidcached: authenticated peer %s:%s\n", peer->Host, peer->Port);
+
+    BIDCachedSynchronizePeer(peer);
+
+    return peer->Socket == -1 ? -1 : 0;
+}
+
+/*
+ * Process acknowledgements from a peer. Responses arrive in the order in
+ * which changes were sent.
+ */
+static void
+BIDCachedAcknowledge(uint64_t changeId, BIDError status)
+{
+    size_t i;
+
+    if (changeId == 0)
+        return;
+
+    for (i = 0; i < gcClients; i++) {
+        struct BIDCachedClient *client = &gClients[i];
+
+        if (client->PendingId == changeId) {
+            /* a peer that no longer has a removed key has still applied it */
+            if (status == BID_S_CACHE_KEY_NOT_FOUND &&
+                client->PendingOp == BID_CACHE_DAEMON_OP_REMOVE)
+                status = BID_S_OK;
+
+            if (status == BID_S_OK && client->PendingAcks != 0)
+                client->PendingAcks--;
+            break;
+        }
+    }
+}
+
+static int
+BIDCachedReadPeer(struct BIDCachedPeer *peer)
+{
+    ssize_t cbRead;
+    size_t offset = 0;
+
+    if (BIDCachedBufferReserve(&peer->Input, 4096) != 0)
+        return -1;
+
+    cbRead = read(peer->Socket, peer->Input.Data + peer->Input.Length,
+                  peer->Input.Capacity - peer->Input.Length);
+    if (cbRead < 0)
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    else if (cbRead == 0)
+        return -1;
+
+    peer->Input.Length += cbRead;
+
+    while (peer->Input.Length - offset >= 8) {
+        uint32_t cbResponse = BIDCachedGetUInt32(peer->Input.Data + offset);
+        BIDError status = BIDCachedGetUInt32(peer->Input.Data + offset + 4);
+
+        if (cbResponse < 4 || cbResponse > BID_CACHE_DAEMON_MAX_MESSAGE ||
+            (peer->Authenticated && peer->cInFlight == 0))
+            return -1;
+
+        if (peer->Input.Length - offset - 4 < cbResponse)
+            break;
+
+        if (!peer->Authenticated) {
+            if (BIDCachedContinuePeerHandshake(peer, status,
+                                               peer->Input.Data + offset + 8,
+                                               cbResponse - 4) != 0)
+                return -1;
+            offset += 4 + cbResponse;
+            continue;
+        }
+
+        BIDCachedAcknowledge(peer->InFlight[0], status);
+
+        memmove(peer->InFlight, peer->InFlight + 1,
+                --peer->cInFlight * sizeof(uint64_t));
+        offset += 4 + cbResponse;
+    }
+
+    BIDCachedBufferConsume(&peer->Input, offset);
+
+    return 0;
+}
+
+static int
+BIDCachedWritePeer(struct BIDCachedPeer *peer)
+{
+    ssize_t cbWritten;
+
+    cbWritten = write(peer->Socket, peer->Output.Data, peer->Output.Length);
+    if (cbWritten < 0)
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+
+    BIDCachedBufferConsume(&peer->Output, cbWritten);
+
+    return BIDCachedContinueSync(peer);
+}
+
+static int
+BIDCachedAddPeer(const char *szPeer)
+{
+    struct BIDCachedPeer *peers, *peer;
+    const char *p = strrchr(szPeer, ':');
+
+    if (p == NULL || p == szPeer || p[1] == '\0')
+        return -1;
+
+    peers = realloc(gPeers, (gcPeers + 1) * sizeof(*peers));
+    if (peers == NULL)
+        return -1;
+    gPeers = peers;
+
+    peer = &gPeers[gcPeers];
+    memset(peer, 0, sizeof(*peer));
+    peer->Socket = -1;
+    peer->Host = strndup(szPeer, p - szPeer);
+    peer->Port = strdup(p + 1);
+    if (peer->Host == NULL || peer->Port == NULL)
+        return -1;
+
+    gcPeers++;
+
+    return 0;
+}
+
+/*
+ * Requests
+ */
+
+/*
+ * Check a connecting peer's answer to our challenge, and answer its own.
+ * Returns -1 if the peer should be dropped.
+ */
+static int
+BIDCachedAuthenticatePeer(
+    struct BIDCachedClient *client,
+    uint8_t op,
+    const char *szKey,
+    const unsigned char *pbValue,
+    size_t cbValue)
+{
+    unsigned char challenge[BIDCACHED_PEER_CHALLENGE_LENGTH];
+    unsigned char mac[BIDCACHED_PEER_MAC_LENGTH];
+    unsigned char expectedMac[BIDCACHED_PEER_MAC_LENGTH];
+
+    if (op != BID_CACHE_DAEMON_OP_AUTH ||
+        BIDCachedHexDecode(szKey, strlen(szKey), challenge, sizeof(challenge)) != 0 ||
+        BIDCachedHexDecode((const char *)pbValue, cbValue, mac, sizeof(mac)) != 0)
+        return -1;
+
+    BIDCachedPeerMac('C', client->Challenge, challenge, expectedMac);
+
+    if (CRYPTO_memcmp(mac, expectedMac, sizeof(mac)) != 0) {
+        fprintf(stderr, "bidcached: peer client %d failed to authenticate\n",
+                client->Socket);
+        return -1;
+    }
+
+    client->Authenticated = 1;
+
+    BIDCachedPeerMac('A', client->Challenge, challenge, mac);
+
+    return BIDCachedAppendResponse(client, BID_S_OK, mac, sizeof(mac));
+}
+
+/*
+ * Process one request, appending the response to the client's output.
+ * Returns -1 if the request is malformed and the client should be dropped,
+ * or 1 if the response awaits acknowledgement from peers.
+ */
+static int
+BIDCachedProcessRequest(
+    struct BIDCachedClient *client,
+    const unsigned char *pbRequest,
+    size_t cbRequest)
+{
+    uint8_t op;
+    int bReplica;
+    size_t cchStore, cchKey, cbValue;
+    char szStore[256];
+    char *szKey = NULL;
+    const unsigned char *p = pbRequest;
+    struct BIDCachedStore *store;
+    json_t *value = NULL;
+    unsigned char timestamp[8];
+    int bChanged = 0;
+    int ret = 0;
+
+    if (cbRequest < 2)
+        return -1;
+
+    op = *p++;
+    cchStore = *p++;
+    cbRequest -= 2;
+
+    bReplica = (op & BID_CACHE_DAEMON_OP_FLAG_REPLICA) != 0;
+    op &= ~(BID_CACHE_DAEMON_OP_FLAG_REPLICA);
+
+    if (cbRequest < cchStore + 2)
+        return -1;
+
+    memcpy(szStore, p, cchStore);
+    szStore[cchStore] = '\0';
+    p += cchStore;
+    cbRequest -= cchStore;
+
+    cchKey = (p[0] << 8) | p[1];
+    p += 2;
+    cbRequest -= 2;
+
+    if (cbRequest < cchKey)
+        return -1;
+
+    szKey = malloc(cchKey + 1);
+    if (szKey == NULL)
+        return -1;
+
+    memcpy(szKey, p, cchKey);
+    szKey[cchKey] = '\0';
+    p += cchKey;
+    cbValue = cbRequest - cchKey;
+
+    if (client->Peer && !client->Authenticated) {
+        ret = BIDCachedAuthenticatePeer(client, op, szKey, p, cbValue);
+        goto cleanup;
+    }
+
+    /* peers may only replicate changes, never read */
+    if (client->Peer &&
+        !(bReplica && (op == BID_CACHE_DAEMON_OP_SET ||
+                       op == BID_CACHE_DAEMON_OP_REMOVE ||
+                       op == BID_CACHE_DAEMON_OP_DESTROY))) {
+        ret = BIDCachedAppendResponse(client, BID_S_CACHE_PERMISSION_DENIED, NULL, 0);
+        goto cleanup;
+    }
+
+    store = BIDCachedGetStore(szStore);
+    if (store == NULL) {
+        ret = BIDCachedAppendResponse(client, BID_S_CACHE_NOT_FOUND, NULL, 0);
+        goto cleanup;
+    }
+
+    switch (op) {
+    case BID_CACHE_DAEMON_OP_GET:
+        value = json_object_get(store->Data, szKey);
+        if (value == NULL)
+            ret = BIDCachedAppendResponse(client, BID_S_CACHE_KEY_NOT_FOUND, NULL, 0);
+        else
+            ret = BIDCachedAppendJsonResponse(client, value);
+        value = NULL;
+        break;
+    case BID_CACHE_DAEMON_OP_SET:
+        value = json_loadb((const char *)p, cbValue, 0, NULL);
+        if (value == NULL) {
+            ret = BIDCachedAppendResponse(client, BID_S_INVALID_JSON, NULL, 0);
+        } else if (json_object_set(store->Data, szKey, value) != 0) {
+            ret = BIDCachedAppendResponse(client, BID_S_NO_MEMORY, NULL, 0);
+        } else {
+            bChanged = 1;
+        }
+        break;
+    case BID_CACHE_DAEMON_OP_REMOVE:
+        if (json_object_del(store->Data, szKey) != 0)
+            ret = BIDCachedAppendResponse(client, BID_S_CACHE_KEY_NOT_FOUND, NULL, 0);
+        else
+            bChanged = 1;
+        break;
+    case BID_CACHE_DAEMON_OP_ITERATE:
+        ret = BIDCachedAppendIterateResponse(client, store, szKey);
+        break;
+    case BID_CACHE_DAEMON_OP_LAST_CHANGED:
+        BIDCachedPutUInt32(timestamp, (uint32_t)((uint64_t)store->LastChangedTime >> 32));
+        BIDCachedPutUInt32(timestamp + 4, (uint32_t)store->LastChangedTime);
+        ret = BIDCachedAppendResponse(client, BID_S_OK, timestamp, sizeof(timestamp));
+        break;
+    case BID_CACHE_DAEMON_OP_DESTROY:
+        json_object_clear(store->Data);
+        bChanged = 1;
+        break;
+    default:
+        ret = BIDCachedAppendResponse(client, BID_S_NOT_IMPLEMENTED, NULL, 0);
+        break;
+    }
+
+    if (bChanged) {
+        uint64_t changeId = gNextChangeId++;
+
+        time(&store->LastChangedTime);
+        store->Dirty = 1;
+
+        BIDCachedSupersedeSync(op, store->Name, szKey);
+
+        if (!bReplica) {
+            unsigned int cQueued;
+
+            cQueued = BIDCachedReplicate(changeId, op, store->Name, szKey, value);
+            if (gAcks != 0) {
+                client->PendingId = changeId;
+                client->PendingOp = op;
+                client->PendingAcks = gAcks;
+                client->PendingDeadline = BIDCachedNow() + gAckTimeout;
+                ret = 1;
+                if (gVerbose && cQueued < gAcks)
+                    fprintf(stderr, "bidcached: only %u of %u peers connected\n",
+                            cQueued, gAcks);
+                goto cleanup;
+            }
+        }
+
+        ret = BIDCachedAppendResponse(client, BID_S_OK, NULL, 0);
+    }
+
+cleanup:
+    json_decref(value);
+    free(szKey);
+
+    return ret;
+}
+
+/*
+ * Process every complete request in the input buffer, so that pipelined
+ * requests are answered in a single write. Processing stops at a request
+ * awaiting acknowledgement from peers, so that responses stay in order.
+ */
+static int
+BIDCachedProcessInput(struct BIDCachedClient *client)
+{
+    size_t offset = 0;
+    int ret = 0;
+
+    if (client->PendingId != 0)
+        return 0;
+
+    while (client->Input.Length - offset >= 4) {
+        uint32_t cbRequest = BIDCachedGetUInt32(client->Input.Data + offset);
+
+        if (cbRequest > BID_CACHE_DAEMON_MAX_MESSAGE) {
+            ret = -1;
+            break;
+        }
+
+        if (client->Input.Length - offset - 4 < cbRequest)
+            break;
+
+        ret = BIDCachedProcessRequest(client, client->Input.Data + offset + 4, cbRequest);
+        if (ret < 0)
+            break;
+
+        offset += 4 + cbRequest;
+
+        if (ret > 0) {
+            ret = 0;
+            break;
+        }
+    }
+
+    BIDCachedBufferConsume(&client->Input, offset);
+
+    return ret;
+}
+
+/*
+ * Complete a deferred response once enough peers have acknowledged the
+ * change, or fail it when the deadline passes.
+ */
+static int
+BIDCachedCompletePending(struct BIDCachedClient *client, uint64_t now)
+{
+    BIDError status;
+
+    if (client->PendingId == 0)
+        return 0;
+
+    if (client->PendingAcks == 0)
+        status = BID_S_OK;
+    else if (now >= client->PendingDeadline)
+        status = BID_S_CACHE_WRITE_ERROR;
+    else
+        return 0;
+
+    client->PendingId = 0;
+    client->PendingOp = 0;
+    client->PendingAcks = 0;
+
+    if (BIDCachedAppendResponse(client, status, NULL, 0) != 0)
+        return -1;
+
+    return BIDCachedProcessInput(client);
+}
+
+static void
+BIDCachedCloseClient(size_t i)
+{
+    close(gClients[i].Socket);
+    BIDCachedBufferFree(&gClients[i].Input);
+    BIDCachedBufferFree(&gClients[i].Output);
+
+    gClients[i] = gClients[--gcClients];
+}
+
+static int
+BIDCachedAcceptClient(int listener, int bPeer)
+{
+    struct BIDCachedClient *clients;
+    struct BIDCachedClient *client;
+    int s;
+
+    s = accept(listener, NULL, NULL);
+    if (s < 0)
+        return -1;
+
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+    clients = realloc(gClients, (gcClients + 1) * sizeof(*clients));
+    if (clients == NULL) {
+        close(s);
+        return -1;
+    }
+
+    gClients = clients;
+    client = &gClients[gcClients];
+    memset(client, 0, sizeof(*client));
+    client->Socket = s;
+    client->Peer = bPeer;
+
+    /* a peer must answer this challenge before anything else */
+    if (bPeer &&
+        (RAND_bytes(client->Challenge, sizeof(client->Challenge)) != 1 ||
+         BIDCachedAppendResponse(client, BID_S_OK, client->Challenge,
+                                 sizeof(client->Challenge)) != 0)) {
+        BIDCachedBufferFree(&client->Output);
+        close(s);
+        return -1;
+    }
+
+    gcClients++;
+
+    if (gVerbose)
+        fprintf(stderr, "bidcached: accepted %s %d\n", bPeer ? "peer" : "client", s);
+
+    return 0;
+}
+
+/*
+ * Returns -1 if the client should be dropped.
+ */
+static int
+BIDCachedReadClient(struct BIDCachedClient *client)
+{
+    ssize_t cbRead;
+
+    if (BIDCachedBufferReserve(&client->Input, 4096) != 0)
+        return -1;
+
+    cbRead = read(client->Socket, client->Input.Data + client->Input.Length,
+                  client->Input.Capacity - client->Input.Length);
+    if (cbRead < 0)
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    else if (cbRead == 0)
+        return -1;
+
+    client->Input.Length += cbRead;
+
+    return BIDCachedProcessInput(client);
+}
+
+static int
+BIDCachedWriteClient(struct BIDCachedClient *client)
+{
+    ssize_t cbWritten;
+
+    cbWritten = write(client->Socket, client->Output.Data, client->Output.Length);
+    if (cbWritten < 0)
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+
+    BIDCachedBufferConsume(&client->Output, cbWritten);
+
+    return 0;
+}
+
+/*
+ * Stores hold replay caches and ticket keys, so the socket is only
+ * accessible to the daemon's user (and group, with -mode 0660).
+ */
+static int
+BIDCachedListen(const char *szSocketPath)
+{
+    struct sockaddr_un sun;
+    mode_t oldMask;
+    int s, ret;
+
+    if (strlen(szSocketPath) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "bidcached: socket path too long\n");
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, szSocketPath, sizeof(sun.sun_path) - 1);
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("bidcached: socket");
+        return -1;
+    }
+
+    unlink(szSocketPath);
+
+    /* don't let anyone else connect before the mode is set */
+    oldMask = umask(077);
+    ret = bind(s, (struct sockaddr *)&sun, sizeof(sun));
+    umask(oldMask);
+
+    if (ret != 0 ||
+        chmod(szSocketPath, gSocketMode) != 0 ||
+        listen(s, SOMAXCONN) != 0) {
+        perror("bidcached: bind");
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static int
+BIDCachedListenPeers(const char *szListen)
+{
+    struct addrinfo hints, *ai = NULL;
+    char *szHost = NULL;
+    const char *szPort, *p;
+    int s = -1, on = 1;
+
+    /* without a host, only listen on loopback */
+    p = strrchr(szListen, ':');
+    if (p != NULL) {
+        szHost = strndup(szListen, p - szListen);
+        szPort = p + 1;
+    } else {
+        szHost = strdup("127.0.0.1");
+        szPort = szListen;
+    }
+    if (szHost == NULL)
+        goto cleanup;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(szHost, szPort, &hints, &ai) != 0) {
+        fprintf(stderr, "bidcached: cannot resolve %s\n", szListen);
+        goto cleanup;
+    }
+
+    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (s < 0) {
+        perror("bidcached: socket");
+        goto cleanup;
+    }
+
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(s, ai->ai_addr, ai->ai_addrlen) != 0 ||
+        listen(s, SOMAXCONN) != 0) {
+        perror("bidcached: bind");
+        close(s);
+        s = -1;
+    }
+
+cleanup:
+    if (ai != NULL)
+        freeaddrinfo(ai);
+    free(szHost);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *szSocketPath = getenv("BID_CACHE_DAEMON_SOCKET");
+    const char *szListen = NULL;
+    struct pollfd *pfds = NULL;
+    time_t nextSnapshot;
+    int listener, peerListener = -1;
+    size_t i;
+
+    if (szSocketPath == NULL)
+        szSocketPath = BID_CACHE_DAEMON_SOCKET;
+
+    for (argc--, argv++; argc > 0; argc--, argv++) {
+        if (strcmp(argv[0], "-socket") == 0 && argc > 1) {
+            szSocketPath = *++argv;
+            argc--;
+        } else if (strcmp(argv[0], "-mode") == 0 && argc > 1) {
+            gSocketMode = (mode_t)strtoul(*++argv, NULL, 8) & 0777;
+            argc--;
+        } else if (strcmp(argv[0], "-snapshot") == 0 && argc > 1) {
+            gSnapshotDir = *++argv;
+            argc--;
+        } else if (strcmp(argv[0], "-interval") == 0 && argc > 1) {
+            gSnapshotInterval = atoi(*++argv);
+            argc--;
+        } else if (strcmp(argv[0], "-listen") == 0 && argc > 1) {
+            szListen = *++argv;
+            argc--;
+        } else if (strcmp(argv[0], "-peer-key") == 0 && argc > 1) {
+            if (BIDCachedLoadPeerKey(*++argv) != 0)
+                exit(BID_S_INVALID_PARAMETER);
+            argc--;
+        } else if (strcmp(argv[0], "-peer") == 0 && argc > 1) {
+            if (BIDCachedAddPeer(*++argv) != 0)
+                BIDCachedUsage();
+            argc--;
+        } else if (strcmp(argv[0], "-acks") == 0 && argc > 1) {
+            gAcks = atoi(*++argv);
+            argc--;
+        } else if (strcmp(argv[0], "-ack-timeout") == 0 && argc > 1) {
+            gAckTimeout = atoi(*++argv);
+            argc--;
+        } else if (strcmp(argv[0], "-verbose") == 0 || strcmp(argv[0], "-v") == 0) {
+            gVerbose = 1;
+        } else {
+            BIDCachedUsage();
+        }
+    }
+
+    if (gSnapshotInterval <= 0 || gAcks > gcPeers)
+        BIDCachedUsage();
+
+    if ((szListen != NULL || gcPeers != 0) && gcbPeerKey == 0) {
+        fprintf(stderr, "bidcached: -listen and -peer require -peer-key\n");
+        BIDCachedUsage();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, BIDCachedSignal);
+    signal(SIGTERM, BIDCachedSignal);
+
+    if (BIDCachedRestoreSnapshots() != 0)
+        exit(BID_S_CACHE_OPEN_ERROR);
+
+    listener = BIDCachedListen(szSocketPath);
+    if (listener < 0)
+        exit(BID_S_CACHE_OPEN_ERROR);
+
+    if (szListen != NULL) {
+        peerListener = BIDCachedListenPeers(szListen);
+        if (peerListener < 0)
+            exit(BID_S_CACHE_OPEN_ERROR);
+    }
+
+    nextSnapshot = time(NULL) + gSnapshotInterval;
+
+    while (!gTerminate) {
+        struct pollfd *newPfds;
+        size_t cPfds = 2 + gcPeers + gcClients, cPolledClients;
+        uint64_t now = BIDCachedNow();
+        int nReady, timeout = 1000;
+
+        for (i = 0; i < gcPeers; i++) {
+            if (gPeers[i].Socket == -1 && now >= gPeers[i].NextConnectTime)
+                BIDCachedConnectPeer(&gPeers[i]);
+        }
+
+        newPfds = realloc(pfds, cPfds * sizeof(*pfds));
+        if (newPfds == NULL)
+            break;
+        pfds = newPfds;
+        memset(pfds, 0, cPfds * sizeof(*pfds));
+
+        pfds[0].fd = listener;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = peerListener;
+        pfds[1].events = POLLIN;
+
+        for (i = 0; i < gcPeers; i++) {
+            struct pollfd *pfd = &pfds[2 + i];
+
+            pfd->fd = gPeers[i].Socket;
+            if (!gPeers[i].Connected)
+                pfd->events = POLLOUT;
+            else if (gPeers[i].Output.Length != 0)
+                pfd->events = POLLIN | POLLOUT;
+            else
+                pfd->events = POLLIN;
+        }
+
+        cPolledClients = gcClients;
+
+        for (i = 0; i < cPolledClients; i++) {
+            struct pollfd *pfd = &pfds[2 + gcPeers + i];
+
+            pfd->fd = gClients[i].Socket;
+            pfd->events = POLLIN;
+            if (gClients[i].Output.Length != 0)
+                pfd->events |= POLLOUT;
+            if (gClients[i].PendingId != 0) {
+                uint64_t wait = gClients[i].PendingDeadline > now ?
+                    gClients[i].PendingDeadline - now : 0;
+
+                if (wait < (uint64_t)timeout)
+                    timeout = (int)wait;
+            }
+        }
+
+        nReady = poll(pfds, cPfds, timeout);
+        if (nReady < 0 && errno != EINTR) {
+            perror("bidcached: poll");
+            break;
+        }
+
+        for (i = 0; nReady > 0 && i < gcPeers; i++) {
+            struct BIDCachedPeer *peer = &gPeers[i];
+            short revents = pfds[2 + i].revents;
+            int ret = 0;
+
+            if (peer->Socket == -1 || revents == 0)
+                continue;
+
+            if (!peer->Connected) {
+                BIDCachedPeerConnected(peer);
+                if (peer->Socket == -1)
+                    peer->NextConnectTime = BIDCachedNow() + BIDCACHED_PEER_RETRY_INTERVAL;
+                continue;
+            }
+
+            if (revents & (POLLERR | POLLNVAL))
+                ret = -1;
+            if (ret == 0 && (revents & (POLLIN | POLLHUP)))
+                ret = BIDCachedReadPeer(peer);
+            if (ret == 0 && peer->Output.Length != 0)
+                ret = BIDCachedWritePeer(peer);
+
+            if (ret != 0)
+                BIDCachedDisconnectPeer(peer);
+        }
+
+        now = BIDCachedNow();
+
+        /* walk backwards, as closing a client moves the last into its slot */
+        for (i = cPolledClients; i > 0; i--) {
+            struct BIDCachedClient *client = &gClients[i - 1];
+            short revents = nReady > 0 ? pfds[2 + gcPeers + i - 1].revents : 0;
+            int ret;
+
+            ret = BIDCachedCompletePending(client, now);
+            if (revents & (POLLERR | POLLNVAL))
+                ret = -1;
+            if (ret == 0 && (revents & (POLLIN | POLLHUP)))
+                ret = BIDCachedReadClient(client);
+            if (ret == 0 && client->Output.Length != 0)
+                ret = BIDCachedWriteClient(client);
+
+            if (ret != 0) {
+                if (gVerbose)
+                    fprintf(stderr, "bidcached: closing client %d\n", client->Socket);
+                BIDCachedCloseClient(i - 1);
+            }
+        }
+
+        /* flush changes queued for peers while processing clients */
+        for (i = 0; i < gcPeers; i++) {
+            if (gPeers[i].Connected && gPeers[i].Output.Length != 0 &&
+                BIDCachedWritePeer(&gPeers[i]) != 0)
+                BIDCachedDisconnectPeer(&gPeers[i]);
+        }
+
+        if (nReady > 0) {
+            if (pfds[0].revents & POLLIN)
+                BIDCachedAcceptClient(listener, 0);
+            if (peerListener != -1 && (pfds[1].revents & POLLIN))
+                BIDCachedAcceptClient(peerListener, 1);
+        }
+
+        if (time(NULL) >= nextSnapshot) {
+            BIDCachedSnapshot();
+            nextSnapshot = time(NULL) + gSnapshotInterval;
+        }
+    }
+
+    BIDCachedSnapshot();
+
+    while (gcClients != 0)
+        BIDCachedCloseClient(gcClients - 1);
+    free(gClients);
+    for (i = 0; i < gcPeers; i++) {
+        if (gPeers[i].Socket != -1)
+            close(gPeers[i].Socket);
+        BIDCachedBufferFree(&gPeers[i].Input);
+        BIDCachedBufferFree(&gPeers[i].Output);
+        json_decref(gPeers[i].SyncData);
+        free(gPeers[i].InFlight);
+        free(gPeers[i].Host);
+        free(gPeers[i].Port);
+    }
+    free(gPeers);
+    free(pfds);
+    OPENSSL_cleanse(gPeerKey, sizeof(gPeerKey));
+
+    close(listener);
+    if (peerListener != -1)
+        close(peerListener);
+    unlink(szSocketPath);
+
+    exit(BID_S_OK);
+}
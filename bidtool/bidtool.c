@@ -478,6 +478,29 @@ cleanup:
     return err;
 }
 
+static BIDError
+BIDConvertCache(int argc, char *argv[])
+{
+    BIDError err;
+    uint32_t ulFormat = BID_FCACHE_FORMAT_BINARY;
+
+    if (argc < 1 || argc > 2)
+        BIDToolUsage();
+
+    if (argc == 2) {
+        if (strcmp(argv[1], "json") == 0)
+            ulFormat = BID_FCACHE_FORMAT_JSON;
+        else if (strcmp(argv[1], "binary") != 0)
+            BIDToolUsage();
+    }
+
+    err = _BIDConvertFileCache(gContext, argv[0], ulFormat);
+    if (err != BID_S_OK)
+        BIDAbortError("Failed to convert cache", err);
+
+    return err;
+}
+
 static struct {
     const char *Argument;
     const char *Usage;
@@ -497,6 +520,7 @@ static struct {
     { "certdestroy",  "", BIDDestroyAuthorityCache,       AUTHORITY_CACHE      },
 
     { "verify",       "assertion audience", BIDVerifyAssertionFromString, REPLAY_CACHE },
+    { "convert",      "file [binary|json]", BIDConvertCache,  NO_CACHE             },
 
 };
 
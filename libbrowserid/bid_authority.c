@@ -42,7 +42,9 @@
 BIDError
 _BIDAcquireDefaultAuthorityCache(BIDContext context)
 {
-    return _BIDAcquireCacheForUser(context, "browserid.authority", &context->AuthorityCache);
+    return _BIDAcquireDefaultCache(context, context->ConfigParams.AuthorityCache,
+                                   "browserid.authority", BID_CACHE_FLAG_READ_MOSTLY,
+                                   &context->AuthorityCache);
 }
 
 BIDError
@@ -111,6 +113,94 @@ _BIDAuthorityEqual(
     return (strcasecmp(a1, a2) == 0);
 }
 
+/*
+ * The result of walking the delegation chain from a hostname to an issuer
+ * is remembered in a shared cache, expiring with the shortest-lived
+ * support document in the chain. The maximum delegation depth is part of
+ * the key as it affects the result.
+ */
+#define BID_DELEGATION_CACHE                "browserid.delegations"
+
+static BIDError
+_BIDMakeDelegationKey(
+    BIDContext context BID_UNUSED,
+    const char *szHostname,
+    const char *szIssuer,
+    uint32_t maxDelegs,
+    char **pszKey)
+{
+    size_t cchKey;
+    char *szKey;
+
+    *pszKey = NULL;
+
+    cchKey = 10 + 1 + strlen(szHostname) + 1 + strlen(szIssuer) + 1;
+
+    szKey = BIDMalloc(cchKey);
+    if (szKey == NULL)
+        return BID_S_NO_MEMORY;
+
+    snprintf(szKey, cchKey, "%u %s %s", maxDelegs, szHostname, szIssuer);
+
+    *pszKey = szKey;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDGetCachedDelegation(
+    BIDContext context,
+    BIDCache delegCache,
+    const char *szKey,
+    time_t verificationTime,
+    int *pbIsAuthoritative)
+{
+    BIDError err;
+    json_t *deleg = NULL;
+    time_t expiryTime = 0;
+
+    *pbIsAuthoritative = -1;
+
+    err = _BIDGetCacheObject(context, delegCache, szKey, &deleg);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDGetJsonTimestampValue(context, deleg, "exp", &expiryTime);
+    BID_BAIL_ON_ERROR(err);
+
+    if (verificationTime >= expiryTime) {
+        err = BID_S_CACHE_KEY_NOT_FOUND;
+        goto cleanup;
+    }
+
+    *pbIsAuthoritative = json_is_true(json_object_get(deleg, "auth")) ? 1 : 0;
+
+cleanup:
+    json_decref(deleg);
+
+    return err;
+}
+
+static void
+_BIDSetCachedDelegation(
+    BIDContext context,
+    BIDCache delegCache,
+    const char *szKey,
+    time_t expiryTime,
+    int bIsAuthoritative)
+{
+    json_t *deleg;
+
+    deleg = json_object();
+    if (deleg == NULL)
+        return;
+
+    if (_BIDSetJsonTimestampValue(context, deleg, "exp", expiryTime) == BID_S_OK &&
+        json_object_set_new(deleg, "auth", bIsAuthoritative ? json_true() : json_false()) == 0)
+        _BIDSetCacheObject(context, delegCache, szKey, deleg);
+
+    json_decref(deleg);
+}
+
 /*
  * From https://github.com/mozilla/id-specs/blob/prod/browserid/index.md:
  *
@@ -130,6 +220,8 @@ _BIDIssuerIsAuthoritative(
     int bIsAuthoritative = 0;
     BIDAuthority authority = NULL;
     const char **secondaryAuthorities = NULL;
+    BIDCache delegCache = NULL;
+    char *szDelegKey = NULL;
 
     BID_CONTEXT_VALIDATE(context);
 
@@ -159,14 +251,28 @@ _BIDIssuerIsAuthoritative(
     if (!bIsAuthoritative) {
         uint32_t maxDelegs;
         const char *szAuthority;
+        time_t expiryTime = 0, docExpiryTime;
 
         err = BIDGetContextParam(context, BID_PARAM_MAX_DELEGATIONS, (void **)&maxDelegs);
         BID_BAIL_ON_ERROR(err);
 
+        if (_BIDGetSharedCache(context, BID_DELEGATION_CACHE, &delegCache) == BID_S_OK &&
+            _BIDMakeDelegationKey(context, szHostname, szIssuer, maxDelegs, &szDelegKey) == BID_S_OK &&
+            _BIDGetCachedDelegation(context, delegCache, szDelegKey,
+                                    verificationTime, &bIsAuthoritative) == BID_S_OK) {
+            err = (bIsAuthoritative == 1) ? BID_S_OK : BID_S_UNTRUSTED_ISSUER;
+            goto cleanup;
+        }
+
         err = _BIDAcquireAuthority(context, szHostname, verificationTime, &authority);
         BID_BAIL_ON_ERROR(err);
 
         for (i = 0, bIsAuthoritative = -1; i < maxDelegs; i++) {
+            docExpiryTime = 0;
+            _BIDGetJsonTimestampValue(context, authority, "exp", &docExpiryTime);
+            if (expiryTime == 0 || (docExpiryTime != 0 && docExpiryTime < expiryTime))
+                expiryTime = docExpiryTime;
+
             szAuthority = json_string_value(json_object_get(authority, "authority"));
             if (szAuthority != NULL) {
                 if (_BIDAuthorityEqual(szIssuer, szAuthority)) {
@@ -188,12 +294,17 @@ _BIDIssuerIsAuthoritative(
                 break;
             }
         }
+
+        if (szDelegKey != NULL && expiryTime != 0)
+            _BIDSetCachedDelegation(context, delegCache, szDelegKey,
+                                    expiryTime, bIsAuthoritative == 1);
     }
 
     err = (bIsAuthoritative == 1) ? BID_S_OK : BID_S_UNTRUSTED_ISSUER;
 
 cleanup:
     json_decref(authority);
+    BIDFree(szDelegKey);
 
     return err;
 }
@@ -58,7 +58,11 @@ static struct BIDCacheOps *_BIDCacheOps[] = {
 #else
     &_BIDFileCache,
 #endif
-    &_BIDMemoryCache
+    &_BIDMemoryCache,
+#ifndef WIN32
+    &_BIDDaemonCache,
+    &_BIDShardedCache,
+#endif
 };
 
 BIDError
@@ -217,6 +221,22 @@ _BIDGetCacheName(
     return err;
 }
 
+/*
+ * Returns true if cache is backed by a file, beside which other files
+ * may be kept.
+ */
+int
+_BIDIsFileCacheP(
+    BIDContext context BID_UNUSED,
+    BIDCache cache)
+{
+#ifdef WIN32
+    return 0;
+#else
+    return cache != NULL && cache->Ops == &_BIDFileCache;
+#endif
+}
+
 BIDError
 _BIDGetCacheObject(
     BIDContext context,
@@ -353,6 +373,29 @@ _BIDGetCacheLastChangedTime(
     return err;
 }
 
+BIDError
+_BIDGetCacheStatistics(
+    BIDContext context,
+    BIDCache cache,
+    struct BIDCacheStatistics *pStats)
+{
+    BIDError err;
+
+    memset(pStats, 0, sizeof(*pStats));
+
+    BID_CONTEXT_VALIDATE(context);
+
+    if (cache == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (cache->Ops->GetStatistics == NULL)
+        return BID_S_NOT_IMPLEMENTED;
+
+    err = cache->Ops->GetStatistics(cache->Ops, context, cache->Data, pStats);
+
+    return err;
+}
+
 BIDError
 _BIDGetFirstCacheObject(
     BIDContext context,
@@ -543,6 +586,9 @@ _BIDPurgeCache(
 {
     struct BIDPurgeCacheArgsDesc args;
 
+    if (cache == NULL)
+        return BID_S_INVALID_PARAMETER;
+
     args.Predicate = predicate;
     args.Data = data;
 
@@ -557,11 +603,12 @@ BIDError
 _BIDAcquireCacheForUser(
     BIDContext context,
     const char *szTemplate,
+    uint32_t ulFlags,
     BIDCache *pCache)
 {
     BIDError err;
 #ifdef WIN32
-    err = _BIDAcquireCache(context, "memory:", 0, pCache);
+    err = _BIDAcquireCache(context, "memory:", ulFlags, pCache);
 #else
     char szFileName[PATH_MAX];
 
@@ -622,7 +669,7 @@ _BIDAcquireCacheForUser(
                  "file:/tmp/.%s.%d.json", szTemplate, getuid());
 #endif
 
-    err = _BIDAcquireCache(context, szFileName, 0, pCache);
+    err = _BIDAcquireCache(context, szFileName, ulFlags, pCache);
     BID_BAIL_ON_ERROR(err);
 
 cleanup:
@@ -646,6 +693,124 @@ cleanup:
     return err;
 }
 
+/*
+ * Acquire the cache named in the configuration, e.g. "daemon:replay" to
+ * share it via bidcached, or else the per-user cache for szTemplate.
+ */
+BIDError
+_BIDAcquireDefaultCache(
+    BIDContext context,
+    const char *szConfiguredName,
+    const char *szTemplate,
+    uint32_t ulFlags,
+    BIDCache *pCache)
+{
+    if (szConfiguredName != NULL)
+        return _BIDAcquireCache(context, szConfiguredName, ulFlags, pCache);
+
+    return _BIDAcquireCacheForUser(context, szTemplate, ulFlags, pCache);
+}
+
+/*
+ * Process-wide memory caches, shared by all contexts, for state that is
+ * costly to recompute. Objects must carry an "exp" timestamp; expired
+ * objects are purged periodically when the cache is looked up. Shared
+ * caches live until the process exits and are not released by callers.
+ */
+struct BIDSharedCacheDesc {
+    struct BIDSharedCacheDesc *Next;
+    char *Name;
+    BIDCache Cache;
+    time_t NextPurgeTime;
+};
+
+#define BID_SHARED_CACHE_PURGE_INTERVAL     (60 * 60)
+
+static BID_THREAD_ONCE _BIDSharedCacheOnce = BID_ONCE_INITIALIZER;
+static BID_MUTEX _BIDSharedCacheMutex;
+static struct BIDSharedCacheDesc *_BIDSharedCaches = NULL;
+
+static BID_ONCE_CALLBACK(_BIDInitSharedCaches)
+{
+    BID_MUTEX_INIT(&_BIDSharedCacheMutex);
+    BID_ONCE_LEAVE;
+}
+
+static int
+_BIDShouldPurgeSharedCacheObjectP(
+    BIDContext context,
+    BIDCache cache BID_UNUSED,
+    const char *szKey BID_UNUSED,
+    json_t *object,
+    void *data)
+{
+    time_t currentTime = *((time_t *)data);
+    time_t expiryTime = 0;
+
+    _BIDGetJsonTimestampValue(context, object, "exp", &expiryTime);
+
+    return (expiryTime <= currentTime);
+}
+
+BIDError
+_BIDGetSharedCache(
+    BIDContext context,
+    const char *szCacheName,
+    BIDCache *pCache)
+{
+    BIDError err = BID_S_OK;
+    struct BIDSharedCacheDesc *sc;
+    time_t currentTime = time(NULL);
+    int bPurge = 0;
+
+    *pCache = NULL;
+
+    BID_CONTEXT_VALIDATE(context);
+
+    BID_ONCE(&_BIDSharedCacheOnce, _BIDInitSharedCaches);
+
+    BID_MUTEX_LOCK(&_BIDSharedCacheMutex);
+
+    for (sc = _BIDSharedCaches; sc != NULL; sc = sc->Next) {
+        if (strcmp(sc->Name, szCacheName) == 0)
+            break;
+    }
+
+    if (sc == NULL) {
+        sc = BIDCalloc(1, sizeof(*sc));
+        if (sc == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        err = _BIDDuplicateString(context, szCacheName, &sc->Name);
+        if (err == BID_S_OK)
+            err = _BIDAcquireCache(context, "memory:", 0, &sc->Cache);
+        if (err != BID_S_OK) {
+            BIDFree(sc->Name);
+            BIDFree(sc);
+            goto cleanup;
+        }
+
+        sc->NextPurgeTime = currentTime + BID_SHARED_CACHE_PURGE_INTERVAL;
+        sc->Next = _BIDSharedCaches;
+        _BIDSharedCaches = sc;
+    } else if (currentTime >= sc->NextPurgeTime) {
+        sc->NextPurgeTime = currentTime + BID_SHARED_CACHE_PURGE_INTERVAL;
+        bPurge = 1;
+    }
+
+    *pCache = sc->Cache;
+
+cleanup:
+    BID_MUTEX_UNLOCK(&_BIDSharedCacheMutex);
+
+    if (bPurge)
+        _BIDPurgeCache(context, *pCache, _BIDShouldPurgeSharedCacheObjectP, &currentTime);
+
+    return err;
+}
+
 #if __BLOCKS__
 static BIDError
 _BIDPerformCallbackBlock(
@@ -265,7 +265,7 @@ _BIDMakeHttpRequest(
     responseBody = CFHTTPMessageCopyBody(response);
     responseString = CFStringCreateFromExternalRepresentation(kCFAllocatorDefault,
                                                               responseBody, kCFStringEncodingUTF8);
-    *pJsonDoc = json_loadcf(responseString, 0, &context->JsonError);
+    *pJsonDoc = json_loadcf(responseString, 0, _BIDJsonError(context));
     if (*pJsonDoc == NULL) {
         err = BID_S_INVALID_JSON;
         goto cleanup;
@@ -49,111 +49,276 @@ _BIDSecondaryAuthorities[] = {
     NULL
 };
 
+static const char *
+_BIDFileCacheSyncModes[] = {
+    "none",                             /* BID_FCACHE_SYNC_NONE */
+    "batch",                            /* BID_FCACHE_SYNC_BATCH */
+    "write",                            /* BID_FCACHE_SYNC_WRITE */
+    NULL
+};
+
+#define BID_CONFIG_TYPE_INTEGER         1   /* uint32_t, from 0 to Max */
+#define BID_CONFIG_TYPE_STRING          2   /* char * */
+#define BID_CONFIG_TYPE_STRING_ARRAY    3   /* char **, defaults to Values */
+#define BID_CONFIG_TYPE_ENUM            4   /* uint32_t, index into Values */
+
+#define BID_CONFIG_OFFSET(field)        offsetof(struct BIDConfigDesc, field)
+
+static const struct BIDConfigParamDesc {
+    const char *Key;
+    uint32_t Type;
+    size_t Offset;
+    uint32_t Default;
+    uint32_t Max;                       /* 0 for no limit */
+    const char **Values;
+} _BIDConfigParams[] = {
+    /* default clock skew is 5 minutes */
+    { "maxclockskew",           BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(MaxClockSkew),          60 * 5 },
+    /* default delegations level is 6 */
+    { "maxdelegations",         BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(MaxDelegations),        6 },
+    /* default ticket lifetime is 10 hours */
+    { "maxticketage",           BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(MaxTicketAge),          60 * 60 * 10 },
+    /* default renew lifetime is 7 days */
+    { "maxrenewage",            BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(MaxRenewAge),           60 * 60 * 24 * 7 },
+    /* default ticket key rotation interval is 1 day */
+    { "ticketkeylifetime",      BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(TicketKeyLifetime),     60 * 60 * 24 },
+    /* replay cache filter is disabled by default */
+    { "replayfiltersize",       BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(ReplayFilterSize),      0 },
+    { "replaycacheshards",      BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(ReplayCacheShards),     0,
+      BID_CACHE_MAX_SHARDS },
+    { "cacheshards",            BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(CacheShards),           BID_CACHE_DEFAULT_SHARDS,
+      BID_CACHE_MAX_SHARDS },
+    /* default is to keep 8 ECDH keys per curve, refilled by one thread */
+    { "ecdhkeypoolsize",        BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(ECDHKeyPoolSize),       8 },
+    { "ecdhkeypoolthreads",     BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(ECDHKeyPoolThreads),    1 },
+    { "filecachesync",          BID_CONFIG_TYPE_ENUM,         BID_CONFIG_OFFSET(FileCacheSync),         BID_FCACHE_SYNC_NONE,
+      0, _BIDFileCacheSyncModes },
+    { "filecachewindow",        BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(FileCacheWindow),       0 },
+    /* memory caches are unbounded by default */
+    { "memorycachemaxentries",  BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(MemoryCacheMaxEntries), 0 },
+    { "memorycachemaxbytes",    BID_CONFIG_TYPE_INTEGER,      BID_CONFIG_OFFSET(MemoryCacheMaxBytes),   0 },
+    { "secondaryauthorities",   BID_CONFIG_TYPE_STRING_ARRAY, BID_CONFIG_OFFSET(SecondaryAuthorities),  0,
+      0, _BIDSecondaryAuthorities },
+    { "verifierurl",            BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(VerifierUrl) },
+    { "authoritycache",         BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(AuthorityCache) },
+    { "replaycache",            BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(ReplayCache) },
+    { "ticketcache",            BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(TicketCache) },
+    { "ticketkeycache",         BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(TicketKeyCache) },
+    { "certificate",            BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(Certificate) },
+    { "private-key",            BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(PrivateKey) },
+    { "ca-certificate",         BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(CACertificate) },
+    { "ca-directory",           BID_CONFIG_TYPE_STRING,       BID_CONFIG_OFFSET(CADirectory) },
+};
+
+static void
+_BIDFreeConfig(struct BIDConfigDesc *config)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(_BIDConfigParams) / sizeof(_BIDConfigParams[0]); i++) {
+        const struct BIDConfigParamDesc *param = &_BIDConfigParams[i];
+        void *p = (char *)config + param->Offset;
+
+        if (param->Type == BID_CONFIG_TYPE_STRING) {
+            BIDFree(*(char **)p);
+        } else if (param->Type == BID_CONFIG_TYPE_STRING_ARRAY && *(char ***)p != NULL) {
+            char **q;
+
+            for (q = *(char ***)p; *q != NULL; q++)
+                BIDFree(*q);
+            BIDFree(*(char ***)p);
+        }
+    }
+
+    json_decref(config->CAParams);
+
+    memset(config, 0, sizeof(*config));
+}
+
+/*
+ * Report which configuration value is invalid in the thread's JSON error
+ * information (BID_PARAM_JSON_ERROR_INFO).
+ */
 static BIDError
-_BIDGetConfigIntegerValue(
+_BIDConfigError(
     BIDContext context,
-    const char *szKey,
-    uint32_t ulDefaultValue,
-    uint32_t *pulValue)
+    const struct BIDConfigParamDesc *param)
 {
-    json_t *value;
-
-    *pulValue = 0;
+    json_error_t *error = _BIDJsonError(context);
+    const char *szExpected;
 
-    if (_BIDGetCacheObject(context, context->Config, szKey, &value) == BID_S_OK) {
-        *pulValue = _BIDJsonUInt32Value(value);
-        json_decref(value);
-    } else if (ulDefaultValue != 0) {
-        *pulValue = ulDefaultValue;
-    } else {
-        return BID_S_UNKNOWN_JSON_KEY;
+    switch (param->Type) {
+    case BID_CONFIG_TYPE_INTEGER:
+        szExpected = param->Max ? "an integer within range" : "a non-negative integer";
+        break;
+    case BID_CONFIG_TYPE_STRING_ARRAY:
+        szExpected = "a string or array of strings";
+        break;
+    case BID_CONFIG_TYPE_ENUM:
+        szExpected = "a known keyword";
+        break;
+    default:
+        szExpected = "a string";
+        break;
     }
 
-    return BID_S_OK;
+    memset(error, 0, sizeof(*error));
+    snprintf(error->source, sizeof(error->source), "%s", param->Key);
+    snprintf(error->text, sizeof(error->text), "%s must be %s", param->Key, szExpected);
+
+    return BID_S_INVALID_CONFIG;
 }
 
-#if 0
 static BIDError
-_BIDGetConfigStringValue(
+_BIDParseConfigParam(
     BIDContext context,
-    const char *szKey,
-    const char *szDefaultValue,
-    char **pszValue)
+    const struct BIDConfigParamDesc *param,
+    json_t *value,
+    struct BIDConfigDesc *config)
 {
-    BIDError err;
-    json_t *value;
-    const char *szValue = NULL;
+    BIDError err = BID_S_OK;
+    void *p = (char *)config + param->Offset;
+    size_t i;
 
-    *pszValue = NULL;
+    switch (param->Type) {
+    case BID_CONFIG_TYPE_INTEGER:
+        if (value == NULL) {
+            *(uint32_t *)p = param->Default;
+        } else if (!json_is_integer(value) ||
+                   json_integer_value(value) < 0 ||
+                   json_integer_value(value) > (param->Max ? param->Max : 0xFFFFFFFF)) {
+            err = _BIDConfigError(context, param);
+        } else {
+            *(uint32_t *)p = (uint32_t)json_integer_value(value);
+        }
+        break;
+    case BID_CONFIG_TYPE_STRING:
+        if (value == NULL)
+            *(char **)p = NULL;
+        else if (!json_is_string(value))
+            err = _BIDConfigError(context, param);
+        else
+            err = _BIDDuplicateString(context, json_string_value(value), (char **)p);
+        break;
+    case BID_CONFIG_TYPE_STRING_ARRAY:
+        if (value != NULL) {
+            err = _BIDGetJsonStringValueArray(context, value, NULL, (char ***)p);
+            if (err == BID_S_INVALID_JSON)
+                err = _BIDConfigError(context, param);
+            break;
+        }
 
-    if (_BIDGetCacheObject(context, context->Config, szKey, &value) == BID_S_OK)
-        szValue = json_string_value(value);
+        for (i = 0; param->Values[i] != NULL; i++)
+            ;
 
-    if (szValue == NULL)
-        szValue = szDefaultValue;
-    if (szValue == NULL)
-        return BID_S_UNKNOWN_JSON_KEY;
+        *(char ***)p = BIDCalloc(i + 1, sizeof(char *));
+        if (*(char ***)p == NULL) {
+            err = BID_S_NO_MEMORY;
+            break;
+        }
 
-    err = _BIDDuplicateString(context, szDefaultValue, pszValue);
+        for (i = 0; param->Values[i] != NULL; i++) {
+            err = _BIDDuplicateString(context, param->Values[i], &(*(char ***)p)[i]);
+            BID_BAIL_ON_ERROR(err);
+        }
+        break;
+    case BID_CONFIG_TYPE_ENUM:
+        *(uint32_t *)p = param->Default;
+
+        if (value == NULL)
+            break;
 
-    json_decref(value);
+        err = _BIDConfigError(context, param);
 
+        for (i = 0; json_is_string(value) && param->Values[i] != NULL; i++) {
+            if (strcmp(json_string_value(value), param->Values[i]) == 0) {
+                *(uint32_t *)p = (uint32_t)i;
+                err = BID_S_OK;
+                break;
+            }
+        }
+        break;
+    default:
+        BID_ASSERT(0);
+        err = BID_S_INVALID_PARAMETER;
+        break;
+    }
+
+cleanup:
     return err;
 }
-#endif
 
+/*
+ * Parse and validate the configuration cache, or just fill in the defaults
+ * if there is none. Values are read once, here, rather than on use.
+ */
 static BIDError
-_BIDGetConfigStringValueArray(
+_BIDParseConfig(
     BIDContext context,
-    const char *szKey,
-    const char **rgszDefaultValues,
-    char ***prgszValues)
+    BIDCache cache,
+    struct BIDConfigDesc *config)
 {
-    BIDError err;
+    BIDError err = BID_S_OK;
     size_t i;
-    char **rgszValues = NULL;
-    json_t *value = NULL;
 
-    *prgszValues = NULL;
+    memset(config, 0, sizeof(*config));
 
-    if (_BIDGetCacheObject(context, context->Config, szKey, &value) == BID_S_OK &&
-        _BIDGetJsonStringValueArray(context, value, NULL, prgszValues) == BID_S_OK) {
-        err = BID_S_OK;
-        goto cleanup;
-    }
+    for (i = 0; i < sizeof(_BIDConfigParams) / sizeof(_BIDConfigParams[0]); i++) {
+        json_t *value = NULL;
 
-    if (rgszDefaultValues == NULL) {
-        err = BID_S_UNKNOWN_JSON_KEY;
-        goto cleanup;
+        if (cache != NULL)
+            _BIDGetCacheObject(context, cache, _BIDConfigParams[i].Key, &value);
+
+        err = _BIDParseConfigParam(context, &_BIDConfigParams[i], value, config);
+
+        json_decref(value);
+
+        BID_BAIL_ON_ERROR(err);
     }
 
-    for (i = 0; rgszDefaultValues[i] != NULL; i++)
-        ;
+    /* passed as is to the crypto provider when validating X.509 chains */
+    err = _BIDAllocJsonObject(context, &config->CAParams);
+    BID_BAIL_ON_ERROR(err);
 
-    rgszValues = BIDCalloc(i + 1, sizeof(char *));
-    if (rgszValues == NULL) {
-        err = BID_S_NO_MEMORY;
-        goto cleanup;
+    if (config->CACertificate != NULL) {
+        err = _BIDJsonObjectSet(context, config->CAParams, "ca-certificate",
+                                json_string(config->CACertificate),
+                                BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
+        BID_BAIL_ON_ERROR(err);
     }
 
-    for (i = 0; rgszDefaultValues[i] != NULL; i++) {
-        err = _BIDDuplicateString(context, rgszDefaultValues[i], &rgszValues[i]);
+    if (config->CADirectory != NULL) {
+        err = _BIDJsonObjectSet(context, config->CAParams, "ca-directory",
+                                json_string(config->CADirectory),
+                                BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
         BID_BAIL_ON_ERROR(err);
     }
 
-    rgszValues[i] = NULL;
+cleanup:
+    if (err != BID_S_OK)
+        _BIDFreeConfig(config);
 
-    *prgszValues = rgszValues;
-    err = BID_S_OK;
+    return err;
+}
 
-cleanup:
-    if (err != BID_S_OK && rgszValues != NULL) {
-        for (i = 0; rgszValues[i] != NULL; i++)
-            BIDFree(rgszValues[i]);
-        BIDFree(rgszValues);
-    }
+/*
+ * Replace the parsed configuration with that of a new configuration cache,
+ * provided that it is valid. The caller installs the cache itself.
+ */
+static BIDError
+_BIDLoadConfig(
+    BIDContext context,
+    BIDCache cache)
+{
+    BIDError err;
+    struct BIDConfigDesc config;
+
+    err = _BIDParseConfig(context, cache, &config);
+    if (err != BID_S_OK)
+        return err;
 
-    json_decref(value);
+    _BIDFreeConfig(&context->ConfigParams);
+    context->ConfigParams = config;
 
     return BID_S_OK;
 }
@@ -191,8 +356,7 @@ BIDAcquireContext(
     }
 
     context->ContextOptions         = ulContextOptions;
-    context->SecondaryAuthorities   = NULL;
-    memset(&context->JsonError, 0, sizeof(context->JsonError));
+    context->Frozen                 = 0;
     context->VerifierUrl            = NULL;
     context->MaxDelegations         = 0;
     context->Skew                   = 0;
@@ -202,33 +366,27 @@ BIDAcquireContext(
     context->ECDHCurve              = 0;
     context->TicketLifetime         = 0;
     context->RenewLifetime          = 0;
+    context->ReplayFilterSize       = 0;
+    context->TicketKeyCache         = NULL;
+    context->TicketKeyLifetime      = 0;
     context->Config                 = NULL;
     context->ParentWindow           = NULL;
 
+    err = _BIDParseConfig(context, NULL, &context->ConfigParams);
+    BID_BAIL_ON_ERROR(err);
+
     if (szConfig != NULL) {
         err = BIDSetContextParam(context, BID_PARAM_CONFIG_NAME, (void *)szConfig);
         BID_BAIL_ON_ERROR(err);
     }
 
-    /* default clock skew is 5 minutes */
-    _BIDGetConfigIntegerValue(context, "maxclockskew",    60 * 5,
-                              &context->Skew);
+    context->Skew = context->ConfigParams.MaxClockSkew;
 
     if (ulContextOptions & BID_CONTEXT_RP) {
-        /* default delegations level is 6 */
-        _BIDGetConfigIntegerValue(context, "maxdelegations",  6,
-                                  &context->MaxDelegations);
-        /* default ticket lifetime is 10 hours */
-        _BIDGetConfigIntegerValue(context, "maxticketage",    60 * 60 * 10,
-                                  &context->TicketLifetime);
-        /* default renew lifetime is 7 days */
-        _BIDGetConfigIntegerValue(context, "maxrenewage",     60 * 60 * 24 * 7,
-                                  &context->RenewLifetime);
-
-        err = _BIDGetConfigStringValueArray(context, "secondaryauthorities",
-                                            _BIDSecondaryAuthorities,
-                                            &context->SecondaryAuthorities);
-        BID_BAIL_ON_ERROR(err);
+        context->MaxDelegations   = context->ConfigParams.MaxDelegations;
+        context->TicketLifetime   = context->ConfigParams.MaxTicketAge;
+        context->RenewLifetime    = context->ConfigParams.MaxRenewAge;
+        context->ReplayFilterSize = context->ConfigParams.ReplayFilterSize;
     }
 
     if (ulContextOptions & BID_CONTEXT_AUTHORITY_CACHE) {
@@ -261,6 +419,17 @@ BIDAcquireContext(
         }
 
         BID_ASSERT(context->ReplayCache != BID_C_NO_REPLAY_CACHE);
+
+        if (ulContextOptions & BID_CONTEXT_REAUTH) {
+            /* stateless tickets are enabled by configuring a key cache */
+            if (context->ConfigParams.TicketKeyCache != NULL) {
+                err = _BIDAcquireCache(context, context->ConfigParams.TicketKeyCache, 0,
+                                       &context->TicketKeyCache);
+                BID_BAIL_ON_ERROR(err);
+            }
+
+            context->TicketKeyLifetime = context->ConfigParams.TicketKeyLifetime;
+        }
     }
 
     if (ulContextOptions & BID_CONTEXT_TICKET_CACHE) {
@@ -285,6 +454,14 @@ BIDAcquireContext(
     else
         context->ECDHCurve = 0;
 
+    if ((ulContextOptions & BID_CONTEXT_RP) &&
+        (ulContextOptions & BID_CONTEXT_ECDH_KEYEX)) {
+        /* not fatal, keys will be generated on demand */
+        _BIDConfigureECDHKeyPool(context,
+                                 context->ConfigParams.ECDHKeyPoolSize,
+                                 context->ConfigParams.ECDHKeyPoolThreads);
+    }
+
     err = BID_S_OK;
     *pContext = context;
 
@@ -298,18 +475,12 @@ cleanup:
 void
 _BIDFinalizeContext(BIDContext context)
 {
-    if (context->SecondaryAuthorities) {
-        char **p;
-
-        for (p = context->SecondaryAuthorities; *p != NULL; p++)
-            BIDFree(*p);
-        BIDFree(context->SecondaryAuthorities);
-    }
-
+    _BIDFreeConfig(&context->ConfigParams);
     BIDFree(context->VerifierUrl);
     _BIDReleaseCache(context, context->AuthorityCache);
     _BIDReleaseCache(context, context->ReplayCache);
     _BIDReleaseCache(context, context->TicketCache);
+    _BIDReleaseCache(context, context->TicketKeyCache);
     _BIDReleaseCache(context, context->Config);
 }
 
@@ -329,6 +500,29 @@ BIDReleaseContext(BIDContext context)
     return BID_S_OK;
 }
 
+/*
+ * JSON parse errors are returned in per-thread storage, so that a context
+ * may be shared by concurrent callers.
+ */
+static BID_THREAD_LOCAL json_error_t _BIDThreadJsonError;
+
+json_error_t *
+_BIDJsonError(
+    BIDContext context BID_UNUSED)
+{
+    return &_BIDThreadJsonError;
+}
+
+BIDError
+BIDFreezeContext(BIDContext context)
+{
+    BID_CONTEXT_VALIDATE(context);
+
+    context->Frozen = 1;
+
+    return BID_S_OK;
+}
+
 BIDError
 BIDSetContextParam(
     BIDContext context,
@@ -339,6 +533,9 @@ BIDSetContextParam(
 
     BID_CONTEXT_VALIDATE(context);
 
+    if (context->Frozen)
+        return BID_S_CONTEXT_FROZEN;
+
     switch (ulParam) {
     case BID_PARAM_SECONDARY_AUTHORITIES:
         err = BID_S_NOT_IMPLEMENTED;
@@ -360,15 +557,17 @@ BIDSetContextParam(
         BIDCache cache, *pCache = NULL;
         uint32_t ulFlags = 0;
 
-        if (ulParam == BID_PARAM_AUTHORITY_CACHE_NAME)
+        if (ulParam == BID_PARAM_AUTHORITY_CACHE_NAME) {
             pCache = &context->AuthorityCache;
-        else if (ulParam == BID_PARAM_REPLAY_CACHE_NAME)
+            ulFlags |= BID_CACHE_FLAG_READ_MOSTLY;
+        } else if (ulParam == BID_PARAM_REPLAY_CACHE_NAME) {
             pCache = &context->ReplayCache;
-        else if (ulParam == BID_PARAM_TICKET_CACHE_NAME)
+            ulFlags |= BID_CACHE_FLAG_NO_EVICT;
+        } else if (ulParam == BID_PARAM_TICKET_CACHE_NAME)
             pCache = &context->TicketCache;
         else if (ulParam == BID_PARAM_CONFIG_NAME) {
             pCache = &context->Config;
-            ulFlags |= BID_CACHE_FLAG_UNVERSIONED;
+            ulFlags |= BID_CACHE_FLAG_UNVERSIONED | BID_CACHE_FLAG_READ_MOSTLY;
         }
 
         if (*pCache != NULL) {
@@ -381,6 +580,11 @@ BIDSetContextParam(
         }
 
         err = _BIDAcquireCache(context, (const char *)value, ulFlags, &cache);
+        if (err == BID_S_OK && ulParam == BID_PARAM_CONFIG_NAME) {
+            err = _BIDLoadConfig(context, cache);
+            if (err != BID_S_OK)
+                _BIDReleaseCache(context, cache);
+        }
         if (err == BID_S_OK) {
             _BIDReleaseCache(context, *pCache);
             *pCache = cache;
@@ -404,7 +608,14 @@ BIDSetContextParam(
 
         BID_ASSERT(pCache != NULL);
 
+        if (ulParam == BID_PARAM_CONFIG_CACHE) {
+            err = _BIDLoadConfig(context, (BIDCache)value);
+            if (err != BID_S_OK)
+                break;
+        }
+
         *pCache = (BIDCache)value;
+        break;
     }
     case BID_PARAM_PARENT_WINDOW:
         context->ParentWindow = value;
@@ -449,11 +660,13 @@ BIDGetContextParam(
 
     switch (ulParam) {
     case BID_PARAM_SECONDARY_AUTHORITIES:
-        *pValue = context->SecondaryAuthorities;
+        *pValue = context->ConfigParams.SecondaryAuthorities;
         break;
     case BID_PARAM_VERIFIER_URL:
         if (context->VerifierUrl != NULL)
             *pValue = context->VerifierUrl;
+        else if (context->ConfigParams.VerifierUrl != NULL)
+            *pValue = context->ConfigParams.VerifierUrl;
         else
             *pValue = BID_VERIFIER_URL;
         break;
@@ -461,7 +674,7 @@ BIDGetContextParam(
         *((uint32_t *)pValue) = context->MaxDelegations;
         break;
     case BID_PARAM_JSON_ERROR_INFO:
-        *pValue = &context->JsonError;
+        *pValue = _BIDJsonError(context);
         break;
     case BID_PARAM_SKEW:
         *((uint32_t *)pValue) = context->Skew;
@@ -204,6 +204,13 @@ _BIDKeyMatchesP(
         alg = json_string_value(json_object_get(jwk, "algorithm"));
         if (alg == NULL)
             alg = json_string_value(json_object_get(jwk, "alg"));
+        if (alg == NULL) {
+            const char *kty = json_string_value(json_object_get(jwk, "kty"));
+
+            /* standard EC JWKs need only name the key type */
+            if (kty != NULL && strcmp(kty, "EC") == 0)
+                alg = "ES";
+        }
     }
 
     if (alg == NULL)
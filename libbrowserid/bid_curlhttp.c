@@ -243,7 +243,7 @@ _BIDMakeHttpRequest(
         err = BID_S_HTTP_ERROR;
     }
 
-    *pJsonDoc = json_loads(buffer->Data, 0, &context->JsonError);
+    *pJsonDoc = json_loads(buffer->Data, 0, _BIDJsonError(context));
     if (*pJsonDoc == NULL) {
         err = BID_S_INVALID_JSON;
         goto cleanup;
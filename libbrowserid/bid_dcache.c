@@ -0,0 +1,721 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bid_private.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+/*
+ * Cache backend that forwards operations to bidcached over a Unix domain
+ * socket, so that processes on a host can share replay, authority and
+ * ticket stores without file locking. Cache names have the form
+ * "daemon:[socket#]store"; the socket defaults to $BID_CACHE_DAEMON_SOCKET
+ * or BID_CACHE_DAEMON_SOCKET.
+ */
+
+struct BIDDaemonCache {
+    BID_MUTEX Mutex;
+    char *Name;
+    char *SocketPath;
+    char *Store;
+    int Socket;
+    uint32_t Flags;
+};
+
+#define BIDDaemonCacheLock(dc)      BID_MUTEX_LOCK(&(dc)->Mutex)
+#define BIDDaemonCacheUnlock(dc)    BID_MUTEX_UNLOCK(&(dc)->Mutex)
+
+#ifndef JSON_ENCODE_ANY
+#define JSON_ENCODE_ANY             0
+#endif
+#ifndef JSON_DECODE_ANY
+#define JSON_DECODE_ANY             0
+#endif
+
+static void
+_BIDDaemonCachePutUInt32(unsigned char *p, uint32_t n)
+{
+    n = htonl(n);
+    memcpy(p, &n, sizeof(n));
+}
+
+static uint32_t
+_BIDDaemonCacheGetUInt32(const unsigned char *p)
+{
+    uint32_t n;
+
+    memcpy(&n, p, sizeof(n));
+
+    return ntohl(n);
+}
+
+static BIDError
+_BIDDaemonCacheRelease(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache)
+{
+    struct BIDDaemonCache *dc = (struct BIDDaemonCache *)cache;
+
+    if (dc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (dc->Socket != -1)
+        close(dc->Socket);
+    BIDFree(dc->Name);
+    BIDFree(dc->SocketPath);
+    BIDFree(dc->Store);
+    BID_MUTEX_DESTROY(&dc->Mutex);
+    BIDFree(dc);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDDaemonCacheAcquire(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void **cache,
+    const char *name,
+    uint32_t ulFlags)
+{
+    BIDError err;
+    struct BIDDaemonCache *dc;
+    const char *p;
+
+    dc = BIDCalloc(1, sizeof(*dc));
+    if (dc == NULL)
+        return BID_S_NO_MEMORY;
+
+    dc->Socket = -1;
+    dc->Flags = ulFlags;
+    BID_MUTEX_INIT(&dc->Mutex);
+
+    err = _BIDDuplicateString(context, name, &dc->Name);
+    BID_BAIL_ON_ERROR(err);
+
+    p = strrchr(name, '#');
+    if (p != NULL) {
+        dc->SocketPath = BIDMalloc(p - name + 1);
+        if (dc->SocketPath == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+        memcpy(dc->SocketPath, name, p - name);
+        dc->SocketPath[p - name] = '\0';
+        p++;
+    } else {
+        const char *szSocketPath = getenv("BID_CACHE_DAEMON_SOCKET");
+
+        if (szSocketPath == NULL)
+            szSocketPath = BID_CACHE_DAEMON_SOCKET;
+
+        err = _BIDDuplicateString(context, szSocketPath, &dc->SocketPath);
+        BID_BAIL_ON_ERROR(err);
+
+        p = name;
+    }
+
+    if (*p == '\0' || strlen(p) > 255 ||
+        strlen(dc->SocketPath) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+    err = _BIDDuplicateString(context, p, &dc->Store);
+    BID_BAIL_ON_ERROR(err);
+
+    *cache = dc;
+    dc = NULL;
+
+cleanup:
+    if (dc != NULL)
+        ops->Release(ops, context, dc);
+
+    return err;
+}
+
+static BIDError
+_BIDDaemonCacheConnect(struct BIDDaemonCache *dc)
+{
+    struct sockaddr_un sun;
+    int s;
+
+    if (dc->Socket != -1)
+        return BID_S_OK;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, dc->SocketPath, sizeof(sun.sun_path) - 1);
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+        return BID_S_CACHE_OPEN_ERROR;
+
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+
+    /* don't hold the cache mutex forever if the daemon stops responding */
+    {
+        struct timeval tv;
+
+        tv.tv_sec = BID_CACHE_DAEMON_TIMEOUT / 1000;
+        tv.tv_usec = (BID_CACHE_DAEMON_TIMEOUT % 1000) * 1000;
+
+        if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+            setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+            close(s);
+            return BID_S_CACHE_OPEN_ERROR;
+        }
+    }
+
+    if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        close(s);
+        return errno == ENOENT ? BID_S_CACHE_NOT_FOUND : BID_S_CACHE_OPEN_ERROR;
+    }
+
+    dc->Socket = s;
+
+    return BID_S_OK;
+}
+
+static void
+_BIDDaemonCacheDisconnect(struct BIDDaemonCache *dc)
+{
+    if (dc->Socket != -1) {
+        close(dc->Socket);
+        dc->Socket = -1;
+    }
+}
+
+static int
+_BIDDaemonCacheWriteAll(int s, const unsigned char *pb, size_t cb)
+{
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+
+    while (cb != 0) {
+        ssize_t cbWritten = send(s, pb, cb, flags);
+
+        if (cbWritten < 0 && errno == EINTR)
+            continue;
+        else if (cbWritten <= 0)
+            return -1;
+
+        pb += cbWritten;
+        cb -= cbWritten;
+    }
+
+    return 0;
+}
+
+static int
+_BIDDaemonCacheReadAll(int s, unsigned char *pb, size_t cb)
+{
+    while (cb != 0) {
+        ssize_t cbRead = recv(s, pb, cb, 0);
+
+        if (cbRead < 0 && errno == EINTR)
+            continue;
+        else if (cbRead < 0)
+            return -1;
+        else if (cbRead == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        pb += cbRead;
+        cb -= cbRead;
+    }
+
+    return 0;
+}
+
+static BIDError
+_BIDDaemonCacheMakeRequest(
+    struct BIDDaemonCache *dc,
+    uint8_t op,
+    const char *key,
+    json_t *value,
+    unsigned char **pbRequest,
+    size_t *pcbRequest)
+{
+    size_t cchStore = strlen(dc->Store);
+    size_t cchKey = (key != NULL) ? strlen(key) : 0;
+    size_t cchValue = 0, cbRequest;
+    char *szValue = NULL;
+    unsigned char *pbRequest2, *p;
+
+    *pbRequest = NULL;
+    *pcbRequest = 0;
+
+    if (cchKey > 0xFFFF)
+        return BID_S_INVALID_PARAMETER;
+
+    if (value != NULL) {
+        szValue = json_dumps(value, JSON_COMPACT | JSON_ENCODE_ANY);
+        if (szValue == NULL)
+            return BID_S_INVALID_JSON;
+        cchValue = strlen(szValue);
+    }
+
+    cbRequest = 4 + 1 + 1 + cchStore + 2 + cchKey + cchValue;
+    if (cbRequest > BID_CACHE_DAEMON_MAX_MESSAGE) {
+        BIDFree(szValue);
+        return BID_S_BUFFER_TOO_LONG;
+    }
+
+    pbRequest2 = BIDMalloc(cbRequest);
+    if (pbRequest2 == NULL) {
+        BIDFree(szValue);
+        return BID_S_NO_MEMORY;
+    }
+
+    p = pbRequest2;
+
+    _BIDDaemonCachePutUInt32(p, (uint32_t)(cbRequest - 4));
+    p += 4;
+    *p++ = op;
+    *p++ = (uint8_t)cchStore;
+    memcpy(p, dc->Store, cchStore);
+    p += cchStore;
+    *p++ = (cchKey >> 8) & 0xFF;
+    *p++ = (cchKey     ) & 0xFF;
+    if (cchKey != 0)
+        memcpy(p, key, cchKey);
+    p += cchKey;
+    if (cchValue != 0)
+        memcpy(p, szValue, cchValue);
+
+    BIDFree(szValue);
+
+    *pbRequest = pbRequest2;
+    *pcbRequest = cbRequest;
+
+    return BID_S_OK;
+}
+
+/*
+ * Send a request and wait for its response. If the connection has been
+ * lost (for example, because the daemon restarted), reconnect and retry
+ * once. The returned payload is NUL terminated.
+ */
+static BIDError
+_BIDDaemonCacheTransact(
+    struct BIDDaemonCache *dc,
+    uint8_t op,
+    const char *key,
+    json_t *value,
+    unsigned char **pbPayload,
+    size_t *pcbPayload)
+{
+    BIDError err;
+    unsigned char *pbRequest = NULL;
+    size_t cbRequest = 0;
+    unsigned char header[8];
+    unsigned char *pbResponse = NULL;
+    uint32_t cbResponse = 0;
+    int attempt;
+
+    *pbPayload = NULL;
+    *pcbPayload = 0;
+
+    err = _BIDDaemonCacheMakeRequest(dc, op, key, value, &pbRequest, &cbRequest);
+    if (err != BID_S_OK)
+        return err;
+
+    BIDDaemonCacheLock(dc);
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        err = _BIDDaemonCacheConnect(dc);
+        if (err != BID_S_OK)
+            break;
+
+        if (_BIDDaemonCacheWriteAll(dc->Socket, pbRequest, cbRequest) != 0) {
+            _BIDDaemonCacheDisconnect(dc);
+            err = BID_S_CACHE_WRITE_ERROR;
+            continue;
+        }
+
+        if (_BIDDaemonCacheReadAll(dc->Socket, header, sizeof(header)) != 0) {
+            int bTimedOut = (errno == EAGAIN || errno == EWOULDBLOCK);
+
+            _BIDDaemonCacheDisconnect(dc);
+            err = BID_S_CACHE_READ_ERROR;
+            /* a daemon that has stopped responding won't do better on retry */
+            if (bTimedOut)
+                break;
+            continue;
+        }
+
+        cbResponse = _BIDDaemonCacheGetUInt32(header);
+        if (cbResponse < 4 || cbResponse > BID_CACHE_DAEMON_MAX_MESSAGE) {
+            _BIDDaemonCacheDisconnect(dc);
+            err = BID_S_CACHE_READ_ERROR;
+            break;
+        }
+        cbResponse -= 4;
+
+        pbResponse = BIDMalloc(cbResponse + 1);
+        if (pbResponse == NULL) {
+            _BIDDaemonCacheDisconnect(dc);
+            err = BID_S_NO_MEMORY;
+            break;
+        }
+
+        if (_BIDDaemonCacheReadAll(dc->Socket, pbResponse, cbResponse) != 0) {
+            _BIDDaemonCacheDisconnect(dc);
+            BIDFree(pbResponse);
+            pbResponse = NULL;
+            err = BID_S_CACHE_READ_ERROR;
+            break;
+        }
+
+        pbResponse[cbResponse] = '\0';
+        err = (BIDError)_BIDDaemonCacheGetUInt32(&header[4]);
+        break;
+    }
+
+    BIDDaemonCacheUnlock(dc);
+
+    BIDFree(pbRequest);
+
+    if (err == BID_S_OK) {
+        *pbPayload = pbResponse;
+        *pcbPayload = cbResponse;
+    } else {
+        BIDFree(pbResponse);
+    }
+
+    return err;
+}
+
+static BIDError
+_BIDDaemonCacheTransactJson(
+    BIDContext context,
+    struct BIDDaemonCache *dc,
+    uint8_t op,
+    const char *key,
+    json_t **pValue)
+{
+    BIDError err;
+    unsigned char *pbPayload = NULL;
+    size_t cbPayload = 0;
+
+    *pValue = NULL;
+
+    err = _BIDDaemonCacheTransact(dc, op, key, NULL, &pbPayload, &cbPayload);
+    if (err != BID_S_OK)
+        return err;
+
+    *pValue = json_loads((char *)pbPayload, JSON_DECODE_ANY, _BIDJsonError(context));
+    if (*pValue == NULL)
+        err = BID_S_INVALID_JSON;
+
+    BIDFree(pbPayload);
+
+    return err;
+}
+
+static BIDError
+_BIDDaemonCacheInitialize(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache BID_UNUSED)
+{
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDDaemonCacheDestroy(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache)
+{
+    struct BIDDaemonCache *dc = (struct BIDDaemonCache *)cache;
+    BIDError err;
+    unsigned char *pbPayload = NULL;
+    size_t cbPayload = 0;
+
+    if (dc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (dc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    err = _BIDDaemonCacheTransact(dc, BID_CACHE_DAEMON_OP_DESTROY, NULL, NULL,
+                                  &pbPayload, &cbPayload);
+    BIDFree(pbPayload);
+
+    return err;
+}
+
+static BIDError
+_BIDDaemonCacheGetName(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    const char **name)
+{
+    struct BIDDaemonCache *dc = (struct BIDDaemonCache *)cache;
+
+    if (dc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    *name = dc->Name;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDDaemonCacheGetLastChangedTime(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    time_t *pTime)
+{
+    struct BIDDaemonCache *dc = (struct BIDDaemonCache *)cache;
+    BIDError err;
+    unsigned char *pbPayload = NULL;
+    size_t cbPayload = 0;
+
+    *pTime = 0;
+
+    if (dc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    err = _BIDDaemonCacheTransact(dc, BID_CACHE_DAEMON_OP_LAST_CHANGED, NULL, NULL,
+                                  &pbPayload, &cbPayload);
+    if (err == BID_S_OK) {
+        if (cbPayload == 8)
+            *pTime = (time_t)(((uint64_t)_BIDDaemonCacheGetUInt32(pbPayload) << 32) |
+                              _BIDDaemonCacheGetUInt32(pbPayload + 4));
+        else
+            err = BID_S_CACHE_READ_ERROR;
+    }
+
+    BIDFree(pbPayload);
+
+    return err;
+}
+
+static BIDError
+_BIDDaemonCacheGetObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t **val)
+{
+    struct BIDDaemonCache *dc = (struct BIDDaemonCache *)cache;
+
+    *val = NULL;
+
+    if (dc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    return _BIDDaemonCacheTransactJson(context, dc, BID_CACHE_DAEMON_OP_GET, key, val);
+}
+
+static BIDError
+_BIDDaemonCacheSetOrRemoveObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    const char *key,
+    json_t *val,
+    int remove)
+{
+    struct BIDDaemonCache *dc = (struct BIDDaemonCache *)cache;
+    BIDError err;
+    unsigned char *pbPayload = NULL;
+    size_t cbPayload = 0;
+
+    if (dc == NULL || (val == NULL && !remove))
+        return BID_S_INVALID_PARAMETER;
+
+    if (dc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    err = _BIDDaemonCacheTransact(dc,
+                                  remove ? BID_CACHE_DAEMON_OP_REMOVE : BID_CACHE_DAEMON_OP_SET,
+                                  key, val, &pbPayload, &cbPayload);
+    BIDFree(pbPayload);
+
+    return err;
+}
+
+static BIDError
+_BIDDaemonCacheSetObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    return _BIDDaemonCacheSetOrRemoveObject(ops, context, cache, key, val, 0);
+}
+
+static BIDError
+_BIDDaemonCacheRemoveObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key)
+{
+    return _BIDDaemonCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1);
+}
+
+static BIDError
+_BIDDaemonCacheFirstObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    struct BIDDaemonCache *dc = (struct BIDDaemonCache *)cache;
+    BIDError err;
+    json_t *data = NULL;
+    json_t *page = NULL;
+    char *szCursor = NULL;
+
+    *cookie = NULL;
+    *key = NULL;
+    *val = NULL;
+
+    if (dc == NULL) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+    err = _BIDAllocJsonObject(context, &data);
+    BID_BAIL_ON_ERROR(err);
+
+    /* the daemon returns the store a page at a time */
+    do {
+        json_t *next;
+
+        err = _BIDDaemonCacheTransactJson(context, dc, BID_CACHE_DAEMON_OP_ITERATE,
+                                          szCursor, &page);
+        BID_BAIL_ON_ERROR(err);
+
+        if (json_object_update(data, json_object_get(page, "d")) != 0) {
+            err = BID_S_INVALID_JSON;
+            goto cleanup;
+        }
+
+        BIDFree(szCursor);
+        szCursor = NULL;
+
+        next = json_object_get(page, "next");
+        if (next != NULL) {
+            if (!json_is_string(next)) {
+                err = BID_S_INVALID_JSON;
+                goto cleanup;
+            }
+
+            err = _BIDDuplicateString(context, json_string_value(next), &szCursor);
+            BID_BAIL_ON_ERROR(err);
+        }
+
+        json_decref(page);
+        page = NULL;
+    } while (szCursor != NULL);
+
+    err = _BIDCacheIteratorAlloc(data, cookie);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCacheIteratorNext(cookie, key, val);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    json_decref(data);
+    json_decref(page);
+    BIDFree(szCursor);
+
+    return err;
+}
+
+static BIDError
+_BIDDaemonCacheNextObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache BID_UNUSED,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    BIDError err;
+
+    *key = NULL;
+    *val = NULL;
+
+    err = _BIDCacheIteratorNext(cookie, key, val);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    return err;
+}
+
+struct BIDCacheOps _BIDDaemonCache = {
+    "daemon",
+    _BIDDaemonCacheAcquire,
+    _BIDDaemonCacheRelease,
+    _BIDDaemonCacheInitialize,
+    _BIDDaemonCacheDestroy,
+    _BIDDaemonCacheGetName,
+    _BIDDaemonCacheGetLastChangedTime,
+    _BIDDaemonCacheGetObject,
+    _BIDDaemonCacheSetObject,
+    _BIDDaemonCacheRemoveObject,
+    _BIDDaemonCacheFirstObject,
+    _BIDDaemonCacheNextObject,
+};
@@ -120,6 +120,9 @@ const char *_BIDErrorTable[] = {
     "Unknown Elliptic Curve",
     "Invalid Elliptic Curve for context",
     "Missing nonce",
+    "Context cannot be modified",
+    "Cache is full",
+    "Invalid configuration value",
     "Unknown error code"
 };
 
@@ -78,16 +78,64 @@
 #endif
 
 #include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 /*
  * Very loosely based on Heimdal's Kerberos credentials cache file backend.
  */
 
+struct BIDFileCacheUpdate;
+
 struct BIDFileCache {
     char *Name;
     uint32_t Flags;
+    BID_MUTEX Mutex;
+    json_t *Snapshot;
+    struct stat SnapshotStat;
+    struct BIDFileCacheUpdate *Pending;
+    struct BIDFileCacheUpdate **PendingTail;
+    int Committing;
+    pthread_cond_t Committed;
+    uint32_t SyncMode;
+    uint32_t CommitWindow;
+};
+
+/*
+ * Updates are group committed: a thread that finds no commit in progress
+ * becomes the leader, optionally waits CommitWindow microseconds for more
+ * updates to arrive, and then applies every queued update in a single
+ * rewrite. Other threads wait until the batch containing their update
+ * has committed, and return its result.
+ */
+struct BIDFileCacheUpdate {
+    struct BIDFileCacheUpdate *Next;
+    const char *Key;
+    json_t *Value;                  /* NULL to remove */
+    BIDError Result;
+    int Done;
 };
 
+/*
+ * Read-mostly caches (authority and configuration) keep the decoded cache
+ * in memory, and only re-read it when stat() shows the file was replaced
+ * or modified. As writers rename a new file into place, the inode number
+ * changes on every write. The same assumptions as for the memory cache
+ * apply: libjansson uses atomic refcounting, and returned values are
+ * immutable.
+ */
+#define BIDFileCacheLock(fc)        BID_MUTEX_LOCK(&(fc)->Mutex)
+#define BIDFileCacheUnlock(fc)      BID_MUTEX_UNLOCK(&(fc)->Mutex)
+
+#if defined(__APPLE__)
+#define BID_STAT_MTIME_NSEC(sb)     ((sb)->st_mtimespec.tv_nsec)
+#elif defined(st_mtime)
+#define BID_STAT_MTIME_NSEC(sb)     ((sb)->st_mtim.tv_nsec)
+#else
+#define BID_STAT_MTIME_NSEC(sb)     0
+#endif
+
 static BIDError
 _BIDFileCacheAcquire(
     struct BIDCacheOps *ops BID_UNUSED,
@@ -109,7 +157,14 @@ _BIDFileCacheAcquire(
         return err;
     }
 
+    BID_MUTEX_INIT(&fc->Mutex);
+    pthread_cond_init(&fc->Committed, NULL);
+
     fc->Flags = ulFlags;
+    fc->PendingTail = &fc->Pending;
+
+    fc->SyncMode = context->ConfigParams.FileCacheSync;
+    fc->CommitWindow = context->ConfigParams.FileCacheWindow;
 
     *cache = fc;
 
@@ -128,6 +183,10 @@ _BIDFileCacheRelease(
         return BID_S_INVALID_PARAMETER;
 
     BIDFree(fc->Name);
+    json_decref(fc->Snapshot);
+    BID_ASSERT(fc->Pending == NULL);
+    pthread_cond_destroy(&fc->Committed);
+    BID_MUTEX_DESTROY(&fc->Mutex);
     BIDFree(fc);
 
     return BID_S_OK;
@@ -345,330 +404,1224 @@ cleanup:
     return (err == BID_S_OK) ? err2 : err;
 }
 
+/*
+ * Binary cache format, used for all versioned caches created by this
+ * version. Integers are big-endian and varints are unsigned LEB128.
+ *
+ *      header      "BIDC" version(1) flags(1)
+ *      record      key value
+ *      key         0x01 digest(32) | 0x02 varint-length bytes
+ *      value       fields(1) varint* varint-length blob
+ *      trailer     FNV-1a checksum(4), if BID_FCACHE_HEADER_FLAG_CHECKSUM
+ *
+ * Replay cache keys are base64url encoded SHA-256 digests, and are stored
+ * as raw digests. Each bit in the fields byte indicates that the matching
+ * well known member in _BIDFileCacheFields is present as a varint; the
+ * remaining members are stored as a NUL terminated compact JSON blob,
+ * whose length (including the NUL) is zero if there are none.
+ */
+#define BID_FCACHE_MAGIC                    "BIDC"
+#define BID_FCACHE_VERSION                  1
+#define BID_FCACHE_HEADER_LENGTH            6
+#define BID_FCACHE_HEADER_FLAG_CHECKSUM     0x01
+
+#define BID_FCACHE_KEY_DIGEST               0x01
+#define BID_FCACHE_KEY_STRING               0x02
+
+#define BID_FCACHE_DIGEST_LENGTH            32
+
+#define BID_FCACHE_VALUE_NOT_OBJECT         0x80
+
+#ifndef JSON_ENCODE_ANY
+#define JSON_ENCODE_ANY                     0
+#endif
+#ifndef JSON_DECODE_ANY
+#define JSON_DECODE_ANY                     0
+#endif
+
+static const char *_BIDFileCacheFields[] = {
+    "iat",
+    "exp",
+    "a-exp",
+    "renew-exp",
+    "flags",
+};
+
+#define BID_FCACHE_FIELD_COUNT  (sizeof(_BIDFileCacheFields) / sizeof(_BIDFileCacheFields[0]))
+
+struct BIDFileCacheBuffer {
+    unsigned char *Data;
+    size_t Length;
+    size_t Allocated;
+};
+
 static BIDError
-_BIDFileCacheStore(
-    struct BIDCacheOps *ops BID_UNUSED,
-    BIDContext context BID_UNUSED,
-    struct BIDFileCache *fc BID_UNUSED,
-    int fd,
-    json_t *data)
+_BIDFileCacheBufferAppend(
+    struct BIDFileCacheBuffer *buf,
+    const void *pb,
+    size_t cb)
 {
-    char *szJson;
-    size_t cchJson;
-    ssize_t cbWritten;
+    if (buf->Length + cb > buf->Allocated) {
+        size_t cbAlloc = buf->Allocated ? buf->Allocated : 4096;
+        unsigned char *pbNew;
 
-    szJson = json_dumps(data, JSON_COMPACT);
-    if (szJson == NULL)
-        return BID_S_CANNOT_ENCODE_JSON;
+        while (cbAlloc < buf->Length + cb)
+            cbAlloc *= 2;
 
-    cchJson = strlen(szJson);
+        pbNew = BIDRealloc(buf->Data, cbAlloc);
+        if (pbNew == NULL)
+            return BID_S_NO_MEMORY;
 
-    cbWritten = write(fd, szJson, cchJson);
-    if (cbWritten == cchJson)
-        cbWritten += write(fd, "\n", 1);
+        buf->Data = pbNew;
+        buf->Allocated = cbAlloc;
+    }
 
-    BIDFree(szJson);
+    memcpy(buf->Data + buf->Length, pb, cb);
+    buf->Length += cb;
 
-    return (cbWritten != cchJson + 1) ? BID_S_CACHE_WRITE_ERROR : BID_S_OK;
+    return BID_S_OK;
 }
 
 static BIDError
-_BIDFileCacheLoad(
-    struct BIDCacheOps *ops BID_UNUSED,
-    BIDContext context,
-    struct BIDFileCache *fc BID_UNUSED,
-    int fd,
-    json_t **pData)
+_BIDFileCacheBufferAppendVarint(
+    struct BIDFileCacheBuffer *buf,
+    uint64_t n)
 {
-    FILE *fp;
-    json_t *data;
-    int fd2; /* lazy */
+    unsigned char rgb[10];
+    size_t cb = 0;
+
+    do {
+        rgb[cb] = n & 0x7f;
+        n >>= 7;
+        if (n != 0)
+            rgb[cb] |= 0x80;
+        cb++;
+    } while (n != 0);
+
+    return _BIDFileCacheBufferAppend(buf, rgb, cb);
+}
 
-    fd2 = fcntl(fd, F_DUPFD, 0);
-    if (fd2 < 0)
-        return BID_S_CACHE_READ_ERROR;
-   
-    fp = fdopen(fd2, "r");
-    if (fp == NULL) {
-        close(fd2);
-        return BID_S_CACHE_READ_ERROR;
+static BIDError
+_BIDFileCacheGetVarint(
+    const unsigned char **pp,
+    const unsigned char *pEnd,
+    uint64_t *pn)
+{
+    const unsigned char *p = *pp;
+    uint64_t n = 0;
+    unsigned int shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        if (p == pEnd)
+            return BID_S_CACHE_READ_ERROR;
+
+        n |= (uint64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *pp = p;
+            *pn = n;
+            return BID_S_OK;
+        }
     }
 
-    data = json_loadf(fp, 0, &context->JsonError);
-
-    *pData = data;
-
-    fclose(fp);
-    return (data == NULL) ? BID_S_CACHE_READ_ERROR : BID_S_OK;
+    return BID_S_CACHE_READ_ERROR;
 }
 
 static BIDError
-_BIDFileCacheNew(
-    struct BIDCacheOps *ops BID_UNUSED,
-    BIDContext context,
-    struct BIDFileCache *fc,
-    json_t **pData,
-    json_t **pUserData)
+_BIDFileCacheEncodeKey(
+    BIDContext context BID_UNUSED,
+    struct BIDFileCacheBuffer *buf,
+    const char *key)
 {
     BIDError err;
-    json_t *data = NULL;
-
-    *pData = NULL;
-    *pUserData = NULL;
+    size_t cchKey = strlen(key);
+    unsigned char *pbDigest = NULL;
+    size_t cbDigest = 0;
+    char *szEncoded = NULL;
+    size_t cchEncoded = 0;
+    unsigned char tag;
+
+    /* only use the digest form if it reproduces the key exactly */
+    if (cchKey == BID_FCACHE_DIGEST_KEY_LENGTH &&
+        _BIDBase64UrlDecode(key, &pbDigest, &cbDigest) == BID_S_OK &&
+        cbDigest == BID_FCACHE_DIGEST_LENGTH &&
+        _BIDBase64Encode(pbDigest, cbDigest, BID_ENCODING_BASE64_URL, &szEncoded, &cchEncoded) == BID_S_OK &&
+        cchEncoded == cchKey && memcmp(szEncoded, key, cchKey) == 0) {
+        tag = BID_FCACHE_KEY_DIGEST;
+
+        err = _BIDFileCacheBufferAppend(buf, &tag, 1);
+        BID_BAIL_ON_ERROR(err);
 
-    err = _BIDAllocJsonObject(context, &data);
-    BID_BAIL_ON_ERROR(err);
+        err = _BIDFileCacheBufferAppend(buf, pbDigest, cbDigest);
+        BID_BAIL_ON_ERROR(err);
+    } else {
+        tag = BID_FCACHE_KEY_STRING;
 
-    if ((fc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
-        err = _BIDJsonObjectSet(context, data, "v", json_string("2013.01.01"), BID_JSON_FLAG_CONSUME_REF);
+        err = _BIDFileCacheBufferAppend(buf, &tag, 1);
         BID_BAIL_ON_ERROR(err);
 
-        err = _BIDJsonObjectSet(context, data, "d", json_object(), BID_JSON_FLAG_CONSUME_REF);
+        err = _BIDFileCacheBufferAppendVarint(buf, cchKey);
         BID_BAIL_ON_ERROR(err);
 
-        *pUserData = json_incref(json_object_get(data, "d"));
-    } else {
-        *pUserData = json_incref(data);
+        err = _BIDFileCacheBufferAppend(buf, key, cchKey);
+        BID_BAIL_ON_ERROR(err);
     }
 
-    err = BID_S_OK;
-    *pData = data;
-
 cleanup:
-    if (err != BID_S_OK)
-        json_decref(data);
+    BIDFree(pbDigest);
+    BIDFree(szEncoded);
 
     return err;
 }
 
 static BIDError
-_BIDFileCacheInitialize(
-    struct BIDCacheOps *ops,
-    BIDContext context,
-    void *cache)
+_BIDFileCacheEncodeBlob(
+    BIDContext context BID_UNUSED,
+    struct BIDFileCacheBuffer *buf,
+    json_t *value,
+    size_t flags)
 {
-    BIDError err, err2;
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
-    json_t *data = NULL;
-    json_t *d = NULL;
-    int fd = -1;
-    int flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
-
-    if (fc == NULL)
-        return BID_S_INVALID_PARAMETER;
-
-    err = _BIDFileCacheNew(ops, context, fc, &data, &d);
-    BID_BAIL_ON_ERROR(err);
+    BIDError err;
+    char *szJson;
+    size_t cchJson;
 
-    err = _BIDFileCacheOpen(ops, context, fc, flags, &fd);
-    BID_BAIL_ON_ERROR(err);
+    szJson = json_dumps(value, JSON_COMPACT | flags);
+    if (szJson == NULL)
+        return BID_S_CANNOT_ENCODE_JSON;
 
-    err = _BIDFileCacheStore(ops, context, fc, fd, data);
-    BID_BAIL_ON_ERROR(err);
+    cchJson = strlen(szJson);
 
-cleanup:
-    err2 = _BIDFileCacheClose(ops, context, fc, fd);
+    err = _BIDFileCacheBufferAppendVarint(buf, cchJson + 1);
+    if (err == BID_S_OK)
+        err = _BIDFileCacheBufferAppend(buf, szJson, cchJson + 1);
 
-    json_decref(data);
-    json_decref(d);
+    BIDFree(szJson);
 
-    return (err == BID_S_OK) ? err2 : err;
+    return err;
 }
 
 static BIDError
-_BIDFileCacheRead(
-    struct BIDCacheOps *ops,
+_BIDFileCacheEncodeValue(
     BIDContext context,
-    void *cache,
-    int fd,
-    json_t **pData,
-    json_t **pUserData)
+    struct BIDFileCacheBuffer *buf,
+    json_t *value)
 {
     BIDError err;
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
-    const char *version;
+    json_t *rest = NULL;
+    json_int_t rgFields[BID_FCACHE_FIELD_COUNT];
+    unsigned char fields = 0;
+    size_t i, cFields = 0;
 
-    *pData = NULL;
-    *pUserData = NULL;
+    if (!json_is_object(value)) {
+        fields = BID_FCACHE_VALUE_NOT_OBJECT;
 
-    err = _BIDFileCacheLoad(ops, context, fc, fd, pData);
-    BID_BAIL_ON_ERROR(err);
+        err = _BIDFileCacheBufferAppend(buf, &fields, 1);
+        BID_BAIL_ON_ERROR(err);
 
-    if ((fc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
-        json_t *d;
+        err = _BIDFileCacheEncodeBlob(context, buf, value, JSON_ENCODE_ANY);
+        goto cleanup;
+    }
 
-        version = json_string_value(json_object_get(*pData, "v"));
-        if (version == NULL || strcmp(version, "2013.01.01") != 0) {
-            err = BID_S_CACHE_INVALID_VERSION;
-            goto cleanup;
-        }
+    for (i = 0; i < BID_FCACHE_FIELD_COUNT; i++) {
+        json_t *field = json_object_get(value, _BIDFileCacheFields[i]);
 
-        d = json_object_get(*pData, "d");
-        if (!json_is_object(d)) {
-            err = BID_S_CACHE_READ_ERROR;
-            goto cleanup;
+        if (json_is_integer(field) && json_integer_value(field) >= 0) {
+            rgFields[i] = json_integer_value(field);
+            fields |= 1 << i;
+            cFields++;
         }
-
-        *pUserData = json_incref(d);
-    } else {
-        *pUserData = json_incref(*pData);
     }
 
-    err = BID_S_OK;
+    err = _BIDFileCacheBufferAppend(buf, &fields, 1);
+    BID_BAIL_ON_ERROR(err);
 
-cleanup:
-    if (err != BID_S_OK) {
-        json_decref(*pData);
-        *pData = NULL;
+    for (i = 0; i < BID_FCACHE_FIELD_COUNT; i++) {
+        if (fields & (1 << i)) {
+            err = _BIDFileCacheBufferAppendVarint(buf, (uint64_t)rgFields[i]);
+            BID_BAIL_ON_ERROR(err);
+        }
     }
 
-    return err; 
-}
-
-static BIDError
-_BIDFileCacheWrite(
-    struct BIDCacheOps *ops,
-    BIDContext context,
-    void *cache,
-    json_t *d)
-{
-    BIDError err;
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
-    int fd = -1;
-    char *szTmpName = NULL;
-    size_t cchFileName;
-
-    cchFileName = strlen(fc->Name);
-    szTmpName = BIDMalloc(cchFileName + sizeof(".XXXXXX"));
-    if (szTmpName == NULL) {
-        err = BID_S_NO_MEMORY;
-        goto cleanup;
-    }
+    if (json_object_size(value) == cFields) {
+        err = _BIDFileCacheBufferAppendVarint(buf, 0);
+    } else if (cFields == 0) {
+        err = _BIDFileCacheEncodeBlob(context, buf, value, 0);
+    } else {
+        void *iter;
 
-    memcpy(szTmpName, fc->Name, cchFileName);
-    memcpy(&szTmpName[cchFileName], ".XXXXXX", sizeof(".XXXXXX"));
+        err = _BIDAllocJsonObject(context, &rest);
+        BID_BAIL_ON_ERROR(err);
 
-    fd = mkstemp(szTmpName);
-    if (fd < 0) {
-        err = BID_S_CACHE_WRITE_ERROR;
-        goto cleanup;
-    }
+        for (iter = json_object_iter(value);
+             iter != NULL;
+             iter = json_object_iter_next(value, iter)) {
+            const char *szKey = json_object_iter_key(iter);
 
-    err = _BIDFileCacheStore(ops, context, fc, fd, d);
-    BID_BAIL_ON_ERROR(err);
+            for (i = 0; i < BID_FCACHE_FIELD_COUNT; i++) {
+                if ((fields & (1 << i)) && strcmp(szKey, _BIDFileCacheFields[i]) == 0)
+                    break;
+            }
+            if (i < BID_FCACHE_FIELD_COUNT)
+                continue;
 
-    close(fd);
-    fd = -1;
+            err = _BIDJsonObjectSet(context, rest, szKey, json_object_iter_value(iter), 0);
+            BID_BAIL_ON_ERROR(err);
+        }
 
-    if (rename(szTmpName, fc->Name) < 0) {
-        err = BID_S_CACHE_WRITE_ERROR;
-        goto cleanup;
+        err = _BIDFileCacheEncodeBlob(context, buf, rest, 0);
     }
 
-    err = BID_S_OK;
-
 cleanup:
-    if (fd != -1) {
-        if (close(fd) < 0)
-            err = BID_S_CACHE_CLOSE_ERROR;
-    }
-    BIDFree(szTmpName);
+    json_decref(rest);
 
-    return err; 
+    return err;
 }
 
 static BIDError
-_BIDFileCacheDestroy(
-    struct BIDCacheOps *ops,
-    BIDContext context,
-    void *cache)
+_BIDFileCacheBufferAppendHeader(struct BIDFileCacheBuffer *buf)
 {
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    unsigned char header[BID_FCACHE_HEADER_LENGTH];
 
-    if (fc == NULL)
-        return BID_S_INVALID_PARAMETER;
+    memcpy(header, BID_FCACHE_MAGIC, 4);
+    header[4] = BID_FCACHE_VERSION;
+    header[5] = BID_FCACHE_HEADER_FLAG_CHECKSUM;
 
-    return _BIDFileCacheErase(ops, context, fc);
+    return _BIDFileCacheBufferAppend(buf, header, sizeof(header));
 }
 
 static BIDError
-_BIDFileCacheGetName(
-    struct BIDCacheOps *ops BID_UNUSED,
-    BIDContext context BID_UNUSED,
-    void *cache,
-    const char **name)
+_BIDFileCacheBufferAppendChecksum(struct BIDFileCacheBuffer *buf)
 {
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    unsigned char trailer[4];
+    uint32_t checksum;
 
-    if (fc == NULL)
-        return BID_S_INVALID_PARAMETER;
+    checksum = _BIDFnv1a(buf->Data, buf->Length);
 
-    *name = fc->Name;
-    BID_ASSERT(*name != NULL);
+    trailer[0] = (checksum >> 24) & 0xff;
+    trailer[1] = (checksum >> 16) & 0xff;
+    trailer[2] = (checksum >>  8) & 0xff;
+    trailer[3] = (checksum      ) & 0xff;
 
-    return BID_S_OK;
+    return _BIDFileCacheBufferAppend(buf, trailer, sizeof(trailer));
 }
 
 static BIDError
-_BIDFileCacheGetLastChangedTime(
-    struct BIDCacheOps *ops,
+_BIDFileCacheEncodeBinary(
     BIDContext context,
-    void *cache,
-    time_t *pTime)
+    struct BIDFileCache *fc BID_UNUSED,
+    json_t *d,
+    struct BIDFileCacheBuffer *buf)
 {
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
     BIDError err;
-    int fd;
-    struct stat sb;
-
-    *pTime = 0;
+    void *iter;
 
-    if (fc == NULL)
-        return BID_S_INVALID_PARAMETER;
+    err = _BIDFileCacheBufferAppendHeader(buf);
+    BID_BAIL_ON_ERROR(err);
 
-    err = _BIDFileCacheOpen(ops, context, fc, O_RDONLY | O_CLOEXEC, &fd);
-    if (err != BID_S_OK)
-        return err;
+    for (iter = json_object_iter(d);
+         iter != NULL;
+         iter = json_object_iter_next(d, iter)) {
+        err = _BIDFileCacheEncodeKey(context, buf, json_object_iter_key(iter));
+        BID_BAIL_ON_ERROR(err);
 
-    if (fstat(fd, &sb) == 0)
-        *pTime = sb.st_mtime;
-    else
-        return BID_S_CACHE_OPEN_ERROR;
+        err = _BIDFileCacheEncodeValue(context, buf, json_object_iter_value(iter));
+        BID_BAIL_ON_ERROR(err);
+    }
 
-    _BIDFileCacheClose(ops, context, fc, fd);
+    err = _BIDFileCacheBufferAppendChecksum(buf);
+    BID_BAIL_ON_ERROR(err);
 
-    return BID_S_OK;
+cleanup:
+    return err;
 }
 
 static BIDError
-_BIDFileCacheGetObject(
-    struct BIDCacheOps *ops,
+_BIDFileCacheEncodeJson(
     BIDContext context,
-    void *cache,
-    const char *key,
-    json_t **val)
+    struct BIDFileCache *fc,
+    json_t *d,
+    struct BIDFileCacheBuffer *buf)
 {
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
     BIDError err;
     json_t *data = NULL;
-    json_t *d = NULL;
-    int fd = -1;
+    char *szJson = NULL;
 
-    *val = NULL;
+    if ((fc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
+        err = _BIDAllocJsonObject(context, &data);
+        BID_BAIL_ON_ERROR(err);
 
-    if (fc == NULL) {
-        err = BID_S_INVALID_PARAMETER;
+        err = _BIDJsonObjectSet(context, data, "v", json_string("2013.01.01"), BID_JSON_FLAG_CONSUME_REF);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDJsonObjectSet(context, data, "d", d, 0);
+        BID_BAIL_ON_ERROR(err);
+    } else {
+        data = json_incref(d);
+    }
+
+    szJson = json_dumps(data, JSON_COMPACT);
+    if (szJson == NULL) {
+        err = BID_S_CANNOT_ENCODE_JSON;
         goto cleanup;
     }
 
-    err = _BIDFileCacheOpen(ops, context, fc, O_RDONLY | O_CLOEXEC, &fd);
+    err = _BIDFileCacheBufferAppend(buf, szJson, strlen(szJson));
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDFileCacheRead(ops, context, cache, fd, &data, &d);
+    err = _BIDFileCacheBufferAppend(buf, "\n", 1);
     BID_BAIL_ON_ERROR(err);
 
-    *val = json_incref(json_object_get(d, key));
-
+cleanup:
+    json_decref(data);
+    BIDFree(szJson);
+
+    return err;
+}
+
+static BIDError
+_BIDFileCacheDecodeRecord(
+    BIDContext context,
+    const unsigned char **pp,
+    const unsigned char *pEnd,
+    json_t *d)
+{
+    BIDError err;
+    const unsigned char *p = *pp;
+    char *szKey = NULL;
+    size_t cchKey;
+    json_t *value = NULL;
+    uint64_t rgFields[BID_FCACHE_FIELD_COUNT];
+    unsigned char tag, fields;
+    uint64_t n;
+    size_t i;
+
+    if (p == pEnd) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    tag = *p++;
+
+    if (tag == BID_FCACHE_KEY_DIGEST) {
+        if ((size_t)(pEnd - p) < BID_FCACHE_DIGEST_LENGTH) {
+            err = BID_S_CACHE_READ_ERROR;
+            goto cleanup;
+        }
+
+        err = _BIDBase64Encode(p, BID_FCACHE_DIGEST_LENGTH, BID_ENCODING_BASE64_URL, &szKey, &cchKey);
+        BID_BAIL_ON_ERROR(err);
+
+        p += BID_FCACHE_DIGEST_LENGTH;
+    } else if (tag == BID_FCACHE_KEY_STRING) {
+        err = _BIDFileCacheGetVarint(&p, pEnd, &n);
+        BID_BAIL_ON_ERROR(err);
+
+        if (n > (uint64_t)(pEnd - p)) {
+            err = BID_S_CACHE_READ_ERROR;
+            goto cleanup;
+        }
+
+        szKey = BIDMalloc(n + 1);
+        if (szKey == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        memcpy(szKey, p, n);
+        szKey[n] = '\0';
+
+        p += n;
+    } else {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    if (p == pEnd) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    fields = *p++;
+
+    if ((fields & BID_FCACHE_VALUE_NOT_OBJECT) && fields != BID_FCACHE_VALUE_NOT_OBJECT) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    for (i = 0; i < BID_FCACHE_FIELD_COUNT; i++) {
+        if (fields & (1 << i)) {
+            err = _BIDFileCacheGetVarint(&p, pEnd, &rgFields[i]);
+            BID_BAIL_ON_ERROR(err);
+        }
+    }
+
+    err = _BIDFileCacheGetVarint(&p, pEnd, &n);
+    BID_BAIL_ON_ERROR(err);
+
+    if (n > (uint64_t)(pEnd - p) || (n != 0 && p[n - 1] != '\0')) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    if (n != 0) {
+        value = json_loads((const char *)p,
+                           (fields & BID_FCACHE_VALUE_NOT_OBJECT) ? JSON_DECODE_ANY : 0,
+                           _BIDJsonError(context));
+        if (value == NULL) {
+            err = BID_S_CACHE_READ_ERROR;
+            goto cleanup;
+        }
+    } else if (fields & BID_FCACHE_VALUE_NOT_OBJECT) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    } else {
+        err = _BIDAllocJsonObject(context, &value);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    p += n;
+
+    for (i = 0; i < BID_FCACHE_FIELD_COUNT; i++) {
+        if (fields & (1 << i)) {
+            err = _BIDJsonObjectSet(context, value, _BIDFileCacheFields[i],
+                                    json_integer((json_int_t)rgFields[i]),
+                                    BID_JSON_FLAG_CONSUME_REF);
+            BID_BAIL_ON_ERROR(err);
+        }
+    }
+
+    err = _BIDJsonObjectSet(context, d, szKey, value, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    *pp = p;
+
+cleanup:
+    BIDFree(szKey);
+    json_decref(value);
+
+    return err;
+}
+
+#define BID_FCACHE_IS_BINARY(pb, cb)    ((cb) >= 4 && memcmp((pb), BID_FCACHE_MAGIC, 4) == 0)
+
+/*
+ * Validates the header and checksum, and returns the extent of the records.
+ */
+static BIDError
+_BIDFileCacheCheckHeader(
+    const unsigned char *pb,
+    size_t cb,
+    const unsigned char **pRecords,
+    const unsigned char **pEnd)
+{
+    const unsigned char *p = pb + cb;
+
+    if (cb < BID_FCACHE_HEADER_LENGTH || !BID_FCACHE_IS_BINARY(pb, cb))
+        return BID_S_CACHE_READ_ERROR;
+
+    /* a cache written by a newer version is not corrupt, just unreadable */
+    if (pb[4] > BID_FCACHE_VERSION)
+        return BID_S_CACHE_INVALID_VERSION;
+    else if (pb[4] != BID_FCACHE_VERSION)
+        return BID_S_CACHE_READ_ERROR;
+
+    if (pb[5] & BID_FCACHE_HEADER_FLAG_CHECKSUM) {
+        uint32_t checksum;
+
+        if (cb < BID_FCACHE_HEADER_LENGTH + 4)
+            return BID_S_CACHE_READ_ERROR;
+
+        p -= 4;
+
+        checksum = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                   ((uint32_t)p[2] <<  8) | ((uint32_t)p[3]);
+
+        if (checksum != _BIDFnv1a(pb, p - pb))
+            return BID_S_CACHE_READ_ERROR;
+    }
+
+    *pRecords = pb + BID_FCACHE_HEADER_LENGTH;
+    *pEnd = p;
+
+    return BID_S_OK;
+}
+
+/*
+ * Advances past a record without decoding it. The first *pcbKey bytes of
+ * the record are its encoded key, which can be compared directly against
+ * the output of _BIDFileCacheEncodeKey().
+ */
+static BIDError
+_BIDFileCacheSkipRecord(
+    const unsigned char **pp,
+    const unsigned char *pEnd,
+    size_t *pcbKey)
+{
+    BIDError err;
+    const unsigned char *p = *pp;
+    unsigned char tag, fields;
+    uint64_t n;
+    size_t i;
+
+    if (p == pEnd)
+        return BID_S_CACHE_READ_ERROR;
+
+    tag = *p++;
+
+    if (tag == BID_FCACHE_KEY_DIGEST) {
+        n = BID_FCACHE_DIGEST_LENGTH;
+    } else if (tag == BID_FCACHE_KEY_STRING) {
+        err = _BIDFileCacheGetVarint(&p, pEnd, &n);
+        if (err != BID_S_OK)
+            return err;
+    } else {
+        return BID_S_CACHE_READ_ERROR;
+    }
+
+    if (n >= (uint64_t)(pEnd - p))
+        return BID_S_CACHE_READ_ERROR;
+
+    p += n;
+    *pcbKey = p - *pp;
+
+    fields = *p++;
+
+    for (i = 0; i < BID_FCACHE_FIELD_COUNT; i++) {
+        if (fields & (1 << i)) {
+            err = _BIDFileCacheGetVarint(&p, pEnd, &n);
+            if (err != BID_S_OK)
+                return err;
+        }
+    }
+
+    err = _BIDFileCacheGetVarint(&p, pEnd, &n);
+    if (err != BID_S_OK)
+        return err;
+
+    if (n > (uint64_t)(pEnd - p))
+        return BID_S_CACHE_READ_ERROR;
+
+    *pp = p + n;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDFileCacheDecodeBinary(
+    BIDContext context,
+    const unsigned char *pb,
+    size_t cb,
+    json_t **pData)
+{
+    BIDError err;
+    json_t *d = NULL;
+    const unsigned char *p, *pEnd;
+
+    *pData = NULL;
+
+    err = _BIDFileCacheCheckHeader(pb, cb, &p, &pEnd);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAllocJsonObject(context, &d);
+    BID_BAIL_ON_ERROR(err);
+
+    while (p < pEnd) {
+        err = _BIDFileCacheDecodeRecord(context, &p, pEnd, d);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = BID_S_OK;
+    *pData = d;
+    d = NULL;
+
+cleanup:
+    json_decref(d);
+
+    return err;
+}
+
+static BIDError
+_BIDFileCacheDecodeJson(
+    BIDContext context,
+    struct BIDFileCache *fc,
+    const char *szJson,
+    json_t **pData)
+{
+    BIDError err;
+    json_t *data;
+    const char *version;
+
+    *pData = NULL;
+
+    data = json_loads(szJson, 0, _BIDJsonError(context));
+    if (data == NULL)
+        return BID_S_CACHE_READ_ERROR;
+
+    if ((fc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
+        json_t *d;
+
+        version = json_string_value(json_object_get(data, "v"));
+        if (version == NULL || strcmp(version, "2013.01.01") != 0) {
+            err = BID_S_CACHE_INVALID_VERSION;
+            goto cleanup;
+        }
+
+        d = json_object_get(data, "d");
+        if (!json_is_object(d)) {
+            err = BID_S_CACHE_READ_ERROR;
+            goto cleanup;
+        }
+
+        *pData = json_incref(d);
+    } else {
+        *pData = json_incref(data);
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    json_decref(data);
+
+    return err;
+}
+
+static BIDError
+_BIDFileCacheEncode(
+    BIDContext context,
+    struct BIDFileCache *fc,
+    json_t *d,
+    uint32_t ulFormat,
+    struct BIDFileCacheBuffer *buf)
+{
+    if (ulFormat == BID_FCACHE_FORMAT_BINARY)
+        return _BIDFileCacheEncodeBinary(context, fc, d, buf);
+    else
+        return _BIDFileCacheEncodeJson(context, fc, d, buf);
+}
+
+static BIDError
+_BIDFileCacheDecode(
+    BIDContext context,
+    struct BIDFileCache *fc,
+    const unsigned char *pb,
+    size_t cb,
+    json_t **pData,
+    uint32_t *pulFormat)
+{
+    BIDError err;
+    uint32_t ulFormat;
+
+    if (BID_FCACHE_IS_BINARY(pb, cb)) {
+        ulFormat = BID_FCACHE_FORMAT_BINARY;
+        err = _BIDFileCacheDecodeBinary(context, pb, cb, pData);
+    } else {
+        ulFormat = BID_FCACHE_FORMAT_JSON;
+        err = _BIDFileCacheDecodeJson(context, fc, (const char *)pb, pData);
+    }
+
+    if (err == BID_S_OK)
+        *pulFormat = ulFormat;
+
+    return err;
+}
+
+static BIDError
+_BIDFileCacheStore(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    struct BIDFileCache *fc BID_UNUSED,
+    int fd,
+    struct BIDFileCacheBuffer *buf)
+{
+    size_t cbWritten = 0;
+
+    while (cbWritten < buf->Length) {
+        ssize_t cb = write(fd, buf->Data + cbWritten, buf->Length - cbWritten);
+
+        if (cb < 0) {
+            if (errno == EINTR)
+                continue;
+            return BID_S_CACHE_WRITE_ERROR;
+        }
+
+        cbWritten += cb;
+    }
+
+    return BID_S_OK;
+}
+
+/*
+ * Reads the entire cache, NUL terminated so that JSON can be parsed in place.
+ */
+static BIDError
+_BIDFileCacheLoad(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    struct BIDFileCache *fc BID_UNUSED,
+    int fd,
+    unsigned char **ppb,
+    size_t *pcb)
+{
+    BIDError err;
+    struct stat sb;
+    unsigned char *pb = NULL;
+    size_t cbRead = 0;
+
+    *ppb = NULL;
+    *pcb = 0;
+
+    if (fstat(fd, &sb) < 0) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    pb = BIDMalloc(sb.st_size + 1);
+    if (pb == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    while (cbRead < (size_t)sb.st_size) {
+        ssize_t cb = pread(fd, pb + cbRead, sb.st_size - cbRead, cbRead);
+
+        if (cb < 0 && errno == EINTR)
+            continue;
+        if (cb <= 0) {
+            err = BID_S_CACHE_READ_ERROR;
+            goto cleanup;
+        }
+
+        cbRead += cb;
+    }
+
+    pb[cbRead] = '\0';
+
+    err = BID_S_OK;
+    *ppb = pb;
+    *pcb = cbRead;
+    pb = NULL;
+
+cleanup:
+    BIDFree(pb);
+
+    return err;
+}
+
+static BIDError
+_BIDFileCacheRead(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    struct BIDFileCache *fc,
+    int fd,
+    json_t **pData,
+    uint32_t *pulFormat)
+{
+    BIDError err;
+    unsigned char *pb = NULL;
+    size_t cb = 0;
+
+    *pData = NULL;
+
+    err = _BIDFileCacheLoad(ops, context, fc, fd, &pb, &cb);
+    if (err == BID_S_OK)
+        err = _BIDFileCacheDecode(context, fc, pb, cb, pData, pulFormat);
+
+    BIDFree(pb);
+
+    return err;
+}
+
+#define BID_FCACHE_SAME_FILE(sb1, sb2)                                  \
+    ((sb1)->st_dev == (sb2)->st_dev &&                                  \
+     (sb1)->st_ino == (sb2)->st_ino &&                                  \
+     (sb1)->st_size == (sb2)->st_size &&                                \
+     (sb1)->st_mtime == (sb2)->st_mtime &&                              \
+     BID_STAT_MTIME_NSEC(sb1) == BID_STAT_MTIME_NSEC(sb2))
+
+/*
+ * Reads a cache for the snapshot. Binary caches are decoded directly from
+ * a mapping of the file.
+ */
+static BIDError
+_BIDFileCacheMapAndDecode(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    struct BIDFileCache *fc,
+    int fd,
+    struct stat *sb,
+    json_t **pData)
+{
+    uint32_t ulFormat;
+#ifdef HAVE_SYS_MMAN_H
+    BIDError err;
+    void *pv;
+
+    if (sb->st_size >= BID_FCACHE_HEADER_LENGTH) {
+        pv = mmap(NULL, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pv != MAP_FAILED) {
+            if (BID_FCACHE_IS_BINARY((unsigned char *)pv, (size_t)sb->st_size)) {
+                err = _BIDFileCacheDecodeBinary(context, pv, sb->st_size, pData);
+                munmap(pv, sb->st_size);
+                return err;
+            }
+            munmap(pv, sb->st_size);
+        }
+    }
+#endif /* HAVE_SYS_MMAN_H */
+
+    /* JSON must be NUL terminated, so it is read instead */
+    return _BIDFileCacheRead(ops, context, fc, fd, pData, &ulFormat);
+}
+
+/*
+ * Called with the cache locked; on success fc->Snapshot is current.
+ */
+static BIDError
+_BIDFileCacheRevalidate(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    struct BIDFileCache *fc)
+{
+    BIDError err;
+    struct stat sb;
+    json_t *d = NULL;
+    int fd = -1;
+
+    if (stat(fc->Name, &sb) < 0) {
+        err = (errno == ENOENT) ? BID_S_CACHE_NOT_FOUND : BID_S_CACHE_OPEN_ERROR;
+        goto cleanup;
+    }
+
+    if (fc->Snapshot != NULL && BID_FCACHE_SAME_FILE(&sb, &fc->SnapshotStat))
+        return BID_S_OK;
+
+    err = _BIDFileCacheOpen(ops, context, fc, O_RDONLY | O_CLOEXEC, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    /* the file may have been replaced after the stat() */
+    if (fstat(fd, &sb) < 0) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    err = _BIDFileCacheMapAndDecode(ops, context, fc, fd, &sb, &d);
+    BID_BAIL_ON_ERROR(err);
+
+    json_decref(fc->Snapshot);
+    fc->Snapshot = d;
+    fc->SnapshotStat = sb;
+    d = NULL;
+
+cleanup:
+    if (err != BID_S_OK) {
+        json_decref(fc->Snapshot);
+        fc->Snapshot = NULL;
+    }
+    _BIDFileCacheClose(ops, context, fc, fd);
+    json_decref(d);
+
+    return err;
+}
+
+static uint32_t
+_BIDFileCacheDefaultFormat(struct BIDFileCache *fc)
+{
+    /* unversioned caches (i.e. configuration) are edited by hand */
+    if (fc->Flags & BID_CACHE_FLAG_UNVERSIONED)
+        return BID_FCACHE_FORMAT_JSON;
+
+    return BID_FCACHE_FORMAT_BINARY;
+}
+
+static BIDError
+_BIDFileCacheInitialize(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache)
+{
+    BIDError err, err2;
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    struct BIDFileCacheBuffer buf = { NULL, 0, 0 };
+    json_t *d = NULL;
+    int fd = -1;
+    int flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
+
+    if (fc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    err = _BIDAllocJsonObject(context, &d);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDFileCacheEncode(context, fc, d, _BIDFileCacheDefaultFormat(fc), &buf);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDFileCacheOpen(ops, context, fc, flags, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDFileCacheStore(ops, context, fc, fd, &buf);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    err2 = _BIDFileCacheClose(ops, context, fc, fd);
+
+    json_decref(d);
+    BIDFree(buf.Data);
+
+    return (err == BID_S_OK) ? err2 : err;
+}
+
+/*
+ * Makes the rename of a new cache file durable.
+ */
+static BIDError
+_BIDFileCacheSyncDirectory(struct BIDFileCache *fc)
+{
+    BIDError err = BID_S_OK;
+    char *szDirName = NULL;
+    const char *p;
+    int fd;
+
+    p = strrchr(fc->Name, '/');
+    if (p == NULL) {
+        fd = open(".", O_RDONLY);
+    } else {
+        size_t cchDirName = (p == fc->Name) ? 1 : p - fc->Name;
+
+        szDirName = BIDMalloc(cchDirName + 1);
+        if (szDirName == NULL)
+            return BID_S_NO_MEMORY;
+
+        memcpy(szDirName, fc->Name, cchDirName);
+        szDirName[cchDirName] = '\0';
+
+        fd = open(szDirName, O_RDONLY);
+    }
+
+    if (fd < 0 || fsync(fd) < 0)
+        err = BID_S_CACHE_WRITE_ERROR;
+
+    if (fd >= 0)
+        close(fd);
+    BIDFree(szDirName);
+
+    return err;
+}
+
+static BIDError
+_BIDFileCacheWrite(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    struct BIDFileCacheBuffer *buf)
+{
+    BIDError err;
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    int fd = -1;
+    char *szTmpName = NULL;
+    size_t cchFileName;
+
+    cchFileName = strlen(fc->Name);
+    szTmpName = BIDMalloc(cchFileName + sizeof(".XXXXXX"));
+    if (szTmpName == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    memcpy(szTmpName, fc->Name, cchFileName);
+    memcpy(&szTmpName[cchFileName], ".XXXXXX", sizeof(".XXXXXX"));
+
+    fd = mkstemp(szTmpName);
+    if (fd < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    err = _BIDFileCacheStore(ops, context, fc, fd, buf);
+    BID_BAIL_ON_ERROR(err);
+
+    if (fc->SyncMode != BID_FCACHE_SYNC_NONE && fsync(fd) < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    close(fd);
+    fd = -1;
+
+    if (rename(szTmpName, fc->Name) < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    if (fc->SyncMode != BID_FCACHE_SYNC_NONE) {
+        err = _BIDFileCacheSyncDirectory(fc);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    if (fd != -1) {
+        if (close(fd) < 0)
+            err = BID_S_CACHE_CLOSE_ERROR;
+    }
+    BIDFree(szTmpName);
+
+    return err; 
+}
+
+static BIDError
+_BIDFileCacheDestroy(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache)
+{
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+
+    if (fc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    return _BIDFileCacheErase(ops, context, fc);
+}
+
+static BIDError
+_BIDFileCacheGetName(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    const char **name)
+{
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+
+    if (fc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    *name = fc->Name;
+    BID_ASSERT(*name != NULL);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDFileCacheGetLastChangedTime(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    time_t *pTime)
+{
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    struct stat sb;
+
+    *pTime = 0;
+
+    if (fc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    /* writers rename a complete file into place, so no lock is needed */
+    if (stat(fc->Name, &sb) < 0)
+        return (errno == ENOENT) ? BID_S_CACHE_NOT_FOUND : BID_S_CACHE_OPEN_ERROR;
+
+    *pTime = sb.st_mtime;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDFileCacheFindRecord(
+    const unsigned char *pb,
+    size_t cb,
+    struct BIDFileCacheBuffer *key,
+    const unsigned char **pRecord,
+    const unsigned char **pRecordEnd)
+{
+    BIDError err;
+    const unsigned char *p, *pEnd;
+
+    err = _BIDFileCacheCheckHeader(pb, cb, &p, &pEnd);
+    if (err != BID_S_OK)
+        return err;
+
+    while (p < pEnd) {
+        const unsigned char *pNext = p;
+        size_t cbKey;
+
+        err = _BIDFileCacheSkipRecord(&pNext, pEnd, &cbKey);
+        if (err != BID_S_OK)
+            return err;
+
+        if (cbKey == key->Length && memcmp(p, key->Data, cbKey) == 0) {
+            *pRecord = p;
+            *pRecordEnd = pNext;
+            return BID_S_OK;
+        }
+
+        p = pNext;
+    }
+
+    return BID_S_CACHE_KEY_NOT_FOUND;
+}
+
+static BIDError
+_BIDFileCacheGetObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t **val)
+{
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    BIDError err;
+    json_t *d = NULL;
+    unsigned char *pb = NULL;
+    size_t cb = 0;
+    struct BIDFileCacheBuffer keyBuf = { NULL, 0, 0 };
+    uint32_t ulFormat;
+    int fd = -1;
+
+    *val = NULL;
+
+    if (fc == NULL) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+    if (fc->Flags & BID_CACHE_FLAG_READ_MOSTLY) {
+        BIDFileCacheLock(fc);
+        err = _BIDFileCacheRevalidate(ops, context, fc);
+        if (err == BID_S_OK)
+            *val = json_incref(json_object_get(fc->Snapshot, key));
+        BIDFileCacheUnlock(fc);
+        BID_BAIL_ON_ERROR(err);
+
+        err = (*val == NULL) ? BID_S_CACHE_KEY_NOT_FOUND : BID_S_OK;
+        goto cleanup;
+    }
+
+    err = _BIDFileCacheOpen(ops, context, fc, O_RDONLY | O_CLOEXEC, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDFileCacheLoad(ops, context, fc, fd, &pb, &cb);
+    BID_BAIL_ON_ERROR(err);
+
+    if (BID_FCACHE_IS_BINARY(pb, cb)) {
+        const unsigned char *p, *pEnd;
+
+        err = _BIDFileCacheEncodeKey(context, &keyBuf, key);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDFileCacheFindRecord(pb, cb, &keyBuf, &p, &pEnd);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDAllocJsonObject(context, &d);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDFileCacheDecodeRecord(context, &p, pEnd, d);
+        BID_BAIL_ON_ERROR(err);
+    } else {
+        err = _BIDFileCacheDecode(context, fc, pb, cb, &d, &ulFormat);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    *val = json_incref(json_object_get(d, key));
+
     if (*val == NULL)
         err = BID_S_CACHE_KEY_NOT_FOUND;
     else
@@ -676,62 +1629,251 @@ _BIDFileCacheGetObject(
 
 cleanup:
     _BIDFileCacheClose(ops, context, fc, fd);
-    json_decref(data);
     json_decref(d);
+    BIDFree(pb);
+    BIDFree(keyBuf.Data);
 
     return err;
 }
 
+/*
+ * Rewrites a binary cache by copying every record except those being
+ * replaced or removed, without decoding any of them.
+ */
 static BIDError
-_BIDFileCacheSetOrRemoveObject(
-    struct BIDCacheOps *ops,
+_BIDFileCacheSpliceBinary(
     BIDContext context,
-    void *cache,
-    const char *key,
-    json_t *val,
-    int remove)
+    const unsigned char *pb,
+    size_t cb,
+    struct BIDFileCacheUpdate *batch,
+    struct BIDFileCacheBuffer *buf)
 {
-    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
     BIDError err;
-    json_t *data = NULL, *d = NULL;
-    int fd = -1;
+    struct BIDFileCacheBuffer *rgKeys = NULL;
+    struct BIDFileCacheUpdate *u;
+    const unsigned char *p, *pEnd;
+    size_t i, j, cUpdates = 0;
 
-    if (fc == NULL || (val == NULL && !remove)) {
-        err = BID_S_INVALID_PARAMETER;
+    for (u = batch; u != NULL; u = u->Next)
+        cUpdates++;
+
+    rgKeys = BIDCalloc(cUpdates, sizeof(*rgKeys));
+    if (rgKeys == NULL) {
+        err = BID_S_NO_MEMORY;
         goto cleanup;
     }
 
-    if (fc->Flags & BID_CACHE_FLAG_READONLY) {
-        err = BID_S_CACHE_PERMISSION_DENIED;
+    for (u = batch, i = 0; u != NULL; u = u->Next, i++) {
+        err = _BIDFileCacheEncodeKey(context, &rgKeys[i], u->Key);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = _BIDFileCacheBufferAppendHeader(buf);
+    BID_BAIL_ON_ERROR(err);
+
+    /* a corrupt cache is replaced, as for JSON caches, but not a newer one */
+    err = _BIDFileCacheCheckHeader(pb, cb, &p, &pEnd);
+    if (err == BID_S_CACHE_INVALID_VERSION)
         goto cleanup;
+    else if (err != BID_S_OK)
+        p = pEnd = NULL;
+
+    while (p < pEnd) {
+        const unsigned char *pNext = p;
+        size_t cbKey;
+
+        err = _BIDFileCacheSkipRecord(&pNext, pEnd, &cbKey);
+        BID_BAIL_ON_ERROR(err);
+
+        for (i = 0; i < cUpdates; i++) {
+            if (cbKey == rgKeys[i].Length && memcmp(p, rgKeys[i].Data, cbKey) == 0)
+                break;
+        }
+
+        if (i == cUpdates) {
+            err = _BIDFileCacheBufferAppend(buf, p, pNext - p);
+            BID_BAIL_ON_ERROR(err);
+        }
+
+        p = pNext;
+    }
+
+    /* where a key is updated more than once, the last update wins */
+    for (u = batch, i = 0; u != NULL; u = u->Next, i++) {
+        if (u->Value == NULL)
+            continue;
+
+        for (j = i + 1; j < cUpdates; j++) {
+            if (rgKeys[j].Length == rgKeys[i].Length &&
+                memcmp(rgKeys[j].Data, rgKeys[i].Data, rgKeys[i].Length) == 0)
+                break;
+        }
+        if (j < cUpdates)
+            continue;
+
+        err = _BIDFileCacheBufferAppend(buf, rgKeys[i].Data, rgKeys[i].Length);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDFileCacheEncodeValue(context, buf, u->Value);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = _BIDFileCacheBufferAppendChecksum(buf);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    if (rgKeys != NULL) {
+        for (i = 0; i < cUpdates; i++)
+            BIDFree(rgKeys[i].Data);
+        BIDFree(rgKeys);
     }
 
+    return err;
+}
+
+/*
+ * Applies a batch of updates with a single rewrite of the cache.
+ */
+static BIDError
+_BIDFileCacheCommit(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    struct BIDFileCache *fc,
+    struct BIDFileCacheUpdate *batch)
+{
+    BIDError err;
+    json_t *d = NULL;
+    unsigned char *pb = NULL;
+    size_t cb = 0;
+    struct BIDFileCacheBuffer buf = { NULL, 0, 0 };
+    struct BIDFileCacheUpdate *u;
+    uint32_t ulFormat;
+    int fd = -1;
+
     err = _BIDFileCacheOpen(ops, context, fc, O_RDWR | O_CREAT | O_CLOEXEC, &fd);
-    if (err == BID_S_OK)
-        err = _BIDFileCacheRead(ops, context, cache, fd, &data, &d);
-    if (err == BID_S_CACHE_NOT_FOUND || err == BID_S_CACHE_READ_ERROR)
-        err = _BIDFileCacheNew(ops, context, fc, &data, &d);
     BID_BAIL_ON_ERROR(err);
 
-    if (remove)
-        err = _BIDJsonObjectDel(context, d, key, 0);
-    else
-        err = _BIDJsonObjectSet(context, d, key, val, 0);
+    err = _BIDFileCacheLoad(ops, context, fc, fd, &pb, &cb);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDFileCacheWrite(ops, context, cache, data);
+    if (cb == 0)
+        ulFormat = _BIDFileCacheDefaultFormat(fc);
+    else if (BID_FCACHE_IS_BINARY(pb, cb))
+        ulFormat = BID_FCACHE_FORMAT_BINARY;
+    else
+        ulFormat = BID_FCACHE_FORMAT_JSON;
+
+    if (ulFormat == BID_FCACHE_FORMAT_BINARY) {
+        err = _BIDFileCacheSpliceBinary(context, pb, cb, batch, &buf);
+        BID_BAIL_ON_ERROR(err);
+    } else {
+        err = _BIDFileCacheDecodeJson(context, fc, (const char *)pb, &d);
+        if (err == BID_S_CACHE_READ_ERROR)
+            err = _BIDAllocJsonObject(context, &d);
+        BID_BAIL_ON_ERROR(err);
+
+        for (u = batch; u != NULL; u = u->Next) {
+            if (u->Value == NULL)
+                err = _BIDJsonObjectDel(context, d, u->Key, 0);
+            else
+                err = _BIDJsonObjectSet(context, d, u->Key, u->Value, 0);
+            BID_BAIL_ON_ERROR(err);
+        }
+
+        err = _BIDFileCacheEncodeJson(context, fc, d, &buf);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = _BIDFileCacheWrite(ops, context, fc, &buf);
     BID_BAIL_ON_ERROR(err);
 
     err = BID_S_OK;
 
 cleanup:
     _BIDFileCacheClose(ops, context, fc, fd);
-    json_decref(data);
     json_decref(d);
+    BIDFree(pb);
+    BIDFree(buf.Data);
 
     return err;
 }
 
+static BIDError
+_BIDFileCacheSetOrRemoveObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val,
+    int remove)
+{
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    struct BIDFileCacheUpdate update;
+
+    if (fc == NULL || (val == NULL && !remove))
+        return BID_S_INVALID_PARAMETER;
+
+    if (fc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    update.Next = NULL;
+    update.Key = key;
+    update.Value = remove ? NULL : val;
+    update.Result = BID_S_OK;
+    update.Done = 0;
+
+    BIDFileCacheLock(fc);
+
+    *fc->PendingTail = &update;
+    fc->PendingTail = &update.Next;
+
+    while (!update.Done) {
+        struct BIDFileCacheUpdate *batch, *u, *next;
+        BIDError err;
+
+        if (fc->Committing) {
+            pthread_cond_wait(&fc->Committed, &fc->Mutex);
+            continue;
+        }
+
+        fc->Committing = 1;
+
+        if (fc->CommitWindow != 0 && fc->SyncMode != BID_FCACHE_SYNC_WRITE) {
+            BIDFileCacheUnlock(fc);
+            usleep(fc->CommitWindow);
+            BIDFileCacheLock(fc);
+        }
+
+        batch = fc->Pending;
+        if (fc->SyncMode == BID_FCACHE_SYNC_WRITE) {
+            fc->Pending = batch->Next;
+            batch->Next = NULL;
+        } else {
+            fc->Pending = NULL;
+        }
+        if (fc->Pending == NULL)
+            fc->PendingTail = &fc->Pending;
+
+        BIDFileCacheUnlock(fc);
+        err = _BIDFileCacheCommit(ops, context, fc, batch);
+        BIDFileCacheLock(fc);
+
+        /* waiters own their updates once Done is set */
+        for (u = batch; u != NULL; u = next) {
+            next = u->Next;
+            u->Result = err;
+            u->Done = 1;
+        }
+
+        fc->Committing = 0;
+        pthread_cond_broadcast(&fc->Committed);
+    }
+
+    BIDFileCacheUnlock(fc);
+
+    return update.Result;
+}
+
 static BIDError
 _BIDFileCacheSetObject(
     struct BIDCacheOps *ops,
@@ -764,7 +1906,8 @@ _BIDFileCacheFirstObject(
 {
     struct BIDFileCache *fc = (struct BIDFileCache *)cache;
     BIDError err;
-    json_t *data = NULL, *d = NULL;
+    json_t *d = NULL;
+    uint32_t ulFormat;
     int fd = -1;
 
     *key = NULL;
@@ -777,16 +1920,25 @@ _BIDFileCacheFirstObject(
         goto cleanup;
     }
 
-    err = _BIDFileCacheOpen(ops, context, fc, O_RDWR | O_CLOEXEC, &fd);
-    BID_BAIL_ON_ERROR(err);
+    if (fc->Flags & BID_CACHE_FLAG_READ_MOSTLY) {
+        BIDFileCacheLock(fc);
+        err = _BIDFileCacheRevalidate(ops, context, fc);
+        if (err == BID_S_OK)
+            d = json_incref(fc->Snapshot);
+        BIDFileCacheUnlock(fc);
+        BID_BAIL_ON_ERROR(err);
+    } else {
+        err = _BIDFileCacheOpen(ops, context, fc, O_RDWR | O_CLOEXEC, &fd);
+        BID_BAIL_ON_ERROR(err);
 
-    err = _BIDFileCacheRead(ops, context, cache, fd, &data, &d);
-    BID_BAIL_ON_ERROR(err);
+        err = _BIDFileCacheRead(ops, context, fc, fd, &d, &ulFormat);
+        BID_BAIL_ON_ERROR(err);
 
-    err = _BIDFileCacheClose(ops, context, fc, fd);
-    BID_BAIL_ON_ERROR(err);
+        err = _BIDFileCacheClose(ops, context, fc, fd);
+        BID_BAIL_ON_ERROR(err);
 
-    fd = -1;
+        fd = -1;
+    }
 
     err = _BIDCacheIteratorAlloc(d, cookie);
     BID_BAIL_ON_ERROR(err);
@@ -800,7 +1952,6 @@ cleanup:
     if (fd != -1)
         _BIDFileCacheClose(ops, context, fc, fd);
 
-    json_decref(data);
     json_decref(d);
 
     return err;
@@ -844,3 +1995,51 @@ struct BIDCacheOps _BIDFileCache = {
     _BIDFileCacheNextObject,
 };
 
+BIDError
+_BIDConvertFileCache(
+    BIDContext context,
+    const char *szCacheName,
+    uint32_t ulFormat)
+{
+    BIDError err, err2;
+    struct BIDFileCache *fc = NULL;
+    struct BIDFileCacheBuffer buf = { NULL, 0, 0 };
+    json_t *d = NULL;
+    uint32_t ulOldFormat;
+    int fd = -1;
+
+    if (ulFormat != BID_FCACHE_FORMAT_JSON && ulFormat != BID_FCACHE_FORMAT_BINARY)
+        return BID_S_INVALID_PARAMETER;
+
+    if (strncmp(szCacheName, "file:", 5) == 0)
+        szCacheName += 5;
+
+    err = _BIDFileCacheAcquire(&_BIDFileCache, context, (void **)&fc, szCacheName, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDFileCacheOpen(&_BIDFileCache, context, fc, O_RDWR | O_CLOEXEC, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDFileCacheRead(&_BIDFileCache, context, fc, fd, &d, &ulOldFormat);
+    BID_BAIL_ON_ERROR(err);
+
+    if (ulOldFormat != ulFormat) {
+        err = _BIDFileCacheEncode(context, fc, d, ulFormat, &buf);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDFileCacheWrite(&_BIDFileCache, context, fc, &buf);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+cleanup:
+    if (fc != NULL) {
+        err2 = _BIDFileCacheClose(&_BIDFileCache, context, fc, fd);
+        if (err == BID_S_OK)
+            err = err2;
+        _BIDFileCacheRelease(&_BIDFileCache, context, fc);
+    }
+    json_decref(d);
+    BIDFree(buf.Data);
+
+    return err;
+}
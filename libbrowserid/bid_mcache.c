@@ -37,61 +37,482 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #include "bid_private.h"
 
-struct BIDMemoryCache {
+/*
+ * The memory cache is a hash table whose buckets are divided among a
+ * fixed number of stripes, each with its own lock, so that threads
+ * working on different keys rarely contend. Each stripe grows its share
+ * of the buckets independently.
+ *
+ * Iteration takes a snapshot of one stripe at a time, holding its lock
+ * only while the entries are copied, so it never blocks writers for
+ * long; changes to stripes not yet visited may or may not be seen.
+ *
+ * The "memorycachemaxentries" and "memorycachemaxbytes" configuration
+ * values bound the size of each memory cache (the limits are divided
+ * evenly between the stripes). When a stripe is full, entries whose
+ * "exp" (or "renew-exp") time has passed are evicted first, then the
+ * least recently used entries. Caches acquired with BID_CACHE_FLAG_NO_EVICT,
+ * such as replay caches, never evict unexpired entries; instead the update
+ * fails with BID_S_CACHE_FULL. As a stripe of such a cache cannot make
+ * room by evicting, their limits apply to the cache as a whole rather than
+ * to each stripe, and expired entries are swept from every stripe before
+ * an update is refused. Byte counts are estimates of the memory held by
+ * each key and value.
+ *
+ * Concurrency makes the following assumptions:
+ *
+ * - libjansson is compiled with atomic refcounting ops
+ * - returned values are immutable
+ */
+#define BID_MCACHE_STRIPES          64      /* power of 2 */
+#define BID_MCACHE_MIN_BUCKETS      8       /* power of 2 */
+
+struct BIDMemoryCacheEntry {
+    struct BIDMemoryCacheEntry *Next;
+    struct BIDMemoryCacheEntry *LruPrev;
+    struct BIDMemoryCacheEntry *LruNext;
+    uint32_t Hash;
+    size_t cbSize;
+    time_t Expiry;
+    json_t *Value;
+    char Key[1];
+};
+
+struct BIDMemoryCacheStripe {
     BID_MUTEX Mutex;
+    struct BIDMemoryCacheEntry **Buckets;
+    size_t cBuckets;
+    size_t cEntries;
+    size_t cbKeys;
+    size_t cbSize;
+    struct BIDMemoryCacheEntry *LruHead;    /* most recently used */
+    struct BIDMemoryCacheEntry *LruTail;
+    time_t NextExpiry;                      /* 0 if nothing expires */
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t Evictions;
+    uint64_t Rejections;
+};
+
+struct BIDMemoryCache {
     char *Name;
-    json_t *Data;
     uint32_t Flags;
     time_t LastChangedTime;
+    size_t MaxEntries;                      /* per stripe, 0 for no limit */
+    size_t MaxBytes;                        /* (per cache if global) */
+    int GlobalLimits;
+    BID_MUTEX UsageMutex;                   /* protects the following */
+    size_t cEntries;                        /* totals, if limits are global */
+    size_t cbSize;
+    struct BIDMemoryCacheStripe Stripes[BID_MCACHE_STRIPES];
 };
 
+/* if set, MaxEntries and MaxBytes are totals for the whole cache */
+#define BID_MCACHE_GLOBAL_LIMITS_P(mc)  ((mc)->GlobalLimits)
+
+/* called with the usage mutex held */
+#define BID_MCACHE_USAGE_FITS_P(mc, cAdd, cbAdd)                                        \
+    (((mc)->MaxEntries == 0 || (mc)->cEntries + (cAdd) <= (mc)->MaxEntries) &&          \
+     ((mc)->MaxBytes == 0 || (mc)->cbSize + (cbAdd) <= (mc)->MaxBytes))
+
+#define BIDMemoryCacheLock(stripe)      BID_MUTEX_LOCK(&(stripe)->Mutex)
+#define BIDMemoryCacheUnlock(stripe)    BID_MUTEX_UNLOCK(&(stripe)->Mutex)
+
+#define BID_MCACHE_STRIPE(mc, hash)     (&(mc)->Stripes[(hash) & (BID_MCACHE_STRIPES - 1)])
+#define BID_MCACHE_BUCKET(stripe, hash) (&(stripe)->Buckets[((hash) / BID_MCACHE_STRIPES) & \
+                                                            ((stripe)->cBuckets - 1)])
+
 /*
- * Concurrency makes the following assumptions:
- *
- * - libjansson is compiled with atomic refcounting ops
- * - returned values are immutable
+ * Approximate memory held by a value, for byte limits.
  */
-#define BIDMemoryCacheLock(mc)      BID_MUTEX_LOCK(&(mc)->Mutex)
-#define BIDMemoryCacheUnlock(mc)    BID_MUTEX_UNLOCK(&(mc)->Mutex)
+static size_t
+_BIDMemoryCacheValueSize(json_t *value)
+{
+    size_t cbSize = 32, i;
+    void *iter;
 
-static BIDError
-_BIDMemoryCacheAcquire(
-    struct BIDCacheOps *ops,
-    BIDContext context,
-    void **cache,
-    const char *name,
-    uint32_t ulFlags BID_UNUSED)
+    if (json_is_object(value)) {
+        for (iter = json_object_iter(value);
+             iter != NULL;
+             iter = json_object_iter_next(value, iter)) {
+            cbSize += 32 + strlen(json_object_iter_key(iter)) + 1;
+            cbSize += _BIDMemoryCacheValueSize(json_object_iter_value(iter));
+        }
+    } else if (json_is_array(value)) {
+        for (i = 0; i < json_array_size(value); i++)
+            cbSize += 8 + _BIDMemoryCacheValueSize(json_array_get(value, i));
+    } else if (json_is_string(value)) {
+        cbSize += strlen(json_string_value(value)) + 1;
+    }
+
+    return cbSize;
+}
+
+static time_t
+_BIDMemoryCacheValueExpiry(BIDContext context, json_t *value)
 {
-    BIDError err;
-    struct BIDMemoryCache *mc;
+    time_t expiryTime = 0, renewExpiryTime = 0;
 
-    mc = BIDCalloc(1, sizeof(*mc));
-    if (mc == NULL)
-        return BID_S_NO_MEMORY;
+    if (!json_is_object(value))
+        return 0;
 
-    err = _BIDAllocJsonObject(context, &mc->Data);
-    if (err != BID_S_OK) {
-        ops->Release(ops, context, mc);
-        return BID_S_NO_MEMORY;
+    _BIDGetJsonTimestampValue(context, value, "exp", &expiryTime);
+    _BIDGetJsonTimestampValue(context, value, "renew-exp", &renewExpiryTime);
+
+    return renewExpiryTime > expiryTime ? renewExpiryTime : expiryTime;
+}
+
+/*
+ * LRU list maintenance; called with the stripe locked.
+ */
+static void
+_BIDMemoryCacheLruUnlink(
+    struct BIDMemoryCacheStripe *stripe,
+    struct BIDMemoryCacheEntry *entry)
+{
+    if (entry->LruPrev != NULL)
+        entry->LruPrev->LruNext = entry->LruNext;
+    else
+        stripe->LruHead = entry->LruNext;
+
+    if (entry->LruNext != NULL)
+        entry->LruNext->LruPrev = entry->LruPrev;
+    else
+        stripe->LruTail = entry->LruPrev;
+
+    entry->LruPrev = entry->LruNext = NULL;
+}
+
+static void
+_BIDMemoryCacheLruPush(
+    struct BIDMemoryCacheStripe *stripe,
+    struct BIDMemoryCacheEntry *entry)
+{
+    entry->LruPrev = NULL;
+    entry->LruNext = stripe->LruHead;
+
+    if (stripe->LruHead != NULL)
+        stripe->LruHead->LruPrev = entry;
+    else
+        stripe->LruTail = entry;
+
+    stripe->LruHead = entry;
+}
+
+/*
+ * Account for cAdd entries and cbAdd bytes against the cache-wide limits,
+ * returning 0 if they would be exceeded. Stripe locks may be held.
+ */
+static int
+_BIDMemoryCacheReserveUsage(
+    struct BIDMemoryCache *mc,
+    size_t cAdd,
+    size_t cbAdd)
+{
+    int bReserved;
+
+    if (!BID_MCACHE_GLOBAL_LIMITS_P(mc))
+        return 1;
+
+    BID_MUTEX_LOCK(&mc->UsageMutex);
+    bReserved = BID_MCACHE_USAGE_FITS_P(mc, cAdd, cbAdd);
+    if (bReserved) {
+        mc->cEntries += cAdd;
+        mc->cbSize += cbAdd;
     }
+    BID_MUTEX_UNLOCK(&mc->UsageMutex);
 
-    err = _BIDDuplicateString(context, name, &mc->Name);
-    if (err != BID_S_OK) {
-        ops->Release(ops, context, mc);
-        return err;
+    return bReserved;
+}
+
+static void
+_BIDMemoryCacheReleaseUsage(
+    struct BIDMemoryCache *mc,
+    size_t cRemove,
+    size_t cbRemove)
+{
+    if (!BID_MCACHE_GLOBAL_LIMITS_P(mc))
+        return;
+
+    BID_MUTEX_LOCK(&mc->UsageMutex);
+    BID_ASSERT(mc->cEntries >= cRemove && mc->cbSize >= cbRemove);
+    mc->cEntries -= cRemove;
+    mc->cbSize -= cbRemove;
+    BID_MUTEX_UNLOCK(&mc->UsageMutex);
+}
+
+/*
+ * Unlink an entry from its stripe, putting it on a list to be freed
+ * once the stripe is unlocked.
+ */
+static void
+_BIDMemoryCacheUnlinkEntry(
+    struct BIDMemoryCache *mc,
+    struct BIDMemoryCacheStripe *stripe,
+    struct BIDMemoryCacheEntry *entry,
+    struct BIDMemoryCacheEntry **pFreeList)
+{
+    struct BIDMemoryCacheEntry **pEntry;
+
+    for (pEntry = BID_MCACHE_BUCKET(stripe, entry->Hash);
+         *pEntry != entry;
+         pEntry = &(*pEntry)->Next)
+        ;
+
+    *pEntry = entry->Next;
+
+    _BIDMemoryCacheLruUnlink(stripe, entry);
+
+    stripe->cEntries--;
+    stripe->cbKeys -= strlen(entry->Key) + 1;
+    stripe->cbSize -= entry->cbSize;
+    _BIDMemoryCacheReleaseUsage(mc, 1, entry->cbSize);
+
+    entry->Next = *pFreeList;
+    *pFreeList = entry;
+}
+
+/*
+ * Evict the stripe's expired entries, other than the entry being updated;
+ * called with the stripe locked.
+ */
+static void
+_BIDMemoryCacheEvictExpired(
+    struct BIDMemoryCache *mc,
+    struct BIDMemoryCacheStripe *stripe,
+    struct BIDMemoryCacheEntry *updated,
+    time_t now,
+    struct BIDMemoryCacheEntry **pFreeList)
+{
+    struct BIDMemoryCacheEntry *entry, *prev;
+
+    if (stripe->NextExpiry == 0 || stripe->NextExpiry > now)
+        return;
+
+    stripe->NextExpiry = 0;
+
+    for (entry = stripe->LruTail; entry != NULL; entry = prev) {
+        prev = entry->LruPrev;
+
+        if (entry == updated || entry->Expiry == 0) {
+            continue;
+        } else if (entry->Expiry <= now) {
+            _BIDMemoryCacheUnlinkEntry(mc, stripe, entry, pFreeList);
+            stripe->Evictions++;
+        } else if (stripe->NextExpiry == 0 || entry->Expiry < stripe->NextExpiry) {
+            stripe->NextExpiry = entry->Expiry;
+        }
     }
+}
 
-    BID_MUTEX_INIT(&mc->Mutex);
+/*
+ * Evict entries until an update adding cAdd entries and cbAdd bytes fits
+ * within the limits; called with the stripe locked. The entry being
+ * updated, if any, is never evicted. With cache-wide limits, the space is
+ * reserved on success.
+ */
+static BIDError
+_BIDMemoryCacheMakeRoom(
+    struct BIDMemoryCache *mc,
+    struct BIDMemoryCacheStripe *stripe,
+    struct BIDMemoryCacheEntry *updated,
+    size_t cAdd,
+    size_t cbAdd,
+    struct BIDMemoryCacheEntry **pFreeList)
+{
+    struct BIDMemoryCacheEntry *entry, *prev;
 
-    mc->Flags = ulFlags;
+    if (BID_MCACHE_GLOBAL_LIMITS_P(mc)) {
+        if (_BIDMemoryCacheReserveUsage(mc, cAdd, cbAdd))
+            return BID_S_OK;
 
-    *cache = mc;
+        _BIDMemoryCacheEvictExpired(mc, stripe, updated, time(NULL), pFreeList);
+
+        /* then this stripe's least recently used, unless they must be kept */
+        for (entry = stripe->LruTail; ; entry = prev) {
+            if (_BIDMemoryCacheReserveUsage(mc, cAdd, cbAdd))
+                return BID_S_OK;
+            if (entry == NULL || (mc->Flags & BID_CACHE_FLAG_NO_EVICT))
+                return BID_S_CACHE_FULL;
+
+            prev = entry->LruPrev;
+
+            if (entry != updated) {
+                _BIDMemoryCacheUnlinkEntry(mc, stripe, entry, pFreeList);
+                stripe->Evictions++;
+            }
+        }
+    }
+
+#define BID_MCACHE_FULL_P(mc, stripe)                                                   \
+    (((mc)->MaxEntries != 0 && (stripe)->cEntries + cAdd > (mc)->MaxEntries) ||         \
+     ((mc)->MaxBytes != 0 && (stripe)->cbSize + cbAdd > (mc)->MaxBytes))
+
+    if (!BID_MCACHE_FULL_P(mc, stripe))
+        return BID_S_OK;
+
+    /* expired entries first */
+    _BIDMemoryCacheEvictExpired(mc, stripe, updated, time(NULL), pFreeList);
+
+    /* then the least recently used, unless they must be kept */
+    if ((mc->Flags & BID_CACHE_FLAG_NO_EVICT) == 0) {
+        for (entry = stripe->LruTail;
+             entry != NULL && BID_MCACHE_FULL_P(mc, stripe);
+             entry = prev) {
+            prev = entry->LruPrev;
+
+            if (entry != updated) {
+                _BIDMemoryCacheUnlinkEntry(mc, stripe, entry, pFreeList);
+                stripe->Evictions++;
+            }
+        }
+    }
+
+    if (BID_MCACHE_FULL_P(mc, stripe))
+        return BID_S_CACHE_FULL;
+
+#undef BID_MCACHE_FULL_P
 
     return BID_S_OK;
 }
 
+static void
+_BIDMemoryCacheFreeEntries(struct BIDMemoryCacheEntry **buckets, size_t cBuckets)
+{
+    size_t i;
+
+    for (i = 0; i < cBuckets; i++) {
+        struct BIDMemoryCacheEntry *entry, *next;
+
+        for (entry = buckets[i]; entry != NULL; entry = next) {
+            next = entry->Next;
+            json_decref(entry->Value);
+            BIDFree(entry);
+        }
+    }
+
+    BIDFree(buckets);
+}
+
+static void
+_BIDMemoryCacheFreeList(struct BIDMemoryCacheEntry *entry)
+{
+    struct BIDMemoryCacheEntry *next;
+
+    for (; entry != NULL; entry = next) {
+        next = entry->Next;
+        json_decref(entry->Value);
+        BIDFree(entry);
+    }
+}
+
+static int
+_BIDMemoryCacheUsageFitsP(
+    struct BIDMemoryCache *mc,
+    size_t cAdd,
+    size_t cbAdd)
+{
+    int bFits;
+
+    BID_MUTEX_LOCK(&mc->UsageMutex);
+    bFits = BID_MCACHE_USAGE_FITS_P(mc, cAdd, cbAdd);
+    BID_MUTEX_UNLOCK(&mc->UsageMutex);
+
+    return bFits;
+}
+
+/*
+ * Make room under cache-wide limits for an update to a stripe that could
+ * not make room itself, locking the other stripes one at a time. Expired
+ * entries are evicted from every stripe; then, unless entries must be
+ * kept, the least recently used entry of each of the other stripes in
+ * turn until the update fits.
+ */
+static void
+_BIDMemoryCacheSweep(
+    struct BIDMemoryCache *mc,
+    struct BIDMemoryCacheStripe *updated,
+    size_t cAdd,
+    size_t cbAdd)
+{
+    time_t now = time(NULL);
+    size_t i, iFirst = updated - mc->Stripes;
+    int bEvicted;
+
+    for (i = 0; i < BID_MCACHE_STRIPES; i++) {
+        struct BIDMemoryCacheStripe *stripe = &mc->Stripes[i];
+        struct BIDMemoryCacheEntry *freeList = NULL;
+
+        BIDMemoryCacheLock(stripe);
+        _BIDMemoryCacheEvictExpired(mc, stripe, NULL, now, &freeList);
+        BIDMemoryCacheUnlock(stripe);
+
+        _BIDMemoryCacheFreeList(freeList);
+    }
+
+    if (mc->Flags & BID_CACHE_FLAG_NO_EVICT)
+        return;
+
+    do {
+        bEvicted = 0;
+
+        for (i = 1; i < BID_MCACHE_STRIPES; i++) {
+            struct BIDMemoryCacheStripe *stripe;
+            struct BIDMemoryCacheEntry *freeList = NULL;
+
+            if (_BIDMemoryCacheUsageFitsP(mc, cAdd, cbAdd))
+                return;
+
+            stripe = &mc->Stripes[(iFirst + i) % BID_MCACHE_STRIPES];
+
+            BIDMemoryCacheLock(stripe);
+            if (stripe->LruTail != NULL) {
+                _BIDMemoryCacheUnlinkEntry(mc, stripe, stripe->LruTail, &freeList);
+                stripe->Evictions++;
+                bEvicted = 1;
+            }
+            BIDMemoryCacheUnlock(stripe);
+
+            _BIDMemoryCacheFreeList(freeList);
+        }
+    } while (bEvicted);
+}
+
+/*
+ * Double the number of buckets in a stripe; called with the stripe locked.
+ * Failure to grow is not an error, it just makes the chains longer.
+ */
+static void
+_BIDMemoryCacheGrowStripe(struct BIDMemoryCacheStripe *stripe)
+{
+    struct BIDMemoryCacheEntry **buckets, **oldBuckets = stripe->Buckets;
+    size_t i, cOldBuckets = stripe->cBuckets;
+
+    buckets = BIDCalloc(2 * cOldBuckets, sizeof(*buckets));
+    if (buckets == NULL)
+        return;
+
+    stripe->Buckets = buckets;
+    stripe->cBuckets = 2 * cOldBuckets;
+
+    for (i = 0; i < cOldBuckets; i++) {
+        struct BIDMemoryCacheEntry *entry, *next;
+
+        for (entry = oldBuckets[i]; entry != NULL; entry = next) {
+            struct BIDMemoryCacheEntry **pBucket = BID_MCACHE_BUCKET(stripe, entry->Hash);
+
+            next = entry->Next;
+            entry->Next = *pBucket;
+            *pBucket = entry;
+        }
+    }
+
+    BIDFree(oldBuckets);
+}
+
 static BIDError
 _BIDMemoryCacheRelease(
     struct BIDCacheOps *ops BID_UNUSED,
@@ -99,18 +520,88 @@ _BIDMemoryCacheRelease(
     void *cache)
 {
     struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
+    size_t i;
 
     if (mc == NULL)
         return BID_S_INVALID_PARAMETER;
 
+    for (i = 0; i < BID_MCACHE_STRIPES; i++) {
+        struct BIDMemoryCacheStripe *stripe = &mc->Stripes[i];
+
+        if (stripe->Buckets == NULL)
+            break;
+
+        _BIDMemoryCacheFreeEntries(stripe->Buckets, stripe->cBuckets);
+        BID_MUTEX_DESTROY(&stripe->Mutex);
+    }
+
+    BID_MUTEX_DESTROY(&mc->UsageMutex);
     BIDFree(mc->Name);
-    json_decref(mc->Data);
-    BID_MUTEX_DESTROY(&mc->Mutex);
     BIDFree(mc);
 
     return BID_S_OK;
 }
 
+static BIDError
+_BIDMemoryCacheAcquire(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void **cache,
+    const char *name,
+    uint32_t ulFlags)
+{
+    BIDError err;
+    struct BIDMemoryCache *mc;
+    size_t i;
+
+    mc = BIDCalloc(1, sizeof(*mc));
+    if (mc == NULL)
+        return BID_S_NO_MEMORY;
+
+    BID_MUTEX_INIT(&mc->UsageMutex);
+
+    for (i = 0; i < BID_MCACHE_STRIPES; i++) {
+        struct BIDMemoryCacheStripe *stripe = &mc->Stripes[i];
+
+        stripe->Buckets = BIDCalloc(BID_MCACHE_MIN_BUCKETS, sizeof(*stripe->Buckets));
+        if (stripe->Buckets == NULL) {
+            ops->Release(ops, context, mc);
+            return BID_S_NO_MEMORY;
+        }
+        stripe->cBuckets = BID_MCACHE_MIN_BUCKETS;
+
+        BID_MUTEX_INIT(&stripe->Mutex);
+    }
+
+    err = _BIDDuplicateString(context, name, &mc->Name);
+    if (err != BID_S_OK) {
+        ops->Release(ops, context, mc);
+        return err;
+    }
+
+    mc->Flags = ulFlags;
+    mc->MaxEntries = context->ConfigParams.MemoryCacheMaxEntries;
+    mc->MaxBytes = context->ConfigParams.MemoryCacheMaxBytes;
+
+    /*
+     * Per-stripe limits need no shared counters, but caches that cannot
+     * evict must count across stripes, and rounding up an entry limit
+     * below the number of stripes would overshoot it many times over.
+     */
+    mc->GlobalLimits = (mc->MaxEntries != 0 || mc->MaxBytes != 0) &&
+                       ((ulFlags & BID_CACHE_FLAG_NO_EVICT) ||
+                        (mc->MaxEntries != 0 && mc->MaxEntries < BID_MCACHE_STRIPES));
+
+    if (!BID_MCACHE_GLOBAL_LIMITS_P(mc)) {
+        mc->MaxEntries = (mc->MaxEntries + BID_MCACHE_STRIPES - 1) / BID_MCACHE_STRIPES;
+        mc->MaxBytes = (mc->MaxBytes + BID_MCACHE_STRIPES - 1) / BID_MCACHE_STRIPES;
+    }
+
+    *cache = mc;
+
+    return BID_S_OK;
+}
+
 static BIDError
 _BIDMemoryCacheInitialize(
     struct BIDCacheOps *ops BID_UNUSED,
@@ -127,22 +618,36 @@ _BIDMemoryCacheDestroy(
     void *cache)
 {
     struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
-    BIDError err;
-    json_t *j;
+    size_t i;
 
     if (mc == NULL)
         return BID_S_INVALID_PARAMETER;
 
-    err = _BIDAllocJsonObject(context, &j);
-    if (err != BID_S_OK)
-        return err;
+    for (i = 0; i < BID_MCACHE_STRIPES; i++) {
+        struct BIDMemoryCacheStripe *stripe = &mc->Stripes[i];
+        struct BIDMemoryCacheEntry **buckets, **oldBuckets;
+        size_t cOldBuckets;
 
-    BIDMemoryCacheLock(mc);
+        buckets = BIDCalloc(BID_MCACHE_MIN_BUCKETS, sizeof(*buckets));
+        if (buckets == NULL)
+            return BID_S_NO_MEMORY;
 
-    json_decref(mc->Data);
-    mc->Data = j;
+        BIDMemoryCacheLock(stripe);
+        oldBuckets = stripe->Buckets;
+        cOldBuckets = stripe->cBuckets;
+        stripe->Buckets = buckets;
+        stripe->cBuckets = BID_MCACHE_MIN_BUCKETS;
+        _BIDMemoryCacheReleaseUsage(mc, stripe->cEntries, stripe->cbSize);
+        stripe->cEntries = 0;
+        stripe->cbKeys = 0;
+        stripe->cbSize = 0;
+        stripe->LruHead = stripe->LruTail = NULL;
+        stripe->NextExpiry = 0;
+        BIDMemoryCacheUnlock(stripe);
 
-    BIDMemoryCacheUnlock(mc);
+        /* free the old entries outside the lock */
+        _BIDMemoryCacheFreeEntries(oldBuckets, cOldBuckets);
+    }
 
     return BID_S_OK;
 }
@@ -192,7 +697,10 @@ _BIDMemoryCacheGetObject(
     json_t **val)
 {
     struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
+    struct BIDMemoryCacheStripe *stripe;
+    struct BIDMemoryCacheEntry *entry;
     BIDError err;
+    uint32_t hash;
 
     *val = NULL;
 
@@ -201,9 +709,25 @@ _BIDMemoryCacheGetObject(
         goto cleanup;
     }
 
-    BIDMemoryCacheLock(mc);
-    *val = json_incref(json_object_get(mc->Data, key));
-    BIDMemoryCacheUnlock(mc);
+    hash = _BIDFnv1a(key, strlen(key));
+    stripe = BID_MCACHE_STRIPE(mc, hash);
+
+    BIDMemoryCacheLock(stripe);
+    for (entry = *BID_MCACHE_BUCKET(stripe, hash); entry != NULL; entry = entry->Next) {
+        if (entry->Hash == hash && strcmp(entry->Key, key) == 0) {
+            *val = json_incref(entry->Value);
+            if (stripe->LruHead != entry) {
+                _BIDMemoryCacheLruUnlink(stripe, entry);
+                _BIDMemoryCacheLruPush(stripe, entry);
+            }
+            break;
+        }
+    }
+    if (*val != NULL)
+        stripe->Hits++;
+    else
+        stripe->Misses++;
+    BIDMemoryCacheUnlock(stripe);
 
     if (*val == NULL)
         err = BID_S_CACHE_KEY_NOT_FOUND;
@@ -218,14 +742,20 @@ cleanup:
 static BIDError
 _BIDMemoryCacheSetOrRemoveObject(
     struct BIDCacheOps *ops BID_UNUSED,
-    BIDContext context BID_UNUSED,
+    BIDContext context,
     void *cache,
     const char *key,
     json_t *val,
     int remove)
 {
     struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
+    struct BIDMemoryCacheStripe *stripe;
+    struct BIDMemoryCacheEntry **pBucket, *entry, *newEntry = NULL, *freeList = NULL;
+    json_t *oldValue = NULL;
     BIDError err;
+    uint32_t hash;
+    size_t cchKey, cAdd = 0, cbAdd = 0;
+    int bRetried = 0;
 
     if (mc == NULL || (val == NULL && !remove)) {
         err = BID_S_INVALID_PARAMETER;
@@ -237,12 +767,96 @@ _BIDMemoryCacheSetOrRemoveObject(
         goto cleanup;
     }
 
-    BIDMemoryCacheLock(mc);
-    if (remove)
-        err = _BIDJsonObjectDel(context, mc->Data, key, 0);
-    else
-        err = _BIDJsonObjectSet(context, mc->Data, key, val, 0);
-    BIDMemoryCacheUnlock(mc);
+    hash = _BIDFnv1a(key, strlen(key));
+    stripe = BID_MCACHE_STRIPE(mc, hash);
+    cchKey = strlen(key);
+
+    /* allocate outside the lock, in case the key is new */
+    if (!remove) {
+        newEntry = BIDMalloc(sizeof(*newEntry) + cchKey);
+        if (newEntry == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        newEntry->Hash = hash;
+        newEntry->cbSize = sizeof(*newEntry) + cchKey;
+        if (mc->MaxBytes != 0)
+            newEntry->cbSize += _BIDMemoryCacheValueSize(val);
+        newEntry->Expiry = _BIDMemoryCacheValueExpiry(context, val);
+        newEntry->Value = json_incref(val);
+        memcpy(newEntry->Key, key, cchKey + 1);
+    }
+
+retry:
+    BIDMemoryCacheLock(stripe);
+
+    for (entry = *BID_MCACHE_BUCKET(stripe, hash); entry != NULL; entry = entry->Next) {
+        if (entry->Hash == hash && strcmp(entry->Key, key) == 0)
+            break;
+    }
+
+    if (remove) {
+        if (entry != NULL)
+            _BIDMemoryCacheUnlinkEntry(mc, stripe, entry, &freeList);
+        err = BID_S_OK;
+    } else if (entry != NULL) {
+        cAdd = 0;
+        cbAdd = newEntry->cbSize > entry->cbSize ? newEntry->cbSize - entry->cbSize : 0;
+        err = _BIDMemoryCacheMakeRoom(mc, stripe, entry, cAdd, cbAdd, &freeList);
+        if (err == BID_S_OK) {
+            if (newEntry->cbSize < entry->cbSize)
+                _BIDMemoryCacheReleaseUsage(mc, 0, entry->cbSize - newEntry->cbSize);
+            oldValue = entry->Value;
+            entry->Value = newEntry->Value;
+            newEntry->Value = NULL;
+            stripe->cbSize += newEntry->cbSize;
+            stripe->cbSize -= entry->cbSize;
+            entry->cbSize = newEntry->cbSize;
+            entry->Expiry = newEntry->Expiry;
+            _BIDMemoryCacheLruUnlink(stripe, entry);
+            _BIDMemoryCacheLruPush(stripe, entry);
+        }
+    } else {
+        cAdd = 1;
+        cbAdd = newEntry->cbSize;
+        err = _BIDMemoryCacheMakeRoom(mc, stripe, NULL, cAdd, cbAdd, &freeList);
+        if (err == BID_S_OK) {
+            pBucket = BID_MCACHE_BUCKET(stripe, hash);
+            newEntry->Next = *pBucket;
+            *pBucket = newEntry;
+            _BIDMemoryCacheLruPush(stripe, newEntry);
+            stripe->cEntries++;
+            stripe->cbKeys += cchKey + 1;
+            stripe->cbSize += newEntry->cbSize;
+            entry = newEntry;
+            newEntry = NULL;
+
+            if (stripe->cEntries > stripe->cBuckets)
+                _BIDMemoryCacheGrowStripe(stripe);
+        }
+    }
+
+    if (err == BID_S_OK && !remove && entry->Expiry != 0 &&
+        (stripe->NextExpiry == 0 || entry->Expiry < stripe->NextExpiry))
+        stripe->NextExpiry = entry->Expiry;
+
+    if (err == BID_S_CACHE_FULL && (bRetried || !BID_MCACHE_GLOBAL_LIMITS_P(mc)))
+        stripe->Rejections++;
+
+    BIDMemoryCacheUnlock(stripe);
+
+    _BIDMemoryCacheFreeList(freeList);
+    freeList = NULL;
+    json_decref(oldValue);
+    oldValue = NULL;
+
+    /* other stripes may hold entries counting against the limits */
+    if (err == BID_S_CACHE_FULL && !bRetried && BID_MCACHE_GLOBAL_LIMITS_P(mc)) {
+        _BIDMemoryCacheSweep(mc, stripe, cAdd, cbAdd);
+        bRetried = 1;
+        goto retry;
+    }
 
     BID_BAIL_ON_ERROR(err);
 
@@ -251,6 +865,11 @@ _BIDMemoryCacheSetOrRemoveObject(
     err = BID_S_OK;
 
 cleanup:
+    if (newEntry != NULL) {
+        json_decref(newEntry->Value);
+        BIDFree(newEntry);
+    }
+
     return err;
 }
 
@@ -275,6 +894,134 @@ _BIDMemoryCacheRemoveObject(
     return _BIDMemoryCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1);
 }
 
+/*
+ * Iterator over per-stripe snapshots. Each snapshot is a single allocation
+ * holding the entries followed by their keys; keys returned by the
+ * iterator remain valid until the next call.
+ */
+struct BIDMemoryCacheSnapshotEntry {
+    const char *Key;
+    json_t *Value;
+};
+
+struct BIDMemoryCacheIterator {
+    size_t Stripe;
+    size_t Index;
+    size_t cEntries;
+    struct BIDMemoryCacheSnapshotEntry *Entries;
+};
+
+static void
+_BIDMemoryCacheIteratorFreeSnapshot(struct BIDMemoryCacheIterator *iter)
+{
+    size_t i;
+
+    for (i = iter->Index; i < iter->cEntries; i++)
+        json_decref(iter->Entries[i].Value);
+
+    BIDFree(iter->Entries);
+    iter->Entries = NULL;
+    iter->cEntries = 0;
+    iter->Index = 0;
+}
+
+static BIDError
+_BIDMemoryCacheSnapshotStripe(
+    struct BIDMemoryCacheStripe *stripe,
+    struct BIDMemoryCacheIterator *iter)
+{
+    struct BIDMemoryCacheSnapshotEntry *entries = NULL;
+    size_t cEntries, cbKeys, i, j;
+    char *p;
+
+    for (;;) {
+        BIDMemoryCacheLock(stripe);
+        cEntries = stripe->cEntries;
+        cbKeys = stripe->cbKeys;
+        BIDMemoryCacheUnlock(stripe);
+
+        if (cEntries == 0)
+            return BID_S_OK;
+
+        entries = BIDMalloc(cEntries * sizeof(*entries) + cbKeys);
+        if (entries == NULL)
+            return BID_S_NO_MEMORY;
+
+        BIDMemoryCacheLock(stripe);
+        /* retry if the stripe changed size while we were allocating */
+        if (stripe->cEntries == cEntries && stripe->cbKeys == cbKeys)
+            break;
+        BIDMemoryCacheUnlock(stripe);
+
+        BIDFree(entries);
+    }
+
+    p = (char *)&entries[cEntries];
+
+    for (i = 0, j = 0; i < stripe->cBuckets; i++) {
+        struct BIDMemoryCacheEntry *entry;
+
+        for (entry = stripe->Buckets[i]; entry != NULL; entry = entry->Next) {
+            size_t cbKey = strlen(entry->Key) + 1;
+
+            memcpy(p, entry->Key, cbKey);
+            entries[j].Key = p;
+            entries[j].Value = json_incref(entry->Value);
+            p += cbKey;
+            j++;
+        }
+    }
+
+    BIDMemoryCacheUnlock(stripe);
+
+    BID_ASSERT(j == cEntries);
+
+    iter->Entries = entries;
+    iter->cEntries = cEntries;
+    iter->Index = 0;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMemoryCacheIteratorNext(
+    struct BIDMemoryCache *mc,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    struct BIDMemoryCacheIterator *iter = *cookie;
+    BIDError err = BID_S_OK;
+
+    while (iter->Index == iter->cEntries) {
+        _BIDMemoryCacheIteratorFreeSnapshot(iter);
+
+        if (iter->Stripe == BID_MCACHE_STRIPES) {
+            err = BID_S_NO_MORE_ITEMS;
+            break;
+        }
+
+        err = _BIDMemoryCacheSnapshotStripe(&mc->Stripes[iter->Stripe++], iter);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if (err == BID_S_OK) {
+        /* the reference passes to the caller */
+        *key = iter->Entries[iter->Index].Key;
+        *val = iter->Entries[iter->Index].Value;
+        iter->Index++;
+    }
+
+cleanup:
+    if (err != BID_S_OK) {
+        _BIDMemoryCacheIteratorFreeSnapshot(iter);
+        BIDFree(iter);
+        *cookie = NULL;
+    }
+
+    return err;
+}
+
 static BIDError
 _BIDMemoryCacheFirstObject(
     struct BIDCacheOps *ops BID_UNUSED,
@@ -286,29 +1033,21 @@ _BIDMemoryCacheFirstObject(
 {
     struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
     BIDError err;
-    json_t *dataCopy = NULL;
 
     *cookie = NULL;
     *key = NULL;
     *val = NULL;
 
-    if (mc == NULL) {
-        err = BID_S_INVALID_PARAMETER;
-        goto cleanup;
-    }
-
-    BIDMemoryCacheLock(mc);
-    dataCopy = json_copy(mc->Data);
-    BIDMemoryCacheUnlock(mc);
-
-    err = _BIDCacheIteratorAlloc(dataCopy, cookie);
-    BID_BAIL_ON_ERROR(err);
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
 
-    err = _BIDCacheIteratorNext(cookie, key, val);
-    BID_BAIL_ON_ERROR(err);
+    *cookie = BIDCalloc(1, sizeof(struct BIDMemoryCacheIterator));
+    if (*cookie == NULL)
+        return BID_S_NO_MEMORY;
 
-cleanup:
-    json_decref(dataCopy);
+    err = _BIDMemoryCacheIteratorNext(mc, cookie, key, val);
+    if (err == BID_S_NO_MORE_ITEMS)
+        err = BID_S_CACHE_KEY_NOT_FOUND;
 
     return err;
 }
@@ -317,21 +1056,49 @@ static BIDError
 _BIDMemoryCacheNextObject(
     struct BIDCacheOps *ops BID_UNUSED,
     BIDContext context BID_UNUSED,
-    void *cache BID_UNUSED,
+    void *cache,
     void **cookie,
     const char **key,
     json_t **val)
 {
-    BIDError err;
+    struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
 
     *key = NULL;
     *val = NULL;
 
-    err = _BIDCacheIteratorNext(cookie, key, val);
-    BID_BAIL_ON_ERROR(err);
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
 
-cleanup:
-    return err;
+    return _BIDMemoryCacheIteratorNext(mc, cookie, key, val);
+}
+
+static BIDError
+_BIDMemoryCacheGetStatistics(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    struct BIDCacheStatistics *pStats)
+{
+    struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
+    size_t i;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    for (i = 0; i < BID_MCACHE_STRIPES; i++) {
+        struct BIDMemoryCacheStripe *stripe = &mc->Stripes[i];
+
+        BIDMemoryCacheLock(stripe);
+        pStats->Entries    += stripe->cEntries;
+        pStats->Bytes      += stripe->cbSize;
+        pStats->Hits       += stripe->Hits;
+        pStats->Misses     += stripe->Misses;
+        pStats->Evictions  += stripe->Evictions;
+        pStats->Rejections += stripe->Rejections;
+        BIDMemoryCacheUnlock(stripe);
+    }
+
+    return BID_S_OK;
 }
 
 struct BIDCacheOps _BIDMemoryCache = {
@@ -347,5 +1114,5 @@ struct BIDCacheOps _BIDMemoryCache = {
     _BIDMemoryCacheRemoveObject,
     _BIDMemoryCacheFirstObject,
     _BIDMemoryCacheNextObject,
+    _BIDMemoryCacheGetStatistics,
 };
-
@@ -47,6 +47,7 @@
 #include <openssl/rand.h>
 #include <openssl/dh.h>
 #include <openssl/ecdh.h>
+#include <openssl/ecdsa.h>
 #include <openssl/hmac.h>
 #include <openssl/pem.h>
 #include <openssl/x509v3.h>
@@ -81,6 +82,80 @@ _BIDAllocSecret(
     int freeit,
     BIDSecretHandle *pSecretHandle);
 
+/*
+ * Shared, immutable group objects for the ECDH curves, with the generator
+ * multiples precomputed once at load time.
+ */
+struct BIDECGroup {
+    int Nid;
+    EC_GROUP *Group;
+};
+
+static struct BIDECGroup
+_BIDECGroups[] = {
+    { NID_X9_62_prime256v1,     NULL },
+    { NID_secp384r1,            NULL },
+    { NID_secp521r1,            NULL },
+};
+
+#define BID_EC_GROUP_COUNT                  (sizeof(_BIDECGroups) / sizeof(_BIDECGroups[0]))
+
+static void
+_BIDInitECGroups(void)
+{
+    size_t i;
+
+    for (i = 0; i < BID_EC_GROUP_COUNT; i++) {
+        EC_GROUP *group;
+
+        group = EC_GROUP_new_by_curve_name(_BIDECGroups[i].Nid);
+        if (group == NULL)
+            continue;
+
+        if (!EC_GROUP_precompute_mult(group, NULL)) {
+            EC_GROUP_free(group);
+            continue;
+        }
+
+        _BIDECGroups[i].Group = group;
+    }
+}
+
+/*
+ * Per-thread BN_CTX for point arithmetic.
+ */
+static pthread_key_t _BIDBNCtxKey;
+static int _BIDBNCtxKeyValid;
+
+static void
+_BIDFreeThreadBNCtx(void *bnCtx)
+{
+    BN_CTX_free((BN_CTX *)bnCtx);
+}
+
+static BN_CTX *
+_BIDGetThreadBNCtx(void)
+{
+    BN_CTX *bnCtx;
+
+    if (!_BIDBNCtxKeyValid)
+        return NULL;
+
+    bnCtx = pthread_getspecific(_BIDBNCtxKey);
+    if (bnCtx == NULL) {
+        bnCtx = BN_CTX_new();
+        if (bnCtx != NULL && pthread_setspecific(_BIDBNCtxKey, bnCtx) != 0) {
+            BN_CTX_free(bnCtx);
+            bnCtx = NULL;
+        }
+    }
+
+    return bnCtx;
+}
+
+static void
+_BIDInitECDHKeyPool(void);
+
 static void
 _BIDOpenSSLInit(void) __attribute__((__constructor__));
 
@@ -89,6 +164,9 @@ _BIDOpenSSLInit(void)
 {
     OpenSSL_add_all_algorithms();
     ERR_load_crypto_strings();
+    _BIDInitECGroups();
+    _BIDBNCtxKeyValid = (pthread_key_create(&_BIDBNCtxKey, _BIDFreeThreadBNCtx) == 0);
+    _BIDInitECDHKeyPool();
 }
 
 static BIDError
@@ -173,7 +251,7 @@ _BIDGetJsonECPointValue(
         goto cleanup;
     }
 
-    if (!EC_POINT_set_affine_coordinates_GFp(group, ecPoint, x, y, NULL)) {
+    if (!EC_POINT_set_affine_coordinates_GFp(group, ecPoint, x, y, _BIDGetThreadBNCtx())) {
         err = BID_S_CRYPTO_ERROR;
         goto cleanup;
     }
@@ -803,6 +881,275 @@ cleanup:
     return err;
 }
 
+static BIDError
+_BIDGetECCurveNid(
+    BIDContext context,
+    json_t *ecDhParams,
+    int *pNid);
+
+static BIDError
+_BIDMakeECKeyByNid(
+    BIDContext context,
+    int nid,
+    EC_KEY **pEcKey);
+
+static BIDError
+_BIDCertDataToX509EcKey(
+    BIDContext context,
+    json_t *x5c,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    X509 *x509;
+    EVP_PKEY *pkey;
+
+    err = _BIDCertDataToX509(context, x5c, 0, &x509);
+    if (err != BID_S_OK)
+        return err;
+
+    pkey = X509_get_pubkey(x509);
+    if (pkey == NULL || EVP_PKEY_type(pkey->type) != EVP_PKEY_EC) {
+        EVP_PKEY_free(pkey);
+        X509_free(x509);
+        return BID_S_NO_KEY;
+    }
+
+    *pEcKey = EVP_PKEY_get1_EC_KEY(pkey);
+
+    EVP_PKEY_free(pkey);
+    X509_free(x509);
+
+    return (*pEcKey != NULL) ? BID_S_OK : BID_S_NO_KEY;
+}
+
+static BIDError
+_BIDMakeJwtEcKey(
+    BIDContext context,
+    BIDJWK jwk,
+    int public,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    EC_KEY *ecKey = NULL;
+    EC_POINT *ecPoint = NULL;
+    BIGNUM *d = NULL;
+    int nid;
+
+    err = _BIDGetECCurveNid(context, jwk, &nid);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDMakeECKeyByNid(context, nid, &ecKey);
+    BID_BAIL_ON_ERROR(err);
+
+    if (public) {
+        err = _BIDGetJsonECPointValue(context, EC_KEY_get0_group(ecKey), jwk, &ecPoint);
+        BID_BAIL_ON_ERROR(err);
+
+        if (!EC_KEY_set_public_key(ecKey, ecPoint)) {
+            BID_CRYPTO_PRINT_ERRORS();
+            err = BID_S_INVALID_KEY;
+            goto cleanup;
+        }
+    } else {
+        err = _BIDGetJsonBNValue(context, jwk, "d", BID_ENCODING_BASE64_URL, &d);
+        BID_BAIL_ON_ERROR(err);
+
+        if (!EC_KEY_set_private_key(ecKey, d)) {
+            BID_CRYPTO_PRINT_ERRORS();
+            err = BID_S_INVALID_KEY;
+            goto cleanup;
+        }
+    }
+
+    err = BID_S_OK;
+    *pEcKey = ecKey;
+
+cleanup:
+    if (err != BID_S_OK)
+        EC_KEY_free(ecKey);
+    EC_POINT_free(ecPoint);
+    BN_clear_free(d);
+
+    return err;
+}
+
+static BIDError
+_BIDMakeEcKey(
+    BIDContext context,
+    BIDJWK jwk,
+    int public,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    json_t *x5c;
+
+    *pEcKey = NULL;
+
+    x5c = json_object_get(jwk, "x5c");
+    if (public && x5c != NULL)
+        err = _BIDCertDataToX509EcKey(context, x5c, pEcKey);
+    else
+        err = _BIDMakeJwtEcKey(context, jwk, public, pEcKey);
+
+    return err;
+}
+
+static BIDError
+_ECKeySize(
+    struct BIDJWTAlgorithmDesc *algorithm BID_UNUSED,
+    BIDContext context,
+    BIDJWK jwk,
+    size_t *pcbKey)
+{
+    BIDError err;
+    EC_KEY *ecKey = NULL;
+    ssize_t curve;
+
+    /* the curve is named in a JWK, but a certificate must be parsed */
+    if (_BIDGetECDHCurve(context, jwk, &curve) == BID_S_OK) {
+        *pcbKey = curve;
+        return BID_S_OK;
+    }
+
+    err = _BIDMakeEcKey(context, jwk, 1, &ecKey);
+    if (err != BID_S_OK)
+        return err;
+
+    *pcbKey = EC_GROUP_get_degree(EC_KEY_get0_group(ecKey));
+    EC_KEY_free(ecKey);
+
+    return BID_S_OK;
+}
+
+/*
+ * JWS ECDSA signatures are the concatenation of R and S, each padded to
+ * the size of the curve's field elements.
+ */
+static size_t
+_ECSignatureComponentLength(EC_KEY *ecKey)
+{
+    return (EC_GROUP_get_degree(EC_KEY_get0_group(ecKey)) + 7) / 8;
+}
+
+static BIDError
+_ECMakeSignature(
+    struct BIDJWTAlgorithmDesc *algorithm,
+    BIDContext context,
+    BIDJWT jwt,
+    BIDJWK jwk)
+{
+    BIDError err;
+    EC_KEY *ecKey = NULL;
+    ECDSA_SIG *ecSig = NULL;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    size_t digestLength = sizeof(digest);
+    size_t cbComponent, cbR, cbS;
+
+    BID_ASSERT(jwt->EncData != NULL);
+
+    err = _BIDMakeShaDigest(algorithm, context, jwt, digest, &digestLength);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDMakeEcKey(context, jwk, 0, &ecKey);
+    BID_BAIL_ON_ERROR(err);
+
+    ecSig = ECDSA_do_sign(digest, (int)digestLength, ecKey);
+    if (ecSig == NULL) {
+        BID_CRYPTO_PRINT_ERRORS();
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    cbComponent = _ECSignatureComponentLength(ecKey);
+    cbR = BN_num_bytes(ecSig->r);
+    cbS = BN_num_bytes(ecSig->s);
+
+    if (cbR > cbComponent || cbS > cbComponent) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    jwt->Signature = BIDCalloc(2, cbComponent);
+    if (jwt->Signature == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    BN_bn2bin(ecSig->r, &jwt->Signature[cbComponent - cbR]);
+    BN_bn2bin(ecSig->s, &jwt->Signature[2 * cbComponent - cbS]);
+
+    jwt->SignatureLength = 2 * cbComponent;
+
+    err = BID_S_OK;
+
+cleanup:
+    EC_KEY_free(ecKey);
+    ECDSA_SIG_free(ecSig);
+
+    return err;
+}
+
+static BIDError
+_ECVerifySignature(
+    struct BIDJWTAlgorithmDesc *algorithm,
+    BIDContext context,
+    BIDJWT jwt,
+    BIDJWK jwk,
+    int *valid)
+{
+    BIDError err;
+    EC_KEY *ecKey = NULL;
+    ECDSA_SIG *ecSig = NULL;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    size_t digestLength = sizeof(digest);
+    size_t cbComponent;
+
+    *valid = 0;
+
+    BID_ASSERT(jwt->EncData != NULL);
+
+    err = _BIDMakeEcKey(context, jwk, 1, &ecKey);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDMakeShaDigest(algorithm, context, jwt, digest, &digestLength);
+    BID_BAIL_ON_ERROR(err);
+
+    cbComponent = _ECSignatureComponentLength(ecKey);
+
+    if (jwt->SignatureLength != 2 * cbComponent) {
+        err = BID_S_INVALID_SIGNATURE;
+        goto cleanup;
+    }
+
+    ecSig = ECDSA_SIG_new();
+    if (ecSig == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    if (BN_bin2bn(&jwt->Signature[0],           (int)cbComponent, ecSig->r) == NULL ||
+        BN_bin2bn(&jwt->Signature[cbComponent], (int)cbComponent, ecSig->s) == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    *valid = ECDSA_do_verify(digest, (int)digestLength, ecSig, ecKey);
+    if (*valid < 0) {
+        BID_CRYPTO_PRINT_ERRORS();
+        *valid = 0;
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    EC_KEY_free(ecKey);
+    ECDSA_SIG_free(ecSig);
+
+    return err;
+}
+
 static BIDError
 _BIDHMACSHA(
     struct BIDJWTAlgorithmDesc *algorithm,
@@ -963,6 +1310,36 @@ _BIDJWTAlgorithms[] = {
         _RSAKeySize,
     },
 #endif
+    {
+        "ES256",
+        "ES",
+        BID_CONTEXT_ECDH_CURVE_P256,
+        NULL,
+        0,
+        _ECMakeSignature,
+        _ECVerifySignature,
+        _ECKeySize,
+    },
+    {
+        "ES384",
+        "ES",
+        BID_CONTEXT_ECDH_CURVE_P384,
+        NULL,
+        0,
+        _ECMakeSignature,
+        _ECVerifySignature,
+        _ECKeySize,
+    },
+    {
+        "ES512",
+        "ES",
+        BID_CONTEXT_ECDH_CURVE_P521,
+        NULL,
+        0,
+        _ECMakeSignature,
+        _ECVerifySignature,
+        _ECKeySize,
+    },
     {
         "RS256",
         "RSA",
@@ -1091,15 +1468,249 @@ _BIDDeriveKey(
     return BID_S_OK;
 }
 
+#define BID_SEAL_IV_LENGTH          12
+#define BID_SEAL_TAG_LENGTH         16
+
+static const EVP_CIPHER *
+_BIDGetSealCipher(size_t cbKey)
+{
+    switch (cbKey) {
+    case 16:
+        return EVP_aes_128_gcm();
+    case 32:
+        return EVP_aes_256_gcm();
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Authenticated encryption with AES-GCM. The output is IV || ciphertext || tag;
+ * the AES key size is selected by the length of the supplied key.
+ */
 BIDError
-_BIDLoadX509PrivateKey(
+_BIDSealData(
     BIDContext context BID_UNUSED,
-    const char *path,
-    const char *certPath BID_UNUSED,
-    BIDJWK *pPrivateKey)
+    const unsigned char *pbKey,
+    size_t cbKey,
+    const unsigned char *pbAad,
+    size_t cbAad,
+    const unsigned char *pbData,
+    size_t cbData,
+    unsigned char **ppbSealed,
+    size_t *pcbSealed)
 {
     BIDError err;
-    BIDJWK privateKey = NULL;
+    const EVP_CIPHER *cipher;
+    EVP_CIPHER_CTX *ctx = NULL;
+    unsigned char *pbSealed = NULL;
+    size_t cbSealed;
+    int cbOut;
+
+    *ppbSealed = NULL;
+    *pcbSealed = 0;
+
+    cipher = _BIDGetSealCipher(cbKey);
+    if (cipher == NULL)
+        return BID_S_INVALID_KEY;
+
+    cbSealed = BID_SEAL_IV_LENGTH + cbData + BID_SEAL_TAG_LENGTH;
+
+    pbSealed = BIDMalloc(cbSealed);
+    if (pbSealed == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    if (!RAND_bytes(pbSealed, BID_SEAL_IV_LENGTH)) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    if (!EVP_EncryptInit_ex(ctx, cipher, NULL, NULL, NULL) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, BID_SEAL_IV_LENGTH, NULL) ||
+        !EVP_EncryptInit_ex(ctx, NULL, NULL, pbKey, pbSealed) ||
+        (pbAad != NULL && !EVP_EncryptUpdate(ctx, NULL, &cbOut, pbAad, (int)cbAad)) ||
+        !EVP_EncryptUpdate(ctx, &pbSealed[BID_SEAL_IV_LENGTH], &cbOut, pbData, (int)cbData) ||
+        !EVP_EncryptFinal_ex(ctx, &pbSealed[BID_SEAL_IV_LENGTH + cbOut], &cbOut) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, BID_SEAL_TAG_LENGTH,
+                             &pbSealed[BID_SEAL_IV_LENGTH + cbData])) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    err = BID_S_OK;
+
+    *ppbSealed = pbSealed;
+    *pcbSealed = cbSealed;
+
+cleanup:
+    if (err != BID_S_OK)
+        BIDFree(pbSealed);
+    EVP_CIPHER_CTX_free(ctx);
+
+    return err;
+}
+
+BIDError
+_BIDUnsealData(
+    BIDContext context BID_UNUSED,
+    const unsigned char *pbKey,
+    size_t cbKey,
+    const unsigned char *pbAad,
+    size_t cbAad,
+    const unsigned char *pbSealed,
+    size_t cbSealed,
+    unsigned char **ppbData,
+    size_t *pcbData)
+{
+    BIDError err;
+    const EVP_CIPHER *cipher;
+    EVP_CIPHER_CTX *ctx = NULL;
+    unsigned char *pbData = NULL;
+    unsigned char tag[BID_SEAL_TAG_LENGTH];
+    size_t cbData;
+    int cbOut;
+
+    *ppbData = NULL;
+    *pcbData = 0;
+
+    cipher = _BIDGetSealCipher(cbKey);
+    if (cipher == NULL)
+        return BID_S_INVALID_KEY;
+
+    if (cbSealed < BID_SEAL_IV_LENGTH + BID_SEAL_TAG_LENGTH)
+        return BID_S_BUFFER_TOO_SMALL;
+
+    cbData = cbSealed - BID_SEAL_IV_LENGTH - BID_SEAL_TAG_LENGTH;
+
+    /* some versions of OpenSSL take a non-const tag */
+    memcpy(tag, &pbSealed[cbSealed - BID_SEAL_TAG_LENGTH], sizeof(tag));
+
+    pbData = BIDMalloc(cbData + 1);
+    if (pbData == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    if (!EVP_DecryptInit_ex(ctx, cipher, NULL, NULL, NULL) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, BID_SEAL_IV_LENGTH, NULL) ||
+        !EVP_DecryptInit_ex(ctx, NULL, NULL, pbKey, pbSealed) ||
+        (pbAad != NULL && !EVP_DecryptUpdate(ctx, NULL, &cbOut, pbAad, (int)cbAad)) ||
+        !EVP_DecryptUpdate(ctx, pbData, &cbOut, &pbSealed[BID_SEAL_IV_LENGTH], (int)cbData) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, BID_SEAL_TAG_LENGTH, tag)) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    if (!EVP_DecryptFinal_ex(ctx, &pbData[cbOut], &cbOut)) {
+        err = BID_S_INVALID_SIGNATURE;
+        goto cleanup;
+    }
+
+    pbData[cbData] = '\0';
+
+    err = BID_S_OK;
+
+    *ppbData = pbData;
+    *pcbData = cbData;
+
+cleanup:
+    if (err != BID_S_OK) {
+        if (pbData != NULL) {
+            memset(pbData, 0, cbData);
+            BIDFree(pbData);
+        }
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    return err;
+}
+
+/*
+ * Set the JWK members of an EC key, including the private key "d".
+ */
+static BIDError
+_BIDSetJsonECKey(
+    BIDContext context,
+    BIDJWK jwk,
+    EC_KEY *ecKey)
+{
+    BIDError err;
+    const EC_GROUP *group = EC_KEY_get0_group(ecKey);
+    const char *szCurve;
+    BIGNUM *x = NULL, *y = NULL;
+
+    switch (EC_GROUP_get_curve_name(group)) {
+    case NID_X9_62_prime256v1:
+        szCurve = BID_ECDH_CURVE_P256;
+        break;
+    case NID_secp384r1:
+        szCurve = BID_ECDH_CURVE_P384;
+        break;
+    case NID_secp521r1:
+        szCurve = BID_ECDH_CURVE_P521;
+        break;
+    default:
+        return BID_S_UNKNOWN_EC_CURVE;
+    }
+
+    err = _BIDJsonObjectSet(context, jwk, "kty", json_string("EC"), BID_JSON_FLAG_CONSUME_REF);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDJsonObjectSet(context, jwk, "crv", json_string(szCurve), BID_JSON_FLAG_CONSUME_REF);
+    BID_BAIL_ON_ERROR(err);
+
+    x = BN_new();
+    y = BN_new();
+    if (x == NULL || y == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    if (!EC_POINT_get_affine_coordinates_GFp(group, EC_KEY_get0_public_key(ecKey),
+                                             x, y, _BIDGetThreadBNCtx())) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    err = _BIDSetJsonBNValue(context, jwk, "x", x);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetJsonBNValue(context, jwk, "y", y);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetJsonBNValue(context, jwk, "d", EC_KEY_get0_private_key(ecKey));
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    BN_free(x);
+    BN_free(y);
+
+    return err;
+}
+
+BIDError
+_BIDLoadX509PrivateKey(
+    BIDContext context BID_UNUSED,
+    const char *path,
+    const char *certPath BID_UNUSED,
+    BIDJWK *pPrivateKey)
+{
+    BIDError err;
+    BIDJWK privateKey = NULL;
     FILE *fp = NULL;
     EVP_PKEY *pemKey = NULL;
 
@@ -1165,6 +1776,14 @@ _BIDLoadX509PrivateKey(
         err = _BIDSetJsonBNValue(context, privateKey, "x", pemKey->pkey.dsa->priv_key);
         BID_BAIL_ON_ERROR(err);
 
+        break;
+    case EVP_PKEY_EC:
+        err = _BIDJsonObjectSet(context, privateKey, "algorithm", json_string("ES"), BID_JSON_FLAG_CONSUME_REF);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDSetJsonECKey(context, privateKey, pemKey->pkey.ec);
+        BID_BAIL_ON_ERROR(err);
+
         break;
     default:
         err = BID_S_UNKNOWN_ALGORITHM;
@@ -1731,45 +2350,356 @@ _BIDImportSecretKeyData(
 }
 
 static BIDError
-_BIDMakeECKeyByCurve(
-    BIDContext context BID_UNUSED,
+_BIDGetECCurveNid(
+    BIDContext context,
     json_t *ecDhParams,
-    EC_KEY **pEcKey)
+    int *pNid)
 {
     BIDError err;
-    EC_KEY *ecKey = NULL;
     ssize_t curve = 0;
-    int nid = 0;
+
+    *pNid = 0;
 
     err = _BIDGetECDHCurve(context, ecDhParams, &curve);
-    BID_BAIL_ON_ERROR(err);
+    if (err != BID_S_OK)
+        return err;
 
     switch (curve) {
     case BID_CONTEXT_ECDH_CURVE_P256:
-        nid = NID_X9_62_prime256v1;
+        *pNid = NID_X9_62_prime256v1;
         break;
     case BID_CONTEXT_ECDH_CURVE_P384:
-        nid = NID_secp384r1;
+        *pNid = NID_secp384r1;
         break;
     case BID_CONTEXT_ECDH_CURVE_P521:
-        nid = NID_secp521r1;
+        *pNid = NID_secp521r1;
         break;
     default:
-        err = BID_S_UNKNOWN_EC_CURVE;
-        goto cleanup;
-        break;
+        return BID_S_UNKNOWN_EC_CURVE;
     }
 
-    ecKey = EC_KEY_new_by_curve_name(nid);
-    if (ecKey == NULL) {
-        err = BID_S_CRYPTO_ERROR;
-        goto cleanup;
+    return BID_S_OK;
+}
+
+static const EC_GROUP *
+_BIDGetECGroupByNid(int nid)
+{
+    size_t i;
+
+    for (i = 0; i < BID_EC_GROUP_COUNT; i++) {
+        if (_BIDECGroups[i].Nid == nid)
+            return _BIDECGroups[i].Group;
     }
 
-    err = BID_S_OK;
+    return NULL;
+}
+
+static BIDError
+_BIDMakeECKeyByNid(
+    BIDContext context BID_UNUSED,
+    int nid,
+    EC_KEY **pEcKey)
+{
+    EC_KEY *ecKey;
+    const EC_GROUP *group;
+
+    *pEcKey = NULL;
+
+    group = _BIDGetECGroupByNid(nid);
+    if (group != NULL) {
+        /* the key's copy of the group shares the precomputed multiples */
+        ecKey = EC_KEY_new();
+        if (ecKey != NULL && !EC_KEY_set_group(ecKey, group)) {
+            EC_KEY_free(ecKey);
+            ecKey = NULL;
+        }
+    } else {
+        ecKey = EC_KEY_new_by_curve_name(nid);
+    }
+    if (ecKey == NULL)
+        return BID_S_CRYPTO_ERROR;
+
     *pEcKey = ecKey;
 
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMakeECKeyByCurve(
+    BIDContext context,
+    json_t *ecDhParams,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    int nid;
+
+    *pEcKey = NULL;
+
+    err = _BIDGetECCurveNid(context, ecDhParams, &nid);
+    if (err != BID_S_OK)
+        return err;
+
+    return _BIDMakeECKeyByNid(context, nid, pEcKey);
+}
+
+static BIDError
+_BIDGenerateECKeyByNid(
+    BIDContext context,
+    int nid,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    EC_KEY *ecKey = NULL;
+
+    *pEcKey = NULL;
+
+    err = _BIDMakeECKeyByNid(context, nid, &ecKey);
+    if (err != BID_S_OK)
+        return err;
+
+    if (!EC_KEY_generate_key(ecKey)) {
+        EC_KEY_free(ecKey);
+        return BID_S_DH_KEY_GENERATION_FAILURE;
+    }
+
+    *pEcKey = ecKey;
+
+    return BID_S_OK;
+}
+
+/*
+ * Pool of pre-generated ECDH ephemeral keys.
+ *
+ * Each curve has a stack of keys from which _BIDGenerateECDHKey pops;
+ * a popped key is owned by the caller and never returned to the pool,
+ * so every key is used exactly once. Refill threads top up any pool
+ * that has been drawn from since the pool was configured; an empty
+ * pool falls back to generating a key inline.
+ */
+#define BID_ECDH_KEY_POOL_MAX_SIZE          1024
+#define BID_ECDH_KEY_POOL_MAX_THREADS       16
+
+struct BIDECDHKeyPool {
+    int Nid;
+    int Active;                 /* a key has been requested */
+    size_t cPending;            /* keys being generated */
+    size_t cKeys;
+    EC_KEY **rgKeys;
+};
+
+static struct BIDECDHKeyPool
+_BIDECDHKeyPools[] = {
+    { NID_X9_62_prime256v1,     0, 0, 0, NULL },
+    { NID_secp384r1,            0, 0, 0, NULL },
+    { NID_secp521r1,            0, 0, 0, NULL },
+};
+
+#define BID_ECDH_KEY_POOL_COUNT             (sizeof(_BIDECDHKeyPools) / sizeof(_BIDECDHKeyPools[0]))
+
+static BID_MUTEX _BIDECDHKeyPoolMutex;
+static pthread_cond_t _BIDECDHKeyPoolCond;
+static size_t _BIDECDHKeyPoolSize;          /* zero if pool disabled */
+static uint32_t _BIDECDHKeyPoolThreads;     /* running refill threads */
+
+static struct BIDECDHKeyPool *
+_BIDFindECDHKeyPool(int nid)
+{
+    size_t i;
+
+    for (i = 0; i < BID_ECDH_KEY_POOL_COUNT; i++) {
+        if (_BIDECDHKeyPools[i].Nid == nid)
+            return &_BIDECDHKeyPools[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Called with _BIDECDHKeyPoolMutex held.
+ */
+static struct BIDECDHKeyPool *
+_BIDNextECDHKeyPoolToRefill(void)
+{
+    size_t i;
+
+    for (i = 0; i < BID_ECDH_KEY_POOL_COUNT; i++) {
+        struct BIDECDHKeyPool *pool = &_BIDECDHKeyPools[i];
+
+        if (pool->Active && pool->cKeys + pool->cPending < _BIDECDHKeyPoolSize)
+            return pool;
+    }
+
+    return NULL;
+}
+
+static void *
+_BIDECDHKeyPoolRefillThread(void *arg BID_UNUSED)
+{
+    BID_MUTEX_LOCK(&_BIDECDHKeyPoolMutex);
+
+    for (;;) {
+        struct BIDECDHKeyPool *pool;
+        EC_KEY *ecKey = NULL;
+        BIDError err;
+
+        pool = _BIDNextECDHKeyPoolToRefill();
+        if (pool == NULL) {
+            pthread_cond_wait(&_BIDECDHKeyPoolCond, &_BIDECDHKeyPoolMutex);
+            continue;
+        }
+
+        pool->cPending++;
+        BID_MUTEX_UNLOCK(&_BIDECDHKeyPoolMutex);
+
+        err = _BIDGenerateECKeyByNid(BID_C_NO_CONTEXT, pool->Nid, &ecKey);
+
+        BID_MUTEX_LOCK(&_BIDECDHKeyPoolMutex);
+        pool->cPending--;
+
+        if (err != BID_S_OK) {
+            /* wait for the next request rather than spinning */
+            pool->Active = 0;
+        } else if (pool->rgKeys != NULL && pool->cKeys < _BIDECDHKeyPoolSize) {
+            pool->rgKeys[pool->cKeys++] = ecKey;
+        } else {
+            EC_KEY_free(ecKey);
+        }
+    }
+
+    /* NOTREACHED */
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPoolMutex);
+
+    return NULL;
+}
+
+/*
+ * Remove a key from the pool for the given curve, or return NULL if the
+ * pool is disabled or empty.
+ */
+static EC_KEY *
+_BIDAcquirePooledECDHKey(int nid)
+{
+    struct BIDECDHKeyPool *pool;
+    EC_KEY *ecKey = NULL;
+
+    BID_MUTEX_LOCK(&_BIDECDHKeyPoolMutex);
+
+    pool = _BIDFindECDHKeyPool(nid);
+    if (pool != NULL && pool->rgKeys != NULL) {
+        if (pool->cKeys != 0) {
+            ecKey = pool->rgKeys[--pool->cKeys];
+            pool->rgKeys[pool->cKeys] = NULL;
+        }
+
+        pool->Active = 1;
+        pthread_cond_signal(&_BIDECDHKeyPoolCond);
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPoolMutex);
+
+    return ecKey;
+}
+
+/*
+ * A forked child must not hand out keys its parent may also use, and it
+ * has no refill threads, so discard the pool and start again.
+ */
+static void
+_BIDECDHKeyPoolAtForkChild(void)
+{
+    size_t i, j;
+
+    BID_MUTEX_INIT(&_BIDECDHKeyPoolMutex);
+    pthread_cond_init(&_BIDECDHKeyPoolCond, NULL);
+
+    for (i = 0; i < BID_ECDH_KEY_POOL_COUNT; i++) {
+        struct BIDECDHKeyPool *pool = &_BIDECDHKeyPools[i];
+
+        for (j = 0; j < pool->cKeys; j++) {
+            EC_KEY_free(pool->rgKeys[j]);
+            pool->rgKeys[j] = NULL;
+        }
+
+        pool->Active = 0;
+        pool->cPending = 0;
+        pool->cKeys = 0;
+    }
+
+    _BIDECDHKeyPoolThreads = 0;
+}
+
+static void
+_BIDInitECDHKeyPool(void)
+{
+    BID_MUTEX_INIT(&_BIDECDHKeyPoolMutex);
+    pthread_cond_init(&_BIDECDHKeyPoolCond, NULL);
+    pthread_atfork(NULL, NULL, _BIDECDHKeyPoolAtForkChild);
+}
+
+/*
+ * The pool is sized by the first context that enables it; subsequent
+ * contexts may only add refill threads.
+ */
+BIDError
+_BIDConfigureECDHKeyPool(
+    BIDContext context BID_UNUSED,
+    uint32_t ulPoolSize,
+    uint32_t ulThreads)
+{
+    BIDError err = BID_S_OK;
+    size_t i;
+
+    if (ulPoolSize > BID_ECDH_KEY_POOL_MAX_SIZE)
+        ulPoolSize = BID_ECDH_KEY_POOL_MAX_SIZE;
+    if (ulThreads > BID_ECDH_KEY_POOL_MAX_THREADS)
+        ulThreads = BID_ECDH_KEY_POOL_MAX_THREADS;
+
+    if (ulPoolSize == 0 || ulThreads == 0)
+        return BID_S_OK;
+
+    BID_MUTEX_LOCK(&_BIDECDHKeyPoolMutex);
+
+    if (_BIDECDHKeyPoolSize == 0) {
+        for (i = 0; i < BID_ECDH_KEY_POOL_COUNT; i++) {
+            _BIDECDHKeyPools[i].rgKeys = BIDCalloc(ulPoolSize, sizeof(EC_KEY *));
+            if (_BIDECDHKeyPools[i].rgKeys == NULL) {
+                err = BID_S_NO_MEMORY;
+                break;
+            }
+        }
+
+        if (err != BID_S_OK) {
+            for (i = 0; i < BID_ECDH_KEY_POOL_COUNT; i++) {
+                BIDFree(_BIDECDHKeyPools[i].rgKeys);
+                _BIDECDHKeyPools[i].rgKeys = NULL;
+            }
+            goto cleanup;
+        }
+
+        _BIDECDHKeyPoolSize = ulPoolSize;
+    }
+
+    while (_BIDECDHKeyPoolThreads < ulThreads) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        int ret;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = pthread_create(&thread, &attr, _BIDECDHKeyPoolRefillThread, NULL);
+        pthread_attr_destroy(&attr);
+
+        if (ret != 0) {
+            err = BID_S_CRYPTO_ERROR;
+            break;
+        }
+
+        _BIDECDHKeyPoolThreads++;
+    }
+
 cleanup:
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPoolMutex);
+
     return err;
 }
 
@@ -1786,22 +2716,24 @@ _BIDGenerateECDHKey(
     BIGNUM *x = NULL, *y = NULL;
     const EC_GROUP *group = NULL;
     const EC_POINT *publicKey = NULL;
+    int nid;
 
     err = _BIDAllocJsonObject(context, &ecDhKey);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDMakeECKeyByCurve(context, ecDhParams, &ec);
+    err = _BIDGetECCurveNid(context, ecDhParams, &nid);
     BID_BAIL_ON_ERROR(err);
 
-    if (!EC_KEY_generate_key(ec)) {
-        err = BID_S_DH_KEY_GENERATION_FAILURE;
-        goto cleanup;
+    ec = _BIDAcquirePooledECDHKey(nid);
+    if (ec == NULL) {
+        err = _BIDGenerateECKeyByNid(context, nid, &ec);
+        BID_BAIL_ON_ERROR(err);
     }
 
     err = _BIDJsonObjectSet(context, ecDhKey, "params", ecDhParams, BID_JSON_FLAG_REQUIRED);
     BID_BAIL_ON_ERROR(err);
 
-    bnCtx = BN_CTX_new();
+    bnCtx = _BIDGetThreadBNCtx();
     if (bnCtx == NULL) {
         err = BID_S_CRYPTO_ERROR;
         goto cleanup;
@@ -1842,7 +2774,6 @@ cleanup:
     }
     BN_free(x);
     BN_free(y);
-    BN_CTX_free(bnCtx);
     EC_KEY_free(ec);
 
     return err;
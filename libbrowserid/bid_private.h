@@ -52,6 +52,7 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#include <stddef.h>
 #ifdef HAVE_STDARG_H
 #include <stdarg.h>
 #endif
@@ -182,6 +183,20 @@ _BIDBase64UrlDecode(const char *str, unsigned char **pData, size_t *cbData);
  */
 #define BID_CACHE_FLAG_UNVERSIONED              0x00000001
 #define BID_CACHE_FLAG_READONLY                 0x00000002
+#define BID_CACHE_FLAG_READ_MOSTLY              0x00000004
+#define BID_CACHE_FLAG_NO_EVICT                 0x00000008  /* keep unexpired entries */
+
+#define BID_CACHE_DEFAULT_SHARDS                16
+#define BID_CACHE_MAX_SHARDS                    256
+
+struct BIDCacheStatistics {
+    uint64_t Entries;
+    uint64_t Bytes;
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t Evictions;
+    uint64_t Rejections;
+};
 
 struct BIDCacheOps {
     const char *Scheme;
@@ -201,6 +216,8 @@ struct BIDCacheOps {
 
     BIDError (*FirstObject)(struct BIDCacheOps *, BIDContext, void *, void **, const char **, json_t **val);
     BIDError (*NextObject)(struct BIDCacheOps *, BIDContext, void *, void **, const char **, json_t **val);
+
+    BIDError (*GetStatistics)(struct BIDCacheOps *, BIDContext, void *, struct BIDCacheStatistics *);
 };
 
 void
@@ -234,6 +251,11 @@ _BIDGetCacheName(
     BIDCache cache,
     const char **pszName);
 
+int
+_BIDIsFileCacheP(
+    BIDContext context,
+    BIDCache cache);
+
 BIDError
 _BIDGetCacheObject(
     BIDContext context,
@@ -270,6 +292,12 @@ _BIDGetCacheLastChangedTime(
     BIDCache cache,
     time_t *ptLastChanged);
 
+BIDError
+_BIDGetCacheStatistics(
+    BIDContext context,
+    BIDCache cache,
+    struct BIDCacheStatistics *pStats);
+
 BIDError
 _BIDGetFirstCacheObject(
     BIDContext context,
@@ -323,6 +351,21 @@ BIDError
 _BIDAcquireCacheForUser(
     BIDContext context,
     const char *szTemplate,
+    uint32_t ulFlags,
+    BIDCache *pCache);
+
+BIDError
+_BIDAcquireDefaultCache(
+    BIDContext context,
+    const char *szConfiguredName,
+    const char *szTemplate,
+    uint32_t ulFlags,
+    BIDCache *pCache);
+
+BIDError
+_BIDGetSharedCache(
+    BIDContext context,
+    const char *szCacheName,
     BIDCache *pCache);
 
 /*
@@ -346,13 +389,44 @@ struct BIDAcquireContextArgsDesc {
 
 #define BID_ACQUIRE_CONTEXT_ARGS_VERSION        1
 
+/*
+ * Configuration values, parsed and validated when the configuration
+ * cache is set so that they can be read directly at run time
+ */
+struct BIDConfigDesc {
+    uint32_t MaxClockSkew;
+    uint32_t MaxDelegations;
+    uint32_t MaxTicketAge;
+    uint32_t MaxRenewAge;
+    uint32_t TicketKeyLifetime;
+    uint32_t ReplayFilterSize;
+    uint32_t ReplayCacheShards;
+    uint32_t CacheShards;
+    uint32_t ECDHKeyPoolSize;
+    uint32_t ECDHKeyPoolThreads;
+    uint32_t FileCacheSync;
+    uint32_t FileCacheWindow;
+    uint32_t MemoryCacheMaxEntries;
+    uint32_t MemoryCacheMaxBytes;
+    char **SecondaryAuthorities;
+    char *VerifierUrl;
+    char *AuthorityCache;
+    char *ReplayCache;
+    char *TicketCache;
+    char *TicketKeyCache;
+    char *Certificate;
+    char *PrivateKey;
+    char *CACertificate;
+    char *CADirectory;
+    json_t *CAParams;                   /* ca-certificate and ca-directory */
+};
+
 struct BIDContextDesc {
 #ifdef __APPLE__
     CFRuntimeBase Base;
 #endif
     uint32_t ContextOptions;
-    char **SecondaryAuthorities;
-    json_error_t JsonError;
+    uint32_t Frozen;
     char *VerifierUrl;
     uint32_t MaxDelegations;
     uint32_t Skew;
@@ -362,7 +436,11 @@ struct BIDContextDesc {
     uint32_t ECDHCurve;
     uint32_t TicketLifetime;
     uint32_t RenewLifetime;
+    uint32_t ReplayFilterSize;
+    BIDCache TicketKeyCache;
+    uint32_t TicketKeyLifetime;
     BIDCache Config;
+    struct BIDConfigDesc ConfigParams;
     void *ParentWindow;
 };
 
@@ -370,6 +448,10 @@ void
 _BIDFinalizeContext(
     BIDContext context);
 
+json_error_t *
+_BIDJsonError(
+    BIDContext context);
+
 /*
  * bid_crypto.c
  */
@@ -491,12 +573,60 @@ _BIDVerifyDigest(
 int
 _BIDTimingSafeCompare(const void *b1, const void *b2, size_t n);
 
+/*
+ * bid_dcache.c
+ */
+
+/*
+ * Cache daemon protocol. Each message is framed by a 32-bit length; all
+ * integers are in network byte order and the client may pipeline requests.
+ *
+ * Request:  length | op (8) | store length (8) | store | key length (16) | key | value
+ * Response: length | status (32) | payload
+ *
+ * Values and GET/ITERATE payloads are compact JSON text. The key of an
+ * ITERATE request is a cursor, empty for the first page; the payload is
+ * {"d": entries, "next": cursor}, where "next" is absent on the last
+ * page. The LAST_CHANGED payload is a 64-bit timestamp.
+ */
+#define BID_CACHE_DAEMON_SOCKET             "/var/run/bidcached.sock"
+
+#define BID_CACHE_DAEMON_OP_GET             1
+#define BID_CACHE_DAEMON_OP_SET             2
+#define BID_CACHE_DAEMON_OP_REMOVE          3
+#define BID_CACHE_DAEMON_OP_ITERATE         4
+#define BID_CACHE_DAEMON_OP_LAST_CHANGED    5
+#define BID_CACHE_DAEMON_OP_DESTROY         6
+#define BID_CACHE_DAEMON_OP_AUTH            7       /* peer handshake, see bidcached.c */
+
+#define BID_CACHE_DAEMON_OP_FLAG_REPLICA    0x80    /* from peer, do not forward */
+
+#define BID_CACHE_DAEMON_MAX_MESSAGE        (16 * 1024 * 1024)
+#define BID_CACHE_DAEMON_TIMEOUT            5000    /* milliseconds, > bidcached -ack-timeout */
+
+extern struct BIDCacheOps _BIDDaemonCache;
+
 /*
  * bid_fcache.c
  */
 
 extern struct BIDCacheOps _BIDFileCache;
 
+#define BID_FCACHE_SYNC_NONE                0   /* no fsync() */
+#define BID_FCACHE_SYNC_BATCH               1   /* fsync() once per batch */
+#define BID_FCACHE_SYNC_WRITE               2   /* fsync() every update, no batching */
+
+#define BID_FCACHE_FORMAT_JSON              1
+#define BID_FCACHE_FORMAT_BINARY            2
+
+#define BID_FCACHE_DIGEST_KEY_LENGTH        43  /* base64url SHA-256, unpadded */
+
+BIDError
+_BIDConvertFileCache(
+    BIDContext context,
+    const char *szCacheName,
+    uint32_t ulFormat);
+
 /*
  * bid_identity.c
  */
@@ -643,6 +773,37 @@ _BIDDeriveKey(
     unsigned char **ppbDerivedKey,
     size_t *pcbDerivedKey);
 
+/*
+ * Authenticated encryption of pbData under a 128 or 256-bit key. The
+ * sealed output includes a random IV and authentication tag.
+ */
+BIDError
+_BIDSealData(
+    BIDContext context,
+    const unsigned char *pbKey,
+    size_t cbKey,
+    const unsigned char *pbAad,
+    size_t cbAad,
+    const unsigned char *pbData,
+    size_t cbData,
+    unsigned char **ppbSealed,
+    size_t *pcbSealed);
+
+/*
+ * Reverse _BIDSealData. The output is NUL terminated for convenience.
+ */
+BIDError
+_BIDUnsealData(
+    BIDContext context,
+    const unsigned char *pbKey,
+    size_t cbKey,
+    const unsigned char *pbAad,
+    size_t cbAad,
+    const unsigned char *pbSealed,
+    size_t cbSealed,
+    unsigned char **ppbData,
+    size_t *pcbData);
+
 BIDError
 _BIDLoadX509PrivateKey(
     BIDContext context,
@@ -686,6 +847,12 @@ _BIDGenerateECDHKey(
     json_t *ecDhParams,
     BIDJWK *pEcDhKey);
 
+BIDError
+_BIDConfigureECDHKeyPool(
+    BIDContext context,
+    uint32_t ulPoolSize,
+    uint32_t ulThreads);
+
 /*
  * bid_ppal.c
  */
@@ -697,6 +864,14 @@ _BIDGenerateECDHKey(
 #define BID_MUTEX_DESTROY(m)         pthread_mutex_destroy((m))
 #define BID_MUTEX_LOCK(m)            pthread_mutex_lock((m))
 #define BID_MUTEX_UNLOCK(m)          pthread_mutex_unlock((m))
+
+#define BID_THREAD_ONCE              pthread_once_t
+#define BID_ONCE_CALLBACK(cb)        void cb(void)
+#define BID_ONCE(o, i)               pthread_once((o), (i))
+#define BID_ONCE_INITIALIZER         PTHREAD_ONCE_INIT
+#define BID_ONCE_LEAVE               do { } while (0)
+
+#define BID_THREAD_LOCAL             __thread
 #endif /* !WIN32 */
 
 BIDError
@@ -746,13 +921,19 @@ _BIDVerifyReauthAssertion(
     BIDBackedAssertion assertion,
     time_t verificationTime,
     BIDIdentity *pVerifiedIdentity,
-    BIDJWK *pVerifierCred,
     uint32_t *pulRetFlags);
 
 BIDError
 _BIDAcquireDefaultTicketCache(
     BIDContext context);
 
+BIDError
+_BIDSealReauthTicket(
+    BIDContext context,
+    json_t *cred,
+    time_t currentTime,
+    json_t **pTid);
+
 BIDError
 _BIDDeriveAuthenticatorRootKey(
     BIDContext context,
@@ -786,6 +967,14 @@ _BIDVerifyRemote(
     BIDIdentity *pVerifiedIdentity,
     uint32_t *pulRetFlags);
 
+#ifndef WIN32
+/*
+ * bid_scache.c
+ */
+
+extern struct BIDCacheOps _BIDShardedCache;
+#endif
+
 /*
  * bid_util.c
  */
@@ -982,6 +1171,9 @@ _BIDJsonUInt32Value(json_t *object);
 const char *
 _BIDJsonStringValue(json_t *object);
 
+uint32_t
+_BIDFnv1a(const void *pv, size_t cb);
+
 
 /*
  * bid_rcache.c
@@ -990,6 +1182,13 @@ BIDError
 _BIDAcquireDefaultReplayCache(
     BIDContext context);
 
+BIDError
+_BIDGetReplayCacheObject(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    const char *szKey,
+    json_t **pValue);
+
 BIDError
 _BIDCheckReplayCache(
     BIDContext context,
@@ -1149,6 +1348,14 @@ _BIDRunModalSession(
 #define BID_MUTEX_LOCK(m)            EnterCriticalSection((m))
 #define BID_MUTEX_UNLOCK(m)          LeaveCriticalSection((m))
 
+#define BID_THREAD_ONCE              INIT_ONCE
+#define BID_ONCE_CALLBACK(cb)        BOOL CALLBACK cb(PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+#define BID_ONCE(o, i)               InitOnceExecuteOnce((o), (i), NULL, NULL)
+#define BID_ONCE_INITIALIZER         INIT_ONCE_STATIC_INIT
+#define BID_ONCE_LEAVE               do { return TRUE; } while (0)
+
+#define BID_THREAD_LOCAL             __declspec(thread)
+
 BIDError
 _BIDTimeToSecondsSince1970(
     BIDContext context BID_UNUSED,
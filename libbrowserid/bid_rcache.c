@@ -39,10 +39,534 @@
 
 #include "bid_private.h"
 
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+static int
+_BIDShouldPurgeReplayCacheEntryP(BIDContext, BIDCache, const char *, json_t *, void *);
+
+#ifndef WIN32
+struct BIDMigrateReplayCacheArgsDesc {
+    time_t CurrentTime;
+    BIDCache Cache;
+};
+
+static BIDError
+_BIDMigrateReplayCacheEntry(
+    BIDContext context,
+    BIDCache cache,
+    const char *szKey,
+    json_t *j,
+    void *data)
+{
+    struct BIDMigrateReplayCacheArgsDesc *args = data;
+
+    if (_BIDShouldPurgeReplayCacheEntryP(context, cache, szKey, j, &args->CurrentTime))
+        return BID_S_OK;
+
+    return _BIDSetCacheObject(context, args->Cache, szKey, j);
+}
+
+/*
+ * Before the unsharded cache is migrated, a tombstone naming the shard
+ * count is left beside it. A context that acquired the unsharded cache
+ * earlier (or that has sharding disabled) then writes to the shards and
+ * looks there for entries it cannot find in the unsharded cache, so that
+ * no entry is lost when the unsharded cache is removed.
+ */
+#define BID_REPLAY_TOMBSTONE_SUFFIX         ".shards"
+
+static void
+_BIDShardedReplayCacheName(
+    const char *szName,
+    uint32_t cShards,
+    char *szShardedName,
+    size_t cchShardedName)
+{
+    snprintf(szShardedName, cchShardedName, "shard:%u:file:%s", cShards, szName);
+}
+
+static BIDError
+_BIDReadReplayCacheTombstone(
+    const char *szName,
+    uint32_t *pcShards)
+{
+    char szPath[PATH_MAX], szShards[16];
+    unsigned long cShards;
+    char *p;
+    int fd;
+    ssize_t cch;
+
+    *pcShards = 0;
+
+    snprintf(szPath, sizeof(szPath), "%s%s", szName, BID_REPLAY_TOMBSTONE_SUFFIX);
+
+    fd = open(szPath, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? BID_S_CACHE_NOT_FOUND : BID_S_CACHE_READ_ERROR;
+
+    cch = read(fd, szShards, sizeof(szShards) - 1);
+    close(fd);
+
+    if (cch <= 0)
+        return BID_S_CACHE_READ_ERROR;
+
+    szShards[cch] = '\0';
+    cShards = strtoul(szShards, &p, 10);
+    if (p == szShards || cShards < 2 || cShards > UINT32_MAX)
+        return BID_S_CACHE_READ_ERROR;
+
+    *pcShards = (uint32_t)cShards;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDWriteReplayCacheTombstone(
+    const char *szName,
+    uint32_t cShards)
+{
+    BIDError err = BID_S_OK;
+    char szPath[PATH_MAX], szTmpPath[PATH_MAX], szShards[16];
+    uint32_t cOldShards;
+    int fd, cch;
+
+    if (_BIDReadReplayCacheTombstone(szName, &cOldShards) == BID_S_OK &&
+        cOldShards == cShards)
+        return BID_S_OK;
+
+    snprintf(szPath, sizeof(szPath), "%s%s", szName, BID_REPLAY_TOMBSTONE_SUFFIX);
+    snprintf(szTmpPath, sizeof(szTmpPath), "%s.XXXXXX", szPath);
+    cch = snprintf(szShards, sizeof(szShards), "%u\n", cShards);
+
+    fd = mkstemp(szTmpPath);
+    if (fd < 0)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    if (write(fd, szShards, cch) != cch)
+        err = BID_S_CACHE_WRITE_ERROR;
+    if (close(fd) != 0 && err == BID_S_OK)
+        err = BID_S_CACHE_WRITE_ERROR;
+    if (err == BID_S_OK && rename(szTmpPath, szPath) != 0)
+        err = BID_S_CACHE_WRITE_ERROR;
+    if (err != BID_S_OK)
+        unlink(szTmpPath);
+
+    return err;
+}
+
+/*
+ * Returns the shards that replaced replayCache, or NULL if it is not the
+ * default unsharded file cache or has not been migrated.
+ */
+static BIDError
+_BIDAcquireReplayCacheShards(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    BIDCache *pShards)
+{
+    BIDError err;
+    const char *szName = NULL;
+    char szShardedName[PATH_MAX];
+    uint32_t cShards;
+
+    *pShards = NULL;
+
+    if (replayCache != context->ReplayCache ||
+        context->ConfigParams.ReplayCache != NULL ||
+        context->ConfigParams.ReplayCacheShards > 1 ||
+        !_BIDIsFileCacheP(context, replayCache))
+        return BID_S_OK;
+
+    err = _BIDGetCacheName(context, replayCache, &szName);
+    if (err != BID_S_OK)
+        return err;
+
+    err = _BIDReadReplayCacheTombstone(szName, &cShards);
+    if (err == BID_S_CACHE_NOT_FOUND)
+        return BID_S_OK;
+    else if (err != BID_S_OK)
+        return err;
+
+    _BIDShardedReplayCacheName(szName, cShards, szShardedName, sizeof(szShardedName));
+
+    return _BIDAcquireCache(context, szShardedName, BID_CACHE_FLAG_NO_EVICT, pShards);
+}
+
+/*
+ * Copy the unexpired entries of a replay cache written before sharding
+ * was enabled into the shards, then remove it. Once the tombstone is in
+ * place the shards are authoritative; if copying or removal fails, the
+ * entries are simply copied again next time.
+ */
+static BIDError
+_BIDMigrateReplayCache(
+    BIDContext context,
+    BIDCache oldCache,
+    BIDCache newCache)
+{
+    BIDError err;
+    const char *szName = NULL;
+    struct BIDMigrateReplayCacheArgsDesc args;
+
+    err = _BIDGetCacheName(context, oldCache, &szName);
+    if (err != BID_S_OK)
+        return err;
+
+    err = _BIDWriteReplayCacheTombstone(szName, context->ConfigParams.ReplayCacheShards);
+    if (err != BID_S_OK)
+        return err;
+
+    args.CurrentTime = time(NULL);
+    args.Cache = newCache;
+
+    err = _BIDPerformCacheObjects(context, oldCache, _BIDMigrateReplayCacheEntry, &args);
+    if (err == BID_S_OK || err == BID_S_CACHE_KEY_NOT_FOUND)
+        _BIDDestroyCache(context, oldCache);
+
+    return BID_S_OK;
+}
+#endif /* !WIN32 */
+
+/*
+ * Look up an entry in a replay cache, and then in the shards that have
+ * replaced it.
+ */
+static BIDError
+_BIDGetReplayCacheEntry(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    BIDCache shards,
+    const char *szKey,
+    json_t **pValue)
+{
+    BIDError err;
+
+    err = _BIDGetCacheObject(context, replayCache, szKey, pValue);
+    if (err != BID_S_OK && shards != NULL)
+        err = _BIDGetCacheObject(context, shards, szKey, pValue);
+
+    return err;
+}
+
+BIDError
+_BIDGetReplayCacheObject(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    const char *szKey,
+    json_t **pValue)
+{
+    BIDError err;
+    BIDCache shards = NULL;
+
+#ifndef WIN32
+    err = _BIDAcquireReplayCacheShards(context, replayCache, &shards);
+    if (err != BID_S_OK)
+        return err;
+#endif
+
+    err = _BIDGetReplayCacheEntry(context, replayCache, shards, szKey, pValue);
+
+    if (shards != NULL)
+        _BIDReleaseCache(context, shards);
+
+    return err;
+}
+
 BIDError
 _BIDAcquireDefaultReplayCache(BIDContext context)
 {
-    return _BIDAcquireCacheForUser(context, "browserid.replay", &context->ReplayCache);
+    BIDError err;
+
+    err = _BIDAcquireDefaultCache(context, context->ConfigParams.ReplayCache,
+                                  "browserid.replay", BID_CACHE_FLAG_NO_EVICT,
+                                  &context->ReplayCache);
+    BID_BAIL_ON_ERROR(err);
+
+#ifndef WIN32
+    /* spread the per-user cache over several files to reduce contention */
+    if (context->ConfigParams.ReplayCache == NULL &&
+        context->ConfigParams.ReplayCacheShards > 1) {
+        BIDCache cache = NULL;
+        const char *szName = NULL;
+        char szShardedName[PATH_MAX];
+
+        err = _BIDGetCacheName(context, context->ReplayCache, &szName);
+        BID_BAIL_ON_ERROR(err);
+
+        _BIDShardedReplayCacheName(szName, context->ConfigParams.ReplayCacheShards,
+                                   szShardedName, sizeof(szShardedName));
+
+        err = _BIDAcquireCache(context, szShardedName, BID_CACHE_FLAG_NO_EVICT, &cache);
+        BID_BAIL_ON_ERROR(err);
+
+        /* don't forget assertions seen before sharding was enabled */
+        err = _BIDMigrateReplayCache(context, context->ReplayCache, cache);
+        if (err != BID_S_OK) {
+            /* no tombstone, so keep using the unsharded cache */
+            _BIDReleaseCache(context, cache);
+            err = BID_S_OK;
+            goto cleanup;
+        }
+
+        _BIDReleaseCache(context, context->ReplayCache);
+        context->ReplayCache = cache;
+    }
+#endif
+
+cleanup:
+    return err;
+}
+
+/*
+ * Counting Bloom filter in front of the replay cache. Fresh assertions
+ * are the common case, so most lookups miss; the filter answers those
+ * without reading the backend. A filter is shared by all contexts using
+ * a replay cache of the same name and is rebuilt from the backend when
+ * the backend's last changed time moves without the filter having seen
+ * the change. This assumes a replay cache is only written by a single
+ * process, so the filter is disabled unless "replayfiltersize" is set.
+ */
+#define BID_REPLAY_FILTER_HASHES            4
+
+struct BIDReplayFilterDesc {
+    struct BIDReplayFilterDesc *Next;
+    BID_MUTEX Mutex;
+    char *Name;
+    size_t cCounters;
+    unsigned char *Counters;
+    int Valid;
+    time_t ChangedTime;
+};
+
+typedef struct BIDReplayFilterDesc *BIDReplayFilter;
+
+static BID_THREAD_ONCE _BIDReplayFilterOnce = BID_ONCE_INITIALIZER;
+static BID_MUTEX _BIDReplayFilterMutex;
+static BIDReplayFilter _BIDReplayFilters = NULL;
+
+static BID_ONCE_CALLBACK(_BIDInitReplayFilters)
+{
+    BID_MUTEX_INIT(&_BIDReplayFilterMutex);
+    BID_ONCE_LEAVE;
+}
+
+static BIDError
+_BIDAcquireReplayFilter(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    BIDReplayFilter *pFilter)
+{
+    BIDError err;
+    BIDReplayFilter filter;
+    const char *szName = NULL;
+
+    *pFilter = NULL;
+
+    if (context->ReplayFilterSize == 0)
+        return BID_S_NOT_IMPLEMENTED;
+
+    err = _BIDGetCacheName(context, replayCache, &szName);
+    if (err != BID_S_OK)
+        return err;
+    if (szName == NULL || szName[0] == '\0')
+        return BID_S_NOT_IMPLEMENTED;
+
+    BID_ONCE(&_BIDReplayFilterOnce, _BIDInitReplayFilters);
+
+    BID_MUTEX_LOCK(&_BIDReplayFilterMutex);
+
+    for (filter = _BIDReplayFilters; filter != NULL; filter = filter->Next) {
+        if (strcmp(filter->Name, szName) == 0)
+            break;
+    }
+
+    if (filter == NULL) {
+        filter = BIDCalloc(1, sizeof(*filter));
+        if (filter == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        filter->cCounters = context->ReplayFilterSize;
+        filter->Counters = BIDCalloc(filter->cCounters, 1);
+        err = _BIDDuplicateString(context, szName, &filter->Name);
+        if (filter->Counters == NULL && err == BID_S_OK)
+            err = BID_S_NO_MEMORY;
+        if (err != BID_S_OK) {
+            BIDFree(filter->Counters);
+            BIDFree(filter->Name);
+            BIDFree(filter);
+            goto cleanup;
+        }
+
+        BID_MUTEX_INIT(&filter->Mutex);
+
+        filter->Next = _BIDReplayFilters;
+        _BIDReplayFilters = filter;
+    }
+
+    *pFilter = filter;
+
+cleanup:
+    BID_MUTEX_UNLOCK(&_BIDReplayFilterMutex);
+
+    return err;
+}
+
+static BIDError
+_BIDReplayFilterIndexes(
+    BIDReplayFilter filter,
+    const char *szDigest,
+    size_t rgIndexes[BID_REPLAY_FILTER_HASHES])
+{
+    BIDError err;
+    unsigned char buf[64];
+    unsigned char *pBuf = buf;
+    size_t cbBuf = sizeof(buf);
+    size_t i;
+
+    /* the key is a base64url encoded SHA-256 digest, so it is uniform */
+    err = _BIDBase64UrlDecode(szDigest, &pBuf, &cbBuf);
+    if (err != BID_S_OK)
+        return err;
+
+    if (cbBuf < 4 * BID_REPLAY_FILTER_HASHES)
+        return BID_S_INVALID_PARAMETER;
+
+    for (i = 0; i < BID_REPLAY_FILTER_HASHES; i++) {
+        uint32_t h;
+
+        h = (buf[4 * i] << 24) | (buf[4 * i + 1] << 16) |
+            (buf[4 * i + 2] << 8) | buf[4 * i + 3];
+        rgIndexes[i] = h % filter->cCounters;
+    }
+
+    return BID_S_OK;
+}
+
+/*
+ * The following functions are called with the filter mutex held.
+ */
+static void
+_BIDReplayFilterAdd(
+    BIDReplayFilter filter,
+    const char *szDigest)
+{
+    size_t rgIndexes[BID_REPLAY_FILTER_HASHES], i;
+
+    if (_BIDReplayFilterIndexes(filter, szDigest, rgIndexes) != BID_S_OK) {
+        filter->Valid = 0;
+        return;
+    }
+
+    for (i = 0; i < BID_REPLAY_FILTER_HASHES; i++) {
+        /* a saturated counter is never decremented */
+        if (filter->Counters[rgIndexes[i]] != 0xFF)
+            filter->Counters[rgIndexes[i]]++;
+    }
+}
+
+static void
+_BIDReplayFilterRemove(
+    BIDReplayFilter filter,
+    const char *szDigest)
+{
+    size_t rgIndexes[BID_REPLAY_FILTER_HASHES], i;
+
+    if (_BIDReplayFilterIndexes(filter, szDigest, rgIndexes) != BID_S_OK)
+        return;
+
+    for (i = 0; i < BID_REPLAY_FILTER_HASHES; i++) {
+        if (filter->Counters[rgIndexes[i]] != 0 &&
+            filter->Counters[rgIndexes[i]] != 0xFF)
+            filter->Counters[rgIndexes[i]]--;
+    }
+}
+
+static int
+_BIDReplayFilterContainsP(
+    BIDReplayFilter filter,
+    const char *szDigest)
+{
+    size_t rgIndexes[BID_REPLAY_FILTER_HASHES], i;
+
+    if (!filter->Valid ||
+        _BIDReplayFilterIndexes(filter, szDigest, rgIndexes) != BID_S_OK)
+        return 1;
+
+    for (i = 0; i < BID_REPLAY_FILTER_HASHES; i++) {
+        if (filter->Counters[rgIndexes[i]] == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static BIDError
+_BIDReplayFilterAddCallback(
+    BIDContext context BID_UNUSED,
+    BIDCache cache BID_UNUSED,
+    const char *szKey,
+    json_t *j BID_UNUSED,
+    void *data)
+{
+    _BIDReplayFilterAdd((BIDReplayFilter)data, szKey);
+
+    return BID_S_OK;
+}
+
+/*
+ * Rebuild the filter if the backend has changed since it was last seen.
+ */
+static BIDError
+_BIDSyncReplayFilter(
+    BIDContext context,
+    BIDReplayFilter filter,
+    BIDReplayCache replayCache)
+{
+    BIDError err;
+    time_t changedTime = 0;
+
+    err = _BIDGetCacheLastChangedTime(context, replayCache, &changedTime);
+    if (err != BID_S_OK) {
+        filter->Valid = 0;
+        return err;
+    }
+
+    if (filter->Valid && changedTime == filter->ChangedTime)
+        return BID_S_OK;
+
+    memset(filter->Counters, 0, filter->cCounters);
+    filter->Valid = 1;
+
+    err = _BIDPerformCacheObjects(context, replayCache, _BIDReplayFilterAddCallback, filter);
+    if (err == BID_S_NO_MORE_ITEMS)
+        err = BID_S_OK;
+    if (err != BID_S_OK) {
+        filter->Valid = 0;
+        return err;
+    }
+
+    filter->ChangedTime = changedTime;
+
+    return BID_S_OK;
+}
+
+/*
+ * Called after this process has written to the backend, with the filter
+ * mutex held across the write so that the change is not mistaken for an
+ * external one.
+ */
+static void
+_BIDReplayFilterChanged(
+    BIDContext context,
+    BIDReplayFilter filter,
+    BIDReplayCache replayCache)
+{
+    if (_BIDGetCacheLastChangedTime(context, replayCache, &filter->ChangedTime) != BID_S_OK)
+        filter->Valid = 0;
 }
 
 BIDError
@@ -56,6 +580,8 @@ _BIDCheckReplayCache(
     json_t *rdata = NULL;
     json_t *digest = NULL;
     time_t tsHash, expHash;
+    BIDReplayFilter filter = NULL;
+    BIDCache shards = NULL;
 
     err = _BIDDigestAssertion(context, szAssertion, &digest);
     BID_BAIL_ON_ERROR(err);
@@ -63,7 +589,30 @@ _BIDCheckReplayCache(
     if (replayCache == BID_C_NO_REPLAY_CACHE)
         replayCache = context->ReplayCache;
 
-    err = _BIDGetCacheObject(context, replayCache, json_string_value(digest), &rdata);
+#ifndef WIN32
+    err = _BIDAcquireReplayCacheShards(context, replayCache, &shards);
+    BID_BAIL_ON_ERROR(err);
+#endif
+
+    /* the filter only tracks replayCache, not the shards replacing it */
+    if (shards == NULL &&
+        _BIDAcquireReplayFilter(context, replayCache, &filter) == BID_S_OK) {
+        int bMaybeReplayed;
+
+        BID_MUTEX_LOCK(&filter->Mutex);
+        bMaybeReplayed =
+            _BIDSyncReplayFilter(context, filter, replayCache) != BID_S_OK ||
+            _BIDReplayFilterContainsP(filter, json_string_value(digest));
+        BID_MUTEX_UNLOCK(&filter->Mutex);
+
+        if (!bMaybeReplayed) {
+            err = BID_S_OK;
+            goto cleanup;
+        }
+    }
+
+    err = _BIDGetReplayCacheEntry(context, replayCache, shards,
+                                  json_string_value(digest), &rdata);
     if (err == BID_S_OK) {
         _BIDGetJsonTimestampValue(context, rdata, "iat", &tsHash);
         _BIDGetJsonTimestampValue(context, rdata, "exp", &expHash);
@@ -74,6 +623,8 @@ _BIDCheckReplayCache(
         err = BID_S_OK;
 
 cleanup:
+    if (shards != NULL)
+        _BIDReleaseCache(context, shards);
     json_decref(rdata);
     json_decref(digest);
 
@@ -94,9 +645,13 @@ _BIDUpdateReplayCache(
     json_t *ark = NULL;
     json_t *tkt = NULL;
     json_t *digest = NULL;
+    json_t *tid = NULL;
+    json_t *rentry = NULL;
     int bStoreReauthCreds = 0;
     uint32_t ticketLifetime = 0, renewLifetime = 0;
     time_t ticketExpiry = 0, renewExpiry = 0;
+    BIDReplayFilter filter = NULL;
+    BIDCache shards = NULL;
 
     err = _BIDDigestAssertion(context, szAssertion, &digest);
     BID_BAIL_ON_ERROR(err);
@@ -170,6 +725,28 @@ _BIDUpdateReplayCache(
          */
         err = _BIDSaveKeyAgreementStrength(context, identity, 1, rdata);
         BID_BAIL_ON_ERROR(err);
+
+        /*
+         * With stateless tickets the credentials are carried in the ticket
+         * itself, and the replay cache need only record the assertion. If
+         * sealing fails, fall back to storing the credentials.
+         */
+        if (context->TicketKeyCache != NULL &&
+            _BIDSealReauthTicket(context, rdata, verificationTime, &tid) == BID_S_OK) {
+            err = _BIDAllocJsonObject(context, &rentry);
+            BID_BAIL_ON_ERROR(err);
+
+            err = _BIDJsonObjectSet(context, rentry, "iat", json_object_get(rdata, "iat"), 0);
+            BID_BAIL_ON_ERROR(err);
+
+            err = _BIDJsonObjectSet(context, rentry, "a-exp", json_object_get(rdata, "a-exp"), 0);
+            BID_BAIL_ON_ERROR(err);
+
+            /* replay detection and cache expiry both depend on this */
+            err = _BIDJsonObjectSet(context, rentry, "exp", json_object_get(rdata, "exp"),
+                                    BID_JSON_FLAG_REQUIRED);
+            BID_BAIL_ON_ERROR(err);
+        }
     } else {
         /* XXX is this even necessary? */
         err = _BIDJsonObjectSet(context, rdata, "exp",
@@ -180,16 +757,55 @@ _BIDUpdateReplayCache(
     if (replayCache == BID_C_NO_REPLAY_CACHE)
         replayCache = context->ReplayCache;
 
-    err = _BIDSetCacheObject(context, replayCache, json_string_value(digest), rdata);
+#ifndef WIN32
+    err = _BIDAcquireReplayCacheShards(context, replayCache, &shards);
+    BID_BAIL_ON_ERROR(err);
+
+    /* the cache was migrated after this context acquired it */
+    if (shards != NULL)
+        replayCache = shards;
+#endif
+
+    if (_BIDAcquireReplayFilter(context, replayCache, &filter) == BID_S_OK) {
+        BID_MUTEX_LOCK(&filter->Mutex);
+        _BIDSyncReplayFilter(context, filter, replayCache);
+    }
+
+    err = _BIDSetCacheObject(context, replayCache, json_string_value(digest),
+                             rentry != NULL ? rentry : rdata);
+
+    if (filter != NULL) {
+        if (err == BID_S_OK) {
+            _BIDReplayFilterAdd(filter, json_string_value(digest));
+            _BIDReplayFilterChanged(context, filter, replayCache);
+        }
+        BID_MUTEX_UNLOCK(&filter->Mutex);
+    }
+
     BID_BAIL_ON_ERROR(err);
 
+#ifndef WIN32
+    /* or is being migrated, and the copy may have missed this entry */
+    if (shards == NULL) {
+        err = _BIDAcquireReplayCacheShards(context, replayCache, &shards);
+        BID_BAIL_ON_ERROR(err);
+
+        if (shards != NULL) {
+            err = _BIDSetCacheObject(context, shards, json_string_value(digest),
+                                     rentry != NULL ? rentry : rdata);
+            BID_BAIL_ON_ERROR(err);
+        }
+    }
+#endif
+
     if (bStoreReauthCreds) {
         BID_ASSERT(identity->PrivateAttributes != NULL);
 
         err = _BIDAllocJsonObject(context, &tkt);
         BID_BAIL_ON_ERROR(err);
 
-        err = _BIDJsonObjectSet(context, tkt, "tid", digest, BID_JSON_FLAG_REQUIRED);
+        err = _BIDJsonObjectSet(context, tkt, "tid",
+                                tid != NULL ? tid : digest, BID_JSON_FLAG_REQUIRED);
         BID_BAIL_ON_ERROR(err);
 
         err = _BIDJsonObjectSet(context, tkt, "exp", json_object_get(rdata, "exp"), 0);
@@ -200,9 +816,13 @@ _BIDUpdateReplayCache(
     }
 
 cleanup:
+    if (shards != NULL)
+        _BIDReleaseCache(context, shards);
     json_decref(digest);
+    json_decref(tid);
     json_decref(ark);
     json_decref(rdata);
+    json_decref(rentry);
     json_decref(tkt);
 
     return err;
@@ -214,7 +834,7 @@ BIDAcquireReplayCache(
     const char *szCacheName,
     BIDReplayCache *pCache)
 {
-    return _BIDAcquireCache(context, szCacheName, 0, pCache);
+    return _BIDAcquireCache(context, szCacheName, BID_CACHE_FLAG_NO_EVICT, pCache);
 }
 
 BIDError
@@ -249,11 +869,48 @@ _BIDShouldPurgeReplayCacheEntryP(
     return (expiryTime == 0 || now >= expiryTime);
 }
 
+struct BIDPurgeReplayCacheArgsDesc {
+    time_t CurrentTime;
+    BIDReplayFilter Filter;
+};
+
+static int
+_BIDShouldPurgeReplayCacheEntryAndFilterP(
+    BIDContext context,
+    BIDCache cache,
+    const char *szKey,
+    json_t *j,
+    void *data)
+{
+    struct BIDPurgeReplayCacheArgsDesc *args = data;
+
+    if (!_BIDShouldPurgeReplayCacheEntryP(context, cache, szKey, j, &args->CurrentTime))
+        return 0;
+
+    _BIDReplayFilterRemove(args->Filter, szKey);
+
+    return 1;
+}
+
 BIDError
 _BIDPurgeReplayCache(
     BIDContext context,
     BIDCache cache,
     time_t currentTime)
 {
-    return _BIDPurgeCache(context, cache, _BIDShouldPurgeReplayCacheEntryP, &currentTime);
+    BIDError err;
+    struct BIDPurgeReplayCacheArgsDesc args;
+
+    if (_BIDAcquireReplayFilter(context, cache, &args.Filter) != BID_S_OK)
+        return _BIDPurgeCache(context, cache, _BIDShouldPurgeReplayCacheEntryP, &currentTime);
+
+    args.CurrentTime = currentTime;
+
+    BID_MUTEX_LOCK(&args.Filter->Mutex);
+    _BIDSyncReplayFilter(context, args.Filter, cache);
+    err = _BIDPurgeCache(context, cache, _BIDShouldPurgeReplayCacheEntryAndFilterP, &args);
+    _BIDReplayFilterChanged(context, args.Filter, cache);
+    BID_MUTEX_UNLOCK(&args.Filter->Mutex);
+
+    return err;
 }
@@ -137,7 +137,8 @@ cleanup:
 BIDError
 _BIDAcquireDefaultTicketCache(BIDContext context)
 {
-    return _BIDAcquireCacheForUser(context, "browserid.tickets", &context->TicketCache);
+    return _BIDAcquireDefaultCache(context, context->ConfigParams.TicketCache,
+                                   "browserid.tickets", 0, &context->TicketCache);
 }
 
 BIDError
@@ -229,7 +230,7 @@ BIDStoreTicketInCache(
     json_t *ticket;
     BIDError err;
 
-    ticket = json_loads(szTicket, 0, &context->JsonError);
+    ticket = json_loads(szTicket, 0, _BIDJsonError(context));
     if (ticket == NULL)
         return BID_S_INVALID_JSON;
 
@@ -349,6 +350,31 @@ cleanup:
     return err;
 }
 
+/*
+ * Ticket attributes that are not copied into the identity.
+ */
+static const char *
+_BIDReauthPrivateAttributes[] = {
+    "ark",
+    "a-exp",
+    "flags",
+    "aud",
+    NULL
+};
+
+static int
+_BIDIsReauthPrivateAttributeP(const char *szKey)
+{
+    const char **p;
+
+    for (p = _BIDReauthPrivateAttributes; *p != NULL; p++) {
+        if (strcmp(szKey, *p) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
 static BIDError
 _BIDMakeReauthIdentity(
     BIDContext context,
@@ -358,30 +384,33 @@ _BIDMakeReauthIdentity(
 {
     BIDError err;
     BIDIdentity identity = BID_C_NO_IDENTITY;
-    json_t *credCopy = NULL;
+    json_t *attrs = NULL;
+    void *iter;
 
     *pIdentity = NULL;
 
-    credCopy = json_copy(cred);
-    if (credCopy == NULL) {
-        err = BID_S_NO_MEMORY;
-        goto cleanup;
-    }
-
-    err = _BIDAllocIdentity(context, credCopy, &identity);
+    err = _BIDAllocJsonObject(context, &attrs);
     BID_BAIL_ON_ERROR(err);
 
-    /* remove the secret stuff from the attribute cache */
-    err = _BIDJsonObjectDel(context, identity->Attributes, "ark", 0);
-    BID_BAIL_ON_ERROR(err);
+    /*
+     * Copy everything but the secret stuff into the attribute cache; this
+     * avoids copying the whole ticket only to remove keys from it again.
+     */
+    for (iter = json_object_iter(cred);
+         iter != NULL;
+         iter = json_object_iter_next(cred, iter)) {
+        const char *szKey = json_object_iter_key(iter);
 
-    err = _BIDJsonObjectDel(context, identity->Attributes, "a-exp", 0);
-    BID_BAIL_ON_ERROR(err);
+        if (_BIDIsReauthPrivateAttributeP(szKey))
+            continue;
 
-    err = _BIDJsonObjectDel(context, identity->Attributes, "flags", 0);
-    BID_BAIL_ON_ERROR(err);
+        if (json_object_set(attrs, szKey, json_object_iter_value(iter)) < 0) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+    }
 
-    err = _BIDJsonObjectDel(context, identity->Attributes, "aud", 0);
+    err = _BIDAllocIdentity(context, attrs, &identity);
     BID_BAIL_ON_ERROR(err);
 
     /* copy over the assertion expiry time */
@@ -407,7 +436,7 @@ _BIDMakeReauthIdentity(
 cleanup:
     if (err != BID_S_OK)
         BIDReleaseIdentity(context, identity);
-    json_decref(credCopy);
+    json_decref(attrs);
 
     return err;
 }
@@ -615,6 +644,326 @@ cleanup:
     return err;
 }
 
+/*
+ * Stateless tickets. If a ticket key cache is configured, the credentials
+ * that would otherwise be stored in the replay cache are sealed under an
+ * acceptor master key and returned in the ticket identifier, which takes the
+ * form "kid.sealed-credentials". Any acceptor sharing the key cache can then
+ * verify a re-authentication assertion without a replay cache lookup.
+ *
+ * A new master key is generated every TicketKeyLifetime seconds; old keys are
+ * retained until any tickets they sealed have expired.
+ */
+struct BIDFindTicketKeyArgsDesc {
+    time_t CurrentTime;
+    time_t IssueTime;
+    char *szKid;
+    json_t *Key;
+};
+
+static BIDError
+_BIDFindTicketKeyCB(
+    BIDContext context,
+    BIDCache cache BID_UNUSED,
+    const char *szKey,
+    json_t *cacheVal,
+    void *data)
+{
+    BIDError err;
+    struct BIDFindTicketKeyArgsDesc *args = (struct BIDFindTicketKeyArgsDesc *)data;
+    time_t issueTime = 0;
+    char *szKid = NULL;
+
+    if (json_string_value(json_object_get(cacheVal, "k")) == NULL)
+        return BID_S_OK;
+
+    _BIDGetJsonTimestampValue(context, cacheVal, "iat", &issueTime);
+
+    /* find the most recently issued key that can still be used for sealing */
+    if (args->CurrentTime >= issueTime + context->TicketKeyLifetime ||
+        issueTime <= args->IssueTime)
+        return BID_S_OK;
+
+    err = _BIDDuplicateString(context, szKey, &szKid);
+    if (err != BID_S_OK)
+        return err;
+
+    BIDFree(args->szKid);
+    json_decref(args->Key);
+
+    args->IssueTime = issueTime;
+    args->szKid = szKid;
+    args->Key = json_incref(cacheVal);
+
+    return BID_S_OK;
+}
+
+static int
+_BIDShouldPurgeTicketKeyP(
+    BIDContext context,
+    BIDCache cache BID_UNUSED,
+    const char *szKey BID_UNUSED,
+    json_t *j,
+    void *data)
+{
+    time_t now = *((time_t *)data);
+    time_t expiryTime = 0;
+
+    _BIDGetJsonTimestampValue(context, j, "exp", &expiryTime);
+
+    return (expiryTime == 0 || now >= expiryTime);
+}
+
+static BIDError
+_BIDGenerateTicketKey(
+    BIDContext context,
+    time_t currentTime,
+    char **pszKid,
+    json_t **pKey)
+{
+    BIDError err;
+    json_t *kid = NULL;
+    json_t *k = NULL;
+    json_t *key = NULL;
+    time_t expiryTime;
+
+    *pszKid = NULL;
+    *pKey = NULL;
+
+    err = _BIDGenerateNonce(context, &kid);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDGenerateNonce(context, &k);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAllocJsonObject(context, &key);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDJsonObjectSet(context, key, "k", k, BID_JSON_FLAG_REQUIRED);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetJsonTimestampValue(context, key, "iat", currentTime);
+    BID_BAIL_ON_ERROR(err);
+
+    expiryTime = currentTime + context->TicketKeyLifetime +
+                 context->TicketLifetime + context->Skew;
+
+    err = _BIDSetJsonTimestampValue(context, key, "exp", expiryTime);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetCacheObject(context, context->TicketKeyCache,
+                             json_string_value(kid), key);
+    BID_BAIL_ON_ERROR(err);
+
+    /* a good time to discard any keys that can no longer unseal tickets */
+    _BIDPurgeCache(context, context->TicketKeyCache,
+                   _BIDShouldPurgeTicketKeyP, &currentTime);
+
+    err = _BIDDuplicateString(context, json_string_value(kid), pszKid);
+    BID_BAIL_ON_ERROR(err);
+
+    *pKey = key;
+    key = NULL;
+
+cleanup:
+    json_decref(kid);
+    json_decref(k);
+    json_decref(key);
+
+    return err;
+}
+
+/*
+ * Seal reauthentication credentials into a ticket identifier.
+ */
+BIDError
+_BIDSealReauthTicket(
+    BIDContext context,
+    json_t *cred,
+    time_t currentTime,
+    json_t **pTid)
+{
+    BIDError err;
+    struct BIDFindTicketKeyArgsDesc args = { 0 };
+    unsigned char *pbKey = NULL;
+    size_t cbKey = 0;
+    char *szCred = NULL;
+    unsigned char *pbSealed = NULL;
+    size_t cbSealed = 0;
+    char *szSealed = NULL;
+    size_t cchSealed = 0;
+    char *szTid = NULL;
+    size_t cchKid;
+
+    *pTid = NULL;
+
+    if (context->TicketKeyCache == NULL) {
+        err = BID_S_NOT_IMPLEMENTED;
+        goto cleanup;
+    }
+
+    args.CurrentTime = currentTime;
+
+    err = _BIDPerformCacheObjects(context, context->TicketKeyCache,
+                                  _BIDFindTicketKeyCB, &args);
+    if (err == BID_S_CACHE_NOT_FOUND || err == BID_S_CACHE_KEY_NOT_FOUND)
+        err = BID_S_OK;
+    BID_BAIL_ON_ERROR(err);
+
+    if (args.Key == NULL) {
+        err = _BIDGenerateTicketKey(context, currentTime, &args.szKid, &args.Key);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = _BIDGetJsonBinaryValue(context, args.Key, "k", &pbKey, &cbKey);
+    BID_BAIL_ON_ERROR(err);
+
+    szCred = json_dumps(cred, JSON_COMPACT);
+    if (szCred == NULL) {
+        err = BID_S_CANNOT_ENCODE_JSON;
+        goto cleanup;
+    }
+
+    cchKid = strlen(args.szKid);
+
+    err = _BIDSealData(context, pbKey, cbKey,
+                       (unsigned char *)args.szKid, cchKid,
+                       (unsigned char *)szCred, strlen(szCred),
+                       &pbSealed, &cbSealed);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDBase64UrlEncode(pbSealed, cbSealed, &szSealed, &cchSealed);
+    BID_BAIL_ON_ERROR(err);
+
+    szTid = BIDMalloc(cchKid + 1 + cchSealed + 1);
+    if (szTid == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    memcpy(szTid, args.szKid, cchKid);
+    szTid[cchKid] = '.';
+    memcpy(&szTid[cchKid + 1], szSealed, cchSealed);
+    szTid[cchKid + 1 + cchSealed] = '\0';
+
+    *pTid = json_string(szTid);
+    if (*pTid == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    BIDFree(args.szKid);
+    json_decref(args.Key);
+    if (pbKey != NULL) {
+        memset(pbKey, 0, cbKey);
+        BIDFree(pbKey);
+    }
+    if (szCred != NULL) {
+        memset(szCred, 0, strlen(szCred));
+        BIDFree(szCred);
+    }
+    BIDFree(pbSealed);
+    BIDFree(szSealed);
+    BIDFree(szTid);
+
+    return err;
+}
+
+static int
+_BIDIsSealedTicketP(
+    BIDContext context,
+    const char *szTicket)
+{
+    return context->TicketKeyCache != NULL && strchr(szTicket, '.') != NULL;
+}
+
+static BIDError
+_BIDUnsealReauthTicket(
+    BIDContext context,
+    const char *szTicket,
+    time_t verificationTime,
+    json_t **pCred)
+{
+    BIDError err;
+    const char *p;
+    char *szKid = NULL;
+    size_t cchKid;
+    json_t *key = NULL;
+    time_t expiryTime = 0;
+    unsigned char *pbKey = NULL;
+    size_t cbKey = 0;
+    unsigned char *pbSealed = NULL;
+    size_t cbSealed = 0;
+    unsigned char *pbCred = NULL;
+    size_t cbCred = 0;
+
+    *pCred = NULL;
+
+    p = strchr(szTicket, '.');
+    BID_ASSERT(p != NULL);
+
+    cchKid = p - szTicket;
+
+    szKid = BIDMalloc(cchKid + 1);
+    if (szKid == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    memcpy(szKid, szTicket, cchKid);
+    szKid[cchKid] = '\0';
+
+    err = _BIDGetCacheObject(context, context->TicketKeyCache, szKid, &key);
+    if (err == BID_S_CACHE_NOT_FOUND || err == BID_S_CACHE_KEY_NOT_FOUND)
+        err = BID_S_INVALID_ASSERTION;
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDGetJsonTimestampValue(context, key, "exp", &expiryTime);
+    if (expiryTime == 0 || verificationTime >= expiryTime) {
+        err = BID_S_INVALID_ASSERTION;
+        goto cleanup;
+    }
+
+    err = _BIDGetJsonBinaryValue(context, key, "k", &pbKey, &cbKey);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDBase64UrlDecode(p + 1, &pbSealed, &cbSealed);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUnsealData(context, pbKey, cbKey,
+                         (unsigned char *)szKid, cchKid,
+                         pbSealed, cbSealed, &pbCred, &cbCred);
+    if (err == BID_S_INVALID_SIGNATURE || err == BID_S_BUFFER_TOO_SMALL)
+        err = BID_S_INVALID_ASSERTION;
+    BID_BAIL_ON_ERROR(err);
+
+    *pCred = json_loads((char *)pbCred, 0, _BIDJsonError(context));
+    if (*pCred == NULL) {
+        err = BID_S_INVALID_JSON;
+        goto cleanup;
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    BIDFree(szKid);
+    json_decref(key);
+    if (pbKey != NULL) {
+        memset(pbKey, 0, cbKey);
+        BIDFree(pbKey);
+    }
+    BIDFree(pbSealed);
+    if (pbCred != NULL) {
+        memset(pbCred, 0, cbCred);
+        BIDFree(pbCred);
+    }
+
+    return err;
+}
+
 BIDError
 _BIDVerifyReauthAssertion(
     BIDContext context,
@@ -622,7 +971,6 @@ _BIDVerifyReauthAssertion(
     BIDBackedAssertion assertion,
     time_t verificationTime,
     BIDIdentity *pVerifiedIdentity,
-    BIDJWK *pVerifierCred,
     uint32_t *pulRetFlags)
 {
     BIDError err;
@@ -633,7 +981,6 @@ _BIDVerifyReauthAssertion(
     json_t *tkt = NULL;
 
     *pVerifiedIdentity = BID_C_NO_IDENTITY;
-    *pVerifierCred = NULL;
 
     BID_CONTEXT_VALIDATE(context);
 
@@ -654,9 +1001,13 @@ _BIDVerifyReauthAssertion(
 
     *pulRetFlags |= BID_VERIFY_FLAG_REAUTH;
 
-    err = _BIDGetCacheObject(context, replayCache, szTicket, &cred);
-    if (err == BID_S_CACHE_NOT_FOUND || err == BID_S_CACHE_KEY_NOT_FOUND)
-        err = BID_S_INVALID_ASSERTION;
+    if (_BIDIsSealedTicketP(context, szTicket)) {
+        err = _BIDUnsealReauthTicket(context, szTicket, verificationTime, &cred);
+    } else {
+        err = _BIDGetReplayCacheObject(context, replayCache, szTicket, &cred);
+        if (err == BID_S_CACHE_NOT_FOUND || err == BID_S_CACHE_KEY_NOT_FOUND)
+            err = BID_S_INVALID_ASSERTION;
+    }
     BID_BAIL_ON_ERROR(err);
 
     ulTicketFlags = _BIDJsonUInt32Value(json_object_get(cred, "flags"));
@@ -677,9 +1028,7 @@ _BIDVerifyReauthAssertion(
     if (ulTicketFlags & BID_TICKET_FLAG_MUTUAL_AUTH)
         *pulRetFlags |= BID_VERIFY_FLAG_REAUTH_MUTUAL;
 
-    *pVerifierCred = json_incref(json_object_get(cred, "ark"));
-
-    err = _BIDVerifySignature(context, ap, *pVerifierCred);
+    err = _BIDVerifySignature(context, ap, json_object_get(cred, "ark"));
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDMakeReauthIdentity(context, cred, ap, pVerifiedIdentity);
@@ -698,11 +1047,6 @@ _BIDVerifyReauthAssertion(
     BID_BAIL_ON_ERROR(err);
 
 cleanup:
-    if (err != BID_S_OK) {
-        json_decref(*pVerifierCred);
-        *pVerifierCred = NULL;
-    }
-
     json_decref(cred);
 
     return err;
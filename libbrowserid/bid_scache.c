@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "bid_private.h"
+
+#include <ctype.h>
+
+/*
+ * Cache backend that spreads keys over a number of underlying caches, so
+ * that writers to different keys do not contend on a single lock and
+ * document. Cache names have the form "shard:[count:]name"; shard i is
+ * acquired as "name.i" (e.g. "shard:8:file:/tmp/replay.json" gives
+ * "file:/tmp/replay.json.0" through "file:/tmp/replay.json.7"). The shard
+ * count defaults to the "cacheshards" configuration value.
+ *
+ * Keys that are base64url encoded SHA-256 digests, such as replay cache
+ * keys, are routed by the leading bits of the digest; other keys by a
+ * hash of the key.
+ */
+
+struct BIDShardedCache {
+    char *Name;
+    uint32_t cShards;
+    BIDCache *Shards;
+};
+
+#define BID_SCACHE_EMPTY_P(err)     ((err) == BID_S_NO_MORE_ITEMS ||    \
+                                     (err) == BID_S_CACHE_NOT_FOUND ||  \
+                                     (err) == BID_S_CACHE_KEY_NOT_FOUND)
+
+static void
+_BIDShardedCacheReleaseShard(BIDCache shard)
+{
+    /* may be called with no context from the finalizer */
+#ifdef __APPLE__
+    CFRelease(shard);
+#else
+    _BIDFinalizeCache(shard);
+    BIDFree(shard);
+#endif
+}
+
+static BIDError
+_BIDShardedCacheRelease(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+    uint32_t i;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (sc->Shards != NULL) {
+        for (i = 0; i < sc->cShards; i++) {
+            if (sc->Shards[i] != NULL)
+                _BIDShardedCacheReleaseShard(sc->Shards[i]);
+        }
+        BIDFree(sc->Shards);
+    }
+    BIDFree(sc->Name);
+    BIDFree(sc);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDShardedCacheAcquire(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void **cache,
+    const char *name,
+    uint32_t ulFlags)
+{
+    BIDError err;
+    struct BIDShardedCache *sc;
+    const char *p = name;
+    char *szShardName = NULL;
+    size_t cchShardName;
+    uint32_t i;
+
+    sc = BIDCalloc(1, sizeof(*sc));
+    if (sc == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDDuplicateString(context, name, &sc->Name);
+    BID_BAIL_ON_ERROR(err);
+
+    if (isdigit((unsigned char)*p)) {
+        char *q;
+
+        sc->cShards = strtoul(p, &q, 10);
+        if (*q != ':') {
+            err = BID_S_INVALID_PARAMETER;
+            goto cleanup;
+        }
+        p = q + 1;
+    } else {
+        sc->cShards = context->ConfigParams.CacheShards;
+    }
+
+    if (*p == '\0' || sc->cShards == 0 || sc->cShards > BID_CACHE_MAX_SHARDS) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+    sc->Shards = BIDCalloc(sc->cShards, sizeof(BIDCache));
+    if (sc->Shards == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    cchShardName = strlen(p) + sizeof(".255");
+    szShardName = BIDMalloc(cchShardName);
+    if (szShardName == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    for (i = 0; i < sc->cShards; i++) {
+        snprintf(szShardName, cchShardName, "%s.%u", p, i);
+
+        err = _BIDAcquireCache(context, szShardName, ulFlags, &sc->Shards[i]);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    *cache = sc;
+    sc = NULL;
+
+cleanup:
+    if (sc != NULL)
+        ops->Release(ops, context, sc);
+    BIDFree(szShardName);
+
+    return err;
+}
+
+static BIDError
+_BIDShardedCacheInitialize(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+    BIDError err = BID_S_OK;
+    uint32_t i;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    for (i = 0; i < sc->cShards; i++) {
+        err = _BIDInitializeCache(context, sc->Shards[i]);
+        if (err == BID_S_NOT_IMPLEMENTED)
+            err = BID_S_OK;
+        BID_BAIL_ON_ERROR(err);
+    }
+
+cleanup:
+    return err;
+}
+
+static BIDError
+_BIDShardedCacheDestroy(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+    BIDError err, err2 = BID_S_OK;
+    uint32_t i;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    /* destroy as many shards as we can */
+    for (i = 0; i < sc->cShards; i++) {
+        err = _BIDDestroyCache(context, sc->Shards[i]);
+        if (err2 == BID_S_OK && err != BID_S_CACHE_NOT_FOUND)
+            err2 = err;
+    }
+
+    return err2;
+}
+
+static BIDError
+_BIDShardedCacheGetName(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    const char **name)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    *name = sc->Name;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDShardedCacheGetLastChangedTime(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    time_t *pTime)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+    BIDError err = BID_S_CACHE_NOT_FOUND;
+    uint32_t i;
+
+    *pTime = 0;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    for (i = 0; i < sc->cShards; i++) {
+        BIDError err2;
+        time_t tShard = 0;
+
+        err2 = _BIDGetCacheLastChangedTime(context, sc->Shards[i], &tShard);
+        if (err2 == BID_S_CACHE_NOT_FOUND)
+            continue;
+        else if (err2 != BID_S_OK)
+            return err2;
+
+        if (tShard > *pTime)
+            *pTime = tShard;
+        err = BID_S_OK;
+    }
+
+    return err;
+}
+
+static uint32_t
+_BIDShardedCacheIndex(
+    struct BIDShardedCache *sc,
+    const char *key)
+{
+    size_t cchKey = strlen(key);
+    uint32_t h;
+
+    /* an unpadded base64url encoded SHA-256 digest */
+    if (cchKey == BID_FCACHE_DIGEST_KEY_LENGTH) {
+        char szPrefix[5];
+        unsigned char *pbPrefix = NULL;
+        size_t cbPrefix = 0;
+
+        memcpy(szPrefix, key, 4);
+        szPrefix[4] = '\0';
+
+        if (_BIDBase64UrlDecode(szPrefix, &pbPrefix, &cbPrefix) == BID_S_OK) {
+            if (cbPrefix == 3) {
+                h = (pbPrefix[0] << 16) | (pbPrefix[1] << 8) | pbPrefix[2];
+                BIDFree(pbPrefix);
+                return (h * sc->cShards) >> 24;
+            }
+            BIDFree(pbPrefix);
+        }
+    }
+
+    return _BIDFnv1a(key, cchKey) % sc->cShards;
+}
+
+static BIDError
+_BIDShardedCacheGetObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t **val)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+
+    *val = NULL;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    return _BIDGetCacheObject(context, sc->Shards[_BIDShardedCacheIndex(sc, key)], key, val);
+}
+
+static BIDError
+_BIDShardedCacheSetObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    return _BIDSetCacheObject(context, sc->Shards[_BIDShardedCacheIndex(sc, key)], key, val);
+}
+
+static BIDError
+_BIDShardedCacheRemoveObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    return _BIDRemoveCacheObject(context, sc->Shards[_BIDShardedCacheIndex(sc, key)], key);
+}
+
+static BIDError
+_BIDShardedCacheGetStatistics(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    struct BIDCacheStatistics *pStats)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+    uint32_t i;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    for (i = 0; i < sc->cShards; i++) {
+        BIDError err;
+        struct BIDCacheStatistics stats;
+
+        err = _BIDGetCacheStatistics(context, sc->Shards[i], &stats);
+        if (err != BID_S_OK)
+            return err;
+
+        pStats->Entries    += stats.Entries;
+        pStats->Bytes      += stats.Bytes;
+        pStats->Hits       += stats.Hits;
+        pStats->Misses     += stats.Misses;
+        pStats->Evictions  += stats.Evictions;
+        pStats->Rejections += stats.Rejections;
+    }
+
+    return BID_S_OK;
+}
+
+struct BIDShardedCacheIterator {
+    uint32_t Shard;
+    void *Cookie;
+};
+
+/*
+ * Advance to the first object in the next non-empty shard, starting
+ * with the current one.
+ */
+static BIDError
+_BIDShardedCacheIteratorFirst(
+    BIDContext context,
+    struct BIDShardedCache *sc,
+    struct BIDShardedCacheIterator *iter,
+    const char **key,
+    json_t **val)
+{
+    BIDError err = BID_S_NO_MORE_ITEMS;
+
+    for (; iter->Shard < sc->cShards; iter->Shard++) {
+        err = _BIDGetFirstCacheObject(context, sc->Shards[iter->Shard],
+                                      &iter->Cookie, key, val);
+        if (!BID_SCACHE_EMPTY_P(err))
+            break;
+        err = BID_S_NO_MORE_ITEMS;
+    }
+
+    return err;
+}
+
+static BIDError
+_BIDShardedCacheFirstObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+    struct BIDShardedCacheIterator *iter;
+    BIDError err;
+
+    *cookie = NULL;
+    *key = NULL;
+    *val = NULL;
+
+    if (sc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    iter = BIDCalloc(1, sizeof(*iter));
+    if (iter == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDShardedCacheIteratorFirst(context, sc, iter, key, val);
+    if (err != BID_S_OK) {
+        BIDFree(iter);
+        return err;
+    }
+
+    *cookie = iter;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDShardedCacheNextObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    struct BIDShardedCache *sc = (struct BIDShardedCache *)cache;
+    struct BIDShardedCacheIterator *iter = *cookie;
+    BIDError err;
+
+    *key = NULL;
+    *val = NULL;
+
+    if (sc == NULL || iter == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    err = _BIDGetNextCacheObject(context, sc->Shards[iter->Shard], &iter->Cookie, key, val);
+    if (err == BID_S_NO_MORE_ITEMS) {
+        iter->Shard++;
+        err = _BIDShardedCacheIteratorFirst(context, sc, iter, key, val);
+    }
+
+    if (err != BID_S_OK) {
+        BIDFree(iter);
+        *cookie = NULL;
+    }
+
+    return err;
+}
+
+struct BIDCacheOps _BIDShardedCache = {
+    "shard",
+    _BIDShardedCacheAcquire,
+    _BIDShardedCacheRelease,
+    _BIDShardedCacheInitialize,
+    _BIDShardedCacheDestroy,
+    _BIDShardedCacheGetName,
+    _BIDShardedCacheGetLastChangedTime,
+    _BIDShardedCacheGetObject,
+    _BIDShardedCacheSetObject,
+    _BIDShardedCacheRemoveObject,
+    _BIDShardedCacheFirstObject,
+    _BIDShardedCacheNextObject,
+    _BIDShardedCacheGetStatistics,
+};
@@ -150,7 +150,7 @@ _BIDDecodeJson(
     /* XXX check valid string first? */
     szJson[cbJson] = '\0';
 
-    jData = json_loads(szJson, 0, &context->JsonError);
+    jData = json_loads(szJson, 0, _BIDJsonError(context));
     if (jData == NULL) {
         BIDFree(szJson);
         return BID_S_INVALID_JSON;
@@ -804,3 +804,21 @@ _BIDJsonStringValue(json_t *object)
 {
     return json_string_value(object);
 }
+
+/*
+ * FNV-1a, for hash tables and checksums; not a cryptographic hash.
+ */
+uint32_t
+_BIDFnv1a(const void *pv, size_t cb)
+{
+    const unsigned char *pb = pv;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < cb; i++) {
+        h ^= pb[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
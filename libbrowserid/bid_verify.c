@@ -250,6 +250,111 @@ _BIDValidateCertIssuer(
                                      verificationTime);
 }
 
+/*
+ * Verified certificates are remembered in a shared cache so that a user
+ * certificate, which is typically reused for many assertions, need only
+ * have its signature checked once. The cache key is a digest of the
+ * encoded certificate (including its signature) and of the issuer key,
+ * and the entry expires with the earlier of the certificate and the key.
+ */
+#define BID_VERIFIED_CERT_CACHE             "browserid.verified-certs"
+
+static BIDError
+_BIDMakeVerifiedCertKey(
+    BIDContext context,
+    BIDJWT cert,
+    BIDJWKSet issuerKey,
+    json_t **pCacheKey)
+{
+    BIDError err;
+    char *szIssuerKey = NULL;
+    char *szCacheKey = NULL;
+    json_t *issuerKeyDigest = NULL;
+    const char *szIssuerKeyDigest;
+    size_t cchIssuerKeyDigest, cchCert;
+
+    *pCacheKey = NULL;
+
+    szIssuerKey = json_dumps(issuerKey, JSON_COMPACT);
+    if (szIssuerKey == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = _BIDDigestAssertion(context, szIssuerKey, &issuerKeyDigest);
+    BID_BAIL_ON_ERROR(err);
+
+    szIssuerKeyDigest = json_string_value(issuerKeyDigest);
+    cchIssuerKeyDigest = strlen(szIssuerKeyDigest);
+    cchCert = strlen(cert->EncData); /* EncData retains the signature */
+
+    szCacheKey = BIDMalloc(cchIssuerKeyDigest + 1 + cchCert + 1);
+    if (szCacheKey == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    memcpy(szCacheKey, szIssuerKeyDigest, cchIssuerKeyDigest);
+    szCacheKey[cchIssuerKeyDigest] = '~';
+    memcpy(&szCacheKey[cchIssuerKeyDigest + 1], cert->EncData, cchCert + 1);
+
+    err = _BIDDigestAssertion(context, szCacheKey, pCacheKey);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    BIDFree(szIssuerKey);
+    BIDFree(szCacheKey);
+    json_decref(issuerKeyDigest);
+
+    return err;
+}
+
+static BIDError
+_BIDVerifyCertSignature(
+    BIDContext context,
+    BIDCache certCache,
+    BIDJWT cert,
+    BIDJWKSet issuerKey,
+    time_t keyExpiryTime,
+    time_t verificationTime)
+{
+    BIDError err;
+    json_t *cacheKey = NULL;
+    json_t *verified = NULL;
+    time_t expiryTime = 0;
+
+    if (certCache != NULL &&
+        _BIDMakeVerifiedCertKey(context, cert, issuerKey, &cacheKey) == BID_S_OK &&
+        _BIDGetCacheObject(context, certCache, json_string_value(cacheKey), &verified) == BID_S_OK &&
+        _BIDGetJsonTimestampValue(context, verified, "exp", &expiryTime) == BID_S_OK &&
+        verificationTime < expiryTime) {
+        err = BID_S_OK;
+        goto cleanup;
+    }
+
+    err = _BIDVerifySignature(context, cert, issuerKey);
+    BID_BAIL_ON_ERROR(err);
+
+    if (cacheKey != NULL &&
+        _BIDGetJsonTimestampValue(context, cert->Payload, "exp", &expiryTime) == BID_S_OK) {
+        if (keyExpiryTime != 0 && keyExpiryTime < expiryTime)
+            expiryTime = keyExpiryTime;
+
+        json_decref(verified);
+        verified = json_object();
+
+        if (verified != NULL &&
+            _BIDSetJsonTimestampValue(context, verified, "exp", expiryTime) == BID_S_OK)
+            _BIDSetCacheObject(context, certCache, json_string_value(cacheKey), verified);
+    }
+
+cleanup:
+    json_decref(cacheKey);
+    json_decref(verified);
+
+    return err;
+}
+
 /*
  * From https://github.com/mozilla/id-specs/blob/prod/browserid/index.md:
  *
@@ -269,6 +374,8 @@ _BIDValidateCertChain(
     json_t *rootCert = _BIDRootCert(context, backedAssertion);
     const char *szCertIssuer;
     size_t i;
+    BIDCache certCache = NULL;
+    time_t keyExpiryTime = 0;
 
     if (backedAssertion->cCertificates == 0)
         return BID_S_MISSING_CERT;
@@ -287,16 +394,25 @@ _BIDValidateCertChain(
 
     pKey = json_incref(rootKey);
 
+    _BIDGetJsonTimestampValue(context, authority, "exp", &keyExpiryTime);
+
+    /* not fatal, certificates are verified each time */
+    _BIDGetSharedCache(context, BID_VERIFIED_CERT_CACHE, &certCache);
+
     for (i = 0; i < backedAssertion->cCertificates; i++) {
         BIDJWT cert = backedAssertion->rCertificates[i];
         err = _BIDValidateExpiry(context, verificationTime, cert->Payload);
         BID_BAIL_ON_ERROR(err);
 
-        err = _BIDVerifySignature(context, cert, pKey);
+        err = _BIDVerifyCertSignature(context, certCache, cert, pKey,
+                                      keyExpiryTime, verificationTime);
         BID_BAIL_ON_ERROR(err);
 
         json_decref(pKey);
         pKey = json_incref(cert->Payload);
+
+        keyExpiryTime = 0;
+        _BIDGetJsonTimestampValue(context, cert->Payload, "exp", &keyExpiryTime);
     }
 
 cleanup:
@@ -355,6 +471,7 @@ _BIDVerifyLocal(
     BIDError err;
     BIDIdentity verifiedIdentity = BID_C_NO_IDENTITY;
     json_t *x509Certificate = NULL;
+    int bReauth = 0;
 
     if (pVerifiedIdentity != NULL)
         *pVerifiedIdentity = BID_C_NO_IDENTITY;
@@ -389,10 +506,7 @@ _BIDVerifyLocal(
             BID_ASSERT(verifyCred == NULL);
             BID_ASSERT((ulReqFlags & BID_VERIFY_FLAG_RP) == 0);
 
-            err = _BIDVerifyReauthAssertion(context, replayCache,
-                                            backedAssertion, verificationTime,
-                                            &verifiedIdentity, &verifyCred, pulRetFlags);
-            BID_BAIL_ON_ERROR(err);
+            bReauth = 1;
         } else if ((ulReqFlags & BID_VERIFY_FLAG_RP) == 0) {
             err = BID_S_INVALID_ASSERTION;
             goto cleanup;
@@ -422,10 +536,22 @@ _BIDVerifyLocal(
         *pulRetFlags |= BID_VERIFY_FLAG_VALIDATED_CERTS;
     }
 
-    BID_ASSERT(verifyCred != NULL);
+    if (bReauth) {
+        /*
+         * Verifying a re-authentication assertion looks up the ticket, checks
+         * the authenticator signature against it and makes the identity, so
+         * there is no need to verify the signature again here.
+         */
+        err = _BIDVerifyReauthAssertion(context, replayCache,
+                                        backedAssertion, verificationTime,
+                                        &verifiedIdentity, pulRetFlags);
+        BID_BAIL_ON_ERROR(err);
+    } else {
+        BID_ASSERT(verifyCred != NULL);
 
-    err = _BIDVerifyAssertionSignature(context, backedAssertion, verifyCred);
-    BID_BAIL_ON_ERROR(err);
+        err = _BIDVerifyAssertionSignature(context, backedAssertion, verifyCred);
+        BID_BAIL_ON_ERROR(err);
+    }
 
     if (verifiedIdentity == BID_C_NO_IDENTITY) {
         err = _BIDPopulateIdentity(context, backedAssertion, *pulRetFlags, &verifiedIdentity);
@@ -2883,6 +2883,53 @@ _BIDImportSecretKeyData(
     return _BIDAllocSecret(context, &keyInput, pSecretHandle);
 }
 
+BIDError
+_BIDSealData(
+    BIDContext context BID_UNUSED,
+    const unsigned char *pbKey BID_UNUSED,
+    size_t cbKey BID_UNUSED,
+    const unsigned char *pbAad BID_UNUSED,
+    size_t cbAad BID_UNUSED,
+    const unsigned char *pbData BID_UNUSED,
+    size_t cbData BID_UNUSED,
+    unsigned char **ppbSealed,
+    size_t *pcbSealed)
+{
+    *ppbSealed = NULL;
+    *pcbSealed = 0;
+
+    /* stateless tickets are not supported, the replay cache is used instead */
+    return BID_S_NOT_IMPLEMENTED;
+}
+
+BIDError
+_BIDUnsealData(
+    BIDContext context BID_UNUSED,
+    const unsigned char *pbKey BID_UNUSED,
+    size_t cbKey BID_UNUSED,
+    const unsigned char *pbAad BID_UNUSED,
+    size_t cbAad BID_UNUSED,
+    const unsigned char *pbSealed BID_UNUSED,
+    size_t cbSealed BID_UNUSED,
+    unsigned char **ppbData,
+    size_t *pcbData)
+{
+    *ppbData = NULL;
+    *pcbData = 0;
+
+    return BID_S_NOT_IMPLEMENTED;
+}
+
+BIDError
+_BIDConfigureECDHKeyPool(
+    BIDContext context BID_UNUSED,
+    uint32_t ulPoolSize BID_UNUSED,
+    uint32_t ulThreads BID_UNUSED)
+{
+    /* CNG key generation is not pooled */
+    return BID_S_OK;
+}
+
 BIDError
 _BIDGenerateECDHKey(
     BIDContext context,
@@ -248,7 +248,7 @@ _BIDMakeHttpRequest(
 
     buffer.Data[buffer.Offset] = '\0';
 
-    *pJsonDoc = json_loads(buffer.Data, 0, &context->JsonError);
+    *pJsonDoc = json_loads(buffer.Data, 0, _BIDJsonError(context));
     if (*pJsonDoc == NULL) {
         err = BID_S_INVALID_JSON;
         goto cleanup;
@@ -83,8 +83,6 @@ _BIDGetRPPrivateKey(
     json_t **pCertChain)
 {
     BIDError err;
-    json_t *privateKeyPath = NULL;
-    json_t *certificatePath = NULL;
     const char *rPaths[1] = { 0 };
     size_t cPaths = 0;
 
@@ -93,48 +91,35 @@ _BIDGetRPPrivateKey(
     if (pCertChain != NULL)
         *pCertChain = NULL;
 
-    if (context->Config == NULL) {
+    if (context->ConfigParams.Certificate == NULL) {
         err = BID_S_NO_KEY;
         goto cleanup;
     }
 
-    err = _BIDGetCacheObject(context, context->Config,
-                            "certificate", &certificatePath);
-    BID_BAIL_ON_ERROR(err);
-
-    if (!json_is_string(certificatePath)) {
-        err = BID_S_INVALID_JSON;
-        goto cleanup;
-    }
-
     /*
-     * We allow these to fail; the crypto provider may be able to
+     * The private key may be absent; the crypto provider may be able to
      * determine the private key from the certificate.
      */
-    _BIDGetCacheObject(context, context->Config,
-                       "private-key", &privateKeyPath);
-
     if (pKey != NULL) {
         err = _BIDLoadX509PrivateKey(context,
-                                     json_string_value(privateKeyPath),
-                                     json_string_value(certificatePath),
+                                     context->ConfigParams.PrivateKey,
+                                     context->ConfigParams.Certificate,
                                      pKey);
         BID_BAIL_ON_ERROR(err);
 
         BID_ASSERT(*pKey != NULL);
     }
 
-    rPaths[cPaths++] = json_string_value(certificatePath);
+    rPaths[cPaths++] = context->ConfigParams.Certificate;
 
     if (pCertChain != NULL) {
         err = _BIDLoadX509CertificateChain(context, rPaths, cPaths, pCertChain);
         BID_BAIL_ON_ERROR(err);
     }
 
-cleanup:
-    json_decref(privateKeyPath);
-    json_decref(certificatePath);
+    err = BID_S_OK;
 
+cleanup:
     return err;
 }
 
@@ -153,8 +138,8 @@ _BIDValidateX509(
 {
     BIDError err;
     json_t *certParams = NULL;
-    json_t *caCertificateFile = NULL;
-    json_t *caCertificateDir = NULL;
+    json_t *caParams = context->ConfigParams.CAParams;
+    void *iter;
 
     if (!json_is_array(certChain)) {
         err = BID_S_INVALID_PARAMETER;
@@ -162,28 +147,27 @@ _BIDValidateX509(
     }
 
     /*
-     * We make a copy of the relevant parameters as in a future iteration
-     * we may also add the user's trust anchors, which will be context-
-     * specific rather than being stored in the global RP configuration.
+     * The configured CA parameters are prepared when the configuration
+     * is loaded; we only need a copy if there are also trust anchors,
+     * which are context-specific rather than being stored in the global
+     * RP configuration.
      */
-    certParams = (certAnchors != NULL) ? json_copy(certAnchors) : json_object();
-    if (certParams == NULL) {
-        err = BID_S_NO_MEMORY;
-        goto cleanup;
-    }
-
-    if (_BIDGetCacheObject(context, context->Config,
-                           "ca-certificate", &caCertificateFile) == BID_S_OK) {
-        err = _BIDJsonObjectSet(context, certParams, "ca-certificate",
-                                caCertificateFile, 0);
-        BID_BAIL_ON_ERROR(err);
-    }
+    if (certAnchors == NULL) {
+        certParams = json_incref(caParams);
+    } else {
+        certParams = json_copy(certAnchors);
+        if (certParams == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
 
-    if (_BIDGetCacheObject(context, context->Config,
-                           "ca-directory", &caCertificateDir) == BID_S_OK) {
-        err = _BIDJsonObjectSet(context, certParams, "ca-directory",
-                                caCertificateDir, 0);
-        BID_BAIL_ON_ERROR(err);
+        for (iter = json_object_iter(caParams);
+             iter != NULL;
+             iter = json_object_iter_next(caParams, iter)) {
+            err = _BIDJsonObjectSet(context, certParams, json_object_iter_key(iter),
+                                    json_object_iter_value(iter), 0);
+            BID_BAIL_ON_ERROR(err);
+        }
     }
 
     err = _BIDValidateX509CertChain(context, certChain, certParams,
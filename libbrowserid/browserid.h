@@ -132,6 +132,9 @@ typedef enum {
     BID_S_UNKNOWN_EC_CURVE,
     BID_S_INVALID_EC_CURVE,
     BID_S_MISSING_NONCE,
+    BID_S_CONTEXT_FROZEN,
+    BID_S_CACHE_FULL,
+    BID_S_INVALID_CONFIG,
     BID_S_UNKNOWN_ERROR_CODE,
 } BIDError;
 
@@ -267,6 +270,14 @@ BIDSetContextParam(BIDContext context, BIDContextParameter ulParam, void *value)
 BIDError
 BIDGetContextParam(BIDContext context, BIDContextParameter ulParam, void **pValue);
 
+/*
+ * Make a context immutable. BIDSetContextParam will subsequently fail with
+ * BID_S_CONTEXT_FROZEN. A frozen context, and the caches it holds, may be
+ * shared by concurrent verifiers.
+ */
+BIDError
+BIDFreezeContext(BIDContext context);
+
 struct BIDIdentityDesc;
 typedef struct BIDIdentityDesc *BIDIdentity;
 
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <openssl/rsa.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * JWS signature benchmark. Times signing and verification of the same
+ * payload with RS256 and with each of the ECDSA algorithms, after checking
+ * that ECDSA signatures are rejected if tampered with or verified with a
+ * key on another curve.
+ */
+
+static BIDError
+SetBNValue(BIDContext context, json_t *jwk, const char *key, const BIGNUM *bn)
+{
+    BIDError err;
+    unsigned char buf[1024];
+    size_t cbData;
+    json_t *value = NULL;
+
+    cbData = BN_bn2bin(bn, buf);
+
+    err = _BIDJsonBinaryValue(context, buf, cbData, &value);
+    if (err == BID_S_OK)
+        err = _BIDJsonObjectSet(context, jwk, key, value, 0);
+
+    json_decref(value);
+
+    return err;
+}
+
+static BIDError
+MakeRsaKey(BIDContext context, int bits, json_t **pKey)
+{
+    BIDError err;
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+    json_t *key = json_object();
+
+    BN_set_word(e, RSA_F4);
+
+    if (!RSA_generate_key_ex(rsa, bits, e, NULL)) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    json_object_set_new(key, "algorithm", json_string("RS"));
+    json_object_set_new(key, "version", json_string("2012.08.15"));
+
+    err = SetBNValue(context, key, "n", rsa->n);
+    BID_BAIL_ON_ERROR(err);
+
+    err = SetBNValue(context, key, "e", rsa->e);
+    BID_BAIL_ON_ERROR(err);
+
+    err = SetBNValue(context, key, "d", rsa->d);
+    BID_BAIL_ON_ERROR(err);
+
+    *pKey = json_incref(key);
+
+cleanup:
+    RSA_free(rsa);
+    BN_free(e);
+    json_decref(key);
+
+    return err;
+}
+
+static BIDError
+MakeEcKey(BIDContext context, const char *szCurve, json_t **pKey)
+{
+    BIDError err;
+    json_t *params = json_object();
+    json_t *ecKey = NULL;
+    json_t *key = json_object();
+
+    json_object_set_new(params, "kty", json_string("EC"));
+    json_object_set_new(params, "crv", json_string(szCurve));
+
+    err = _BIDGenerateECDHKey(context, params, &ecKey);
+    BID_BAIL_ON_ERROR(err);
+
+    json_object_set_new(key, "algorithm", json_string("ES"));
+    json_object_set_new(key, "version", json_string("2012.08.15"));
+    json_object_set_new(key, "kty", json_string("EC"));
+    json_object_set_new(key, "crv", json_string(szCurve));
+    json_object_set(key, "x", json_object_get(ecKey, "x"));
+    json_object_set(key, "y", json_object_get(ecKey, "y"));
+    json_object_set(key, "d", json_object_get(ecKey, "d"));
+
+    *pKey = json_incref(key);
+
+cleanup:
+    json_decref(params);
+    json_decref(ecKey);
+    json_decref(key);
+
+    return err;
+}
+
+/*
+ * Make a standard EC public JWK, which names only its key type, so that
+ * the key is matched to an algorithm by its curve.
+ */
+static json_t *
+MakePublicKey(json_t *key)
+{
+    json_t *jwk = json_object();
+
+    json_object_set(jwk, "kty", json_object_get(key, "kty"));
+    json_object_set(jwk, "crv", json_object_get(key, "crv"));
+    json_object_set(jwk, "x", json_object_get(key, "x"));
+    json_object_set(jwk, "y", json_object_get(key, "y"));
+
+    return jwk;
+}
+
+static BIDError
+TestVerifyFailures(BIDContext context, json_t *key, json_t *wrongCurveKey)
+{
+    BIDError err;
+    BIDJWT jwt = NULL;
+    char *szJwt = NULL;
+    size_t cchJwt;
+    json_t *publicKey = MakePublicKey(key);
+    json_t *wrongPublicKey = MakePublicKey(wrongCurveKey);
+
+    jwt = BIDCalloc(1, sizeof(*jwt));
+    if (jwt == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    jwt->Payload = json_object();
+    json_object_set_new(jwt->Payload, "aud", json_string("host/localhost"));
+
+    err = _BIDMakeSignature(context, jwt, key, NULL, &szJwt, &cchJwt);
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDReleaseJWT(context, jwt);
+    jwt = NULL;
+
+    err = _BIDParseJWT(context, szJwt, &jwt);
+    BID_BAIL_ON_ERROR(err);
+
+    /* the public key alone must verify the untampered signature */
+    err = _BIDVerifySignature(context, jwt, publicKey);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDVerifySignature(context, jwt, wrongPublicKey);
+    if (err == BID_S_OK) {
+        fprintf(stderr, "%s signature verified with a %s key\n",
+                json_string_value(json_object_get(jwt->Header, "alg")),
+                json_string_value(json_object_get(wrongCurveKey, "crv")));
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    jwt->Signature[jwt->SignatureLength / 2] ^= 0x01;
+
+    err = _BIDVerifySignature(context, jwt, publicKey);
+    if (err != BID_S_INVALID_SIGNATURE) {
+        fprintf(stderr, "%s tampered signature not rejected\n",
+                json_string_value(json_object_get(jwt->Header, "alg")));
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    _BIDReleaseJWT(context, jwt);
+    BIDFree(szJwt);
+    json_decref(publicKey);
+    json_decref(wrongPublicKey);
+
+    return err;
+}
+
+static double
+Elapsed(struct timeval *start)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+
+    return (end.tv_sec - start->tv_sec) * 1000000.0 + (end.tv_usec - start->tv_usec);
+}
+
+static BIDError
+Benchmark(BIDContext context, json_t *key, int cIterations)
+{
+    BIDError err = BID_S_OK;
+    BIDJWT jwt = NULL;
+    char *szJwt = NULL;
+    size_t cchJwt;
+    struct timeval start;
+    double signTime, verifyTime;
+    int i;
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < cIterations; i++) {
+        jwt = BIDCalloc(1, sizeof(*jwt));
+        if (jwt == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        jwt->Payload = json_object();
+        json_object_set_new(jwt->Payload, "aud", json_string("host/localhost"));
+        json_object_set_new(jwt->Payload, "exp", json_integer(1300819380));
+
+        BIDFree(szJwt);
+        szJwt = NULL;
+
+        err = _BIDMakeSignature(context, jwt, key, NULL, &szJwt, &cchJwt);
+        BID_BAIL_ON_ERROR(err);
+
+        _BIDReleaseJWT(context, jwt);
+        jwt = NULL;
+    }
+
+    signTime = Elapsed(&start);
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < cIterations; i++) {
+        err = _BIDParseJWT(context, szJwt, &jwt);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDVerifySignature(context, jwt, key);
+        BID_BAIL_ON_ERROR(err);
+
+        _BIDReleaseJWT(context, jwt);
+        jwt = NULL;
+    }
+
+    verifyTime = Elapsed(&start);
+
+    err = _BIDParseJWT(context, szJwt, &jwt);
+    BID_BAIL_ON_ERROR(err);
+
+    printf("%-6s sign %8.1fus/op  verify %8.1fus/op  signature %zu bytes\n",
+           json_string_value(json_object_get(jwt->Header, "alg")),
+           signTime / cIterations, verifyTime / cIterations, jwt->SignatureLength);
+
+cleanup:
+    _BIDReleaseJWT(context, jwt);
+    BIDFree(szJwt);
+
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    BIDError err;
+    BIDContext context = NULL;
+    json_t *keys[4] = { NULL };
+    int i, cIterations = 1000;
+    const char *s;
+
+    if (argc > 1)
+        cIterations = atoi(argv[1]);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = MakeRsaKey(context, 2048, &keys[0]);
+    BID_BAIL_ON_ERROR(err);
+
+    err = MakeEcKey(context, BID_ECDH_CURVE_P256, &keys[1]);
+    BID_BAIL_ON_ERROR(err);
+
+    err = MakeEcKey(context, BID_ECDH_CURVE_P384, &keys[2]);
+    BID_BAIL_ON_ERROR(err);
+
+    err = MakeEcKey(context, BID_ECDH_CURVE_P521, &keys[3]);
+    BID_BAIL_ON_ERROR(err);
+
+    for (i = 1; i < 4; i++) {
+        err = TestVerifyFailures(context, keys[i], keys[i % 3 + 1]);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    for (i = 0; i < 4; i++) {
+        err = Benchmark(context, keys[i], cIterations);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+cleanup:
+    for (i = 0; i < 4; i++)
+        json_decref(keys[i]);
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+#include "bid_test.h"
+
+/*
+ * Multithreaded verification stress test. A single frozen relying party
+ * context and its replay cache are shared by all threads, each of which
+ * verifies its own batch of re-authentication assertions and decodes
+ * malformed JSON to exercise the per-thread error state. Build with
+ * -fsanitize=thread to check for data races.
+ */
+
+struct StressThreadArgs {
+    BIDContext Context;
+    char **Assertions;
+    int cAssertions;
+    time_t Now;
+    BIDError Error;
+};
+
+static void *
+StressThread(void *arg)
+{
+    struct StressThreadArgs *args = arg;
+    BIDError err = BID_S_OK;
+    int i;
+
+    for (i = 0; i < args->cAssertions; i++) {
+        BIDIdentity verifiedIdentity = NULL;
+        json_t *j = NULL;
+        json_error_t *jsonError = NULL;
+        time_t expiryTime;
+        uint32_t ulRetFlags = 0;
+
+        err = BIDVerifyAssertion(args->Context, NULL, args->Assertions[i], AUDIENCE,
+                                 NULL, 0, args->Now, BID_VERIFY_FLAG_REAUTH,
+                                 &verifiedIdentity, &expiryTime, &ulRetFlags);
+        BIDReleaseIdentity(args->Context, verifiedIdentity);
+        BID_BAIL_ON_ERROR(err);
+
+        if ((ulRetFlags & BID_VERIFY_FLAG_REAUTH) == 0) {
+            err = BID_S_NOT_REAUTH_ASSERTION;
+            goto cleanup;
+        }
+
+        /* "{" */
+        err = _BIDDecodeJson(args->Context, "ew", &j);
+        if (err != BID_S_INVALID_JSON) {
+            json_decref(j);
+            err = BID_S_UNKNOWN_ERROR_CODE;
+            goto cleanup;
+        }
+
+        BIDGetContextParam(args->Context, BID_PARAM_JSON_ERROR_INFO, (void **)&jsonError);
+        if (jsonError == NULL || jsonError->line != 1) {
+            err = BID_S_UNKNOWN_ERROR_CODE;
+            goto cleanup;
+        }
+
+        err = BID_S_OK;
+    }
+
+cleanup:
+    args->Error = err;
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    BIDError err;
+    BIDContext rpContext = NULL, uaContext = NULL;
+    BIDIdentity identity = NULL;
+    char **rgszAssertions = NULL;
+    int i, cThreads = 8, cIterations = 1000;
+    time_t now = time(NULL);
+    pthread_t *threads = NULL;
+    struct StressThreadArgs *args = NULL;
+    const char *s;
+
+    if (argc > 1)
+        cThreads = atoi(argv[1]);
+    if (argc > 2)
+        cIterations = atoi(argv[2]);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE |
+                            BID_CONTEXT_REAUTH | BID_CONTEXT_ECDH_KEYEX, NULL, &rpContext);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(rpContext, BID_PARAM_REPLAY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDFreezeContext(rpContext);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_USER_AGENT | BID_CONTEXT_TICKET_CACHE |
+                            BID_CONTEXT_REAUTH | BID_CONTEXT_ECDH_KEYEX, NULL, &uaContext);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(uaContext, BID_PARAM_TICKET_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = MakeIdentity(rpContext, now, &identity);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUpdateReplayCache(rpContext, NULL, identity, "bid_mtv", now, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDStoreTicketInCache(uaContext, identity, AUDIENCE,
+                                 json_object_get(identity->PrivateAttributes, "tkt"), 0);
+    BID_BAIL_ON_ERROR(err);
+
+    rgszAssertions = calloc(cThreads * cIterations, sizeof(char *));
+    threads = calloc(cThreads, sizeof(pthread_t));
+    args = calloc(cThreads, sizeof(*args));
+    if (rgszAssertions == NULL || threads == NULL || args == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    for (i = 0; i < cThreads * cIterations; i++) {
+        err = _BIDGetReauthAssertion(uaContext, NULL, AUDIENCE, NULL, 0, NULL, 0,
+                                     &rgszAssertions[i], NULL, NULL, NULL);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    for (i = 0; i < cThreads; i++) {
+        args[i].Context = rpContext;
+        args[i].Assertions = &rgszAssertions[i * cIterations];
+        args[i].cAssertions = cIterations;
+        args[i].Now = now;
+        args[i].Error = BID_S_OK;
+
+        if (pthread_create(&threads[i], NULL, StressThread, &args[i]) != 0) {
+            cThreads = i;
+            err = BID_S_NO_MEMORY;
+            break;
+        }
+    }
+
+    for (i = 0; i < cThreads; i++) {
+        pthread_join(threads[i], NULL);
+        if (err == BID_S_OK)
+            err = args[i].Error;
+    }
+    BID_BAIL_ON_ERROR(err);
+
+    printf("%d threads verified %d re-authentications each\n", cThreads, cIterations);
+
+cleanup:
+    if (rgszAssertions != NULL) {
+        for (i = 0; i < cThreads * cIterations; i++)
+            BIDFree(rgszAssertions[i]);
+        free(rgszAssertions);
+    }
+    free(threads);
+    free(args);
+    BIDReleaseIdentity(rpContext, identity);
+    BIDReleaseContext(rpContext);
+    BIDReleaseContext(uaContext);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+#include "bid_test.h"
+
+/*
+ * Re-authentication verification benchmark. Checks replay detection, then
+ * issues a ticket for a synthetic identity and times BIDVerifyAssertion over
+ * a batch of authenticators.
+ *
+ * Only interfaces that predate single-pass verification of re-authentication
+ * assertions are used, so this directory can be copied into a checkout from
+ * before that change to compare the two.
+ */
+
+/*
+ * An assertion recorded in the replay cache must be rejected if presented
+ * again, whether the ticket credentials are stored in the replay cache or
+ * sealed under a ticket key.
+ */
+static BIDError
+TestReplayDetection(time_t now, int bStatelessTickets)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    BIDIdentity identity = NULL;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE |
+                            BID_CONTEXT_REAUTH | BID_CONTEXT_ECDH_KEYEX, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_REPLAY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    if (bStatelessTickets) {
+        /* as if ticketkeycache were configured */
+        err = _BIDAcquireCache(context, "memory:", 0, &context->TicketKeyCache);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = MakeIdentity(context, now, &identity);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCheckReplayCache(context, NULL, "bid_rab-replay", now);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUpdateReplayCache(context, NULL, identity, "bid_rab-replay", now, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCheckReplayCache(context, NULL, "bid_rab-replay", now + 1);
+    if (err == BID_S_REPLAYED_ASSERTION) {
+        err = BID_S_OK;
+    } else {
+        fprintf(stderr, "replayed assertion not detected (%s tickets)\n",
+                bStatelessTickets ? "stateless" : "stateful");
+        if (err == BID_S_OK)
+            err = BID_S_INVALID_ASSERTION;
+    }
+
+cleanup:
+    BIDReleaseIdentity(context, identity);
+    BIDReleaseContext(context);
+
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    BIDError err;
+    BIDContext rpContext = NULL, uaContext = NULL;
+    BIDIdentity identity = NULL;
+    char **rgszAssertions = NULL;
+    int i, cIterations = 10000;
+    time_t now = time(NULL);
+    struct timeval start, end;
+    double elapsed;
+    const char *s;
+
+    if (argc > 1)
+        cIterations = atoi(argv[1]);
+
+    err = TestReplayDetection(now, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = TestReplayDetection(now, 1);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE |
+                            BID_CONTEXT_REAUTH | BID_CONTEXT_ECDH_KEYEX, NULL, &rpContext);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(rpContext, BID_PARAM_REPLAY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_USER_AGENT | BID_CONTEXT_TICKET_CACHE |
+                            BID_CONTEXT_REAUTH | BID_CONTEXT_ECDH_KEYEX, NULL, &uaContext);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(uaContext, BID_PARAM_TICKET_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = MakeIdentity(rpContext, now, &identity);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUpdateReplayCache(rpContext, NULL, identity, "bid_rab", now, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDStoreTicketInCache(uaContext, identity, AUDIENCE,
+                                 json_object_get(identity->PrivateAttributes, "tkt"), 0);
+    BID_BAIL_ON_ERROR(err);
+
+    rgszAssertions = calloc(cIterations, sizeof(char *));
+    if (rgszAssertions == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    for (i = 0; i < cIterations; i++) {
+        err = _BIDGetReauthAssertion(uaContext, NULL, AUDIENCE, NULL, 0, NULL, 0,
+                                     &rgszAssertions[i], NULL, NULL, NULL);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < cIterations; i++) {
+        BIDIdentity verifiedIdentity = NULL;
+        time_t expiryTime;
+        uint32_t ulRetFlags;
+
+        err = BIDVerifyAssertion(rpContext, NULL, rgszAssertions[i], AUDIENCE,
+                                 NULL, 0, now, BID_VERIFY_FLAG_REAUTH,
+                                 &verifiedIdentity, &expiryTime, &ulRetFlags);
+        BID_BAIL_ON_ERROR(err);
+
+        BID_ASSERT(ulRetFlags & BID_VERIFY_FLAG_REAUTH);
+
+        BIDReleaseIdentity(rpContext, verifiedIdentity);
+    }
+
+    gettimeofday(&end, NULL);
+
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+
+    printf("%d re-authentications in %.0fus (%.1fus/op)\n",
+           cIterations, elapsed, elapsed / cIterations);
+
+cleanup:
+    if (rgszAssertions != NULL) {
+        for (i = 0; i < cIterations; i++)
+            BIDFree(rgszAssertions[i]);
+        free(rgszAssertions);
+    }
+    BIDReleaseIdentity(rpContext, identity);
+    BIDReleaseContext(rpContext);
+    BIDReleaseContext(uaContext);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
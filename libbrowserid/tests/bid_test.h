@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BID_TEST_H_
+#define _BID_TEST_H_ 1
+
+/*
+ * Helpers shared by the re-authentication tests.
+ */
+
+#define AUDIENCE    "host/localhost"
+
+/*
+ * Make a verified identity for AUDIENCE, with a fixed session key, from
+ * which a re-authentication ticket can be issued.
+ */
+static BIDError
+MakeIdentity(BIDContext context, time_t now, BIDIdentity *pIdentity)
+{
+    BIDError err;
+    BIDIdentity identity = NULL;
+    unsigned char secret[32];
+
+    memset(secret, 0x5a, sizeof(secret));
+
+    err = _BIDAllocIdentity(context, NULL, &identity);
+    BID_BAIL_ON_ERROR(err);
+
+    json_object_set_new(identity->Attributes, "sub", json_string("test@example.com"));
+    json_object_set_new(identity->Attributes, "iss", json_string("example.com"));
+    _BIDSetJsonTimestampValue(context, identity->Attributes, "exp", now + 3600);
+
+    json_object_set_new(identity->PrivateAttributes, "aud", json_string(AUDIENCE));
+    json_object_set_new(identity->PrivateAttributes, "crv", json_string(BID_ECDH_CURVE_P256));
+    _BIDSetJsonTimestampValue(context, identity->PrivateAttributes, "a-exp", now + 300);
+
+    err = _BIDImportSecretKeyData(context, secret, sizeof(secret), &identity->SecretHandle);
+    BID_BAIL_ON_ERROR(err);
+
+    *pIdentity = identity;
+    identity = NULL;
+
+cleanup:
+    BIDReleaseIdentity(context, identity);
+
+    return err;
+}
+
+#endif /* _BID_TEST_H_ */
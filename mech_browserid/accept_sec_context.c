@@ -123,24 +123,17 @@ gssBidAcceptSecContext(OM_uint32 *minor,
                        OM_uint32 *time_rec GSSBID_UNUSED,
                        gss_cred_id_t *delegated_cred_handle GSSBID_UNUSED)
 {
-    OM_uint32 major, tmpMajor, tmpMinor;
+    OM_uint32 major, tmpMajor;
     BIDError err;
     char *szAssertion = NULL;
-    gss_buffer_desc bufAudienceOrSpn = GSS_C_EMPTY_BUFFER;
+    const char *szAudienceOrSpn = NULL;
     const unsigned char *pbChannelBindings = NULL;
     size_t cbChannelBindings = 0;
     uint32_t ulBidFlags = 0;
 
     if (cred == GSS_C_NO_CREDENTIAL) {
         if (ctx->cred == GSS_C_NO_CREDENTIAL) {
-            major = gssBidAcquireCred(minor,
-                                      GSS_C_NO_NAME,
-                                      GSS_C_INDEFINITE,
-                                      GSS_C_NO_OID_SET,
-                                      GSS_C_ACCEPT,
-                                      &ctx->cred,
-                                      NULL,
-                                      NULL);
+            major = gssBidAcquireDefaultAcceptorCred(minor, &ctx->cred);
             if (GSS_ERROR(major))
                 goto cleanup;
         }
@@ -164,11 +157,9 @@ gssBidAcceptSecContext(OM_uint32 *minor,
             goto cleanup;
     }
 
-    if (cred->name != GSS_C_NO_NAME) {
-        major = gssBidDisplayName(minor, cred->name, &bufAudienceOrSpn, NULL);
-        if (GSS_ERROR(major))
-            goto cleanup;
-    }
+    major = gssBidCredAudienceOrSpn(minor, cred, &szAudienceOrSpn);
+    if (GSS_ERROR(major))
+        goto cleanup;
 
     if (input_chan_bindings != GSS_C_NO_CHANNEL_BINDINGS) {
         pbChannelBindings = (const unsigned char *)input_chan_bindings->application_data.value;
@@ -181,7 +172,7 @@ gssBidAcceptSecContext(OM_uint32 *minor,
         err = BIDVerifyAssertion(ctx->bidContext,
                                  cred->bidReplayCache,
                                  szAssertion,
-                                 (char *)bufAudienceOrSpn.value,
+                                 szAudienceOrSpn,
                                  pbChannelBindings,
                                  cbChannelBindings,
                                  time(NULL),
@@ -261,7 +252,6 @@ gssBidAcceptSecContext(OM_uint32 *minor,
     GSSBID_ASSERT(CTX_IS_ESTABLISHED(ctx) || major == GSS_S_CONTINUE_NEEDED);
 
 cleanup:
-    gss_release_buffer(&tmpMinor, &bufAudienceOrSpn);
     GSSBID_FREE(szAssertion);
 
     return major;
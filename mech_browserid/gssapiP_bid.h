@@ -152,6 +152,8 @@ struct gss_name_struct
     OM_uint32 flags;
     gss_OID mechanismUsed; /* this is immutable */
     krb5_principal krbPrincipal; /* this is immutable */
+    gss_buffer_desc displayName; /* rendered from krbPrincipal */
+    uint32_t hash; /* of displayName */
 #ifdef GSSBID_ENABLE_ACCEPTOR
     struct BIDGSSAttributeContext *attrCtx;
 #endif
@@ -173,9 +175,11 @@ struct gss_cred_id_struct
 #endif
 {
     GSSBID_MUTEX mutex;
+    OM_uint32 refCount;
     OM_uint32 flags;
     gss_name_t name;
     gss_name_t target; /* for initiator */
+    gss_buffer_desc audienceOrSpn; /* display form of name, for acceptor */
     gss_buffer_desc assertion;
     gss_OID_set mechanisms;
     time_t expiryTime;
@@ -218,6 +222,8 @@ struct gss_ctx_id_struct
     void *seqState;
     gss_cred_id_t cred;
     BIDContext bidContext;
+    unsigned int bidContextSlot;        /* context pool slot */
+    unsigned int bidContextGeneration;  /* context pool generation */
     BIDIdentity bidIdentity;
     struct gss_bid_initiator_ctx {
         gss_buffer_desc serverSubject;
@@ -159,7 +159,7 @@ gssBidInitResponseToken(OM_uint32 *minor,
                        OM_uint32 *ret_flags GSSBID_UNUSED,
                        OM_uint32 *time_rec GSSBID_UNUSED)
 {
-    OM_uint32 major, tmpMinor;
+    OM_uint32 major;
     json_t *response = NULL;
     json_t *tkt = NULL;
     char *szAssertion = NULL;
@@ -194,7 +194,7 @@ gssBidInitResponseToken(OM_uint32 *minor,
         goto cleanup;
 
     if (target_name != GSS_C_NO_NAME) {
-        major = gssBidDisplayName(minor, target_name, &bufAudienceOrSpn, NULL);
+        major = gssBidBorrowDisplayName(minor, target_name, &bufAudienceOrSpn, NULL);
         if (GSS_ERROR(major))
             goto cleanup;
     }
@@ -277,7 +277,6 @@ gssBidInitResponseToken(OM_uint32 *minor,
 cleanup:
     GSSBID_FREE(szAssertion);
     json_decref(response);
-    gss_release_buffer(&tmpMinor, &bufAudienceOrSpn);
 
     return major;
 }
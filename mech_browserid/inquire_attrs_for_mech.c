@@ -101,13 +101,8 @@ gss_inquire_attrs_for_mech(OM_uint32 *minor,
      */
     err = BIDAcquireContext(GSSBID_CONFIG_FILE, BID_CONTEXT_GSS, NULL, &bidContext);
     if (err == BID_S_OK) {
-        BIDCache config = NULL;
-
-        err = BIDGetContextParam(bidContext, BID_PARAM_CONFIG_CACHE, (void **)&config);
-
-        if (err == BID_S_OK &&
-            (_BIDGetCacheObject(bidContext, bidContext->Config, "ca-certificate", NULL) == BID_S_OK ||
-             _BIDGetCacheObject(bidContext, bidContext->Config, "ca-directory", NULL)   == BID_S_OK))
+        if (bidContext->ConfigParams.CACertificate != NULL ||
+            bidContext->ConfigParams.CADirectory   != NULL)
             MA_SUPPORTED(GSS_C_MA_AUTH_TARG_INIT);
     }
 #endif
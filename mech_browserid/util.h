@@ -231,6 +231,12 @@ OM_uint32 gssBidAllocContext(OM_uint32 *minor,
                              gss_ctx_id_t *pCtx);
 OM_uint32 gssBidReleaseContext(OM_uint32 *minor, gss_ctx_id_t *pCtx);
 
+void
+gssBidFinalizeContextPool(void);
+
+time_t
+gssBidConfigModTime(void);
+
 OM_uint32
 gssBidVerifyToken(OM_uint32 *minor,
                   const gss_buffer_t inputToken,
@@ -257,6 +263,18 @@ gssBidContextTime(OM_uint32 *minor,
 /* util_cred.c */
 OM_uint32 gssBidAllocCred(OM_uint32 *minor, gss_cred_id_t *pCred);
 OM_uint32 gssBidReleaseCred(OM_uint32 *minor, gss_cred_id_t *pCred);
+gss_cred_id_t gssBidReferenceCred(gss_cred_id_t cred);
+
+OM_uint32
+gssBidAcquireDefaultAcceptorCred(OM_uint32 *minor, gss_cred_id_t *pCred);
+
+void
+gssBidReleaseDefaultAcceptorCred(void);
+
+OM_uint32
+gssBidCredAudienceOrSpn(OM_uint32 *minor,
+                        gss_cred_id_t cred,
+                        const char **pszAudienceOrSpn);
 
 gss_OID
 gssBidPrimaryMechForCred(gss_cred_id_t cred);
@@ -637,6 +655,13 @@ gssBidCanonicalizeName(OM_uint32 *minor,
                        const gss_OID mech_type,
                        gss_name_t *dest_name);
 
+/* output buffer is owned by the name and must not be released */
+OM_uint32
+gssBidBorrowDisplayName(OM_uint32 *minor,
+                        gss_name_t name,
+                        gss_buffer_t output_name_buffer,
+                        gss_OID *output_name_type);
+
 OM_uint32
 gssBidDisplayName(OM_uint32 *minor,
                   gss_name_t name,
@@ -141,6 +141,8 @@ BIDGSSAttributeContext::unregisterProvider(unsigned int type)
 BIDGSSAttributeContext::BIDGSSAttributeContext(void)
 {
     m_flags = 0;
+    m_pending = 0;
+    m_resolvingName = GSS_C_NO_NAME;
 
     for (unsigned int i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
         BIDGSSAttributeProvider *provider;
@@ -152,6 +154,14 @@ BIDGSSAttributeContext::BIDGSSAttributeContext(void)
         }
 
         m_providers[i] = provider;
+
+        /* Prefixes are constant, so look them up once */
+        m_prefixes[i].value = (provider != NULL) ? (void *)provider->prefix() : NULL;
+        m_prefixes[i].length = (m_prefixes[i].value != NULL) ?
+            strlen((char *)m_prefixes[i].value) : 0;
+
+        m_serialized[i].length = 0;
+        m_serialized[i].value = NULL;
     }
 }
 
@@ -164,17 +174,14 @@ BIDGSSAttributeContext::attributePrefixToType(const gss_buffer_t prefix) const
     unsigned int i;
 
     for (i = ATTR_TYPE_MIN; i < ATTR_TYPE_MAX; i++) {
-        const char *pprefix;
-
-        if (!providerEnabled(i))
+        if (m_prefixes[i].length != prefix->length ||
+            m_prefixes[i].value == NULL)
             continue;
 
-        pprefix = m_providers[i]->prefix();
-        if (pprefix == NULL)
+        if (!providerEnabled(i))
             continue;
 
-        if (strlen(pprefix) == prefix->length &&
-            memcmp(pprefix, prefix->value, prefix->length) == 0)
+        if (memcmp(m_prefixes[i].value, prefix->value, prefix->length) == 0)
             return i;
     }
 
@@ -195,11 +202,7 @@ BIDGSSAttributeContext::attributeTypeToPrefix(unsigned int type) const
     if (!providerEnabled(type))
         return prefix;
 
-    prefix.value = (void *)m_providers[type]->prefix();
-    if (prefix.value != NULL)
-        prefix.length = strlen((char *)prefix.value);
-
-    return prefix;
+    return m_prefixes[type];
 }
 
 bool
@@ -220,6 +223,55 @@ BIDGSSAttributeContext::releaseProvider(unsigned int type)
 {
     delete m_providers[type];
     m_providers[type] = NULL;
+    releaseSerializedProvider(type);
+}
+
+/*
+ * Save a provider's imported state, to be decoded when it is first used
+ */
+void
+BIDGSSAttributeContext::setSerializedProvider(unsigned int type,
+                                              const unsigned char *value,
+                                              size_t length)
+{
+    OM_uint32 minor;
+    gss_buffer_desc source;
+    char *s;
+
+    releaseSerializedProvider(type);
+
+    source.length = length;
+    source.value = (void *)value;
+
+    /* NUL-terminate for the JSON parser */
+    if (GSS_ERROR(bufferToString(&minor, &source, &s)))
+        throw std::bad_alloc();
+
+    m_serialized[type].length = length;
+    m_serialized[type].value = s;
+}
+
+void
+BIDGSSAttributeContext::releaseSerializedProvider(unsigned int type)
+{
+    GSSBID_FREE(m_serialized[type].value);
+    m_serialized[type].length = 0;
+    m_serialized[type].value = NULL;
+}
+
+bool
+BIDGSSAttributeContext::decodeSerializedProvider(unsigned int type)
+{
+    json_error_t error;
+    bool ret = false;
+
+    JSONObject source = JSONObject::load((const char *)m_serialized[type].value, 0, &error);
+    if (!source.isNull())
+        ret = m_providers[type]->initWithJsonObject(this, source);
+
+    releaseSerializedProvider(type);
+
+    return ret;
 }
 
 /*
@@ -240,6 +292,17 @@ BIDGSSAttributeContext::initWithExistingContext(const BIDGSSAttributeContext *ma
             continue;
         }
 
+        /* Providers not yet resolved in the source remain deferred */
+        if (manager->m_pending & ATTR_TYPE_MASK(i)) {
+            m_pending |= ATTR_TYPE_MASK(i);
+            if (manager->m_serialized[i].value != NULL) {
+                setSerializedProvider(i,
+                                      (const unsigned char *)manager->m_serialized[i].value,
+                                      manager->m_serialized[i].length);
+            }
+            continue;
+        }
+
         provider = m_providers[i];
 
         ret = provider->initWithExistingContext(this,
@@ -253,6 +316,29 @@ BIDGSSAttributeContext::initWithExistingContext(const BIDGSSAttributeContext *ma
     return ret;
 }
 
+/*
+ * Only the primary provider needs the security context. The others derive
+ * their attributes from it, and resolving them can be costly, so defer
+ * this until the attributes are first used. A SAML assertion is the
+ * exception: its NotOnOrAfter bounds the lifetime of the security context,
+ * so it is parsed as soon as the primary provider is known to carry one.
+ */
+bool
+BIDGSSAttributeContext::deferProvider(unsigned int type) const
+{
+    if (type == ATTR_TYPE_MIN)
+        return false;
+
+#ifdef HAVE_OPENSAML
+    if (type == ATTR_TYPE_SAML_ASSERTION &&
+        m_providers[ATTR_TYPE_JWT] != NULL &&
+        m_providers[ATTR_TYPE_JWT]->jsonRepresentation().get("saml").isString())
+        return false;
+#endif
+
+    return true;
+}
+
 /*
  * Initialize a context from a GSS credential and context.
  */
@@ -275,6 +361,11 @@ BIDGSSAttributeContext::initWithGssContext(const gss_cred_id_t cred,
             continue;
         }
 
+        if (deferProvider(i)) {
+            m_pending |= ATTR_TYPE_MASK(i);
+            continue;
+        }
+
         provider = m_providers[i];
 
         ret = provider->initWithGssContext(this, cred, ctx);
@@ -287,6 +378,64 @@ BIDGSSAttributeContext::initWithGssContext(const gss_cred_id_t cred,
     return ret;
 }
 
+/*
+ * Initialize any providers deferred by initWithGssContext() or imported
+ * but not yet decoded. The name to which this context belongs stands in
+ * for the initiator name of the security context, which may no longer
+ * exist. When exporting, undecoded providers are left alone as they can
+ * be exported as they are.
+ */
+bool
+BIDGSSAttributeContext::resolveProviders(gss_name_t name, bool exporting)
+{
+    uint32_t pending = m_pending;
+    bool ret = true;
+
+    if (pending == 0)
+        return true;
+
+    if (exporting) {
+        bool resolve = false;
+
+        for (unsigned int i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
+            if ((pending & ATTR_TYPE_MASK(i)) &&
+                providerEnabled(i) &&
+                m_providers[i]->name() != NULL &&
+                m_serialized[i].value == NULL)
+                resolve = true;
+        }
+
+        if (!resolve)
+            return true;
+    }
+
+    /* Providers may export the name, which must not resolve again */
+    m_pending = 0;
+    m_resolvingName = name;
+
+    for (unsigned int i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
+        BIDGSSAttributeProvider *provider;
+
+        if ((pending & ATTR_TYPE_MASK(i)) == 0 || !providerEnabled(i))
+            continue;
+
+        provider = m_providers[i];
+
+        if (ret && m_serialized[i].value != NULL)
+            ret = decodeSerializedProvider(i);
+        else if (ret)
+            ret = provider->initWithGssContext(this,
+                                               GSS_C_NO_CREDENTIAL,
+                                               GSS_C_NO_CONTEXT);
+        if (ret == false)
+            releaseProvider(i);
+    }
+
+    m_resolvingName = GSS_C_NO_NAME;
+
+    return ret;
+}
+
 bool
 BIDGSSAttributeContext::initWithJsonObject(JSONObject &obj)
 {
@@ -350,34 +499,59 @@ BIDGSSAttributeContext::initWithJsonObject(JSONObject &obj)
     return true;
 }
 
-JSONObject
-BIDGSSAttributeContext::jsonRepresentation(void) const
+/*
+ * Initialize a context from a binary export token. Provider sources are
+ * only saved here; resolveProviders() decodes them.
+ */
+bool
+BIDGSSAttributeContext::initWithBinaryBuffer(const gss_buffer_t buffer)
 {
-    JSONObject obj, sources;
-    unsigned int i;
+    const unsigned char *p = (const unsigned char *)buffer->value;
+    size_t remain = buffer->length;
+    unsigned int type;
 
-    obj.set("version", 1);
-    obj.set("flags", m_flags);
+    if (remain < 6 ||
+        p[0] != ATTR_CTX_EXPORT_BINARY ||
+        p[1] != ATTR_CTX_EXPORT_VERSION)
+        return false;
 
-    for (i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
-        BIDGSSAttributeProvider *provider;
-        const char *key;
+    m_flags = load_uint32_be(&p[2]);
 
-        provider = m_providers[i];
-        if (provider == NULL)
-            continue; /* provider not initialised */
+    p += 6;
+    remain -= 6;
 
-        key = provider->name();
-        if (key == NULL)
-            continue; /* provider does not have state */
-
-        JSONObject source = provider->jsonRepresentation();
-        sources.set(key, source);
+    for (type = ATTR_TYPE_MIN; type <= ATTR_TYPE_MAX; type++) {
+        if (!providerEnabled(type))
+            releaseProvider(type);
+        else if (m_providers[type]->name() == NULL)
+            m_pending |= ATTR_TYPE_MASK(type); /* derived from other providers */
     }
 
-    obj.set("sources", sources);
+    while (remain != 0) {
+        size_t length;
+
+        if (remain < 5)
+            return false;
+
+        type = p[0];
+        length = load_uint32_be(&p[1]);
+
+        p += 5;
+        remain -= 5;
+
+        if (type > ATTR_TYPE_MAX || length > remain)
+            return false;
+
+        if (providerEnabled(type) && m_providers[type]->name() != NULL) {
+            setSerializedProvider(type, p, length);
+            m_pending |= ATTR_TYPE_MASK(type);
+        }
 
-    return obj;
+        p += length;
+        remain -= length;
+    }
+
+    return true;
 }
 
 /*
@@ -391,6 +565,10 @@ BIDGSSAttributeContext::initWithBuffer(const gss_buffer_t buffer)
     char *s;
     json_error_t error;
 
+    if (buffer->length != 0 &&
+        ((unsigned char *)buffer->value)[0] == ATTR_CTX_EXPORT_BINARY)
+        return initWithBinaryBuffer(buffer);
+
     major = bufferToString(&minor, buffer, &s);
     if (GSS_ERROR(major))
         return false;
@@ -408,8 +586,10 @@ BIDGSSAttributeContext::initWithBuffer(const gss_buffer_t buffer)
 
 BIDGSSAttributeContext::~BIDGSSAttributeContext(void)
 {
-    for (unsigned int i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++)
+    for (unsigned int i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
         delete m_providers[i];
+        releaseSerializedProvider(i);
+    }
 }
 
 /*
@@ -631,24 +811,80 @@ BIDGSSAttributeContext::releaseAnyNameMapping(gss_buffer_t type_id,
 }
 
 /*
- * Export attribute context to buffer
+ * Export attribute context to buffer, in the binary encoding. Sources
+ * that were imported and never decoded are copied as they are.
  */
 void
 BIDGSSAttributeContext::exportToBuffer(gss_buffer_t buffer) const
 {
-    OM_uint32 minor;
-    char *s;
+    gss_buffer_desc sources[ATTR_TYPE_MAX + 1];
+    char *dumped[ATTR_TYPE_MAX + 1];
+    size_t length = 6;
+    unsigned char *p;
+    unsigned int i;
 
-    JSONObject obj = jsonRepresentation();
+    for (i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
+        sources[i].length = 0;
+        sources[i].value = NULL;
+        dumped[i] = NULL;
+    }
 
-#if 0
-    obj.dump(stdout);
-#endif
+    try {
+        for (i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
+            BIDGSSAttributeProvider *provider = m_providers[i];
 
-    s = obj.dump(JSON_COMPACT);
+            if (provider == NULL || provider->name() == NULL)
+                continue; /* provider not initialised or has no state */
 
-    if (GSS_ERROR(makeStringBuffer(&minor, s, buffer)))
-        throw std::bad_alloc();
+            if (m_serialized[i].value != NULL) {
+                sources[i] = m_serialized[i];
+            } else if ((m_pending & ATTR_TYPE_MASK(i)) == 0) {
+                JSONObject source = provider->jsonRepresentation();
+
+                if (source.isNull())
+                    continue;
+
+                dumped[i] = source.dump(JSON_COMPACT);
+                sources[i].length = strlen(dumped[i]);
+                sources[i].value = dumped[i];
+            } else {
+                continue;
+            }
+
+            length += 5 + sources[i].length;
+        }
+
+        buffer->value = GSSBID_MALLOC(length);
+        if (buffer->value == NULL)
+            throw std::bad_alloc();
+    } catch (...) {
+        for (i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++)
+            free(dumped[i]);
+        throw;
+    }
+
+    buffer->length = length;
+
+    p = (unsigned char *)buffer->value;
+
+    p[0] = ATTR_CTX_EXPORT_BINARY;
+    p[1] = ATTR_CTX_EXPORT_VERSION;
+    store_uint32_be(m_flags, &p[2]);
+    p += 6;
+
+    for (i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
+        if (sources[i].value == NULL)
+            continue;
+
+        p[0] = i & 0xff;
+        store_uint32_be(sources[i].length, &p[1]);
+        memcpy(&p[5], sources[i].value, sources[i].length);
+        p += 5 + sources[i].length;
+
+        free(dumped[i]);
+    }
+
+    GSSBID_ASSERT(p == (unsigned char *)buffer->value + length);
 }
 
 /*
@@ -777,6 +1013,8 @@ BIDGSSAttributeContext::composeAttributeName(const gss_buffer_t prefix,
     if (prefix == GSS_C_NO_BUFFER || prefix->length == 0)
         return str;
 
+    str.reserve(prefix->length +
+                (suffix != GSS_C_NO_BUFFER ? 1 + suffix->length : 0));
     str.append((const char *)prefix->value, prefix->length);
 
     if (suffix != GSS_C_NO_BUFFER) {
@@ -807,14 +1045,37 @@ BIDGSSAttributeContext::composeAttributeName(const gss_buffer_t prefix,
                                              const gss_buffer_t suffix,
                                              gss_buffer_t attribute)
 {
-    std::string str = composeAttributeName(prefix, suffix);
+    unsigned char *p;
+    size_t length;
 
-    if (str.length() != 0) {
-        return duplicateBuffer(str, attribute);
-    } else {
-        attribute->length = 0;
-        attribute->value = NULL;
+    attribute->length = 0;
+    attribute->value = NULL;
+
+    if (prefix == GSS_C_NO_BUFFER || prefix->length == 0)
+        return;
+
+    /* Compose directly into the output buffer, avoiding a temporary string */
+    length = prefix->length;
+    if (suffix != GSS_C_NO_BUFFER)
+        length += 1 + suffix->length;
+
+    p = (unsigned char *)GSSBID_MALLOC(length + 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+
+    attribute->value = p;
+    attribute->length = length;
+
+    memcpy(p, prefix->value, prefix->length);
+    p += prefix->length;
+
+    if (suffix != GSS_C_NO_BUFFER) {
+        *p++ = ' ';
+        memcpy(p, suffix->value, suffix->length);
+        p += suffix->length;
     }
+
+    *p = '\0';
 }
 
 /*
@@ -833,6 +1094,24 @@ BIDGSSAttributeContext::composeAttributeName(unsigned int type,
 /*
  * C wrappers
  */
+static OM_uint32
+gssBidResolveAttrContext(OM_uint32 *minor,
+                         gss_name_t name)
+{
+    GSSBID_ASSERT(name->attrCtx != NULL);
+
+    try {
+        if (!name->attrCtx->resolveProviders(name)) {
+            *minor = GSSBID_ATTR_CONTEXT_FAILURE;
+            return GSS_S_FAILURE;
+        }
+    } catch (std::exception &e) {
+        return name->attrCtx->mapException(minor, e);
+    }
+
+    return GSS_S_COMPLETE;
+}
+
 OM_uint32
 gssBidInquireName(OM_uint32 *minor,
                   gss_name_t name,
@@ -861,6 +1140,10 @@ gssBidInquireName(OM_uint32 *minor,
         return GSS_S_UNAVAILABLE;
     }
 
+    major = gssBidResolveAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     try {
         if (!name->attrCtx->getAttributeTypes(attrs)) {
             *minor = GSSBID_NO_ATTR_CONTEXT;
@@ -883,6 +1166,8 @@ gssBidGetNameAttribute(OM_uint32 *minor,
                        gss_buffer_t display_value,
                        int *more)
 {
+    OM_uint32 major;
+
     if (authenticated != NULL)
         *authenticated = 0;
     if (complete != NULL)
@@ -907,6 +1192,10 @@ gssBidGetNameAttribute(OM_uint32 *minor,
         return GSS_S_UNAVAILABLE;
     }
 
+    major = gssBidResolveAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     try {
         if (!name->attrCtx->getAttribute(attr, authenticated, complete,
                                          value, display_value, more)) {
@@ -927,6 +1216,8 @@ gssBidDeleteNameAttribute(OM_uint32 *minor,
                           gss_name_t name,
                           gss_buffer_t attr)
 {
+    OM_uint32 major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSBID_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -935,6 +1226,10 @@ gssBidDeleteNameAttribute(OM_uint32 *minor,
     if (GSS_ERROR(gssBidAttrProvidersInit(minor)))
         return GSS_S_UNAVAILABLE;
 
+    major = gssBidResolveAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     try {
         if (!name->attrCtx->deleteAttribute(attr)) {
             *minor = GSSBID_NO_SUCH_ATTR;
@@ -956,6 +1251,8 @@ gssBidSetNameAttribute(OM_uint32 *minor,
                        gss_buffer_t attr,
                        gss_buffer_t value)
 {
+    OM_uint32 major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSBID_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -964,6 +1261,10 @@ gssBidSetNameAttribute(OM_uint32 *minor,
     if (GSS_ERROR(gssBidAttrProvidersInit(minor)))
         return GSS_S_UNAVAILABLE;
 
+    major = gssBidResolveAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     try {
         if (!name->attrCtx->setAttribute(complete, attr, value)) {
              *minor = GSSBID_NO_SUCH_ATTR;
@@ -994,6 +1295,11 @@ gssBidExportAttrContext(OM_uint32 *minor,
         return GSS_S_UNAVAILABLE;
 
     try {
+        if (!name->attrCtx->resolveProviders(name, true)) {
+            *minor = GSSBID_ATTR_CONTEXT_FAILURE;
+            return GSS_S_FAILURE;
+        }
+
         name->attrCtx->exportToBuffer(buffer);
     } catch (std::exception &e) {
         return name->attrCtx->mapException(minor, e);
@@ -1090,6 +1396,8 @@ gssBidMapNameToAny(OM_uint32 *minor,
                    gss_buffer_t type_id,
                    gss_any_t *output)
 {
+    OM_uint32 major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSBID_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -1098,6 +1406,10 @@ gssBidMapNameToAny(OM_uint32 *minor,
     if (GSS_ERROR(gssBidAttrProvidersInit(minor)))
         return GSS_S_UNAVAILABLE;
 
+    major = gssBidResolveAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     try {
         *output = name->attrCtx->mapToAny(authenticated, type_id);
     } catch (std::exception &e) {
@@ -1113,6 +1425,8 @@ gssBidReleaseAnyNameMapping(OM_uint32 *minor,
                             gss_buffer_t type_id,
                             gss_any_t *input)
 {
+    OM_uint32 major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSBID_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -1121,6 +1435,10 @@ gssBidReleaseAnyNameMapping(OM_uint32 *minor,
     if (GSS_ERROR(gssBidAttrProvidersInit(minor)))
         return GSS_S_UNAVAILABLE;
 
+    major = gssBidResolveAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     try {
         if (*input != NULL)
             name->attrCtx->releaseAnyNameMapping(type_id, *input);
@@ -1145,7 +1463,8 @@ gssBidReleaseAttrContext(OM_uint32 *minor,
 
 /*
  * Public accessor for initialisng a context from a GSS context. Also
- * sets expiry time on GSS context as a side-effect.
+ * sets expiry time on GSS context as a side-effect; providers that may
+ * bound it are not deferred (see deferProvider()).
  */
 OM_uint32
 gssBidCreateAttrContext(OM_uint32 *minor,
@@ -63,6 +63,21 @@ typedef bool
 
 #define ATTR_FLAG_DISABLE_LOCAL     0x00000001
 
+#define ATTR_TYPE_MASK(type)        (1U << (type))
+
+/*
+ * Exported attribute contexts are either a JSON object (version 1) or,
+ * since version 2, a binary encoding that begins with a zero octet:
+ *
+ *      0x00 | VERSION(1) | FLAGS(4) | { TYPE(1) | LENGTH(4) | SOURCE }*
+ *
+ * where SOURCE is the provider's state. Sources are only decoded when
+ * the provider is first used, and are exported again verbatim if it
+ * never is.
+ */
+#define ATTR_CTX_EXPORT_BINARY      0x00
+#define ATTR_CTX_EXPORT_VERSION     2
+
 /*
  * Attribute provider: this represents a source of attributes derived
  * from the security context.
@@ -192,6 +207,7 @@ public:
     bool initWithExistingContext(const BIDGSSAttributeContext *manager);
     bool initWithGssContext(const gss_cred_id_t cred,
                             const gss_ctx_id_t ctx);
+    bool resolveProviders(gss_name_t name, bool exporting = false);
 
     bool getAttributeTypes(BIDGSSAttributeIterator, void *data) const;
     bool getAttributeTypes(gss_buffer_set_t *attrs);
@@ -240,6 +256,9 @@ public:
 
     BIDGSSAttributeProvider *getProvider(unsigned int type) const;
 
+    /* name whose deferred providers are being resolved, if any */
+    gss_name_t getResolvingName(void) const { return m_resolvingName; }
+
     static void
     registerProvider(unsigned int type,
                      BIDGSSAttributeFactory factory);
@@ -257,16 +276,27 @@ private:
     gss_buffer_desc attributeTypeToPrefix(unsigned int type) const;
 
     bool initWithJsonObject(JSONObject &object);
-    JSONObject jsonRepresentation(void) const;
+
+    bool initWithBinaryBuffer(const gss_buffer_t buffer);
+    bool decodeSerializedProvider(unsigned int type);
+    void setSerializedProvider(unsigned int type,
+                               const unsigned char *value,
+                               size_t length);
+    void releaseSerializedProvider(unsigned int type);
 
     BIDGSSAttributeProvider *getPrimaryProvider(void) const;
+    bool deferProvider(unsigned int type) const;
 
     /* make non-copyable */
     BIDGSSAttributeContext(const BIDGSSAttributeContext&);
     BIDGSSAttributeContext& operator=(const BIDGSSAttributeContext&);
 
     uint32_t m_flags;
+    uint32_t m_pending;
+    gss_name_t m_resolvingName;
     BIDGSSAttributeProvider *m_providers[ATTR_TYPE_MAX + 1];
+    gss_buffer_desc m_prefixes[ATTR_TYPE_MAX + 1]; /* cached provider prefixes */
+    gss_buffer_desc m_serialized[ATTR_TYPE_MAX + 1]; /* imported, undecoded sources */
 };
 
 #endif /* __cplusplus */
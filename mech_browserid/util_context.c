@@ -36,6 +36,156 @@
 
 #include "gssapiP_bid.h"
 
+#include <sys/stat.h>
+
+/*
+ * Pool of initialised BIDContexts, keyed by role and ECDH curve, so that
+ * establishing a security context need not re-read the configuration or
+ * re-acquire the caches. A pooled BIDContext is used by one security
+ * context at a time and carries no per-exchange state. The pool is flushed
+ * when the configuration file changes.
+ */
+#define GSSBID_CONTEXT_POOL_CURVES      4   /* none, P-256, P-384, P-521 */
+#define GSSBID_CONTEXT_POOL_SLOTS       (2 * GSSBID_CONTEXT_POOL_CURVES)
+#define GSSBID_CONTEXT_POOL_DEPTH       16
+
+struct gss_bid_context_pool {
+    BIDContext contexts[GSSBID_CONTEXT_POOL_DEPTH];
+    size_t count;
+};
+
+static GSSBID_THREAD_ONCE gssBidContextPoolInitOnce = GSSBID_ONCE_INITIALIZER;
+static int gssBidContextPoolInitialized;
+static GSSBID_MUTEX gssBidContextPoolMutex;
+static struct gss_bid_context_pool gssBidContextPool[GSSBID_CONTEXT_POOL_SLOTS];
+static unsigned int gssBidContextPoolGeneration;
+static time_t gssBidContextPoolConfigTime;
+
+GSSBID_ONCE_CALLBACK(gssBidContextPoolInitInternal)
+{
+    if (GSSBID_MUTEX_INIT(&gssBidContextPoolMutex) == 0)
+        gssBidContextPoolInitialized = 1;
+
+    GSSBID_ONCE_LEAVE;
+}
+
+time_t
+gssBidConfigModTime(void)
+{
+    struct stat sb;
+
+    if (stat(GSSBID_CONFIG_FILE, &sb) != 0)
+        return 0;
+
+    return sb.st_mtime;
+}
+
+/* called with gssBidContextPoolMutex held */
+static void
+gssBidFlushContextPool(void)
+{
+    size_t i, j;
+
+    for (i = 0; i < GSSBID_CONTEXT_POOL_SLOTS; i++) {
+        struct gss_bid_context_pool *pool = &gssBidContextPool[i];
+
+        for (j = 0; j < pool->count; j++)
+            BIDReleaseContext(pool->contexts[j]);
+
+        pool->count = 0;
+    }
+
+    gssBidContextPoolGeneration++;
+}
+
+static BIDError
+gssBidAcquirePooledContext(gss_ctx_id_t ctx,
+                           uint32_t contextParams,
+                           unsigned int ulCurve,
+                           const char *szCurve)
+{
+    BIDError err = BID_S_OK;
+    struct gss_bid_context_pool *pool;
+    time_t configTime;
+
+    GSSBID_ONCE(&gssBidContextPoolInitOnce, gssBidContextPoolInitInternal);
+
+    ctx->bidContextSlot = ulCurve;
+    if (CTX_IS_INITIATOR(ctx))
+        ctx->bidContextSlot += GSSBID_CONTEXT_POOL_CURVES;
+
+    if (gssBidContextPoolInitialized) {
+        configTime = gssBidConfigModTime();
+
+        GSSBID_MUTEX_LOCK(&gssBidContextPoolMutex);
+
+        if (configTime != gssBidContextPoolConfigTime) {
+            gssBidFlushContextPool();
+            gssBidContextPoolConfigTime = configTime;
+        }
+
+        pool = &gssBidContextPool[ctx->bidContextSlot];
+        if (pool->count != 0)
+            ctx->bidContext = pool->contexts[--pool->count];
+        ctx->bidContextGeneration = gssBidContextPoolGeneration;
+
+        GSSBID_MUTEX_UNLOCK(&gssBidContextPoolMutex);
+
+        if (ctx->bidContext != BID_C_NO_CONTEXT)
+            return BID_S_OK;
+    }
+
+    err = BIDAcquireContext(GSSBID_CONFIG_FILE, contextParams, NULL, &ctx->bidContext);
+    if (err != BID_S_OK)
+        return err;
+
+    if (szCurve != NULL)
+        err = BIDSetContextParam(ctx->bidContext, BID_PARAM_ECDH_CURVE, (void *)szCurve);
+    if (err == BID_S_OK)
+        err = BIDFreezeContext(ctx->bidContext);
+    if (err != BID_S_OK) {
+        BIDReleaseContext(ctx->bidContext);
+        ctx->bidContext = BID_C_NO_CONTEXT;
+    }
+
+    return err;
+}
+
+static void
+gssBidReleasePooledContext(gss_ctx_id_t ctx)
+{
+    BIDContext bidContext = ctx->bidContext;
+
+    ctx->bidContext = BID_C_NO_CONTEXT;
+
+    if (gssBidContextPoolInitialized) {
+        struct gss_bid_context_pool *pool = &gssBidContextPool[ctx->bidContextSlot];
+
+        GSSBID_MUTEX_LOCK(&gssBidContextPoolMutex);
+
+        if (ctx->bidContextGeneration == gssBidContextPoolGeneration &&
+            pool->count < GSSBID_CONTEXT_POOL_DEPTH) {
+            pool->contexts[pool->count++] = bidContext;
+            bidContext = BID_C_NO_CONTEXT;
+        }
+
+        GSSBID_MUTEX_UNLOCK(&gssBidContextPoolMutex);
+    }
+
+    if (bidContext != BID_C_NO_CONTEXT)
+        BIDReleaseContext(bidContext);
+}
+
+void
+gssBidFinalizeContextPool(void)
+{
+    if (gssBidContextPoolInitialized) {
+        GSSBID_MUTEX_LOCK(&gssBidContextPoolMutex);
+        gssBidFlushContextPool();
+        GSSBID_MUTEX_UNLOCK(&gssBidContextPoolMutex);
+    }
+}
+
 OM_uint32
 gssBidAllocContext(OM_uint32 *minor,
                    int isInitiator,
@@ -47,6 +197,8 @@ gssBidAllocContext(OM_uint32 *minor,
     BIDError err;
     uint32_t contextParams;
     size_t cbKey = 0;
+    unsigned int ulCurve = 0;
+    char *szCurve = NULL;
 
     GSSBID_ASSERT(*pCtx == GSS_C_NO_CONTEXT);
 
@@ -96,29 +248,25 @@ gssBidAllocContext(OM_uint32 *minor,
     else
         contextParams |= BID_CONTEXT_RP | BID_CONTEXT_AUTHORITY_CACHE | BID_CONTEXT_REPLAY_CACHE;
 
-    err = BIDAcquireContext(GSSBID_CONFIG_FILE, contextParams, NULL, &ctx->bidContext);
-    if (err != BID_S_OK) {
-        major = gssBidMapError(minor, err);
-        goto cleanup;
-    }
-
     if (ctx->encryptionType != ENCTYPE_NULL) {
-        char *szCurve;
-
-        if (cbKey >= 32)                            /* aes256 */
+        if (cbKey >= 32) {                          /* aes256 */
             szCurve = BID_ECDH_CURVE_P521;
-        else if (cbKey >= 24)                       /* aes192 */
+            ulCurve = 3;
+        } else if (cbKey >= 24) {                   /* aes192 */
             szCurve = BID_ECDH_CURVE_P384;
-        else                                        /* aes128 */
+            ulCurve = 2;
+        } else {                                    /* aes128 */
             szCurve = BID_ECDH_CURVE_P256;
-
-        err = BIDSetContextParam(ctx->bidContext, BID_PARAM_ECDH_CURVE, szCurve);
-        if (err != BID_S_OK) {
-            major = gssBidMapError(minor, err);
-            goto cleanup;
+            ulCurve = 1;
         }
     }
 
+    err = gssBidAcquirePooledContext(ctx, contextParams, ulCurve, szCurve);
+    if (err != BID_S_OK) {
+        major = gssBidMapError(minor, err);
+        goto cleanup;
+    }
+
     /*
      * Integrity, confidentiality, sequencing and replay detection are
      * always available.  Regardless of what flags are requested in
@@ -160,7 +308,7 @@ gssBidReleaseContext(OM_uint32 *minor,
 
     if (ctx->bidContext != BID_C_NO_CONTEXT) {
         BIDReleaseIdentity(ctx->bidContext, ctx->bidIdentity);
-        BIDReleaseContext(ctx->bidContext);
+        gssBidReleasePooledContext(ctx);
     }
 
     krb5_free_keyblock_contents(krbContext, &ctx->rfc3961Key);
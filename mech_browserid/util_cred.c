@@ -36,6 +36,23 @@
 
 #include "gssapiP_bid.h"
 
+/*
+ * Default acceptor credential, shared by all contexts accepted with
+ * GSS_C_NO_CREDENTIAL. It is created on first use and replaced when the
+ * configuration file changes.
+ */
+static GSSBID_THREAD_ONCE gssBidDefaultCredInitOnce = GSSBID_ONCE_INITIALIZER;
+static GSSBID_MUTEX gssBidDefaultCredMutex;
+static gss_cred_id_t gssBidDefaultCred = GSS_C_NO_CREDENTIAL;
+static time_t gssBidDefaultCredConfigTime;
+
+GSSBID_ONCE_CALLBACK(gssBidDefaultCredInitInternal)
+{
+    GSSBID_MUTEX_INIT(&gssBidDefaultCredMutex);
+
+    GSSBID_ONCE_LEAVE;
+}
+
 OM_uint32
 gssBidAllocCred(OM_uint32 *minor, gss_cred_id_t *pCred)
 {
@@ -53,10 +70,12 @@ gssBidAllocCred(OM_uint32 *minor, gss_cred_id_t *pCred)
 
     if (GSSBID_MUTEX_INIT(&cred->mutex) != 0) {
         *minor = GSSBID_GET_LAST_ERROR();
-        gssBidReleaseCred(&tmpMinor, &cred);
+        GSSBID_FREE(cred);
         return GSS_S_FAILURE;
     }
 
+    cred->refCount = 1;
+
     err = BIDAcquireContext(GSSBID_CONFIG_FILE, BID_CONTEXT_GSS, NULL, &cred->bidContext);
     if (err != BID_S_OK) {
         major = gssBidMapError(minor, err);
@@ -76,14 +95,26 @@ gssBidReleaseCred(OM_uint32 *minor, gss_cred_id_t *pCred)
     OM_uint32 tmpMinor;
     gss_cred_id_t cred = *pCred;
     krb5_context krbContext = NULL;
+    OM_uint32 refCount;
 
     if (cred == GSS_C_NO_CREDENTIAL) {
         return GSS_S_COMPLETE;
     }
 
+    GSSBID_MUTEX_LOCK(&cred->mutex);
+    refCount = --cred->refCount;
+    GSSBID_MUTEX_UNLOCK(&cred->mutex);
+
+    if (refCount != 0) {
+        *pCred = GSS_C_NO_CREDENTIAL;
+        *minor = 0;
+        return GSS_S_COMPLETE;
+    }
+
     GSSBID_KRB_INIT(&krbContext);
 
     gssBidReleaseName(&tmpMinor, &cred->name);
+    gss_release_buffer(&tmpMinor, &cred->audienceOrSpn);
     gssBidReleaseName(&tmpMinor, &cred->target);
     gss_release_buffer(&tmpMinor, &cred->assertion);
     gss_release_oid_set(&tmpMinor, &cred->mechanisms);
@@ -106,6 +137,107 @@ gssBidReleaseCred(OM_uint32 *minor, gss_cred_id_t *pCred)
     return GSS_S_COMPLETE;
 }
 
+gss_cred_id_t
+gssBidReferenceCred(gss_cred_id_t cred)
+{
+    if (cred != GSS_C_NO_CREDENTIAL) {
+        GSSBID_MUTEX_LOCK(&cred->mutex);
+        cred->refCount++;
+        GSSBID_MUTEX_UNLOCK(&cred->mutex);
+    }
+
+    return cred;
+}
+
+OM_uint32
+gssBidAcquireDefaultAcceptorCred(OM_uint32 *minor, gss_cred_id_t *pCred)
+{
+    OM_uint32 major, tmpMinor;
+    gss_cred_id_t staleCred = GSS_C_NO_CREDENTIAL;
+    time_t configTime;
+
+    *pCred = GSS_C_NO_CREDENTIAL;
+
+    GSSBID_ONCE(&gssBidDefaultCredInitOnce, gssBidDefaultCredInitInternal);
+
+    configTime = gssBidConfigModTime();
+
+    GSSBID_MUTEX_LOCK(&gssBidDefaultCredMutex);
+
+    if (gssBidDefaultCred != GSS_C_NO_CREDENTIAL &&
+        gssBidDefaultCredConfigTime != configTime) {
+        staleCred = gssBidDefaultCred;
+        gssBidDefaultCred = GSS_C_NO_CREDENTIAL;
+    }
+
+    if (gssBidDefaultCred == GSS_C_NO_CREDENTIAL) {
+        major = gssBidAcquireCred(minor,
+                                  GSS_C_NO_NAME,
+                                  GSS_C_INDEFINITE,
+                                  GSS_C_NO_OID_SET,
+                                  GSS_C_ACCEPT,
+                                  &gssBidDefaultCred,
+                                  NULL,
+                                  NULL);
+        if (GSS_ERROR(major))
+            goto cleanup;
+
+        gssBidDefaultCredConfigTime = configTime;
+    }
+
+    *pCred = gssBidReferenceCred(gssBidDefaultCred);
+
+    major = GSS_S_COMPLETE;
+    *minor = 0;
+
+cleanup:
+    GSSBID_MUTEX_UNLOCK(&gssBidDefaultCredMutex);
+
+    /* contexts using the stale credential retain their own references */
+    gssBidReleaseCred(&tmpMinor, &staleCred);
+
+    return major;
+}
+
+void
+gssBidReleaseDefaultAcceptorCred(void)
+{
+    OM_uint32 minor;
+
+    /* only called from the library destructor */
+    gssBidReleaseCred(&minor, &gssBidDefaultCred);
+}
+
+/*
+ * Return the audience or SPN string for an acceptor credential, or NULL
+ * if the credential has no name. The string is computed once and remains
+ * valid until the credential name changes or the credential is released.
+ */
+OM_uint32
+gssBidCredAudienceOrSpn(OM_uint32 *minor,
+                        gss_cred_id_t cred,
+                        const char **pszAudienceOrSpn)
+{
+    OM_uint32 major = GSS_S_COMPLETE;
+
+    *pszAudienceOrSpn = NULL;
+    *minor = 0;
+
+    if (cred->name == GSS_C_NO_NAME)
+        return GSS_S_COMPLETE;
+
+    GSSBID_MUTEX_LOCK(&cred->mutex);
+
+    if (cred->audienceOrSpn.value == NULL)
+        major = gssBidDisplayName(minor, cred->name, &cred->audienceOrSpn, NULL);
+    if (!GSS_ERROR(major))
+        *pszAudienceOrSpn = (const char *)cred->audienceOrSpn.value;
+
+    GSSBID_MUTEX_UNLOCK(&cred->mutex);
+
+    return major;
+}
+
 gss_OID
 gssBidPrimaryMechForCred(gss_cred_id_t cred)
 {
@@ -158,6 +290,7 @@ gssBidSetCredName(OM_uint32 *minor,
     }
 
     gssBidReleaseName(&tmpMinor, &cred->name);
+    gss_release_buffer(&tmpMinor, &cred->audienceOrSpn);
     cred->name = newName;
 
     return GSS_S_COMPLETE;
@@ -615,13 +748,13 @@ gssBidResolveInitiatorCred(OM_uint32 *minor,
         }
 
         if (targetName != GSS_C_NO_NAME) {
-            major = gssBidDisplayName(minor, targetName, &bufAudienceOrSpn, NULL);
+            major = gssBidBorrowDisplayName(minor, targetName, &bufAudienceOrSpn, NULL);
             if (GSS_ERROR(major))
                 goto cleanup;
         }
 
         if (resolvedCred->name != GSS_C_NO_NAME) {
-            major = gssBidDisplayName(minor, resolvedCred->name, &bufSubject, NULL);
+            major = gssBidBorrowDisplayName(minor, resolvedCred->name, &bufSubject, NULL);
             if (GSS_ERROR(major))
                 goto cleanup;
         }
@@ -649,8 +782,6 @@ gssBidResolveInitiatorCred(OM_uint32 *minor,
                                   &ctx->bidIdentity,
                                   &resolvedCred->expiryTime,
                                   &ulRetFlags);
-
-        gss_release_buffer(&tmpMinor, &bufSubject);
     }
     if (err != BID_S_OK) {
         major = gssBidMapError(minor, err);
@@ -714,7 +845,6 @@ gssBidResolveInitiatorCred(OM_uint32 *minor,
 cleanup:
     gssBidReleaseCred(&tmpMinor, &resolvedCred);
     gssBidReleaseName(&tmpMinor, &identityName);
-    gss_release_buffer(&tmpMinor, &bufAudienceOrSpn);
     BIDFreeAssertion(ctx->bidContext, szAssertion);
 
     return major;
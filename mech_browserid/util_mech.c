@@ -431,8 +431,11 @@ gssBidFinalize(void)
 #ifdef GSSBID_ENABLE_ACCEPTOR
     OM_uint32 minor;
 
+    gssBidReleaseDefaultAcceptorCred();
     gssBidAttrProvidersFinalize(&minor);
 #endif
+
+    gssBidFinalizeContextPool();
 }
 
 #ifdef GSSBID_CONSTRUCTOR
@@ -110,6 +110,7 @@ gssBidReleaseName(OM_uint32 *minor, gss_name_t *pName)
 
     GSSBID_KRB_INIT(&krbContext);
     krb5_free_principal(krbContext, name->krbPrincipal);
+    gss_release_buffer(&tmpMinor, &name->displayName);
     gssBidReleaseOid(&tmpMinor, &name->mechanismUsed);
 #ifdef GSSBID_ENABLE_ACCEPTOR
     gssBidReleaseAttrContext(&tmpMinor, name);
@@ -122,12 +123,81 @@ gssBidReleaseName(OM_uint32 *minor, gss_name_t *pName)
     return GSS_S_COMPLETE;
 }
 
+static int
+hasRealmP(gss_name_t name)
+{
+#ifdef HAVE_HEIMDAL_VERSION
+    if (KRB_PRINC_REALM(name->krbPrincipal) != NULL &&
+        KRB_PRINC_REALM(name->krbPrincipal)[0] != '\0')
+#else
+    if (KRB_PRINC_REALM(name->krbPrincipal)->length != 0)
+#endif
+        return TRUE;
+
+    return FALSE;
+}
+
+/*
+ * FNV-1a, used to reject unequal names without comparing them
+ */
+static uint32_t
+hashDisplayName(const gss_buffer_t buffer)
+{
+    const unsigned char *p = (const unsigned char *)buffer->value;
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < buffer->length; i++) {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/*
+ * Names are immutable, so render the display form once when the name is
+ * created. Comparison uses the display form too, as the principal
+ * unparses unambiguously.
+ */
+static OM_uint32
+cacheDisplayName(OM_uint32 *minor, gss_name_t name)
+{
+    OM_uint32 major;
+    krb5_context krbContext;
+    char *krbName;
+    int flags = 0;
+
+    GSSBID_KRB_INIT(&krbContext);
+
+    if (!hasRealmP(name))
+        flags |= KRB5_PRINCIPAL_UNPARSE_NO_REALM;
+
+    *minor = krb5_unparse_name_flags(krbContext, name->krbPrincipal,
+                                     flags, &krbName);
+    if (*minor != 0)
+        return GSS_S_FAILURE;
+
+    major = makeStringBuffer(minor, krbName, &name->displayName);
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_xfree(krbName);
+#else
+    krb5_free_unparsed_name(krbContext, krbName);
+#endif
+    if (GSS_ERROR(major))
+        return major;
+
+    name->hash = hashDisplayName(&name->displayName);
+
+    return GSS_S_COMPLETE;
+}
+
 static OM_uint32
 krbPrincipalToName(OM_uint32 *minor,
                    krb5_principal *principal,
                    gss_name_t *pName)
 {
-    OM_uint32 major;
+    OM_uint32 major, tmpMinor;
     gss_name_t name;
 
     major = gssBidAllocName(minor, &name);
@@ -143,6 +213,12 @@ krbPrincipalToName(OM_uint32 *minor,
         name->flags |= NAME_FLAG_EMAIL;
     }
 
+    major = cacheDisplayName(minor, name);
+    if (GSS_ERROR(major)) {
+        gssBidReleaseName(&tmpMinor, &name);
+        return major;
+    }
+
     *pName = name;
     *minor = 0;
 
@@ -565,7 +641,7 @@ gssBidExportNameInternal(OM_uint32 *minor,
     else
         mech = GSS_BROWSERID_MECHANISM;
 
-    major = gssBidDisplayName(minor, name, &nameBuf, NULL);
+    major = gssBidBorrowDisplayName(minor, name, &nameBuf, NULL);
     if (GSS_ERROR(major))
         goto cleanup;
 
@@ -630,7 +706,6 @@ gssBidExportNameInternal(OM_uint32 *minor,
 
 cleanup:
     gss_release_buffer(&tmpMinor, &attrs);
-    gss_release_buffer(&tmpMinor, &nameBuf);
     if (GSS_ERROR(major))
         gss_release_buffer(&tmpMinor, exportedName);
 
@@ -681,6 +756,12 @@ gssBidCanonicalizeName(OM_uint32 *minor,
         goto cleanup;
     }
 
+    major = duplicateBuffer(minor, &input_name->displayName, &name->displayName);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    name->hash = input_name->hash;
+
 #ifdef GSSBID_ENABLE_ACCEPTOR
     if (input_name->attrCtx != NULL) {
         major = gssBidDuplicateAttrContext(minor, input_name, name);
@@ -708,33 +789,17 @@ gssBidDuplicateName(OM_uint32 *minor,
                                   GSS_C_NO_OID, dest_name);
 }
 
-static int
-hasRealmP(gss_name_t name)
-{
-#ifdef HAVE_HEIMDAL_VERSION
-    if (KRB_PRINC_REALM(name->krbPrincipal) != NULL &&
-        KRB_PRINC_REALM(name->krbPrincipal)[0] != '\0')
-#else
-    if (KRB_PRINC_REALM(name->krbPrincipal)->length != 0)
-#endif
-        return TRUE;
-
-    return FALSE;
-}
-
+/*
+ * Return the display form of a name without copying it. The buffer is
+ * owned by the name and must not be released.
+ */
 OM_uint32
-gssBidDisplayName(OM_uint32 *minor,
-                  gss_name_t name,
-                  gss_buffer_t output_name_buffer,
-                  gss_OID *output_name_type)
+gssBidBorrowDisplayName(OM_uint32 *minor,
+                        gss_name_t name,
+                        gss_buffer_t output_name_buffer,
+                        gss_OID *output_name_type)
 {
-    OM_uint32 major;
-    krb5_context krbContext;
-    char *krbName;
     gss_OID name_type;
-    int flags = 0;
-
-    GSSBID_KRB_INIT(&krbContext);
 
     output_name_buffer->length = 0;
     output_name_buffer->value = NULL;
@@ -744,23 +809,7 @@ gssBidDisplayName(OM_uint32 *minor,
         return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_BAD_NAME;
     }
 
-    if (!hasRealmP(name))
-        flags |= KRB5_PRINCIPAL_UNPARSE_NO_REALM;
-
-    *minor = krb5_unparse_name_flags(krbContext, name->krbPrincipal,
-                                     flags, &krbName);
-    if (*minor != 0) {
-        return GSS_S_FAILURE;
-    }
-
-    major = makeStringBuffer(minor, krbName, output_name_buffer);
-#ifdef HAVE_HEIMDAL_VERSION
-    krb5_xfree(krbName);
-#else
-    krb5_free_unparsed_name(krbContext, krbName);
-#endif
-    if (GSS_ERROR(major))
-        return major;
+    *output_name_buffer = name->displayName;
 
     if (output_name_buffer->length == 0) {
         name_type = GSS_C_NT_ANONYMOUS;
@@ -773,9 +822,29 @@ gssBidDisplayName(OM_uint32 *minor,
     if (output_name_type != NULL)
         *output_name_type = name_type;
 
+    *minor = 0;
     return GSS_S_COMPLETE;
 }
 
+OM_uint32
+gssBidDisplayName(OM_uint32 *minor,
+                  gss_name_t name,
+                  gss_buffer_t output_name_buffer,
+                  gss_OID *output_name_type)
+{
+    OM_uint32 major;
+    gss_buffer_desc nameBuf;
+
+    major = gssBidBorrowDisplayName(minor, name, &nameBuf, output_name_type);
+    if (GSS_ERROR(major)) {
+        output_name_buffer->length = 0;
+        output_name_buffer->value = NULL;
+        return major;
+    }
+
+    return duplicateBuffer(minor, &nameBuf, output_name_buffer);
+}
+
 OM_uint32
 gssBidCompareName(OM_uint32 *minor,
                   gss_name_t name1,
@@ -790,18 +859,19 @@ gssBidCompareName(OM_uint32 *minor,
     if (name1 == GSS_C_NO_NAME && name2 == GSS_C_NO_NAME) {
         *name_equal = 1;
     } else if (name1 != GSS_C_NO_NAME && name2 != GSS_C_NO_NAME) {
-        GSSBID_KRB_INIT(&krbContext);
-
         /* krbPrincipal is immutable, so lock not required */
         if ((flags & COMPARE_NAME_FLAG_IGNORE_EMPTY_REALMS) &&
             (hasRealmP(name1) == FALSE || hasRealmP(name2) == FALSE)) {
+            GSSBID_KRB_INIT(&krbContext);
+
             *name_equal = krb5_principal_compare_any_realm(krbContext,
                                                            name1->krbPrincipal,
                                                            name2->krbPrincipal);
         } else {
-            *name_equal = krb5_principal_compare(krbContext,
-                                                 name1->krbPrincipal,
-                                                 name2->krbPrincipal);
+            *name_equal = (name1->hash == name2->hash &&
+                           name1->displayName.length == name2->displayName.length &&
+                           memcmp(name1->displayName.value, name2->displayName.value,
+                                  name1->displayName.length) == 0);
         }
     } else {
         *name_equal = 0;
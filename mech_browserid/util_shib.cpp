@@ -82,6 +82,25 @@ using namespace opensaml;
 using namespace xercesc;
 #endif
 
+/*
+ * Resolved attributes are cached across security contexts, so that repeat
+ * authentications of the same identity need not run the resolver (or parse
+ * the SAML assertion) again. Entries are keyed by subject, issuer and
+ * application ID and are valid for the lifetime of the assertion from which
+ * they were resolved.
+ */
+#define SHIB_CACHE_MAX_ENTRIES      1024
+
+struct BIDGSSShibbolethCacheEntry {
+    time_t expiryTime;
+    vector<Attribute *> attributes;
+};
+
+typedef map<string, BIDGSSShibbolethCacheEntry> BIDGSSShibbolethCache;
+
+static GSSBID_MUTEX gssBidShibCacheMutex;
+static BIDGSSShibbolethCache gssBidShibCache;
+
 BIDGSSShibbolethAttributeProvider::BIDGSSShibbolethAttributeProvider(void)
 {
     m_initialized = false;
@@ -112,6 +131,7 @@ BIDGSSShibbolethAttributeProvider::initWithExistingContext(const BIDGSSAttribute
     if (shib != NULL) {
         m_attributes = duplicateAttributes(shib->getAttributes());
         m_authenticated = shib->authenticated();
+        indexAttributes();
     }
 
     m_initialized = true;
@@ -127,6 +147,17 @@ BIDGSSShibbolethAttributeProvider::initWithGssContext(const BIDGSSAttributeConte
     if (!BIDGSSAttributeProvider::initWithGssContext(manager, gssCred, gssCtx))
         return false;
 
+    string cacheKey;
+    time_t expiryTime = 0;
+    bool bCacheable = getCacheKey(m_manager, cacheKey, &expiryTime);
+
+    if (bCacheable && getCachedAttributes(cacheKey, m_attributes)) {
+        indexAttributes();
+        m_authenticated = true;
+        m_initialized = true;
+        return true;
+    }
+
     auto_ptr<ShibbolethResolver> resolver(ShibbolethResolver::create());
 
     /*
@@ -145,11 +176,22 @@ BIDGSSShibbolethAttributeProvider::initWithGssContext(const BIDGSSAttributeConte
 #endif
 
     gss_buffer_desc mechName = GSS_C_EMPTY_BUFFER;
+    gss_name_t initiatorName;
     OM_uint32 major, minor;
 
-    major = gssBidExportNameInternal(&minor, gssCtx->initiatorName, &mechName,
-                                     EXPORT_NAME_FLAG_OID |
-                                     EXPORT_NAME_FLAG_COMPOSITE);
+    /* Resolution may be deferred until after the security context is gone */
+    if (gssCtx != GSS_C_NO_CONTEXT)
+        initiatorName = gssCtx->initiatorName;
+    else
+        initiatorName = m_manager->getResolvingName();
+
+    if (initiatorName != GSS_C_NO_NAME) {
+        major = gssBidExportNameInternal(&minor, initiatorName, &mechName,
+                                         EXPORT_NAME_FLAG_OID |
+                                         EXPORT_NAME_FLAG_COMPOSITE);
+    } else {
+        major = GSS_S_BAD_NAME;
+    }
     if (major == GSS_S_COMPLETE) {
         resolver->addToken(&mechName);
         gss_release_buffer(&minor, &mechName);
@@ -185,38 +227,52 @@ BIDGSSShibbolethAttributeProvider::initWithGssContext(const BIDGSSAttributeConte
         resolver->resolve();
         m_attributes = resolver->getResolvedAttributes();
         resolver->getResolvedAttributes().clear();
+        indexAttributes();
     } catch (exception &e) {
         return false;
     }
 
+    if (bCacheable)
+        cacheAttributes(cacheKey, expiryTime, m_attributes);
+
     m_authenticated = true;
     m_initialized = true;
 
     return true;
 }
 
+/*
+ * Build an index from attribute aliases to their position in m_attributes,
+ * so lookups need not compare against every alias of every attribute. Where
+ * aliases collide, the first attribute wins.
+ */
+void
+BIDGSSShibbolethAttributeProvider::indexAttributes(void)
+{
+    m_attributeIndex.clear();
+
+    for (size_t i = 0; i < m_attributes.size(); i++) {
+        const vector<string> &aliases = m_attributes[i]->getAliases();
+
+        for (vector<string>::const_iterator s = aliases.begin();
+             s != aliases.end();
+             ++s)
+            m_attributeIndex.insert(make_pair(*s, i));
+    }
+}
+
 ssize_t
 BIDGSSShibbolethAttributeProvider::getAttributeIndex(const gss_buffer_t attr) const
 {
-    int i = 0;
-
     GSSBID_ASSERT(m_initialized);
 
-    for (vector<Attribute *>::const_iterator a = m_attributes.begin();
-         a != m_attributes.end();
-         ++a)
-    {
-        for (vector<string>::const_iterator s = (*a)->getAliases().begin();
-             s != (*a)->getAliases().end();
-             ++s) {
-            if (attr->length == (*s).length() &&
-                memcmp((*s).c_str(), attr->value, attr->length) == 0) {
-                return i;
-            }
-        }
-    }
+    map<string, size_t>::const_iterator i =
+        m_attributeIndex.find(string((char *)attr->value, attr->length));
+
+    if (i == m_attributeIndex.end())
+        return -1;
 
-    return -1;
+    return (ssize_t)i->second;
 }
 
 bool
@@ -237,6 +293,7 @@ BIDGSSShibbolethAttributeProvider::setAttribute(int complete GSSBID_UNUSED,
     }
 
     m_attributes.push_back(a);
+    m_attributeIndex.insert(make_pair(attrStr, m_attributes.size() - 1));
     m_authenticated = false;
 
     return true;
@@ -250,8 +307,11 @@ BIDGSSShibbolethAttributeProvider::deleteAttribute(const gss_buffer_t attr)
     GSSBID_ASSERT(m_initialized);
 
     i = getAttributeIndex(attr);
-    if (i >= 0)
+    if (i >= 0) {
+        delete m_attributes[i];
         m_attributes.erase(m_attributes.begin() + i);
+        indexAttributes();
+    }
 
     m_authenticated = false;
 
@@ -283,28 +343,13 @@ BIDGSSShibbolethAttributeProvider::getAttributeTypes(BIDGSSAttributeIterator add
 const Attribute *
 BIDGSSShibbolethAttributeProvider::getAttribute(const gss_buffer_t attr) const
 {
-    const Attribute *ret = NULL;
+    ssize_t i;
 
     GSSBID_ASSERT(m_initialized);
 
-    for (vector<Attribute *>::const_iterator a = m_attributes.begin();
-         a != m_attributes.end();
-         ++a)
-    {
-        for (vector<string>::const_iterator s = (*a)->getAliases().begin();
-             s != (*a)->getAliases().end();
-             ++s) {
-            if (attr->length == (*s).length() &&
-                memcmp((*s).c_str(), attr->value, attr->length) == 0) {
-                ret = *a;
-                break;
-            }
-        }
-        if (ret != NULL)
-            break;
-    }
+    i = getAttributeIndex(attr);
 
-    return ret;
+    return (i >= 0) ? m_attributes[i] : NULL;
 }
 
 bool
@@ -455,6 +500,8 @@ BIDGSSShibbolethAttributeProvider::initWithJsonObject(const BIDGSSAttributeConte
         m_attributes.push_back(attribute);
     }
 
+    indexAttributes();
+
     m_authenticated = obj["authenticated"].integer();
     m_initialized = true;
 
@@ -466,6 +513,8 @@ BIDGSSShibbolethAttributeProvider::init(void)
 {
     bool ret = false;
 
+    GSSBID_MUTEX_INIT(&gssBidShibCacheMutex);
+
     try {
         ret = ShibbolethResolver::init();
     } catch (exception &e) {
@@ -481,6 +530,18 @@ void
 BIDGSSShibbolethAttributeProvider::finalize(void)
 {
     BIDGSSAttributeContext::unregisterProvider(ATTR_TYPE_LOCAL);
+
+    GSSBID_MUTEX_LOCK(&gssBidShibCacheMutex);
+    for (BIDGSSShibbolethCache::iterator entry = gssBidShibCache.begin();
+         entry != gssBidShibCache.end();
+         ++entry)
+        for_each(entry->second.attributes.begin(),
+                 entry->second.attributes.end(),
+                 xmltooling::cleanup<Attribute>());
+    gssBidShibCache.clear();
+    GSSBID_MUTEX_UNLOCK(&gssBidShibCacheMutex);
+    GSSBID_MUTEX_DESTROY(&gssBidShibCacheMutex);
+
     ShibbolethResolver::term();
 }
 
@@ -537,6 +598,129 @@ BIDGSSShibbolethAttributeProvider::duplicateAttributes(const vector <Attribute *
     return dst;
 }
 
+bool
+BIDGSSShibbolethAttributeProvider::getCacheKey(const BIDGSSAttributeContext *manager,
+                                               string &key,
+                                               time_t *expiryTime)
+{
+    const BIDGSSJWTAttributeProvider *jwt;
+
+    *expiryTime = 0;
+
+    jwt = static_cast<const BIDGSSJWTAttributeProvider *>
+        (manager->getProvider(ATTR_TYPE_JWT));
+    if (jwt == NULL)
+        return false;
+
+    JSONObject attrs = jwt->jsonRepresentation();
+    const char *sub = attrs.get("sub").string();
+    const char *iss = attrs.get("iss").string();
+
+    *expiryTime = jwt->getExpiryTime();
+
+    if (sub == NULL || iss == NULL || *expiryTime <= time(NULL))
+        return false;
+
+    /* The application ID is presently always defaulted */
+    key.assign(sub);
+    key.append(1, '\0');
+    key.append(iss);
+    key.append(1, '\0');
+    key.append("default");
+
+    return true;
+}
+
+bool
+BIDGSSShibbolethAttributeProvider::getCachedAttributes(const string &key,
+                                                       vector <Attribute *> &attrs)
+{
+    BIDGSSShibbolethCache::iterator entry;
+    bool ret = false;
+
+    GSSBID_MUTEX_LOCK(&gssBidShibCacheMutex);
+
+    entry = gssBidShibCache.find(key);
+    if (entry != gssBidShibCache.end()) {
+        if (entry->second.expiryTime > time(NULL)) {
+            attrs = duplicateAttributes(entry->second.attributes);
+            ret = true;
+        } else {
+            for_each(entry->second.attributes.begin(),
+                     entry->second.attributes.end(),
+                     xmltooling::cleanup<Attribute>());
+            gssBidShibCache.erase(entry);
+        }
+    }
+
+    GSSBID_MUTEX_UNLOCK(&gssBidShibCacheMutex);
+
+    return ret;
+}
+
+void
+BIDGSSShibbolethAttributeProvider::purgeCache(time_t now)
+{
+    BIDGSSShibbolethCache::iterator entry, oldest;
+
+    /* called with gssBidShibCacheMutex held */
+    oldest = gssBidShibCache.end();
+
+    for (entry = gssBidShibCache.begin(); entry != gssBidShibCache.end(); ) {
+        BIDGSSShibbolethCache::iterator next = entry;
+
+        ++next;
+
+        if (entry->second.expiryTime <= now) {
+            for_each(entry->second.attributes.begin(),
+                     entry->second.attributes.end(),
+                     xmltooling::cleanup<Attribute>());
+            gssBidShibCache.erase(entry);
+        } else if (oldest == gssBidShibCache.end() ||
+                   entry->second.expiryTime < oldest->second.expiryTime) {
+            oldest = entry;
+        }
+
+        entry = next;
+    }
+
+    /* If nothing has expired, evict the entry that will expire soonest */
+    if (gssBidShibCache.size() >= SHIB_CACHE_MAX_ENTRIES &&
+        oldest != gssBidShibCache.end()) {
+        for_each(oldest->second.attributes.begin(),
+                 oldest->second.attributes.end(),
+                 xmltooling::cleanup<Attribute>());
+        gssBidShibCache.erase(oldest);
+    }
+}
+
+void
+BIDGSSShibbolethAttributeProvider::cacheAttributes(const string &key,
+                                                   time_t expiryTime,
+                                                   const vector <Attribute *> &attrs)
+{
+    vector <Attribute *> dup = duplicateAttributes(attrs);
+    BIDGSSShibbolethCache::iterator entry;
+
+    GSSBID_MUTEX_LOCK(&gssBidShibCacheMutex);
+
+    entry = gssBidShibCache.find(key);
+    if (entry != gssBidShibCache.end()) {
+        for_each(entry->second.attributes.begin(),
+                 entry->second.attributes.end(),
+                 xmltooling::cleanup<Attribute>());
+    } else {
+        if (gssBidShibCache.size() >= SHIB_CACHE_MAX_ENTRIES)
+            purgeCache(time(NULL));
+        entry = gssBidShibCache.insert(make_pair(key, BIDGSSShibbolethCacheEntry())).first;
+    }
+
+    entry->second.expiryTime = expiryTime;
+    entry->second.attributes = dup;
+
+    GSSBID_MUTEX_UNLOCK(&gssBidShibCacheMutex);
+}
+
 OM_uint32
 gssBidLocalAttrProviderInit(OM_uint32 *minor)
 {
@@ -40,6 +40,8 @@
 #ifdef __cplusplus
 
 #include <vector>
+#include <map>
+#include <string>
 
 namespace shibsp {
     class Attribute;
@@ -99,6 +101,15 @@ private:
     static std::vector <shibsp::Attribute *>
         duplicateAttributes(const std::vector <shibsp::Attribute *>src);
 
+    static bool getCacheKey(const BIDGSSAttributeContext *manager,
+                            std::string &key, time_t *expiryTime);
+    static bool getCachedAttributes(const std::string &key,
+                                    std::vector <shibsp::Attribute *> &attrs);
+    static void cacheAttributes(const std::string &key, time_t expiryTime,
+                                const std::vector <shibsp::Attribute *> &attrs);
+    static void purgeCache(time_t now);
+
+    void indexAttributes(void);
     ssize_t getAttributeIndex(const gss_buffer_t attr) const;
     const shibsp::Attribute *getAttribute(const gss_buffer_t attr) const;
 
@@ -107,6 +118,7 @@ private:
     bool m_initialized;
     bool m_authenticated;
     std::vector<shibsp::Attribute *> m_attributes;
+    std::map<std::string, size_t> m_attributeIndex; /* alias to index */
 };
 
 extern "C" {